@@ -0,0 +1,121 @@
+#ifndef ACL_H
+#define ACL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "lib.h"
+#include "protocols.h"
+#include "packet_pool.h"
+
+#define ACL_MAX_RULES 65536
+
+// Decision tree (HiCuts, Gupta and McKeown): a node is cut in 2^k equal
+// parts along one field, until at most ACL_LEAF_RULES rules are left,
+// the parts holding at most ACL_SPACE_FACTOR times the rules of the node.
+#define ACL_LEAF_RULES 8
+#define ACL_SPACE_FACTOR 4
+#define ACL_MAX_CUTS 256
+#define ACL_MAX_TREE_RULES (1 << 24) // Rules in all the leaves together
+
+
+// Fields of a packet that the rules look at, in the order of the arrays.
+// For the packets that are not TCP or UDP (or later fragments), the ports
+// are 0.
+enum acl_field {
+    ACL_SRC,
+    ACL_DST,
+    ACL_PROTO,
+    ACL_SPORT,
+    ACL_DPORT,
+    ACL_FIELDS_CNT
+};
+
+
+enum acl_action {
+    ACL_PERMIT,
+    ACL_DENY,
+};
+
+
+// A rule of the file, matched in order: the first match decides. Every
+// field is a range of values, prefixes included (host order).
+struct acl_rule {
+    uint32_t lo[ACL_FIELDS_CNT];
+    uint32_t hi[ACL_FIELDS_CNT]; // Inclusive
+    enum acl_action action;
+    uint8_t src_len;
+    uint8_t dst_len;
+    int line;                    // Line of the file, for the reports
+};
+
+
+#define ACL_LEAF 0xff
+
+struct acl_node {
+    uint8_t field;  // Field of the cuts, or ACL_LEAF
+    uint8_t shift;  // Bits of the values in one part
+    uint32_t base;  // Lowest value of the field in the node
+    uint32_t first; // First child in children, or first rule in leaf_rules
+    uint32_t cnt;   // Rules of a leaf
+};
+
+
+// A compiled rule set, never modified once compiled: a new set replaces
+// it as a whole, only its hit counters change.
+struct acl {
+    struct acl_node *nodes; // The root is nodes[0]
+    uint32_t *children;     // Node of every part of the internal nodes
+    uint32_t *leaf_rules;   // Rules of every leaf, in their order
+    int nodes_cnt;
+    int leaf_rules_cnt;
+    struct acl_rule *rules;
+    int rules_cnt;
+    // Hits of every rule, and of no rule (permitted) at rules_cnt.
+    uint64_t *hits;
+};
+
+typedef struct acl acl_t;
+
+
+/**
+ * Reads and compiles a rule file, with lines such as
+ * "deny 10.0.0.0/8 any tcp any 22" or "permit any 192.168.1.0/24 udp
+ * 1024-65535 53": action, source, destination, protocol (any, tcp, udp,
+ * icmp or a number), source ports and destination ports (any, N or N-M).
+ * Empty lines and lines starting with '#' are ignored. The packets that
+ * match no rule are permitted.
+ * @return The compiled rule set, or NULL (after printing why) if the
+ * file is not valid.
+ */
+acl_t *acl_compile(const char *path);
+
+
+/**
+ * Compiles a rule file in a new thread, which runs on the helper CPUs, and
+ * stores the result in *result, where the forwarding loop picks it up. A
+ * result that was never picked up is freed.
+ */
+void acl_compile_async(const char *path, acl_t **result);
+
+
+/**
+ * Frees a rule set, which no thread may still be using.
+ */
+void acl_free(acl_t *acl);
+
+
+/**
+ * Finds the first rule that matches the IPv4 packet and counts its hit.
+ * @param ip_hdr IPv4 header of the packet, whose length is checked
+ * @return The action of the rule, ACL_PERMIT if none matches.
+ */
+enum acl_action acl_classify(acl_t *acl, packet_buf_t *pkt, struct iphdr *ip_hdr);
+
+
+/**
+ * Prints the size of the tree and the rules that were hit, with their
+ * number of hits.
+ */
+void acl_print_hits(const acl_t *acl, FILE *out);
+
+#endif /* ACL_H */
@@ -0,0 +1,135 @@
+#ifndef ADJACENCY_H
+#define ADJACENCY_H
+
+#include <stdint.h>
+#include <string.h>
+#include "lib.h"
+#include "protocols.h"
+#include "timer.h"
+
+// Number of buckets of the adjacency hash table.
+#define ADJ_BUCKETS_BITS 16
+#define ADJ_BUCKETS (1 << ADJ_BUCKETS_BITS)
+
+// A resolved next hop is forgotten if it does not answer for
+// NEIGH_LIFETIME_MS, and asked again before that, to stay resolved.
+#define NEIGH_LIFETIME_MS 60000
+#define NEIGH_REFRESH_MS (NEIGH_LIFETIME_MS * 3 / 4)
+
+// Length of the rewrite, i.e. of the whole Ethernet header.
+#define ADJ_REWRITE_LEN sizeof(struct ether_header)
+
+
+// Everything needed to send a packet to a next hop through an interface.
+// The routes towards the same (interface, next hop) share one adjacency.
+struct adjacency {
+    // Ready-made Ethernet header (next hop MAC, interface MAC, IPv4),
+    // valid only after the MAC of the next hop has been resolved. Both are
+    // written by the forwarding loop only; the slow path reads the flag,
+    // hence atomically.
+    uint8_t rewrite[ADJ_REWRITE_LEN];
+    uint8_t resolved;
+    uint8_t is_static; // Configured MAC, never asked for nor expired
+
+    int interface;
+    uint32_t next_hop; // Network order
+
+    // Neighbor state, kept up to date by the resolver.
+    uint64_t confirmed_ms;  // Time of the last ARP reply
+    uint64_t next_probe_ms; // When the resolver should ask again
+    int probes;             // Unanswered requests since then
+    uint8_t paced;          // next_probe_ms is a turn given by the pacing
+    wheel_timer_t timer;    // Next probe or expiry, set by the resolver
+    struct neighbor_resolver *resolver; // NULL if static or on a missing interface
+
+    struct adjacency *bucket_next;
+};
+
+typedef struct adjacency adjacency_t;
+
+
+struct adjacency_table {
+    adjacency_t *entries;
+    int size;
+    int capacity;
+    adjacency_t *buckets[ADJ_BUCKETS];
+};
+
+typedef struct adjacency_table adjacency_table_t;
+
+
+/**
+ * Allocates an empty adjacency table.
+ * @param capacity Maximum number of adjacencies
+ * @return Dynamically allocated adjacency table
+ */
+adjacency_table_t *init_adjacency_table(int capacity);
+
+
+/**
+ * Searches the adjacency of the given next hop and interface.
+ * @return The adjacency, or NULL if there is none yet.
+ */
+adjacency_t *adjacency_find(adjacency_table_t *adj_table, uint32_t next_hop,
+                            int interface);
+
+
+/**
+ * Searches the adjacency of the given next hop and interface,
+ * creating it (unresolved) if it does not exist yet.
+ * @param next_hop IP of the next hop (Network order)
+ * @param interface Interface the next hop is reachable through
+ * @return The adjacency, shared by all the routes that use it
+ */
+adjacency_t *adjacency_get(adjacency_table_t *adj_table, uint32_t next_hop,
+                           int interface);
+
+
+/**
+ * Stores the MAC of a next hop in its adjacency on an interface, by
+ * rebuilding its Ethernet header.
+ * @param next_hop IP of the next hop (Network order)
+ * @param interface Interface the MAC was learned on
+ * @param mac MAC address of the next hop
+ * @return Number of adjacencies updated
+ */
+int adjacency_resolve(adjacency_table_t *adj_table, uint32_t next_hop, int interface,
+                      const uint8_t *mac);
+
+
+/**
+ * Same as adjacency_resolve(), but for a MAC loaded from a file, on all the
+ * interfaces of the next hop: either a static one, which is never expired,
+ * asked for or overridden by ARP, or one saved before a restart, which is
+ * asked for again right away.
+ */
+int adjacency_load(adjacency_table_t *adj_table, uint32_t next_hop,
+                   const uint8_t *mac, int is_static);
+
+
+/**
+ * Writes the new MAC of an interface in the prebuilt headers of its
+ * adjacencies, as their source.
+ */
+void adjacency_set_interface_mac(adjacency_table_t *adj_table, int interface,
+                                 const uint8_t *mac);
+
+
+/**
+ * Writes the learned (not static) MACs of the resolved adjacencies to a
+ * file, in the same "IP MAC" format as the static neighbor file.
+ * @param path File to write, replaced atomically
+ * @return Number of saved entries, or -1 on error
+ */
+int save_adjacencies(adjacency_table_t *adj_table, const char *path);
+
+
+/**
+ * Rewrites the Ethernet header of the packet with the prebuilt one
+ * of the (resolved) adjacency.
+ */
+static inline void adjacency_rewrite(const adjacency_t *adj, char *packet) {
+    memcpy(packet, adj->rewrite, ADJ_REWRITE_LEN);
+}
+
+#endif /* ADJACENCY_H */
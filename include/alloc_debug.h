@@ -0,0 +1,29 @@
+#ifndef ALLOC_DEBUG_H
+#define ALLOC_DEBUG_H
+
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * Debug builds (make debug_alloc) interpose malloc and friends to count
+ * the heap allocations, so that the forwarding path can assert it does
+ * not allocate at all once the router is warmed up.
+ */
+#ifdef DEBUG_ALLOC
+
+/**
+ * @return Number of heap allocations done by the calling thread so far.
+ */
+uint64_t heap_alloc_count();
+
+#define ALLOC_CHECK_BEGIN() uint64_t __heap_allocs = heap_alloc_count()
+#define ALLOC_CHECK_END() assert(heap_alloc_count() == __heap_allocs)
+
+#else
+
+#define ALLOC_CHECK_BEGIN() do {} while (0)
+#define ALLOC_CHECK_END() do {} while (0)
+
+#endif /* DEBUG_ALLOC */
+
+#endif /* ALLOC_DEBUG_H */
@@ -6,29 +6,76 @@
 #include "lib.h"
 #include "protocols.h"
 #include "utils.h"
+#include "packet_pool.h"
+#include "adjacency.h"
+#include "timer.h"
 
 
-struct arp_cache_entry {
-    uint32_t ip;    // Network order
-    uint8_t mac[6];
+// Number of buckets of the next hop hash table.
+#define ARP_PENDING_BUCKETS_BITS 12
+#define ARP_PENDING_BUCKETS (1 << ARP_PENDING_BUCKETS_BITS)
+
+// Maximum number of packets waiting for the MAC of a single next hop.
+#define ARP_PENDING_MAX_PACKETS 64
+
+// Maximum number of next hops and of packets waiting at the same time.
+// The packets are bounded well below the pool size, so that there is
+// always a buffer left to receive into.
+#define ARP_PENDING_MAX_HOPS 1024
+#define ARP_PENDING_MAX_TOTAL (PACKET_POOL_SIZE / 2)
+
+// Length of an ARP packet (Ethernet header + ARP header).
+#define ARP_PACKET_LEN (sizeof(struct ether_header) + sizeof(struct arp_header))
+
+// ARP requests are retransmitted with exponential backoff,
+// until the maximum number of retries is reached.
+#define ARP_REQUEST_MAX_RETRIES 4
+#define ARP_REQUEST_BACKOFF_MS 100
+#define ARP_REQUEST_MAX_BACKOFF_MS 1000
+
+
+// What to do with a new packet when the queue of its next hop is full.
+enum arp_drop_policy {
+    ARP_DROP_NEWEST, // Tail drop, keep the packets already queued
+    ARP_DROP_OLDEST  // Head drop, make room for the new packet
 };
 
-typedef struct arp_cache_entry arp_cache_entry;
 
+// Packets waiting for the MAC of the same next hop, for which exactly
+// one ARP request is outstanding at a time.
+struct arp_pending_hop {
+    uint32_t next_hop; // Network order
+    int interface;
+    adjacency_t *adj;
+
+    // Packets linked through their descriptors, each holding its
+    // best_route, for fast access to the next hop.
+    packet_buf_t *head;
+    packet_buf_t *tail;
+    int cnt;
 
-// Allows for fast access to the next hop of a packet.
-struct arp_queue_entry {
-    char *packet;
-    size_t packet_len;
-    struct route_table_entry *best_route;
+    int retries;
+    uint64_t backoff_ms;
+    wheel_timer_t retry_timer; // Retransmits the request, or gives up
+
+    struct arp_packet_queue *packet_queue;
+    struct arp_pending_hop *bucket_next; // Next hop in the same bucket
+    struct arp_pending_hop *next;        // Free list
 };
 
-typedef struct arp_queue_entry arp_queue_entry;
+typedef struct arp_pending_hop arp_pending_hop;
 
 
+// Pending packets, indexed by next hop and interface. The next hops are preallocated,
+// so that no memory is allocated while the router is running.
 struct arp_packet_queue {
-    queue entries;
-    int cnt;
+    arp_pending_hop *buckets[ARP_PENDING_BUCKETS];
+    arp_pending_hop *free_hops;
+    arp_pending_hop *hop_storage;
+    packet_pool_t *pool;   // Where the queued packets come from
+    int cnt;               // Total number of pending packets
+    int max_per_hop;
+    enum arp_drop_policy drop_policy;
 };
 
 typedef struct arp_packet_queue arp_packet_queue;
@@ -36,9 +83,11 @@ typedef struct arp_packet_queue arp_packet_queue;
 
 /**
  * Initializes the packet queue.
+ * @param pool Pool of the packets that will be queued
+ * @param drop_policy What to drop when the queue of a next hop is full
  * @return Dynamically allocated packet queue structure.
  */
-arp_packet_queue *init_packet_queue();
+arp_packet_queue *init_packet_queue(packet_pool_t *pool, enum arp_drop_policy drop_policy);
 
 
 /**
@@ -70,76 +119,110 @@ void send_arp_reply(uint8_t *sender_mac, uint8_t *target_mac,
 
 
 /**
- * Dynamically allocates memory for a copy of the orig_packet (because it will
- * disappear when a new packet will be received) and creates a new arp_queue_entry,
- * then enqueues it in the router's packet_queue.
- *
- * Note that the additional packet must be freed after dequeue and send.
- *
- * @param packet_queue Queue of packets, owned by the router.
- * @param orig_packet Packet to be added to the queue.
- * @param packet_len Size of the original packet.
+ * Searches the packet queue for the next hop with the given IP on the
+ * interface: like the adjacencies, the same IP may be pending on several.
+ * @param next_hop IP of the next hop (Network order)
+ * @return The pending next hop, if found, NULL, otherwise.
  */
-void add_packet_in_queue(arp_packet_queue *packet_queue, char *orig_packet,
-                         struct route_table_entry *best_route, size_t packet_len);
+arp_pending_hop *find_pending_hop(arp_packet_queue *packet_queue,
+                                  uint32_t next_hop, int interface);
 
 
 /**
- * Searches the ARP cache for target_ip.
- * @param arp_cache List of already discovered IP-MAC mappings
- * @param target_ip IP of the next hop machine (host order)
- * @return The MAC address of the next hop machine, if found, NULL, otherwise.
+ * Enqueues the packet in the queue of its next hop, by taking a reference
+ * to its buffer instead of copying it. If that queue is full, the drop
+ * policy of the packet_queue decides which packet is discarded.
+ *
+ * Note that the reference must be dropped after dequeue and send.
+ *
+ * @param packet_queue Queue of packets, owned by the router.
+ * @param hop Pending next hop of the packet.
+ * @param pkt Packet to be added to the queue, with pkt->len set.
+ * @param best_route Route previously determined by the LPM algorithm
  */
-uint8_t *search_addr_in_cache(list arp_cache, uint32_t target_ip);
+void add_packet_in_queue(arp_packet_queue *packet_queue, arp_pending_hop *hop,
+                         packet_buf_t *pkt, struct route_table_entry *best_route);
 
 
 /**
- * Allocates memory for an ARP packet (Ethernet header + ARP header).
+ * Fills an ARP packet (Ethernet header + ARP header) in the given buffer.
  * Can be used for both ARP request and ARP reply, if given the correct params.
- * Memory must be freed after sending the packet.
+ * @param packet Buffer of at least ARP_PACKET_LEN bytes
  * @param sender_mac Sender MAC - for both Eth and ARP
  * @param target_mac Target MAC - for both Eth and ARP, might be
  * ff:ff:ff:ff:ff:ff (when broadcasting)
  * @param sender_ip Sender IP (Network order)
  * @param target_ip Target IP (Network order)
  * @param arp_op ARP opcode (1 for request, 2 for reply)
- * @return ARP packet
  */
-char *create_arp_packet(uint8_t *sender_mac, uint8_t *target_mac,
-                        uint32_t sender_ip, uint32_t target_ip,
-                        uint16_t arp_op);
+void create_arp_packet(char *packet, uint8_t *sender_mac, uint8_t *target_mac,
+                       uint32_t sender_ip, uint32_t target_ip,
+                       uint16_t arp_op);
 
 
 /**
- * Updates the ARP cache with the newly received entry and iterates the packet
- * queue, sending all the packets whose next hop's MAC has been discovered
+ * Stores the MAC of the sender of the ARP reply in its adjacency on the
+ * interface the reply was received on.
  * @param arp_hdr ARP header of the newly ARP reply
+ * @param interface Interface the reply was received on
+ * @param adj_table Adjacencies of all the next hops
+ * @return Whether the sender is the next hop of any route there.
+ */
+int arp_reply_resolve(struct arp_header *arp_hdr, int interface,
+                      adjacency_table_t *adj_table);
+
+
+/**
+ * Sends all the packets waiting for the MAC of the sender of the ARP
+ * reply on the interface it was received on, whose adjacency
+ * arp_reply_resolve() has resolved. The other pending next hops, including
+ * the same IP on other interfaces, are not touched.
+ */
+void arp_reply_drain(struct arp_header *arp_hdr, int interface,
+                     arp_packet_queue *packet_queue);
+
+
+/**
+ * Resolves the adjacencies of the sender of the ARP reply and sends all
+ * the packets waiting for the MAC of this next hop.
  */
-void handle_arp_reply(struct arp_header *arp_hdr, list *arp_cache,
+void handle_arp_reply(struct arp_header *arp_hdr, int interface,
+                      adjacency_table_t *adj_table,
                       arp_packet_queue *packet_queue);
 
 
+/**
+ * Answers an ARP request, if it asks for the address of the interface.
+ * @param interface Interface the request was received on
+ */
+void answer_arp_request(struct arp_header *arp_hdr, int interface);
+
 
 /**
- * Allocates memory for a new cache entry and adds it in the arp_cache.
- * @param arp_cache Pointer to the router cache, containing already
- * discovered ARP mappings
- * @param ip New IPv4 address (Network order)
- * @param mac New MAC address
+ * Answers an ARP request for the address of the interface, or handles an
+ * ARP reply (handle_arp_reply()).
+ * @param interface Interface the packet was received on
  */
-void add_cache_entry(list *arp_cache, uint32_t ip, uint8_t *mac);
+void handle_arp_packet(struct arp_header *arp_hdr, int interface,
+                       adjacency_table_t *adj_table, arp_packet_queue *packet_queue);
 
 
 /**
- * Tries to send the packet with best_route already known, by first searching
- * the cache for the MAC of the destination IP. If found, the packet is sent,
- * else, an ARP request is sent and the packet is enqueued in the packet queue.
- * @param packet Packet to send
- * @param packet_len Length of the packet
- * @param best_route Route previously determined by the LPM algorithm
+ * Tries to send the packet with best_route already known. If the adjacency
+ * of the route is resolved, its prebuilt Ethernet header is copied over the
+ * packet, which is sent (egress_send_adjacency()). Else, the packet is
+ * enqueued in the packet queue.
+ * An ARP request is sent only for the first packet towards a next hop, the
+ * following ones just wait for the same reply. The request is retransmitted
+ * by a timer, with exponential backoff, and once the retries are exhausted
+ * the next hop is considered dead and its packets are dropped.
+ * @param pkt Packet to send, with pkt->len set
+ * @param best_route Route previously determined by the LPM algorithm, kept
+ * for the trace only, as its slot may be given to another route meanwhile
+ * @param adj Adjacency of best_route
+ * @return 1 if the packet was sent right away, 0 otherwise.
  */
-void send_packet_safely(char *packet, size_t packet_len, list arp_cache,
-                        arp_packet_queue *packet_queue,
-                        struct route_table_entry *best_route);
+int send_packet_safely(packet_buf_t *pkt, arp_packet_queue *packet_queue,
+                       struct route_table_entry *best_route, adjacency_t *adj);
 
 #endif /* ARP_H */
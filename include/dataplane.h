@@ -0,0 +1,98 @@
+#ifndef DATAPLANE_H
+#define DATAPLANE_H
+
+#include "lib.h"
+#include "forwarding.h"
+#include "arp.h"
+#include "icmp.h"
+#include "packet_pool.h"
+#include "adjacency.h"
+#include "neighbor.h"
+#include "ratelimit.h"
+#include "ipv6.h"
+#include "nd.h"
+#include "acl.h"
+#include "egress.h"
+#include "graph.h"
+#include "timer.h"
+#include "slowpath.h"
+
+// How often a newly compiled ACL is looked for.
+#define DATAPLANE_HOUSEKEEPING_MS 100
+
+
+// Everything the processing of a packet needs.
+struct dataplane {
+    route_table_t *route_table; // Of the default VRF, storing all the routes
+    route_table_t *vrf_tables[ROUTER_NUM_INTERFACES]; // Of the VRF of each interface
+    adjacency_table_t *adj_table;
+    packet_pool_t *packet_pool;
+    arp_packet_queue *packet_queue;
+    icmp_rate_limiter_t *icmp_limiter;
+    neighbor_resolver_t *resolver; // Expiry (and preresolution) of the adjacencies
+    slowpath_t *slowpath; // NULL to do the ARP and ICMP work in the loop
+
+    // Filter of the forwarded IPv4 packets, NULL for none, and the rule
+    // set that replaces it between two packets, once compiled.
+    acl_t *acl;
+    acl_t *acl_next;
+
+    // IPv6, NULL if there is no IPv6 route table.
+    route6_table_t *route6_table;
+    nd_table_t *nd_table;
+
+    // Nodes the received vectors go through, set by init_dataplane_graph().
+    graph_t *graph;
+
+    // Periodic work, once start_dataplane_housekeeping() has been called.
+    wheel_timer_t housekeeping;
+};
+
+typedef struct dataplane dataplane_t;
+
+
+/**
+ * Creates the processing graph of the dataplane: ethernet-input, then
+ * ip4-input, arp-input, ip6-input, icmp-local, ip4-lookup, ip4-rewrite and
+ * interface-output. Must be called once the tables are set.
+ */
+void init_dataplane_graph(dataplane_t *dp);
+
+
+/**
+ * Handles a vector of received packets completely: validation, local delivery
+ * (ICMP Echo, ARP, ND), or forwarding (checksum, ACL, TTL, LPM, ARP, rewrite,
+ * send), for IPv4 and IPv6. Each node of the graph goes over all the packets
+ * it gets before the next one runs.
+ * Whatever still needs a packet afterwards (e.g. an ARP queue) takes
+ * its own reference, the caller's ones are left untouched.
+ * @param pkts Received packets, with pkt->len and pkt->rx_interface set, at
+ * most GRAPH_VECTOR_SIZE
+ */
+void process_vector(dataplane_t *dp, packet_buf_t **pkts, int cnt);
+
+
+/**
+ * Handles a single received packet, as a vector of one.
+ * @param pkt Received packet, with pkt->len set
+ * @param interface Interface the packet was received on
+ */
+void process_packet(dataplane_t *dp, packet_buf_t *pkt, int interface);
+
+
+/**
+ * Starts the periodic work of the dataplane: the switch to a newly compiled
+ * ACL, whose predecessor is freed after printing its hits.
+ */
+void start_dataplane_housekeeping(dataplane_t *dp);
+
+
+/**
+ * Sends the packets waiting for a link, and runs the expired timers: ARP
+ * and ND retransmits, the background resolution of the next hops and the
+ * housekeeping.
+ * @param now Current time, in milliseconds
+ */
+void dataplane_tick(dataplane_t *dp, uint64_t now);
+
+#endif /* DATAPLANE_H */
@@ -0,0 +1,147 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "lib.h"
+#include "packet_pool.h"
+#include "adjacency.h"
+
+// Packets queued on all the interfaces together, bounded like the ARP and
+// ND queues, so that there is always a buffer left to receive into.
+#define EGRESS_MAX_TOTAL (PACKET_POOL_SIZE / 8)
+
+// DSCP from which a packet is network control (CS6 and CS7).
+#define EGRESS_DSCP_CONTROL 48
+
+// RED of the classes that use it: the average queue length is kept with
+// 8 fractional bits and a weight of 1/2^EGRESS_RED_WEIGHT_SHIFT; packets are
+// dropped with a probability growing from 0 at a quarter of the limit to
+// 1/EGRESS_RED_MAX_P_INV at three quarters, and all of them above.
+#define EGRESS_RED_WEIGHT_SHIFT 4
+#define EGRESS_RED_MAX_P_INV 10
+
+// Packets another thread may send between two flushes, and hand over at
+// once to the owner of the queues.
+#define EGRESS_HANDOVER_BATCH 2048
+#define EGRESS_HANDOVER_RING 4096
+
+
+// Traffic classes, served in this order by the deficit round robin.
+enum egress_class {
+    EGRESS_CONTROL, // ARP, Neighbor Discovery, DSCP CS6 and CS7
+    EGRESS_ICMP,    // ICMP and ICMPv6, echo and errors
+    EGRESS_DATA,    // Everything else
+    EGRESS_CLASSES_CNT
+};
+
+
+// Packets of one class waiting for an interface, linked through their
+// descriptors.
+struct egress_queue {
+    packet_buf_t *head;
+    packet_buf_t *tail;
+    int cnt;
+    int deficit;     // Bytes the class may still send in this round
+    uint32_t red_avg; // Average length, in 1/256 packets
+
+    uint64_t sent;
+    uint64_t dropped;
+    int max_cnt;     // Longest the queue has been
+};
+
+
+struct egress_port {
+    struct egress_queue queues[EGRESS_CLASSES_CNT];
+    int backlog;        // Packets in all the queues
+    int current;        // Class visited by the round robin
+    int new_visit;      // The current class has not had its quantum yet
+
+    // Token bucket of the shaper, in bytes, if the rate is limited.
+    uint64_t rate_bps;  // Bits per second, 0 for the speed of the link
+    int64_t tokens;
+    int64_t burst;
+    uint64_t last_ns;
+};
+
+
+/**
+ * Sets up the queues of the interfaces. Until it is called, the packets are
+ * sent straight to the links.
+ * @param pool Pool of the copies of the frames built outside of a buffer
+ * @param rates Rates of the shapers in Mbit/s, "N" for all the interfaces
+ * or "IF=N,..." for some of them, NULL to send at the speed of the links
+ */
+void init_egress(packet_pool_t *pool, const char *rates);
+
+
+/**
+ * Sends a packet, right away if nothing is waiting for the interface and
+ * it accepts it, else through the queue of its class, which takes its own
+ * reference. The packet is dropped (and counted) if its queue is full.
+ */
+void egress_send(packet_buf_t *pkt, int interface);
+
+
+/**
+ * Same as egress_send(), for a frame that is not in a packet buffer (e.g.
+ * an ARP request on the stack), copied only if it has to wait.
+ */
+void egress_send_frame(int interface, char *frame, size_t len);
+
+
+/**
+ * Writes the Ethernet header of the (resolved) adjacency over the packet
+ * and sends it on the interface of the adjacency. In a thread that hands
+ * its packets over, the header is written by the owner of the queues, the
+ * only thread that writes the adjacencies.
+ */
+void egress_send_adjacency(packet_buf_t *pkt, adjacency_t *adj);
+
+
+/**
+ * Lets one other thread (the slow path) send: its packets are handed over
+ * through a ring to the calling thread, which owns the queues and sends
+ * them from recv_from_any_link_timeout(). Called before the other thread
+ * starts.
+ */
+void egress_init_handover();
+
+
+/**
+ * Makes the calling thread, which does not own the queues, hand its packets
+ * over to their owner (egress_init_handover()).
+ * @param pool Pool of the calling thread, for the copies of the frames
+ */
+void egress_handover_thread(packet_pool_t *pool);
+
+
+/**
+ * Hands the packets sent by the calling thread since the last call over to
+ * the owner of the queues, and wakes it up. Until then, they stay with the
+ * calling thread, which must have dropped its own references to them first:
+ * the references to a buffer are held by one thread at a time.
+ */
+void egress_handover_flush();
+
+
+/**
+ * Sends the waiting packets, with a deficit round robin between the classes
+ * of every interface, as long as the links and the shapers accept them.
+ */
+void egress_run();
+
+
+/**
+ * @return The number of packets waiting, on all the interfaces.
+ */
+int egress_backlog();
+
+
+/**
+ * Prints the packets sent and dropped by every queue that was used, and
+ * its longest length.
+ */
+void egress_print_stats(FILE *out);
+
+#endif /* EGRESS_H */
@@ -0,0 +1,72 @@
+#ifndef FIB_SYNC_H
+#define FIB_SYNC_H
+
+#include <stdint.h>
+#include "lib.h"
+#include "forwarding.h"
+#include "adjacency.h"
+#include "neighbor.h"
+
+// Routes that can be learned from the kernel, besides the ones of the file.
+#define FIB_SYNC_MAX_ROUTES MAX_RTABLE_LEN
+
+// The socket buffer holds the notifications of a bulk change of this many
+// bytes, e.g. about 64k routes, before the kernel drops them.
+#define FIB_SYNC_RCVBUF (32 << 20)
+
+// Read at once, then the receive loop goes on: about 700 routes.
+#define FIB_SYNC_READ_LEN 65536
+
+
+// The route table, kept in sync with a routing table of the kernel.
+struct fib_sync {
+    int fd;
+    uint32_t kernel_table;
+    route_table_t *route_table;
+    adjacency_table_t *adj_table;
+    neighbor_resolver_t *resolver;
+    int ifindex[ROUTER_NUM_INTERFACES]; // Kernel index of each interface
+
+    // Slots of the removed routes, reused before the table grows.
+    int *free_slots;
+    int free_cnt;
+
+    // Dump in which each route learned from the kernel was last seen, 0 for
+    // the routes of the file and the free slots. After a dump, the learned
+    // routes that it did not have are removed.
+    uint32_t *seen;
+    uint32_t generation;
+
+    // Routes of the file replaced by a route of the kernel for the same
+    // prefix, put back when the kernel removes it. The file routes are the
+    // first file_cnt slots.
+    struct route_table_entry *file_routes;
+    uint8_t *file_shadowed;
+    int file_cnt;
+    uint32_t seq;
+    int dumping;
+    int resync_needed; // Notifications were lost during the current dump
+};
+
+typedef struct fib_sync fib_sync_t;
+
+
+/**
+ * Follows a routing table of the kernel (rtnetlink), so that e.g. a routing
+ * daemon or "ip route" acts as the control plane: the IPv4 unicast routes
+ * with a gateway through one of the interfaces are loaded at once (dump),
+ * and then added, replaced and removed in the route table as the kernel
+ * notifies them (by recv_from_any_link_timeout()), without a restart.
+ * A prefix has one route, the last one notified, which hides the route of
+ * the file until the kernel removes it. When the socket overflows, the
+ * table is dumped again and the routes it no longer has are removed.
+ * @param kernel_table Id of the kernel table, e.g. 254 for main
+ * @param route_table Table of the default VRF, which must not be shared with
+ * other VRFs, with room for FIB_SYNC_MAX_ROUTES more routes
+ * @param resolver Resolver of the new next hops
+ * @return Allocated state of the sync
+ */
+fib_sync_t *init_fib_sync(uint32_t kernel_table, route_table_t *route_table,
+                          adjacency_table_t *adj_table, neighbor_resolver_t *resolver);
+
+#endif /* FIB_SYNC_H */
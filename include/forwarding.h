@@ -6,13 +6,18 @@
 #include "lib.h"
 #include "protocols.h"
 #include "trie.h"
+#include "adjacency.h"
 
 #define MAX_RTABLE_LEN 100001
 
 
+// The route tables of the VRFs share their entries and adjacencies, so an
+// entry has the same adjacency whichever table it was found in.
 struct route_table {
     struct route_table_entry *entries;
+    adjacency_t **adjacencies; // Adjacency of each entry
     int size;
+    int capacity;
     struct network_trie_node *trie_root;
 };
 
@@ -21,16 +26,22 @@ typedef struct route_table route_table_t;
 
 /**
  * Initializes the route table entries and the table size. Then inserts
- * all the prefixes in the trie.
+ * all the prefixes in the trie and links every entry to the adjacency
+ * of its (interface, next hop).
  * @param path File to read the entries from
+ * @param adj_table Table to create the adjacencies in
+ * @param capacity Entries allocated, at least MAX_RTABLE_LEN, the others
+ * being for the routes of other VRFs
  * @return Allocated route table
  */
-route_table_t *init_route_table(const char *path);
+route_table_t *init_route_table(const char *path, adjacency_table_t *adj_table,
+                                int capacity);
 
 
 /**
  *  Checks whether the destination_mac of the ethernet_header matches
- *  the router's interface MAC address or the broadcast address.
+ *  the router's interface MAC address, the broadcast address or an IPv6
+ *  multicast address.
  *  @return 1 if the MAC is valid, 0 otherwise.
  */
 int check_destination_validity(const uint8_t* destination_mac,
@@ -61,4 +72,13 @@ int update_ttl(struct iphdr *ip_hdr);
  */
 struct route_table_entry *get_best_route(route_table_t *route_table, uint32_t target_ip);
 
+
+/**
+ * @return The adjacency of an entry of the route table.
+ */
+static inline adjacency_t *get_route_adjacency(route_table_t *route_table,
+                                               struct route_table_entry *entry) {
+    return route_table->adjacencies[entry - route_table->entries];
+}
+
 #endif /* FORWARDING_H */
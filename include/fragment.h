@@ -0,0 +1,27 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include "lib.h"
+#include "packet_pool.h"
+#include "protocols.h"
+
+// Fragments a packet may be cut into. Even at a 576 byte MTU, a jumbo
+// packet needs less than 20 of them.
+#define IP4_MAX_FRAGMENTS 64
+
+
+/**
+ * Cuts an IPv4 packet into fragments that fit in the MTU (RFC 791): the
+ * first one keeps all the options, the others only the ones marked to be
+ * copied, and the offsets and the More fragments flag account for the
+ * packet being a fragment itself. The checksums are computed again.
+ * @param pkt Packet, with an Ethernet header and a valid IPv4 header
+ * @param mtu MTU of the egress interface
+ * @param frags Filled with the fragments, taken from the pool of pkt, each
+ * with a reference, and an Ethernet header copied from pkt
+ * @return The number of fragments, or 0 if the packet is malformed, needs
+ * more than max_cnt of them or the pool runs out.
+ */
+int ip4_fragment(packet_buf_t *pkt, int mtu, packet_buf_t **frags, int max_cnt);
+
+#endif /* FRAGMENT_H */
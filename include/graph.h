@@ -0,0 +1,74 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdint.h>
+#include "lib.h"
+#include "packet_pool.h"
+#include "stats.h"
+
+// Packets received and processed together.
+#define GRAPH_VECTOR_SIZE 256
+
+#define GRAPH_MAX_NODES STATS_MAX_NODES
+
+
+struct dataplane;
+
+// Packets waiting for a node, never more than a whole vector.
+struct graph_frame {
+    packet_buf_t *pkts[GRAPH_VECTOR_SIZE];
+    int cnt;
+};
+
+typedef struct graph_frame graph_frame_t;
+
+
+// A step of the processing, which goes over all the packets of its frame
+// before the next node runs, so that its code and data stay in the caches.
+struct graph_node {
+    const char *name;
+    void (*function)(struct dataplane *dp, graph_frame_t *frame);
+};
+
+typedef struct graph_node graph_node_t;
+
+
+// The nodes, in a topological order: a node only sends packets to the
+// nodes after it, so a single pass over them processes a whole vector.
+struct graph {
+    const graph_node_t *nodes;
+    int nodes_cnt;
+    graph_frame_t frames[GRAPH_MAX_NODES];
+};
+
+typedef struct graph graph_t;
+
+
+/**
+ * Creates a graph with empty frames and publishes the names of its nodes in
+ * the statistics.
+ * @param nodes Nodes, in a topological order, the first one taking the
+ * received packets
+ */
+graph_t *init_graph(const graph_node_t *nodes, int cnt);
+
+
+/**
+ * Hands a packet to a node after the current one. The packet keeps the
+ * reference of the vector, no new one is taken.
+ */
+static inline void graph_enqueue(graph_t *graph, int node, packet_buf_t *pkt) {
+    graph_frame_t *frame = &graph->frames[node];
+    frame->pkts[frame->cnt++] = pkt;
+}
+
+
+/**
+ * Runs the nodes that have packets, in order, counting the packets and the
+ * cycles of each one.
+ * @param pkts The received vector, at most GRAPH_VECTOR_SIZE packets,
+ * handed to the first node
+ */
+void graph_dispatch(graph_t *graph, struct dataplane *dp, packet_buf_t **pkts, int cnt);
+
+#endif /* GRAPH_H */
@@ -0,0 +1,47 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stddef.h>
+
+#define HUGEPAGE_SIZE (2UL << 20)
+
+// Allocations smaller than this share huge pages with each other.
+#define HUGEPAGE_SHARED_MAX (HUGEPAGE_SIZE / 2)
+
+// Named regions remembered for the startup report.
+#define HUGEPAGE_MAX_REGIONS 32
+
+
+// How a mapping is backed, from the best to the worst.
+enum hugepage_backing {
+    HUGEPAGE_HUGETLB, // Reserved 2 MB pages (MAP_HUGETLB)
+    HUGEPAGE_THP,     // Transparent huge pages, asked with madvise()
+    HUGEPAGE_NONE,    // 4 KB pages
+};
+
+
+/**
+ * Allocates zeroed, cache aligned memory that is never freed, backed by
+ * 2 MB pages when possible: reserved huge pages first, then transparent
+ * huge pages, then normal pages. Small allocations are packed together
+ * in shared huge pages.
+ * @param region Name of the region, for hugepage_report()
+ * @param size Size in bytes
+ */
+void *hugepage_alloc(const char *region, size_t size);
+
+
+/**
+ * Logs, for every region, how it is backed and, for transparent huge
+ * pages, how much of it the kernel actually gave huge pages.
+ */
+void hugepage_report();
+
+/**
+ * Touches every page of every region, so that no page fault happens later,
+ * while forwarding. The contents are left unchanged.
+ * @return The number of bytes of the regions.
+ */
+size_t hugepage_prefault();
+
+#endif /* HUGEPAGE_H */
@@ -6,25 +6,46 @@
 #include "utils.h"
 #include "arp.h"
 #include "forwarding.h"
+#include "ratelimit.h"
 
 
 /**
- * Creates and sends a packet in accordance with the standard of an
- * ICMP Echo reply.
- * @param ip_hdr The IPv4 header of the Echo request packet
- * @param packet_len Length of the Echo request packet
+ * Turns an ICMP Echo request into the Echo reply, in its own buffer:
+ * the addresses are swapped and the checksums updated incrementally.
+ * The reply is sent back through the ingress interface, to the neighbor
+ * the request came from.
+ * @param pkt The Echo request packet
+ * @param interface Interface the request was received on
  */
-void create_icmp_reply(struct iphdr *ip_hdr, size_t packet_len, list arp_cache,
+void create_icmp_reply(packet_buf_t *pkt, int interface,
                        arp_packet_queue *packet_queue, route_table_t *route_table);
 
 
 /**
- * Creates and sends a packet in accordance with the standard of an
- * ICMP error message.
+ * Decides whether an ICMP error is sent back to the source of a packet,
+ * in accordance with the standard of the ICMP error messages: the limiter
+ * is checked first, before doing any work, then the route back is looked
+ * up, as the VRF of the packet may have none.
  * @param ip_hdr The IPv4 header of the packet that generated the error
+ * @param limiter Rate limiter of the ICMP errors
+ * @return The route back to the source, or NULL if no error is sent.
+ */
+struct route_table_entry *icmp_error_route(struct iphdr *ip_hdr,
+                                           icmp_rate_limiter_t *limiter,
+                                           route_table_t *route_table);
+
+
+/**
+ * Creates and sends an ICMP error that icmp_error_route() allowed, with
+ * the IPv4 header and 8 bytes of data of the packet.
  * @param error_type ICMP encoding of the occurred error
+ * @param rest The second word of the ICMP header, in network order, e.g.
+ * the MTU of the next hop for Fragmentation needed (RFC 1191)
+ * @param best_route Route back to the source of the packet
+ * @param adj Adjacency of best_route, whose interface is the source
  */
-void create_icmp_error(struct iphdr *ip_hdr, uint8_t error_type, list arp_cache,
-                       arp_packet_queue *packet_queue, route_table_t *route_table);
+void send_icmp_error(struct iphdr *ip_hdr, uint8_t error_type, uint8_t code, uint32_t rest,
+                     struct route_table_entry *best_route, adjacency_t *adj,
+                     arp_packet_queue *packet_queue);
 
 #endif /* ICMP_H */
@@ -0,0 +1,45 @@
+#ifndef ICMP6_H
+#define ICMP6_H
+
+#include "protocols.h"
+#include "lib.h"
+#include "packet_pool.h"
+#include "ipv6.h"
+#include "nd.h"
+#include "ratelimit.h"
+
+
+/**
+ * Turns an ICMPv6 Echo request into the Echo reply, in its own buffer,
+ * and sends it back to the neighbor the request came from, as for IPv4.
+ * @param pkt The Echo request packet, to a unicast address of the router
+ * @param interface Interface the request was received on
+ */
+void create_icmp6_reply(packet_buf_t *pkt, int interface);
+
+
+/**
+ * Sends an ICMPv6 error about the packet, with as much of it as fits in
+ * the minimum IPv6 MTU, unless RFC 4443 (2.4 e) forbids it (errors about
+ * errors, multicast, unspecified sources) or the limiter suppresses it.
+ * Errors to link-local sources go back through the ingress interface.
+ * @param pkt The packet that generated the error, with a valid IPv6 header
+ * @param interface Interface the packet was received on
+ * @param type ICMPv6 type of the error
+ * @param code ICMPv6 code of the error
+ */
+void create_icmp6_error(packet_buf_t *pkt, int interface, uint8_t type, uint8_t code,
+                        icmp_rate_limiter_t *limiter, route6_table_t *route6_table,
+                        nd_table_t *nd);
+
+
+/**
+ * Sends a Packet Too Big error about the packet, with the MTU of the link
+ * it cannot go through, under the same conditions as the other errors.
+ * @param mtu MTU of the egress interface
+ */
+void create_icmp6_packet_too_big(packet_buf_t *pkt, int interface, int mtu,
+                                 icmp_rate_limiter_t *limiter, route6_table_t *route6_table,
+                                 nd_table_t *nd);
+
+#endif /* ICMP6_H */
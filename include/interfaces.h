@@ -0,0 +1,57 @@
+#ifndef INTERFACES_H
+#define INTERFACES_H
+
+#include <stdint.h>
+#include "lib.h"
+
+// IPv6 addresses kept for every interface.
+#define INTERFACE_MAX_IP6 4
+
+// Largest MTU used, so that jumbo frames (9000 bytes) fit, but not the
+// 64 KB of a virtual link, whose buffers would take the whole memory.
+#define INTERFACE_MAX_MTU 9216
+
+
+// Addresses of a router interface, read once at startup, so that they are
+// not asked from the kernel (ioctl) for every packet.
+struct interface_info {
+    uint8_t mac[6];
+    uint32_t ip; // Network order
+
+    // The first one is the link-local address, which is the source of the
+    // Neighbor Discovery messages.
+    uint8_t ip6[INTERFACE_MAX_IP6][16];
+    int ip6_cnt;
+
+    // Largest IP packet sent on the link, at most INTERFACE_MAX_MTU.
+    int mtu;
+};
+
+typedef struct interface_info interface_info_t;
+
+extern interface_info_t router_interfaces[ROUTER_NUM_INTERFACES];
+extern int router_interfaces_cnt;
+
+
+/**
+ * Reads the MAC, IPv4 and IPv6 addresses and the MTU of the interfaces set
+ * up by init(), and sizes max_frame_len for the largest MTU, so it must
+ * run before any packet pool is created.
+ * @param cnt Number of interfaces
+ */
+void init_interfaces_info(int cnt);
+
+
+/**
+ * @return 1 if addr is one of the IPv6 addresses of the interface, 0 otherwise.
+ */
+int is_interface_ip6(int interface, const uint8_t *addr);
+
+
+/**
+ * Sets max_frame_len for the largest MTU of the interfaces, with
+ * MAX_PACKET_LEN as the minimum.
+ */
+void update_max_frame_len();
+
+#endif /* INTERFACES_H */
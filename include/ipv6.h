@@ -0,0 +1,87 @@
+#ifndef IPV6_H
+#define IPV6_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "lib.h"
+#include "protocols.h"
+#include "lpm6.h"
+#include "nd.h"
+
+
+// Route of an IPv6 prefix.
+struct route6_table_entry {
+    uint8_t prefix[16];
+    uint8_t next_hop[16]; // :: for the prefixes on the link of the interface
+    int len;
+    int interface;
+};
+
+
+struct route6_table {
+    struct route6_table_entry *entries;
+    // Neighbor of the next hop of each entry, NULL for the on-link ones,
+    // whose neighbor is the destination of the packet.
+    nd_neighbor_t **neighbors;
+    int size;
+    lpm6_t *lpm;
+};
+
+typedef struct route6_table route6_table_t;
+
+
+/**
+ * Reads an IPv6 route table, in the format of the IPv4 one:
+ * "prefix next_hop mask interface" lines, e.g.
+ * "2001:db8:1:: fe80::1 ffff:ffff:ffff:ffff:: 1". The mask may also be
+ * given as a prefix length. Builds the LPM of the prefixes and creates
+ * the neighbors of the next hops.
+ * @param path File to read the entries from
+ * @param nd Neighbor table to create the neighbors in
+ * @return Allocated route table
+ */
+route6_table_t *init_route6_table(const char *path, nd_table_t *nd);
+
+
+/**
+ * IPv6 LPM.
+ * @param target Destination address
+ * @return Best route to target, or NULL if there is none.
+ */
+static inline struct route6_table_entry *get_best_route6(route6_table_t *route6_table,
+                                                         const uint8_t *target) {
+    int64_t idx = lpm6_lookup(route6_table->lpm, target);
+    return idx < 0 ? NULL : &route6_table->entries[idx];
+}
+
+
+/**
+ * Computes the checksum of an upper layer (ICMPv6) message, including
+ * the pseudo-header of RFC 8200, section 8.1.
+ * @param ip6_hdr IPv6 header, for the addresses
+ * @param data Message, with its checksum field set to 0 (or left as
+ * received, to check it)
+ * @param len Length of the message
+ * @return The checksum to store (Network order), 0 for a received
+ * message with a valid checksum.
+ */
+uint16_t ipv6_checksum(const struct ipv6hdr *ip6_hdr, const void *data, size_t len);
+
+
+static inline int ipv6_is_multicast(const uint8_t *addr) {
+    return addr[0] == 0xff;
+}
+
+
+static inline int ipv6_is_link_local(const uint8_t *addr) {
+    return addr[0] == 0xfe && (addr[1] & 0xc0) == 0x80;
+}
+
+
+static inline int ipv6_is_unspecified(const uint8_t *addr) {
+    static const uint8_t unspecified[16];
+    return memcmp(addr, unspecified, 16) == 0;
+}
+
+#endif /* IPV6_H */
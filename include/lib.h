@@ -6,18 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Smallest receive buffer, enough for a 1500 byte MTU */
 #define MAX_PACKET_LEN 1600
 #define ROUTER_NUM_INTERFACES 3
 
+/*
+ * Length of the longest frame received, which every buffer given to the
+ * receive functions must hold: MAX_PACKET_LEN, unless the interfaces have
+ * a larger MTU (see init_interfaces_info()).
+ */
+extern size_t max_frame_len;
+
 
 /*
  * @brief Sends a packet on a specific interface.
  *
  * @param interface - index of the output interface
  * @param frame_data - region of memory in which the data will be copied; should
- *        have at least MAX_PACKET_LEN bytes allocated
- * @param length - will be set to the total number of bytes received.
- * Returns: the interface it has been received from.
+ *        have at least max_frame_len bytes allocated
+ * @param length - length of the frame
+ * Returns: the number of bytes sent, or -1 if the link cannot take the frame
+ * now (full socket buffer or device queue), in which case it was not sent.
  */
 int send_to_link(int interface, char *frame_data, size_t length);
 
@@ -26,12 +35,59 @@ int send_to_link(int interface, char *frame_data, size_t length);
  * be received.
  *
  * @param frame_data - region of memory in which the data will be copied; should
- *        have at least MAX_PACKET_LEN bytes allocated 
+ *        have at least max_frame_len bytes allocated
  * @param length - will be set to the total number of bytes received.
  * Returns: the interface it has been received from.
  */
 int recv_from_any_link(char *frame_data, size_t *length);
 
+/*
+ * @brief Same as recv_from_any_link, but gives up after timeout_ms
+ * milliseconds without any packet (a negative timeout blocks forever).
+ *
+ * Returns: the interface it has been received from, or -1 on timeout or
+ * when interrupted by a signal.
+ */
+int recv_from_any_link_timeout(char *frame_data, size_t *length, int timeout_ms);
+
+/*
+ * @brief Same as recv_from_any_link_timeout, but once a frame has arrived,
+ * also takes the frames already waiting on the interfaces, without blocking,
+ * until max_cnt of them.
+ *
+ * @param frames - max_cnt regions of at least max_frame_len bytes
+ * @param lengths - will be set to the lengths of the received frames
+ * @param ifs - will be set to the interfaces of the received frames
+ * Returns: the number of received frames, 0 on timeout, on an event or when
+ * interrupted by a signal.
+ */
+int recv_burst_timeout(char **frames, size_t *lengths, int *ifs, int max_cnt,
+		       int timeout_ms);
+
+/*
+ * @brief Makes recv_from_any_link_timeout also watch fd (e.g. a control
+ * socket), calling handler(fd, arg) when it becomes readable. The receive
+ * then returns -1, as on timeout.
+ */
+void register_event_fd(int fd, void (*handler)(int fd, void *arg), void *arg);
+
+/*
+ * @brief Get the index of the interface in the kernel (ifindex), as found in
+ * the netlink messages.
+ */
+int get_interface_index(int interface);
+
+struct sock_filter;
+
+/*
+ * @brief Attaches a classic BPF program to the socket of the interface
+ * (SO_ATTACH_FILTER), in place of the previous one, so that the kernel only
+ * queues the frames it accepts.
+ *
+ * Returns: 0 on success, -1 on failure (errno set).
+ */
+int set_interface_filter(int interface, struct sock_filter *insns, int cnt);
+
 /* Route table entry */
 struct route_table_entry {
 	uint32_t prefix;
@@ -48,6 +104,15 @@ struct arp_table_entry {
 
 char *get_interface_ip(int interface);
 
+/**
+ * @brief Get the IPv6 addresses of an interface, link-local included,
+ * as configured in the kernel.
+ *
+ * @param addrs - array of at least max_cnt addresses to fill
+ * Returns: the number of addresses found.
+ */
+int get_interface_ip6(int interface, uint8_t addrs[][16], int max_cnt);
+
 /**
  * @brief Get the interface mac object. The function writes
  * the MAC at the pointer mac. uint8_t *mac should be allocated.
@@ -57,6 +122,12 @@ char *get_interface_ip(int interface);
  */
 void get_interface_mac(int interface, uint8_t *mac);
 
+/**
+ * @brief Get the MTU of an interface, i.e. the largest IP packet its link
+ * takes, as configured in the kernel.
+ */
+int get_interface_mtu(int interface);
+
 /**
  * @brief Homework infrastructure function.
  *
@@ -0,0 +1,58 @@
+#ifndef LPM6_H
+#define LPM6_H
+
+#include <stdint.h>
+
+// Bits of the address consumed by every node of the tree bitmap.
+#define LPM6_STRIDE 4
+
+
+// Node of a tree bitmap (Eatherton et al.): a 4-bit multibit trie node,
+// with its prefixes and children packed in arrays and found by popcount.
+struct lpm6_node {
+    // Prefixes ending in this node: bit (2^len - 1 + bits) for the
+    // prefixes of 0..3 more bits.
+    uint16_t internal;
+    // Children, one bit for each value of the next 4 bits.
+    uint16_t external;
+    uint32_t children; // Index of the first child in nodes
+    uint32_t results;  // Index of the first result in results
+};
+
+typedef struct lpm6_node lpm6_node_t;
+
+
+struct lpm6 {
+    lpm6_node_t *nodes;  // The root is nodes[0], siblings are contiguous
+    uint32_t *results;   // Values of the prefixes
+    int nodes_cnt;
+    int results_cnt;
+};
+
+typedef struct lpm6 lpm6_t;
+
+
+// A prefix to insert, and the value the lookups return for it.
+struct lpm6_prefix {
+    uint8_t addr[16];
+    int len;
+    uint32_t value;
+};
+
+
+/**
+ * Builds the tree bitmap of a set of prefixes at once.
+ * When the same prefix appears several times, the last one wins.
+ * @param prefixes Prefixes to insert, sorted in place
+ * @param cnt Number of prefixes
+ */
+lpm6_t *lpm6_build(struct lpm6_prefix *prefixes, int cnt);
+
+
+/**
+ * Longest prefix match, visiting at most 33 nodes.
+ * @return The value of the longest prefix that matches, or -1.
+ */
+int64_t lpm6_lookup(const lpm6_t *lpm, const uint8_t *addr);
+
+#endif /* LPM6_H */
@@ -0,0 +1,123 @@
+#ifndef ND_H
+#define ND_H
+
+#include <stdint.h>
+#include "lib.h"
+#include "protocols.h"
+#include "packet_pool.h"
+#include "adjacency.h"
+#include "timer.h"
+
+// Number of buckets of the neighbor hash table, and maximum number of
+// neighbors: the next hops of the routes and the on-link destinations.
+#define ND_BUCKETS_BITS 12
+#define ND_BUCKETS (1 << ND_BUCKETS_BITS)
+#define ND_MAX_NEIGHBORS 4096
+
+// Packets waiting for the MAC of a single neighbor, and of all of them.
+#define ND_MAX_PENDING_PACKETS 16
+#define ND_MAX_PENDING_TOTAL (PACKET_POOL_SIZE / 4)
+
+// RFC 4861: RETRANS_TIMER and MAX_MULTICAST_SOLICIT. The reachability of
+// the resolved neighbors follows the ARP one (NEIGH_LIFETIME_MS).
+#define ND_RETRANS_MS 1000
+#define ND_MAX_SOLICIT 3
+
+// Length of a Neighbor Solicitation / Advertisement, with its option.
+#define ND_PACKET_LEN (sizeof(struct ether_header) + sizeof(struct ipv6hdr) \
+                       + sizeof(struct nd_msg))
+
+
+// An IPv6 neighbor, the equivalent of an ARP adjacency and pending next
+// hop together: link-local next hops only mean something on their link,
+// so a neighbor is an (address, interface) pair.
+struct nd_neighbor {
+    // Ready-made Ethernet header, valid once resolved.
+    uint8_t rewrite[ADJ_REWRITE_LEN];
+    uint8_t resolved;
+
+    uint8_t addr[16];
+    int interface;
+
+    uint64_t confirmed_ms;  // Time of the last advertisement
+    uint64_t next_probe_ms; // When to solicit again
+    int probes;             // Unanswered solicitations
+
+    // Next retransmission, refresh or expiry, whichever comes first.
+    wheel_timer_t timer;
+    struct nd_table *table;
+
+    // Packets waiting for the MAC, linked through their descriptors.
+    packet_buf_t *head;
+    packet_buf_t *tail;
+    int cnt;
+
+    struct nd_neighbor *bucket_next;
+};
+
+typedef struct nd_neighbor nd_neighbor_t;
+
+
+// Neighbor cache, preallocated, so that no memory is allocated while
+// the router is running.
+struct nd_table {
+    nd_neighbor_t *buckets[ND_BUCKETS];
+    nd_neighbor_t *entries;
+    int size;
+    packet_pool_t *pool;
+    int pending;       // Packets waiting for any neighbor
+};
+
+typedef struct nd_table nd_table_t;
+
+
+/**
+ * Allocates an empty neighbor table.
+ * @param pool Pool of the packets that will wait for a MAC, and of
+ * the ICMPv6 errors
+ * @return Dynamically allocated neighbor table
+ */
+nd_table_t *init_nd_table(packet_pool_t *pool);
+
+
+/**
+ * Searches the neighbor with the given address on the interface,
+ * creating it (unresolved) if it does not exist yet.
+ * @return The neighbor, or NULL if the table is full.
+ */
+nd_neighbor_t *nd_neighbor_get(nd_table_t *nd, const uint8_t *addr, int interface);
+
+
+/**
+ * Sends the packet to the neighbor, by rewriting its Ethernet header, or
+ * queues it until the neighbor answers a solicitation, which is sent for
+ * the first waiting packet only.
+ * The timer of the neighbor retransmits the solicitations, dropping the
+ * packets if ND_MAX_SOLICIT of them are not answered, and probes (unicast)
+ * or forgets the resolved neighbor once it is about to expire or did.
+ * @param pkt Packet to send, with pkt->len set; the queue takes its own
+ * reference
+ * @return 1 if the packet was sent right away, 0 otherwise.
+ */
+int nd_send_packet(nd_table_t *nd, nd_neighbor_t *neigh, packet_buf_t *pkt);
+
+
+/**
+ * Writes the new MAC of an interface in the prebuilt headers of its
+ * neighbors, as their source.
+ */
+void nd_set_interface_mac(nd_table_t *nd, int interface, const uint8_t *mac);
+
+
+/**
+ * Handles a received Neighbor Solicitation (answered if its target is an
+ * address of the interface) or Advertisement (which resolves the neighbor
+ * and sends its waiting packets). Invalid messages (RFC 4861, 7.1) are
+ * dropped.
+ * @param pkt Received packet, with an ICMPv6 ND message
+ * @param interface Interface the packet was received on
+ */
+void nd_receive(nd_table_t *nd, packet_buf_t *pkt, int interface);
+
+
+#endif /* ND_H */
@@ -0,0 +1,74 @@
+#ifndef NEIGHBOR_H
+#define NEIGHBOR_H
+
+#include <stdint.h>
+#include "adjacency.h"
+
+// Interval between two ARP requests for an unanswered next hop, and the
+// number of requests after which it is left alone for a while.
+#define NEIGH_PROBE_INTERVAL_MS 1000
+#define NEIGH_MAX_PROBES 3
+#define NEIGH_FAILED_RETRY_MS 60000
+
+// Pacing: ARP requests sent in one tick, for unresolved next hops and for
+// refreshing the resolved ones.
+#define NEIGH_REQUESTS_PER_TICK 8
+#define NEIGH_REFRESHES_PER_TICK 32
+#define NEIGH_TICK_MS 50
+
+
+// Turns of the requests of one kind: the ticks already given out, the last
+// one starting at window_ms.
+struct neighbor_pacer {
+    uint64_t window_ms;
+    int used;
+};
+
+
+// Expires the learned MACs of the adjacencies and, if preresolve is set,
+// resolves the next hops of all the routes in the background, so that the
+// first packet towards a next hop does not wait for ARP.
+struct neighbor_resolver {
+    adjacency_table_t *adj_table;
+    int preresolve;
+    struct neighbor_pacer discoveries;
+    struct neighbor_pacer refreshes;
+};
+
+typedef struct neighbor_resolver neighbor_resolver_t;
+
+
+/**
+ * Creates a resolver for all the adjacencies in the table, which are
+ * the distinct next hops of the route table.
+ * Each adjacency gets a timer, for its next ARP request or its expiry: the
+ * expired ones are forgotten, and at most NEIGH_REQUESTS_PER_TICK requests
+ * for the unresolved next hops and NEIGH_REFRESHES_PER_TICK for the resolved
+ * ones that are about to expire are sent every NEIGH_TICK_MS; the others
+ * wait for a turn in a later tick.
+ * @param preresolve Whether to send the requests; if not, the timer of an
+ * adjacency only runs while it is resolved, to expire its MAC, and the next
+ * hops are asked for when a packet needs them.
+ * @return Dynamically allocated resolver
+ */
+neighbor_resolver_t *init_neighbor_resolver(adjacency_table_t *adj_table, int preresolve);
+
+
+/**
+ * Resolves (or only expires) an adjacency created after the resolver, e.g.
+ * for a route learned at run time, unless the resolver has it already.
+ */
+void neighbor_resolver_add(neighbor_resolver_t *resolver, adjacency_t *adj);
+
+
+/**
+ * Loads a neighbor file ("IP MAC" lines, as parsed by parse_arp_table())
+ * into the adjacencies of the listed next hops. The IPs that are not next
+ * hops of any route are ignored.
+ * @param path Neighbor file
+ * @param is_static Whether the MACs are static or were learned (snapshot)
+ * @return Number of adjacencies resolved
+ */
+int load_neighbor_file(adjacency_table_t *adj_table, char *path, int is_static);
+
+#endif /* NEIGHBOR_H */
@@ -0,0 +1,46 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// VRFs that can be given besides the default one.
+#define OPTIONS_MAX_VRFS 7
+
+
+// Optional features of the router, set from the command line.
+struct router_options {
+    int arp_preresolve; // Resolve the next hops of all the routes at startup
+    int prefilter;      // Filter the received frames in the kernel (BPF)
+    char *arp_table;    // Static neighbors, loaded at startup
+    char *arp_snapshot; // Learned neighbors, loaded at startup, saved at exit
+    unsigned int trace_sample; // Trace 1 packet in trace_sample, 0 for none
+    char *rtable6;      // IPv6 route table, NULL to drop IPv6
+    char *acl;          // ACL of the forwarded IPv4 packets, NULL for none
+    char *egress_rates; // Rates of the egress shapers, NULL for the link speed
+    char *vrfs[OPTIONS_MAX_VRFS]; // "FILE:IF,IF..." of the VRFs
+    int vrfs_cnt;
+    unsigned int netlink_table; // Kernel routing table to follow, 0 for none
+    int slow_path;      // Handle ARP and ICMP in a thread of their own
+    int arp_drop_oldest; // Make room in a full ARP queue, instead of dropping
+
+    // Placement and scheduling of the dataplane.
+    int cpu;            // CPU of the forwarding loop, -1 to let it move
+    char *helper_cpus;  // CPU list of the helper threads, NULL for any
+    int fifo_priority;  // SCHED_FIFO priority of the forwarding loop, 0 for none
+    int mlock;          // Lock all the memory of the router in RAM
+    int prefault;       // Touch all the dataplane memory at startup
+    int numa_node;      // NUMA node of the allocations, -1 for the default
+};
+
+typedef struct router_options router_options_t;
+
+
+/**
+ * Parses the "--option" arguments of the router and removes them from argv,
+ * which is left as "router rtable iface...", as if there were no options.
+ * Exits with a usage message on an unknown option.
+ * @param argc Pointer to the argument count, updated
+ * @param argv Arguments, compacted in place
+ * @param opts Options to fill, starting from the defaults
+ */
+void parse_router_options(int *argc, char *argv[], router_options_t *opts);
+
+#endif /* OPTIONS_H */
@@ -0,0 +1,157 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "lib.h"
+#include "ring.h"
+
+#define CACHE_LINE_SIZE 64
+
+// Number of packet buffers preallocated when the router starts.
+#define PACKET_POOL_SIZE 4096
+
+// Size of a buffer holding len bytes, rounded up to a whole number of
+// cache lines.
+#define PACKET_BUF_SIZE(len) (((len) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1))
+
+
+struct packet_pool;
+
+// Descriptor of a packet buffer. The buffer is owned by whoever holds a
+// reference to it and goes back to its pool when the last one is dropped,
+// so a packet can change hands (e.g. wait in a queue) without being copied.
+struct packet_buf {
+    char *data;         // max_frame_len bytes, cache aligned
+    size_t len;
+    int refcnt;
+    uint8_t traced; // 1 + ingress interface if sampled by the trace, else 0
+    uint8_t rx_interface; // Where it was received
+    uint8_t tx_interface; // Where it is sent, once known by the graph
+
+    // Why it was handed to the slow path, and the details the work needs.
+    uint8_t punt_reason;
+    uint32_t punt_arg;
+
+    // Adjacency of best_route, chosen by the forwarding loop, for the
+    // slow path and the egress handover.
+    struct adjacency *adj;
+
+    // Route of the packet, for the ones waiting in a queue or going from
+    // a node of the graph to the next.
+    struct route_table_entry *best_route;
+
+    struct packet_buf *next; // Free list / queue link
+    struct packet_pool *pool;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct packet_buf packet_buf_t;
+
+
+// A pool belongs to one thread, which takes buffers from it and gives them
+// back. It may lend buffers to one other thread, through a ring: that
+// thread may drop the last reference to a buffer, which then goes back
+// through the returns ring, taken by the owner once its free list is empty.
+struct packet_pool {
+    packet_buf_t *descriptors;
+    char *buffers;
+    size_t buf_size;
+    packet_buf_t *free_list;
+    int size;
+    int free_cnt;
+    const int *owner; // &packet_pool_thread of the owner
+    spsc_ring_t *returns;
+    int lent; // Buffers referenced by the other thread, counted by the owner
+};
+
+typedef struct packet_pool packet_pool_t;
+
+
+// Only its address matters: it tells the threads apart.
+extern __thread int packet_pool_thread;
+
+
+/**
+ * Preallocates size packet buffers and their descriptors, all
+ * aligned to a cache line. The buffers hold max_frame_len bytes, as it is
+ * when the pool is created. The calling thread owns the pool.
+ * @return Dynamically allocated pool.
+ */
+packet_pool_t *init_packet_pool(int size);
+
+
+/**
+ * Gives the pool to the calling thread, e.g. to a thread started after the
+ * pool was allocated.
+ */
+void packet_pool_set_owner(packet_pool_t *pool);
+
+
+/**
+ * Puts the buffers whose last reference was dropped by the other thread
+ * back in the free list.
+ */
+void packet_pool_reclaim(packet_pool_t *pool);
+
+
+/**
+ * Takes a buffer out of the pool, with a reference count of 1.
+ * @return The buffer, or NULL if the pool is empty.
+ */
+packet_buf_t *packet_alloc(packet_pool_t *pool);
+
+
+/**
+ * Takes an additional reference to the buffer.
+ */
+static inline packet_buf_t *packet_get(packet_buf_t *pkt) {
+    pkt->refcnt++;
+    return pkt;
+}
+
+
+/**
+ * Counts a buffer whose references go to the other thread through a ring,
+ * if it belongs to the pool of the calling thread.
+ */
+static inline void packet_lend(packet_buf_t *pkt) {
+    if (pkt->pool->owner == &packet_pool_thread) {
+        pkt->pool->lent++;
+    }
+}
+
+
+/**
+ * Counts a buffer whose references come back from the other thread through
+ * a ring, if it belongs to the pool of the calling thread.
+ */
+static inline void packet_take_back(packet_buf_t *pkt) {
+    if (pkt->pool->owner == &packet_pool_thread) {
+        pkt->pool->lent--;
+    }
+}
+
+
+/**
+ * Drops a reference to the buffer, putting it back in its pool
+ * when it was the last one. The references to a buffer are all held by
+ * the same thread at a time, so the count needs no atomic operation.
+ */
+static inline void packet_put(packet_buf_t *pkt) {
+    if (--pkt->refcnt > 0) {
+        return;
+    }
+
+    packet_pool_t *pool = pkt->pool;
+    if (__builtin_expect(pool->owner != &packet_pool_thread, 0)) {
+        // The ring holds the whole pool, it cannot be full.
+        spsc_ring_push(pool->returns, pkt);
+        return;
+    }
+
+    pkt->next = pool->free_list;
+    pool->free_list = pkt;
+    pool->free_cnt++;
+}
+
+#endif /* PACKET_POOL_H */
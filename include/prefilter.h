@@ -0,0 +1,36 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <stdint.h>
+#include "lib.h"
+#include "adjacency.h"
+#include "nd.h"
+
+// Longest program generated for an interface.
+#define PREFILTER_MAX_INSNS 24
+
+
+/**
+ * Attaches to every interface a classic BPF program, generated from its MAC,
+ * that only lets through the frames the router would not drop right away:
+ * IPv4 and ARP (and IPv6 if enabled), sent to the MAC of the interface or to
+ * broadcast (or to an IPv6 multicast MAC). The other frames are no longer
+ * copied to the router.
+ * The links are then watched through netlink (by
+ * recv_from_any_link_timeout()), and the program of an interface is
+ * generated again when its MAC changes.
+ * @param cnt Number of interfaces
+ * @param ipv6 Whether IPv6 frames are accepted
+ */
+void init_prefilter(int cnt, int ipv6);
+
+
+/**
+ * Gives the tables whose prebuilt Ethernet headers carry the MACs of the
+ * interfaces, so that they are rewritten along with the program when a MAC
+ * changes.
+ * @param nd_table IPv6 neighbors, NULL without IPv6
+ */
+void prefilter_watch_neighbors(adjacency_table_t *adj_table, nd_table_t *nd_table);
+
+#endif /* PREFILTER_H */
@@ -7,9 +7,18 @@
 // For Ethernet
 #define ETHER_TYPE_ARP 0x806
 #define ETHER_TYPE_IPV4 0x800
+#define ETHER_TYPE_IPV6 0x86dd
 
 // For IPv4
 #define IPV4_ICMP 1
+#define IPV4_MIN_MTU 68
+#define IPV4_DF 0x4000          // Don't fragment, in frag_off
+#define IPV4_MF 0x2000          // More fragments
+#define IPV4_OFFSET_MASK 0x1fff // Fragment offset, in units of 8 bytes
+
+// For IPv6
+#define IPV6_ICMPV6 58
+#define IPV6_MIN_MTU 1280
 
 // For ARP
 #define ARP_OP_REQUEST 1
@@ -21,6 +30,25 @@
 #define ICMP_ECHO_REPLY_TYPE 0
 #define ICMP_DEST_UNREACHABLE_TYPE 3
 #define ICMP_TIME_EXCEEDED_TYPE 11
+#define ICMP_FRAG_NEEDED_CODE 4
+
+// For ICMPv6
+#define ICMPV6_DEST_UNREACHABLE_TYPE 1
+#define ICMPV6_PACKET_TOO_BIG_TYPE 2
+#define ICMPV6_TIME_EXCEEDED_TYPE 3
+#define ICMPV6_ECHO_REQ_TYPE 128
+#define ICMPV6_ECHO_REPLY_TYPE 129
+#define ICMPV6_ROUTER_SOLICIT_TYPE 133
+#define ICMPV6_NEIGH_SOLICIT_TYPE 135
+#define ICMPV6_NEIGH_ADVERT_TYPE 136
+#define ICMPV6_REDIRECT_TYPE 137
+#define ICMPV6_NO_ROUTE_CODE 0
+#define ICMPV6_BEYOND_SCOPE_CODE 2
+#define ND_OPT_SOURCE_MAC 1
+#define ND_OPT_TARGET_MAC 2
+#define ND_ADVERT_ROUTER 0x80
+#define ND_ADVERT_SOLICITED 0x40
+#define ND_ADVERT_OVERRIDE 0x20
 
 
 /* Ethernet ARP packet from RFC 826 */
@@ -50,7 +78,7 @@ struct iphdr {
     uint8_t    tos;      // we don't use this, set to 0
     uint16_t   tot_len;  // total length = ipheader + data
     uint16_t   id;       // id of this packet
-    uint16_t   frag_off; // we don't use fragmentation, set to 0
+    uint16_t   frag_off; // flags and fragment offset (IPV4_DF, IPV4_MF)
     uint8_t    ttl;      // Time to Live -> to avoid loops, we will decrement
     uint8_t    protocol; // don't care
     uint16_t   check;    // checksum     -> Since we modify TTL,
@@ -59,6 +87,42 @@ struct iphdr {
     uint32_t   daddr;    // the destination of the packet
 };
 
+/* IPv6 Header (RFC 8200) */
+struct ipv6hdr {
+    uint32_t ver_tc_flow;  // version (4 bits), traffic class, flow label
+    uint16_t payload_len;  // length of what follows this header
+    uint8_t  nexthdr;      // only ICMPv6 is handled for the router itself
+    uint8_t  hop_limit;    // the IPv6 TTL
+    uint8_t  saddr[16];
+    uint8_t  daddr[16];
+};
+
+/* ICMPv6 header (RFC 4443), with the first word of the body */
+struct icmp6hdr {
+    uint8_t  type;
+    uint8_t  code;
+    uint16_t checksum;
+    union {
+        struct {
+            uint16_t id;
+            uint16_t sequence;
+        } echo;
+        uint32_t mtu;       // Packet Too Big
+        uint32_t reserved;  // Errors, Neighbor Solicitation
+        uint8_t  flags;     // Neighbor Advertisement
+    } un;
+};
+
+/* Neighbor Solicitation / Advertisement (RFC 4861), with the link-layer
+ * address option, which is the only one sent */
+struct nd_msg {
+    struct icmp6hdr icmp;
+    uint8_t target[16];
+    uint8_t opt_type;
+    uint8_t opt_len;        // in units of 8 bytes
+    uint8_t opt_mac[6];
+};
+
 struct icmphdr
 {
   uint8_t type;                /* message type */
@@ -0,0 +1,75 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// ICMP errors generated per second and burst, for the whole router and
+// for each source /24 prefix, or /64 for IPv6 (the sources are hashed in a
+// fixed number of buckets, so colliding prefixes share a limit).
+#define ICMP_ERR_GLOBAL_RATE 1000
+#define ICMP_ERR_GLOBAL_BURST 100
+#define ICMP_ERR_PREFIX_RATE 20
+#define ICMP_ERR_PREFIX_BURST 10
+#define ICMP_ERR_PREFIX_LEN 24
+#define ICMP6_ERR_PREFIX_LEN 64
+#define ICMP_ERR_PREFIX_BUCKETS_BITS 12
+#define ICMP_ERR_PREFIX_BUCKETS (1 << ICMP_ERR_PREFIX_BUCKETS_BITS)
+
+
+// Token bucket, with the tokens counted in thousandths, so that the
+// refill is exact for any rate with a millisecond clock.
+struct token_bucket {
+    uint64_t milli_tokens;
+    uint64_t last_refill_ms;
+};
+
+typedef struct token_bucket token_bucket_t;
+
+
+struct icmp_rate_limiter {
+    token_bucket_t global;
+    token_bucket_t per_prefix[ICMP_ERR_PREFIX_BUCKETS];
+
+    uint64_t allowed;
+    uint64_t suppressed_global;
+    uint64_t suppressed_prefix;
+};
+
+typedef struct icmp_rate_limiter icmp_rate_limiter_t;
+
+
+/**
+ * Takes a token from the bucket, after refilling it for the time elapsed.
+ * @param rate Tokens added per second
+ * @param burst Maximum number of tokens
+ * @param now Current time, in milliseconds
+ * @return 1 if there was a token, 0 otherwise.
+ */
+int token_bucket_take(token_bucket_t *bucket, uint32_t rate, uint32_t burst,
+                      uint64_t now);
+
+
+/**
+ * Creates a limiter with all the buckets full.
+ * @return Dynamically allocated limiter
+ */
+icmp_rate_limiter_t *init_icmp_rate_limiter();
+
+
+/**
+ * Decides whether an ICMP error may be sent to the given source, first
+ * against the limit of its prefix, then against the global one, and
+ * counts the suppressed errors.
+ * @param source_ip Source of the packet that caused the error (Network order)
+ * @return 1 if the error may be sent, 0 otherwise.
+ */
+int icmp_error_allowed(icmp_rate_limiter_t *limiter, uint32_t source_ip);
+
+
+/**
+ * Same as icmp_error_allowed(), for ICMPv6 errors, sharing the same limits.
+ * @param source Source IPv6 address of the packet that caused the error
+ */
+int icmp6_error_allowed(icmp_rate_limiter_t *limiter, const uint8_t *source);
+
+#endif /* RATELIMIT_H */
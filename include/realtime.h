@@ -0,0 +1,30 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "options.h"
+
+
+/**
+ * Applies the settings that must come before the tables are allocated:
+ * the NUMA node of the allocations and the CPUs of the helper threads,
+ * which the threads started during the setup inherit.
+ */
+void realtime_setup_begin(const router_options_t *opts);
+
+
+/**
+ * Applies the settings of the forwarding loop, once the tables are filled:
+ * prefaults and locks the memory, pins the calling thread to its CPU and
+ * switches it to SCHED_FIFO. Logs what was applied.
+ */
+void realtime_setup_end(const router_options_t *opts);
+
+
+/**
+ * Moves a thread started after the setup (e.g. by the forwarding loop) to
+ * the helper CPUs, with the normal scheduling policy, so that it does not
+ * compete with the forwarding loop. To be called by the thread itself.
+ */
+void realtime_helper_thread();
+
+#endif /* REALTIME_H */
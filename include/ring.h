@@ -0,0 +1,77 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include "lib.h"
+
+
+// Lock-free ring of pointers between exactly two threads: one producer and
+// one consumer. Each side writes only its own index, on its own cache line,
+// and keeps a copy of the other one, read again only when the ring looks
+// full (or empty), so that the cache line bounces once per batch, not once
+// per element.
+struct spsc_ring {
+    void **slots;
+    uint32_t mask; // Size - 1, a power of 2
+
+    // Producer side.
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t cached_head;
+
+    // Consumer side.
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t cached_tail;
+};
+
+typedef struct spsc_ring spsc_ring_t;
+
+
+/**
+ * Allocates an empty ring.
+ * @param size Number of elements, a power of 2
+ * @return Dynamically allocated ring
+ */
+spsc_ring_t *init_spsc_ring(uint32_t size);
+
+
+/**
+ * Adds an element, on the producer side. The writes made before are visible
+ * to the consumer once it takes the element.
+ * @return 1 on success, 0 if the ring is full.
+ */
+static inline int spsc_ring_push(spsc_ring_t *ring, void *element) {
+    uint64_t tail = ring->tail;
+
+    if (tail - ring->cached_head > ring->mask) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head > ring->mask) {
+            return 0;
+        }
+    }
+
+    ring->slots[tail & ring->mask] = element;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/**
+ * Takes the oldest element, on the consumer side.
+ * @return The element, or NULL if the ring is empty.
+ */
+static inline void *spsc_ring_pop(spsc_ring_t *ring) {
+    uint64_t head = ring->head;
+
+    if (head == ring->cached_tail) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->cached_tail) {
+            return NULL;
+        }
+    }
+
+    void *element = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return element;
+}
+
+#endif /* RING_H */
@@ -0,0 +1,117 @@
+#ifndef ROUTE_STATS_H
+#define ROUTE_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "lib.h"
+#include "forwarding.h"
+#include "stats.h"
+
+#define ROUTE_STATS_MAX_THREADS STATS_MAX_THREADS
+
+
+// Traffic of one route, in one thread.
+struct route_counter {
+    uint64_t packets;
+    uint64_t bytes; // Of the IPv4 packets, as received
+};
+
+typedef struct route_counter route_counter_t;
+
+
+// A route in use when the snapshot was taken.
+struct route_snapshot {
+    int slot;
+    struct route_table_entry entry;
+    route_counter_t forgotten; // Sums of the threads before the route got the slot
+};
+
+// What the report needs from the route table, which only the thread that
+// changes it may read. The counters themselves are read by the report.
+struct route_stats_snapshot {
+    struct route_snapshot *routes;
+    int routes_cnt;
+};
+
+typedef struct route_stats_snapshot route_stats_snapshot_t;
+
+
+// Counters of the calling thread, one per slot of the route table, or NULL
+// until it is registered.
+extern __thread route_counter_t *route_counters_local;
+
+
+/**
+ * Allocates the counters of the calling thread, one per slot of the route
+ * table of the default VRF, which stores the routes of all the VRFs.
+ * @param vrf_tables Route tables of the VRFs (repeated ones are allowed), which
+ * tell the routes still in use from the removed ones
+ */
+void init_route_stats(route_table_t **vrf_tables, int vrf_tables_cnt);
+
+
+/**
+ * Allocates the counters of the calling thread, which must not be the first one.
+ */
+void route_stats_register_thread();
+
+
+/**
+ * Starts the counting of a slot again from 0, when it is given to another
+ * route. Called by the thread that changes the route table.
+ */
+void route_stats_forget(int slot);
+
+
+/**
+ * Copies the routes in use, leaving out the removed and shadowed ones.
+ * Called by the thread that changes the route table; it walks the tries
+ * once, so the report itself can run on any thread.
+ * @return The snapshot, or NULL without statistics or memory.
+ */
+route_stats_snapshot_t *route_stats_snapshot();
+
+
+/**
+ * Sums the counters of all the threads for the routes of the snapshot, and
+ * writes the ones that carried the most packets, then the ones that carried
+ * none. A slot given to another route since the snapshot is counted with it.
+ * @param top_n Routes of each list
+ */
+void route_stats_report(FILE *file, route_stats_snapshot_t *snapshot, int top_n);
+
+
+void route_stats_free_snapshot(route_stats_snapshot_t *snapshot);
+
+
+/**
+ * Brings the counters of the route into the cache, ahead of
+ * route_stats_count(), as they are as scattered as the routes.
+ */
+static inline void route_stats_prefetch(route_table_t *table, struct route_table_entry *route) {
+    route_counter_t *counters = route_counters_local;
+    if (__builtin_expect(counters != NULL, 1)) {
+        __builtin_prefetch(&counters[route - table->entries], 1);
+    }
+}
+
+
+/**
+ * Counts a packet on its route. Plain loads and stores, as in stats_add():
+ * only the calling thread writes its counters.
+ */
+static inline void route_stats_count(route_table_t *table, struct route_table_entry *route,
+                                     uint32_t bytes) {
+    route_counter_t *counters = route_counters_local;
+    if (__builtin_expect(counters == NULL, 0)) {
+        return;
+    }
+
+    route_counter_t *c = &counters[route - table->entries];
+    __atomic_store_n(&c->packets, __atomic_load_n(&c->packets, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&c->bytes, __atomic_load_n(&c->bytes, __ATOMIC_RELAXED) + bytes,
+                     __ATOMIC_RELAXED);
+}
+
+#endif /* ROUTE_STATS_H */
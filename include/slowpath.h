@@ -0,0 +1,100 @@
+#ifndef SLOWPATH_H
+#define SLOWPATH_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "lib.h"
+#include "ring.h"
+#include "packet_pool.h"
+#include "forwarding.h"
+#include "adjacency.h"
+#include "arp.h"
+#include "graph.h"
+
+// Packets on their way to the slow path; the ones that do not fit are
+// dropped.
+#define SLOWPATH_RING_SIZE 1024
+
+// Buffers of the forwarding pool that the slow path may hold at once, in
+// its ring, its ARP queue or on their way back to the egress queues: the
+// budget of the ARP queue of the forwarding loop, which stays empty with a
+// slow path. The punts beyond it are dropped, so the pool still covers the
+// ND and egress queues and a vector (see ARP_PENDING_MAX_TOTAL).
+#define SLOWPATH_MAX_LENT ARP_PENDING_MAX_TOTAL
+
+// Packets punted while one vector is handled: received ones, and their
+// fragments.
+#define SLOWPATH_BATCH (2 * GRAPH_VECTOR_SIZE)
+
+// Buffers of the ICMP errors and ARP packets made by the slow path.
+#define SLOWPATH_POOL_SIZE 1024
+
+
+// Why a packet is punted (packet_buf_t.punt_reason).
+enum slowpath_reason {
+    SLOWPATH_ARP,        // ARP request, or reply already resolved
+    SLOWPATH_ECHO,       // Echo request for the router, from a unicast neighbor
+    SLOWPATH_ICMP_ERROR, // Error to send back, see SLOWPATH_ICMP_ARG()
+    SLOWPATH_RESOLVE,    // To send on adj, which is not resolved
+};
+
+// punt_arg of an ICMP error: its type, code and MTU (for Fragmentation
+// needed), while best_route and adj lead back to the source.
+#define SLOWPATH_ICMP_ARG(type, code, mtu) \
+    (((uint32_t) (type) << 24) | ((uint32_t) (code) << 16) | ((mtu) & 0xffff))
+
+
+// The exception work of the forwarding loop (ARP, ICMP generation and the
+// packets waiting for ARP), done by a thread of its own. The loop punts the
+// packets through a ring, and the slow path sends its packets through the
+// egress handover (egress_handover_flush()). Whatever the slow path holds
+// is its own: its ARP queue and retransmit timers, its pool.
+// It never reads the route tables, which the kernel sync changes under the
+// loop, and never writes the adjacencies: the loop resolves them from the
+// ARP replies and writes their headers over the handed over packets
+// (egress_send_adjacency()). Of an adjacency, the slow path reads the
+// next hop and interface, set before the loop punts it, and the resolved
+// flag, atomically, which only decides whether a packet waits for ARP.
+struct slowpath {
+    spsc_ring_t *ring;
+    int wake_fd; // eventfd, written after every batch
+
+    // Punted by the forwarding loop since the last slowpath_flush().
+    packet_buf_t *batch[SLOWPATH_BATCH];
+    int batch_cnt;
+
+    packet_pool_t *pool;
+    arp_packet_queue *packet_queue;
+    pthread_t thread;
+};
+
+typedef struct slowpath slowpath_t;
+
+
+/**
+ * Allocates the slow path and starts its thread. The calling thread, which
+ * runs the forwarding loop, keeps the egress queues, and sends the packets
+ * of the slow path from recv_from_any_link_timeout().
+ * @param drop_policy Of the packets waiting for ARP in the slow path
+ * @return Allocated slow path
+ */
+slowpath_t *init_slowpath(enum arp_drop_policy drop_policy);
+
+
+/**
+ * Hands a packet over to the slow path, at the next slowpath_flush(). Until
+ * then, the packet stays referenced by the forwarding loop.
+ * @param arg Details of the work, depending on the reason
+ */
+void slowpath_punt(slowpath_t *slowpath, packet_buf_t *pkt, enum slowpath_reason reason,
+                   uint32_t arg);
+
+
+/**
+ * Passes the packets punted since the last call to the slow path and wakes
+ * it up. Called once the forwarding loop dropped its own references to
+ * them: the references to a buffer are held by one thread at a time.
+ */
+void slowpath_flush(slowpath_t *slowpath);
+
+#endif /* SLOWPATH_H */
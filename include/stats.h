@@ -0,0 +1,246 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#define STATS_MAGIC 0x52545354 // "RTST"
+#define STATS_VERSION 9
+#define STATS_SHM_PREFIX "/router_stats."
+
+// Each thread of the dataplane owns one slot.
+#define STATS_MAX_THREADS 8
+
+// Latency histograms have one bucket per power of 2 cycles.
+#define STATS_HIST_BUCKETS 32
+
+// Nodes of the packet processing graph, named in the segment by the router.
+#define STATS_MAX_NODES 16
+#define STATS_NODE_NAME_LEN 24
+
+
+enum stats_counter {
+    STAT_RX_PACKETS,
+    STAT_RX_BYTES,
+    STAT_TX_PACKETS,
+    STAT_TX_BYTES,
+    STAT_DROP_BAD_MAC,
+    STAT_DROP_BAD_CHECKSUM,
+    STAT_DROP_ACL,
+    STAT_DROP_TTL,
+    STAT_DROP_NO_ROUTE,
+    STAT_DROP_ARP_QUEUE_FULL,
+    STAT_DROP_ARP_TIMEOUT,
+    STAT_DROP_OTHER_TYPE,
+    STAT_DROP_MALFORMED,
+    STAT_DROP_NOT_FORWARDED,
+    STAT_DROP_ND_QUEUE_FULL,
+    STAT_DROP_ND_TIMEOUT,
+    STAT_DROP_EGRESS_TAIL,
+    STAT_DROP_EGRESS_RED,
+    STAT_DROP_TOO_BIG,
+    STAT_DROP_PUNT_FULL,
+    STAT_DROP_NO_BUFFER,
+    STAT_ARP_REQUESTS_SENT,
+    STAT_ARP_REPLIES_SENT,
+    STAT_ARP_REPLIES_RECEIVED,
+    STAT_ARP_PACKETS_QUEUED,
+    STAT_ND_SOLICITS_SENT,
+    STAT_ND_ADVERTS_SENT,
+    STAT_ND_ADVERTS_RECEIVED,
+    STAT_ND_PACKETS_QUEUED,
+    STAT_EGRESS_QUEUED,
+    STAT_IP4_FRAGMENTS,
+    STAT_ICMP_ECHO_REPLIES,
+    STAT_ICMP_ERRORS_SENT,
+    STAT_ICMP_ERRORS_SUPPRESSED,
+    STAT_FIB_ROUTES_ADDED,
+    STAT_FIB_ROUTES_REMOVED,
+    STAT_FIB_RESYNCS,
+    STAT_PUNTS,
+    STAT_COUNTERS_CNT
+};
+
+static const char *const stats_counter_names[STAT_COUNTERS_CNT] = {
+    [STAT_RX_PACKETS] = "rx_packets",
+    [STAT_RX_BYTES] = "rx_bytes",
+    [STAT_TX_PACKETS] = "tx_packets",
+    [STAT_TX_BYTES] = "tx_bytes",
+    [STAT_DROP_BAD_MAC] = "drop_bad_mac",
+    [STAT_DROP_BAD_CHECKSUM] = "drop_bad_checksum",
+    [STAT_DROP_ACL] = "drop_acl",
+    [STAT_DROP_TTL] = "drop_ttl",
+    [STAT_DROP_NO_ROUTE] = "drop_no_route",
+    [STAT_DROP_ARP_QUEUE_FULL] = "drop_arp_queue_full",
+    [STAT_DROP_ARP_TIMEOUT] = "drop_arp_timeout",
+    [STAT_DROP_OTHER_TYPE] = "drop_other_type",
+    [STAT_DROP_MALFORMED] = "drop_malformed",
+    [STAT_DROP_NOT_FORWARDED] = "drop_not_forwarded",
+    [STAT_DROP_ND_QUEUE_FULL] = "drop_nd_queue_full",
+    [STAT_DROP_ND_TIMEOUT] = "drop_nd_timeout",
+    [STAT_DROP_EGRESS_TAIL] = "drop_egress_tail",
+    [STAT_DROP_EGRESS_RED] = "drop_egress_red",
+    [STAT_DROP_TOO_BIG] = "drop_too_big",
+    [STAT_DROP_PUNT_FULL] = "drop_punt_full",
+    [STAT_DROP_NO_BUFFER] = "drop_no_buffer",
+    [STAT_ARP_REQUESTS_SENT] = "arp_requests_sent",
+    [STAT_ARP_REPLIES_SENT] = "arp_replies_sent",
+    [STAT_ARP_REPLIES_RECEIVED] = "arp_replies_received",
+    [STAT_ARP_PACKETS_QUEUED] = "arp_packets_queued",
+    [STAT_ND_SOLICITS_SENT] = "nd_solicits_sent",
+    [STAT_ND_ADVERTS_SENT] = "nd_adverts_sent",
+    [STAT_ND_ADVERTS_RECEIVED] = "nd_adverts_received",
+    [STAT_ND_PACKETS_QUEUED] = "nd_packets_queued",
+    [STAT_EGRESS_QUEUED] = "egress_queued",
+    [STAT_IP4_FRAGMENTS] = "ip4_fragments",
+    [STAT_ICMP_ECHO_REPLIES] = "icmp_echo_replies",
+    [STAT_ICMP_ERRORS_SENT] = "icmp_errors_sent",
+    [STAT_ICMP_ERRORS_SUPPRESSED] = "icmp_errors_suppressed",
+    [STAT_FIB_ROUTES_ADDED] = "fib_routes_added",
+    [STAT_FIB_ROUTES_REMOVED] = "fib_routes_removed",
+    [STAT_FIB_RESYNCS] = "fib_resyncs",
+    [STAT_PUNTS] = "punts",
+};
+
+
+enum stats_histogram {
+    HIST_LOOKUP, // LPM of a packet
+    HIST_PACKET, // Whole processing of the vector of a packet, receive to send
+    HIST_CNT
+};
+
+static const char *const stats_histogram_names[HIST_CNT] = {
+    [HIST_LOOKUP] = "lookup",
+    [HIST_PACKET] = "packet",
+};
+
+
+// Work of a node of the graph: the vectors it processed, their packets and
+// the cycles it took.
+struct stats_node {
+    uint64_t calls;
+    uint64_t packets;
+    uint64_t cycles;
+};
+
+
+// Statistics of one thread, written only by it, so no atomic
+// read-modify-write is needed. A cache line apart from the other slots.
+struct stats_thread {
+    uint64_t counters[STAT_COUNTERS_CNT];
+    uint64_t histograms[HIST_CNT][STATS_HIST_BUCKETS];
+    struct stats_node nodes[STATS_MAX_NODES];
+} __attribute__((aligned(64)));
+
+typedef struct stats_thread stats_thread_t;
+
+
+// Layout of the shared memory segment, read by the router_stats tool.
+struct stats_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t threads_cnt;
+    uint32_t pid;
+    uint64_t cycles_per_us; // To convert the histograms to time
+    uint32_t nodes_cnt;
+    char node_names[STATS_MAX_NODES][STATS_NODE_NAME_LEN];
+    stats_thread_t threads[STATS_MAX_THREADS];
+};
+
+typedef struct stats_shm stats_shm_t;
+
+
+// Slot of the calling thread (a private dummy one until registered).
+extern __thread stats_thread_t *stats_local;
+
+
+/**
+ * Creates the shared memory segment STATS_SHM_PREFIX<pid> and registers
+ * the calling thread. Statistics still work (privately) if it fails.
+ */
+void init_stats();
+
+
+/**
+ * Gives the calling thread its own slot in the shared memory.
+ */
+void stats_register_thread();
+
+
+/**
+ * Removes the shared memory segment.
+ */
+void destroy_stats();
+
+
+/**
+ * Publishes the names of the nodes of the graph, in the order of their
+ * statistics.
+ */
+void stats_set_node_names(const char *const *names, int cnt);
+
+
+/**
+ * Adds to a counter of the calling thread. Readers in other processes see
+ * whole values, as the store is a single aligned 64-bit one.
+ */
+static inline void stats_add(enum stats_counter counter, uint64_t value) {
+    uint64_t *c = &stats_local->counters[counter];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+#define STAT_INC(counter) stats_add((counter), 1)
+
+
+/**
+ * @return A cheap, monotonic cycle counter (the TSC, where available).
+ */
+static inline uint64_t stats_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * Records a duration in a histogram of the calling thread, cnt times.
+ * @param cycles Duration, as a difference of stats_cycles()
+ */
+static inline void stats_record_n(enum stats_histogram hist, uint64_t cycles, uint64_t cnt) {
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= STATS_HIST_BUCKETS) {
+        bucket = STATS_HIST_BUCKETS - 1;
+    }
+
+    uint64_t *b = &stats_local->histograms[hist][bucket];
+    __atomic_store_n(b, __atomic_load_n(b, __ATOMIC_RELAXED) + cnt, __ATOMIC_RELAXED);
+}
+
+static inline void stats_record(enum stats_histogram hist, uint64_t cycles) {
+    stats_record_n(hist, cycles, 1);
+}
+
+
+/**
+ * Counts a vector processed by a node of the graph.
+ */
+static inline void stats_node_add(int node, uint64_t packets, uint64_t cycles) {
+    struct stats_node *n = &stats_local->nodes[node];
+    __atomic_store_n(&n->calls, __atomic_load_n(&n->calls, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&n->packets, __atomic_load_n(&n->packets, __ATOMIC_RELAXED) + packets,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&n->cycles, __atomic_load_n(&n->cycles, __ATOMIC_RELAXED) + cycles,
+                     __ATOMIC_RELAXED);
+}
+
+#endif /* STATS_H */
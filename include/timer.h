@@ -0,0 +1,93 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "lib.h"
+
+// The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. A slot of level 0
+// lasts 1 ms, and one of level n as long as the whole level n - 1, so the
+// wheel spans 2^32 ms (49 days). Farther timers wait in the last slot.
+#define TIMER_SLOTS_BITS 8
+#define TIMER_SLOTS (1 << TIMER_SLOTS_BITS)
+#define TIMER_LEVELS 4
+
+
+// A timer, embedded in the object it belongs to, so that starting and
+// stopping one never allocates. Its callback may start or stop any timer,
+// itself included. A timer stays in the wheel of the thread that uses it.
+struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev; // NULL when not pending
+    uint64_t expires_ms;
+    void (*callback)(void *arg, uint64_t now);
+    void *arg;
+};
+
+typedef struct wheel_timer wheel_timer_t;
+
+
+/**
+ * Creates the wheel of the calling thread, starting at the current time,
+ * and its timerfd, which recv_from_any_link_timeout() watches, so that the
+ * loop wakes up when the next timer expires.
+ */
+void init_timers();
+
+
+/**
+ * Creates the wheel of the calling thread, which has its own loop instead
+ * of recv_from_any_link_timeout(). Its timers are run by timers_handle_fd(),
+ * once the returned timerfd is readable.
+ * @return The timerfd
+ */
+int init_thread_timers();
+
+
+/**
+ * Runs the expired timers of the calling thread, whose timerfd is readable.
+ */
+void timers_handle_fd(int fd, void *arg);
+
+
+/**
+ * Prepares a timer, not pending yet.
+ * @param callback Called with arg and the current time, in milliseconds,
+ * once the timer expires
+ */
+void timer_init(wheel_timer_t *timer, void (*callback)(void *arg, uint64_t now), void *arg);
+
+
+/**
+ * Makes the timer expire at the given time, whether it was pending or not.
+ * O(1).
+ * @param expires_ms Time, in milliseconds; a past one expires in the next
+ * millisecond
+ */
+void timer_start(wheel_timer_t *timer, uint64_t expires_ms);
+
+
+/**
+ * Cancels the timer, if pending. O(1).
+ */
+void timer_stop(wheel_timer_t *timer);
+
+
+static inline int timer_pending(const wheel_timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+
+/**
+ * Calls the callbacks of the timers expired until now, in the order of their
+ * expiry, and arms the timerfd for the next one. Cheap when nothing expired.
+ * @param now Current time, in milliseconds
+ */
+void timers_run(uint64_t now);
+
+
+/**
+ * @return Number of pending timers.
+ */
+uint64_t timers_pending_cnt();
+
+#endif /* TIMER_H */
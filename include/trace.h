@@ -0,0 +1,129 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "lib.h"
+#include "packet_pool.h"
+#include "stats.h"
+
+// Records kept by every thread; the oldest ones are overwritten.
+#define TRACE_RING_SIZE 4096
+
+// Bytes of every traced packet that are kept (headers, not payloads).
+#define TRACE_SNAPLEN 128
+
+// Control socket: TRACE_SOCKET_PREFIX<pid>.sock
+#define TRACE_SOCKET_PREFIX "/tmp/router_trace."
+
+#define TRACE_MAX_THREADS STATS_MAX_THREADS
+
+
+// Where a packet was seen.
+enum trace_point {
+    TRACE_INGRESS,
+    TRACE_DROP,
+    TRACE_EGRESS,
+};
+
+
+struct trace_record {
+    uint64_t timestamp_ns; // CLOCK_REALTIME
+    uint8_t point;
+    uint8_t interface;
+    uint16_t reason;       // For drops, the stats_counter of the drop
+
+    // For egresses, the chosen route (NULL for a reply sent straight back).
+    uint8_t has_route;
+    struct route_table_entry route;
+
+    uint32_t len;
+    uint32_t caplen;
+    uint8_t data[TRACE_SNAPLEN];
+};
+
+typedef struct trace_record trace_record_t;
+
+
+// Single writer: the thread that owns it.
+struct trace_ring {
+    trace_record_t records[TRACE_RING_SIZE];
+    uint64_t head;      // Records written since the start
+    uint32_t countdown; // Packets until the next sampled one
+    int thread_id;
+};
+
+typedef struct trace_ring trace_ring_t;
+
+
+// One packet out of trace_sample_every is traced, none if 0.
+extern volatile uint32_t trace_sample_every;
+
+extern __thread trace_ring_t *trace_local;
+
+
+/**
+ * Creates the ring of the calling thread and the control socket, on which
+ * "sample N", "dump" (pcapng, to the file passed with SCM_RIGHTS), "status"
+ * and "routes N" commands are accepted. Only the user of the router may
+ * connect.
+ * The socket is watched by recv_from_any_link_timeout().
+ * @param sample_every Initial sampling rate, 0 to start with tracing off
+ */
+void init_trace(uint32_t sample_every);
+
+
+/**
+ * Creates the ring of the calling thread, which must not be the first one.
+ */
+void trace_register_thread();
+
+
+/**
+ * Removes the control socket.
+ */
+void destroy_trace();
+
+
+/**
+ * Writes the records of all the rings to a pcapng file, one Enhanced Packet
+ * Block per record, with the trace point, drop reason or route in its
+ * comment. Runs on any thread: the records that the owners overwrite
+ * while they are copied are left out.
+ * @param fd File open for writing, closed at the end
+ * @return The number of packets written, or -1 on error.
+ */
+int trace_dump_pcapng(int fd);
+
+
+// Slow paths of the inline functions below.
+void trace_sample(packet_buf_t *pkt, int interface);
+void trace_record(packet_buf_t *pkt, enum trace_point point, int interface,
+                  int reason, struct route_table_entry *route);
+
+
+/**
+ * Decides whether the received packet is traced, and records it if so.
+ * Costs a load and a not taken branch when sampling is off.
+ */
+static inline void trace_ingress(packet_buf_t *pkt, int interface) {
+    if (__builtin_expect(trace_sample_every != 0, 0)) {
+        trace_sample(pkt, interface);
+    }
+}
+
+
+static inline void trace_drop(packet_buf_t *pkt, enum stats_counter reason) {
+    if (__builtin_expect(pkt->traced, 0)) {
+        trace_record(pkt, TRACE_DROP, -1, reason, NULL);
+    }
+}
+
+
+static inline void trace_egress(packet_buf_t *pkt, int interface,
+                                struct route_table_entry *route) {
+    if (__builtin_expect(pkt->traced, 0)) {
+        trace_record(pkt, TRACE_EGRESS, interface, 0, route);
+    }
+}
+
+#endif /* TRACE_H */
@@ -4,6 +4,13 @@
 #include "lib.h"
 #include "forwarding.h"
 
+// The bulk builder splits the prefixes in 2^TRIE_SPLIT_BITS subtrees, right
+// after the bits that all of them share.
+#define TRIE_SPLIT_BITS 8
+#define TRIE_BUCKETS (1 << TRIE_SPLIT_BITS)
+
+#define TRIE_BUILD_MAX_THREADS 8
+
 
 struct network_trie_node {
     struct route_table_entry *entry;
@@ -16,6 +23,11 @@ struct network_trie_node {
         TRUE,
         FALSE
     } final_state;
+
+    // VRF whose trie created the node. The tries of the other VRFs may
+    // share it, but only modify their own copy (see trie_insert_vrf()).
+    uint8_t vrf;
+    uint8_t heap; // From create_trie_node(), not from the array of trie_build()
 };
 
 typedef struct network_trie_node network_trie_node_t;
@@ -53,4 +65,56 @@ network_trie_node_t *trie_insert(network_trie_node_t *root, uint32_t ip_prefix,
  */
 network_trie_node_t *trie_retrieve(network_trie_node_t *root, uint32_t target_ip);
 
+
+/**
+ * Finds the node of exactly this prefix.
+ * @param ip_prefix IPv4 prefix (Host order)
+ * @param ip_mask IPv4 mask (Host order)
+ * @return The node, if the prefix is in the trie, and NULL otherwise.
+ */
+network_trie_node_t *trie_find(network_trie_node_t *root, uint32_t ip_prefix,
+                               uint32_t ip_mask);
+
+
+/**
+ * Like trie_insert(), in the trie of a VRF that shares its subtrees with
+ * the tries of other VRFs: the nodes of the path that belong to another VRF
+ * are copied first, and the copy takes their place, so the other tries do
+ * not change (copy on write).
+ * The trie of the default VRF (0) is modified in place, so it must not be
+ * shared then.
+ * @param root Root of the trie of the VRF, replaced if it is copied
+ * @param vrf VRF of the trie, whose nodes are not copies
+ * @return The last node, marked with final_state as TRUE
+ */
+network_trie_node_t *trie_insert_vrf(network_trie_node_t **root, uint32_t ip_prefix,
+                                     uint32_t ip_mask, uint8_t vrf);
+
+
+/**
+ * Removes a prefix that is in the trie of a VRF, copying the nodes of its
+ * path like trie_insert_vrf(), and then dropping the ones left without a
+ * prefix below them, so that the trie is the one that the remaining prefixes
+ * would build.
+ * @param root Root of the trie of the VRF, replaced if it is copied
+ * @param vrf VRF of the trie, as for trie_insert_vrf()
+ */
+void trie_remove_vrf(network_trie_node_t **root, uint32_t ip_prefix, uint32_t ip_mask,
+                     uint8_t vrf);
+
+/**
+ * Builds the trie of a whole route table at once, instead of inserting the
+ * entries one by one: the prefixes are sorted and split in subtrees by the
+ * top bits, the subtrees are built by several threads in a single
+ * contiguous array of nodes, then stitched under a common root.
+ * When the same prefix appears several times, the last entry wins, as with
+ * trie_insert().
+ * @param entries Route table entries (Network order)
+ * @param size Number of entries
+ * @param nodes_cnt If not NULL, set to the number of nodes of the subtrees
+ * @return Root of the trie
+ */
+network_trie_node_t *trie_build(struct route_table_entry *entries, int size,
+                                int *nodes_cnt);
+
 #endif /* TRIE_H */
@@ -30,4 +30,29 @@ void update_mac_addresses(struct ether_header* eth_hdr, const uint8_t *new_dst,
  */
 int get_mask_ones_cnt(uint32_t ip_mask);
 
+
+/**
+ * Updates an Internet checksum after a 16-bit word of the checksummed
+ * data changed, without going over the data again (RFC 1624).
+ * @param check Old checksum (Network order)
+ * @param old_word Old value of the word (Host order)
+ * @param new_word New value of the word (Host order)
+ * @return New checksum (Network order)
+ */
+uint16_t checksum_adjust(uint16_t check, uint16_t old_word, uint16_t new_word);
+
+
+/**
+ * Reads the monotonic clock.
+ * @return Current time in milliseconds (not related to the wall clock)
+ */
+uint64_t get_time_ms();
+
+
+/**
+ * Reads the monotonic clock, for the shorter intervals.
+ * @return Current time in nanoseconds
+ */
+uint64_t get_time_ns();
+
 #endif /* UTILS_H */
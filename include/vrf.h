@@ -0,0 +1,57 @@
+#ifndef VRF_H
+#define VRF_H
+
+#include <stdio.h>
+#include "lib.h"
+#include "forwarding.h"
+#include "adjacency.h"
+
+// VRFs of the router, the default one included.
+#define VRF_MAX 8
+
+
+// A VRF, with what it shares with the default one: the routes found in
+// several files are stored once, and its trie starts as the trie of the
+// default VRF, whose nodes it copies only where its routes differ.
+struct vrf {
+    const char *path;
+    route_table_t *route_table;
+    int routes_cnt;     // Lines of its file
+    int own_routes_cnt; // Routes stored for it, not found in a previous VRF
+    int nodes_cnt;      // Nodes of its trie
+    int own_nodes_cnt;  // Nodes not shared with the default VRF
+};
+
+typedef struct vrf vrf_t;
+
+
+struct vrf_set {
+    vrf_t vrfs[VRF_MAX];
+    int cnt;
+    int interface_vrf[ROUTER_NUM_INTERFACES]; // 0, the default, if not set
+};
+
+typedef struct vrf_set vrf_set_t;
+
+
+/**
+ * Loads the route tables of the VRFs, each from its own file in the rtable
+ * format. The interfaces not given to a VRF stay in the default one.
+ * @param default_path Route table of the default VRF (0)
+ * @param specs "FILE:IF,IF..." of the other VRFs, numbered from 1
+ * @param adj_table Table to create the adjacencies in, shared by the VRFs
+ * @param extra_routes Room for the routes added at run time to the default
+ * VRF (e.g. learned from the kernel)
+ * @return Allocated set of VRFs
+ */
+vrf_set_t *init_vrfs(const char *default_path, char **specs, int specs_cnt,
+                     adjacency_table_t *adj_table, int extra_routes);
+
+
+/**
+ * Prints the routes and the trie nodes of every VRF, the memory they take
+ * beyond what they share, and the total, with and without the sharing.
+ */
+void vrf_print_memory(vrf_set_t *vrfs, FILE *file);
+
+#endif /* VRF_H */
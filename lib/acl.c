@@ -0,0 +1,646 @@
+#include "acl.h"
+#include "realtime.h"
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define IPV4_TCP 6
+#define IPV4_UDP 17
+
+// Width of every field, in bits.
+static const uint8_t field_bits[ACL_FIELDS_CNT] = {
+    [ACL_SRC] = 32,
+    [ACL_DST] = 32,
+    [ACL_PROTO] = 8,
+    [ACL_SPORT] = 16,
+    [ACL_DPORT] = 16,
+};
+
+
+// Part of the space of the packets covered by a node: every field ranges
+// over an aligned block of 2^bits values.
+struct acl_region {
+    uint32_t lo[ACL_FIELDS_CNT];
+    uint8_t bits[ACL_FIELDS_CNT];
+};
+
+
+struct acl_builder {
+    const struct acl_rule *rules;
+    struct acl_node *nodes;
+    uint32_t *children;
+    uint32_t *leaf_rules;
+    int nodes_cnt, nodes_cap;
+    int children_cnt, children_cap;
+    int leaf_rules_cnt, leaf_rules_cap;
+    uint32_t empty_leaf; // Shared by all the empty parts, UINT32_MAX until needed
+    int failed;          // Too many rules in the leaves
+};
+
+
+struct acl_compile_job {
+    char *path;
+    acl_t **result;
+};
+
+
+static inline uint64_t region_hi(const struct acl_region *region, int field) {
+    return region->lo[field] + ((1ull << region->bits[field]) - 1);
+}
+
+
+static inline int rule_overlaps(const struct acl_rule *rule, const struct acl_region *region) {
+    for (int f = 0; f < ACL_FIELDS_CNT; f++) {
+        if (rule->hi[f] < region->lo[f] || rule->lo[f] > region_hi(region, f)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static inline int rule_covers(const struct acl_rule *rule, const struct acl_region *region) {
+    for (int f = 0; f < ACL_FIELDS_CNT; f++) {
+        if (rule->lo[f] > region->lo[f] || rule->hi[f] < region_hi(region, f)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Parses "any", "a.b.c.d" or "a.b.c.d/len" in a range of addresses.
+ * @return 0 on success, -1 otherwise.
+ */
+static int parse_prefix(char *text, struct acl_rule *rule, int field, uint8_t *len) {
+    int prefix_len = 0;
+    uint32_t prefix = 0;
+
+    if (strcmp(text, "any") != 0) {
+        prefix_len = 32;
+        char *slash = strchr(text, '/');
+        if (slash) {
+            *slash = '\0';
+            char *end;
+            prefix_len = strtol(slash + 1, &end, 10);
+            if (*end || prefix_len < 0 || prefix_len > 32) {
+                return -1;
+            }
+        }
+
+        struct in_addr addr;
+        if (inet_pton(AF_INET, text, &addr) != 1) {
+            return -1;
+        }
+        prefix = ntohl(addr.s_addr);
+    }
+
+    uint32_t mask = prefix_len ? ~0u << (32 - prefix_len) : 0;
+    rule->lo[field] = prefix & mask;
+    rule->hi[field] = prefix | ~mask;
+    *len = prefix_len;
+    return 0;
+}
+
+
+/**
+ * Parses "any", "N" or "N-M" in a range of ports.
+ * @return 0 on success, -1 otherwise.
+ */
+static int parse_ports(const char *text, struct acl_rule *rule, int field) {
+    if (strcmp(text, "any") == 0) {
+        rule->lo[field] = 0;
+        rule->hi[field] = 65535;
+        return 0;
+    }
+
+    char *end;
+    long first = strtol(text, &end, 10), last = first;
+    if (*end == '-') {
+        last = strtol(end + 1, &end, 10);
+    }
+
+    if (*end || first < 0 || first > last || last > 65535) {
+        return -1;
+    }
+
+    rule->lo[field] = first;
+    rule->hi[field] = last;
+    return 0;
+}
+
+
+static int parse_proto(const char *text, struct acl_rule *rule) {
+    long proto;
+
+    if (strcmp(text, "any") == 0) {
+        rule->lo[ACL_PROTO] = 0;
+        rule->hi[ACL_PROTO] = 255;
+        return 0;
+    } else if (strcmp(text, "tcp") == 0) {
+        proto = IPV4_TCP;
+    } else if (strcmp(text, "udp") == 0) {
+        proto = IPV4_UDP;
+    } else if (strcmp(text, "icmp") == 0) {
+        proto = IPV4_ICMP;
+    } else {
+        char *end;
+        proto = strtol(text, &end, 10);
+        if (*end || proto < 0 || proto > 255) {
+            return -1;
+        }
+    }
+
+    rule->lo[ACL_PROTO] = proto;
+    rule->hi[ACL_PROTO] = proto;
+    return 0;
+}
+
+
+/**
+ * Reads the rules of the file.
+ * @return The number of rules, or -1 if one of them is not valid.
+ */
+static int read_rules(const char *path, struct acl_rule *rules) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int cnt = 0, line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+
+        char action[16], src[32], dst[32], proto[16], sports[16], dports[16];
+        int fields = sscanf(line, "%15s %31s %31s %15s %15s %15s", action, src, dst,
+                            proto, sports, dports);
+        if (fields <= 0 || action[0] == '#') {
+            continue;
+        }
+
+        // The array has room for ACL_MAX_RULES rules, not one more.
+        if (cnt == ACL_MAX_RULES) {
+            fprintf(stderr, "%s:%d: invalid ACL rule\n", path, line_no);
+            fclose(f);
+            return -1;
+        }
+
+        struct acl_rule *rule = &rules[cnt];
+        rule->line = line_no;
+        rule->action = strcmp(action, "deny") == 0 ? ACL_DENY : ACL_PERMIT;
+
+        if (fields != 6
+            || (strcmp(action, "deny") != 0 && strcmp(action, "permit") != 0)
+            || parse_prefix(src, rule, ACL_SRC, &rule->src_len) < 0
+            || parse_prefix(dst, rule, ACL_DST, &rule->dst_len) < 0
+            || parse_proto(proto, rule) < 0
+            || parse_ports(sports, rule, ACL_SPORT) < 0
+            || parse_ports(dports, rule, ACL_DPORT) < 0) {
+            fprintf(stderr, "%s:%d: invalid ACL rule\n", path, line_no);
+            fclose(f);
+            return -1;
+        }
+
+        cnt++;
+    }
+
+    fclose(f);
+    return cnt;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t value_a = *(const uint64_t *) a, value_b = *(const uint64_t *) b;
+    return value_a < value_b ? -1 : value_a > value_b;
+}
+
+
+/**
+ * Counts the distinct ranges of the rules in a field, once clipped to the
+ * region: the more there are, the better the field separates the rules.
+ */
+static int distinct_ranges(struct acl_builder *builder, const uint32_t *rule_ids, int cnt,
+                           const struct acl_region *region, int field, uint64_t *scratch) {
+    for (int i = 0; i < cnt; i++) {
+        const struct acl_rule *rule = &builder->rules[rule_ids[i]];
+        uint64_t lo = rule->lo[field] > region->lo[field] ? rule->lo[field] : region->lo[field];
+        uint64_t hi = rule->hi[field] < region_hi(region, field)
+                      ? rule->hi[field] : region_hi(region, field);
+        scratch[i] = ((lo - region->lo[field]) << 32) | (hi - region->lo[field]);
+    }
+    qsort(scratch, cnt, sizeof(uint64_t), compare_u64);
+
+    int distinct = cnt > 0;
+    for (int i = 1; i < cnt; i++) {
+        distinct += scratch[i] != scratch[i - 1];
+    }
+    return distinct;
+}
+
+
+/**
+ * Counts the rules in the 2^log_cuts parts of the region along the field.
+ * @param max_part Set to the rules of the fullest part
+ * @return The rules of all the parts together.
+ */
+static uint64_t rules_in_parts(struct acl_builder *builder, const uint32_t *rule_ids, int cnt,
+                               const struct acl_region *region, int field, int log_cuts,
+                               int *max_part, uint32_t *part_cnt) {
+    int shift = region->bits[field] - log_cuts;
+    memset(part_cnt, 0, (sizeof(uint32_t)) << log_cuts);
+
+    uint64_t total = 0;
+    for (int i = 0; i < cnt; i++) {
+        const struct acl_rule *rule = &builder->rules[rule_ids[i]];
+        uint64_t lo = rule->lo[field] > region->lo[field] ? rule->lo[field] : region->lo[field];
+        uint64_t hi = rule->hi[field] < region_hi(region, field)
+                      ? rule->hi[field] : region_hi(region, field);
+        uint64_t first = (lo - region->lo[field]) >> shift;
+        uint64_t last = (hi - region->lo[field]) >> shift;
+
+        total += last - first + 1;
+        for (uint64_t part = first; part <= last; part++) {
+            part_cnt[part]++;
+        }
+    }
+
+    *max_part = 0;
+    for (int part = 0; part < (1 << log_cuts); part++) {
+        if ((int) part_cnt[part] > *max_part) {
+            *max_part = part_cnt[part];
+        }
+    }
+
+    return total;
+}
+
+
+static uint32_t new_node(struct acl_builder *builder) {
+    if (builder->nodes_cnt == builder->nodes_cap) {
+        builder->nodes_cap = 2 * builder->nodes_cap + 64;
+        builder->nodes = realloc(builder->nodes, builder->nodes_cap * sizeof(struct acl_node));
+        DIE(!builder->nodes, "ACL nodes malloc failed.\n");
+    }
+
+    return builder->nodes_cnt++;
+}
+
+
+static void make_leaf(struct acl_builder *builder, uint32_t node_idx, const uint32_t *rule_ids,
+                      int cnt) {
+    if (builder->leaf_rules_cnt + cnt > ACL_MAX_TREE_RULES) {
+        builder->failed = 1;
+        cnt = 0;
+    }
+
+    if (builder->leaf_rules_cnt + cnt > builder->leaf_rules_cap) {
+        builder->leaf_rules_cap = 2 * builder->leaf_rules_cap + cnt;
+        builder->leaf_rules = realloc(builder->leaf_rules,
+                                      builder->leaf_rules_cap * sizeof(uint32_t));
+        DIE(!builder->leaf_rules, "ACL leaves malloc failed.\n");
+    }
+
+    struct acl_node *node = &builder->nodes[node_idx];
+    node->field = ACL_LEAF;
+    node->first = builder->leaf_rules_cnt;
+    node->cnt = cnt;
+
+    memcpy(builder->leaf_rules + builder->leaf_rules_cnt, rule_ids, cnt * sizeof(uint32_t));
+    builder->leaf_rules_cnt += cnt;
+}
+
+
+/**
+ * Picks the field and number of cuts of a node: the fields are tried from
+ * the one with the most distinct ranges, the cuts doubled as long as the
+ * parts hold at most ACL_SPACE_FACTOR times the rules of the node.
+ * @return The field, or -1 if no cut separates the rules.
+ */
+static int choose_cuts(struct acl_builder *builder, const uint32_t *rule_ids, int cnt,
+                       const struct acl_region *region, int *log_cuts) {
+    uint64_t *scratch = malloc(cnt * sizeof(uint64_t));
+    uint32_t *part_cnt = malloc(ACL_MAX_CUTS * sizeof(uint32_t));
+    DIE(!scratch || !part_cnt, "ACL scratch malloc failed.\n");
+
+    int distinct[ACL_FIELDS_CNT];
+    for (int f = 0; f < ACL_FIELDS_CNT; f++) {
+        distinct[f] = region->bits[f] ? distinct_ranges(builder, rule_ids, cnt, region, f,
+                                                        scratch) : 0;
+    }
+
+    int chosen = -1;
+    while (chosen < 0) {
+        int field = 0;
+        for (int f = 1; f < ACL_FIELDS_CNT; f++) {
+            if (distinct[f] > distinct[field]) {
+                field = f;
+            }
+        }
+        if (distinct[field] <= 1) {
+            break;
+        }
+        distinct[field] = 0;
+
+        int max_part;
+        *log_cuts = 1;
+        rules_in_parts(builder, rule_ids, cnt, region, field, 1, &max_part, part_cnt);
+
+        while (*log_cuts < region->bits[field] && (2 << *log_cuts) <= ACL_MAX_CUTS) {
+            int next_max_part;
+            uint64_t total = rules_in_parts(builder, rule_ids, cnt, region, field,
+                                            *log_cuts + 1, &next_max_part, part_cnt);
+            if (total + (2 << *log_cuts) > (uint64_t) ACL_SPACE_FACTOR * cnt) {
+                break;
+            }
+            (*log_cuts)++;
+            max_part = next_max_part;
+        }
+
+        if (max_part < cnt) {
+            chosen = field;
+        }
+    }
+
+    free(scratch);
+    free(part_cnt);
+    return chosen;
+}
+
+
+/**
+ * Drops the rules after one that covers the whole region, never reached.
+ * @return The number of rules left.
+ */
+static int prune_rules(struct acl_builder *builder, const uint32_t *rule_ids, int cnt,
+                       const struct acl_region *region) {
+    for (int i = 0; i < cnt; i++) {
+        if (rule_covers(&builder->rules[rule_ids[i]], region)) {
+            return i + 1;
+        }
+    }
+    return cnt;
+}
+
+
+static void build_node(struct acl_builder *builder, uint32_t node_idx, uint32_t *rule_ids,
+                       int cnt, const struct acl_region *region) {
+    int log_cuts;
+    int field = cnt > ACL_LEAF_RULES && !builder->failed
+                ? choose_cuts(builder, rule_ids, cnt, region, &log_cuts) : -1;
+    if (field < 0) {
+        make_leaf(builder, node_idx, rule_ids, cnt);
+        return;
+    }
+
+    int cuts = 1 << log_cuts;
+    int shift = region->bits[field] - log_cuts;
+
+    if (builder->children_cnt + cuts > builder->children_cap) {
+        builder->children_cap = 2 * builder->children_cap + cuts;
+        builder->children = realloc(builder->children,
+                                    builder->children_cap * sizeof(uint32_t));
+        DIE(!builder->children, "ACL children malloc failed.\n");
+    }
+
+    uint32_t first = builder->children_cnt;
+    builder->children_cnt += cuts;
+
+    struct acl_node *node = &builder->nodes[node_idx];
+    node->field = field;
+    node->shift = shift;
+    node->base = region->lo[field];
+    node->first = first;
+    node->cnt = 0;
+
+    uint32_t *part_ids = malloc(cnt * sizeof(uint32_t));
+    uint32_t *prev_ids = malloc(cnt * sizeof(uint32_t));
+    DIE(!part_ids || !prev_ids, "ACL rules malloc failed.\n");
+    int prev_cnt = -1;
+    uint32_t prev_child = 0;
+
+    struct acl_region part = *region;
+    part.bits[field] = shift;
+
+    for (int c = 0; c < cuts; c++) {
+        part.lo[field] = region->lo[field] + ((uint32_t) c << shift);
+
+        int part_cnt = 0;
+        for (int i = 0; i < cnt; i++) {
+            if (rule_overlaps(&builder->rules[rule_ids[i]], &part)) {
+                part_ids[part_cnt++] = rule_ids[i];
+            }
+        }
+        part_cnt = prune_rules(builder, part_ids, part_cnt, &part);
+
+        // Neighboring parts with the same rules share their leaf. Subtrees
+        // are not shared: their cuts and pruning depend on their region.
+        uint32_t child;
+        if (part_cnt == 0) {
+            if (builder->empty_leaf == UINT32_MAX) {
+                builder->empty_leaf = new_node(builder);
+                make_leaf(builder, builder->empty_leaf, NULL, 0);
+            }
+            child = builder->empty_leaf;
+        } else if (part_cnt == prev_cnt
+                   && memcmp(part_ids, prev_ids, part_cnt * sizeof(uint32_t)) == 0) {
+            child = prev_child;
+        } else {
+            child = new_node(builder);
+            build_node(builder, child, part_ids, part_cnt, &part);
+            prev_cnt = -1;
+            if (builder->nodes[child].field == ACL_LEAF) {
+                memcpy(prev_ids, part_ids, part_cnt * sizeof(uint32_t));
+                prev_cnt = part_cnt;
+                prev_child = child;
+            }
+        }
+
+        builder->children[first + c] = child;
+    }
+
+    free(part_ids);
+    free(prev_ids);
+}
+
+
+acl_t *acl_compile(const char *path) {
+    struct acl_rule *rules = malloc(ACL_MAX_RULES * sizeof(struct acl_rule));
+    DIE(!rules, "ACL rules malloc failed.\n");
+
+    int rules_cnt = read_rules(path, rules);
+    if (rules_cnt < 0) {
+        free(rules);
+        return NULL;
+    }
+
+    struct acl_builder builder = {
+        .rules = rules,
+        .empty_leaf = UINT32_MAX,
+    };
+
+    uint32_t *rule_ids = malloc((rules_cnt + 1) * sizeof(uint32_t));
+    DIE(!rule_ids, "ACL rules malloc failed.\n");
+    for (int i = 0; i < rules_cnt; i++) {
+        rule_ids[i] = i;
+    }
+
+    struct acl_region root = { .lo = {0} };
+    memcpy(root.bits, field_bits, sizeof(field_bits));
+
+    int root_cnt = prune_rules(&builder, rule_ids, rules_cnt, &root);
+    build_node(&builder, new_node(&builder), rule_ids, root_cnt, &root);
+    free(rule_ids);
+
+    if (builder.failed) {
+        fprintf(stderr, "%s: the ACL rules make a too big tree\n", path);
+        free(builder.nodes);
+        free(builder.children);
+        free(builder.leaf_rules);
+        free(rules);
+        return NULL;
+    }
+
+    acl_t *acl = calloc(1, sizeof(acl_t));
+    DIE(!acl, "ACL malloc failed.\n");
+
+    acl->nodes = builder.nodes;
+    acl->nodes_cnt = builder.nodes_cnt;
+    acl->children = builder.children;
+    acl->leaf_rules = builder.leaf_rules;
+    acl->leaf_rules_cnt = builder.leaf_rules_cnt;
+    acl->rules = realloc(rules, (rules_cnt + 1) * sizeof(struct acl_rule));
+    acl->rules_cnt = rules_cnt;
+    acl->hits = calloc(rules_cnt + 1, sizeof(uint64_t));
+    DIE(!acl->rules || !acl->hits, "ACL malloc failed.\n");
+
+    return acl;
+}
+
+static void *acl_compile_thread(void *arg) {
+    struct acl_compile_job *job = arg;
+
+    realtime_helper_thread();
+
+    acl_t *acl = acl_compile(job->path);
+    if (acl) {
+        acl_t *unused = __atomic_exchange_n(job->result, acl, __ATOMIC_ACQ_REL);
+        if (unused) {
+            acl_free(unused);
+        }
+    }
+
+    free(job->path);
+    free(job);
+    return NULL;
+}
+
+
+void acl_compile_async(const char *path, acl_t **result) {
+    struct acl_compile_job *job = malloc(sizeof(struct acl_compile_job));
+    DIE(!job, "ACL job malloc failed.\n");
+    job->path = strdup(path);
+    job->result = result;
+    DIE(!job->path, "ACL job malloc failed.\n");
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, acl_compile_thread, job) != 0) {
+        fprintf(stderr, "Could not start the ACL compilation.\n");
+        free(job->path);
+        free(job);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+
+void acl_free(acl_t *acl) {
+    free(acl->nodes);
+    free(acl->children);
+    free(acl->leaf_rules);
+    free(acl->rules);
+    free(acl->hits);
+    free(acl);
+}
+
+
+enum acl_action acl_classify(acl_t *acl, packet_buf_t *pkt, struct iphdr *ip_hdr) {
+    uint32_t fields[ACL_FIELDS_CNT] = {
+        [ACL_SRC] = ntohl(ip_hdr->saddr),
+        [ACL_DST] = ntohl(ip_hdr->daddr),
+        [ACL_PROTO] = ip_hdr->protocol,
+    };
+
+    // Only the first fragment has the ports.
+    size_t l4_offset = sizeof(struct ether_header) + ip_hdr->ihl * 4;
+    if ((ip_hdr->protocol == IPV4_TCP || ip_hdr->protocol == IPV4_UDP)
+        && !(ip_hdr->frag_off & htons(0x1fff)) && pkt->len >= l4_offset + 4) {
+        uint16_t *ports = (uint16_t *) (pkt->data + l4_offset);
+        fields[ACL_SPORT] = ntohs(ports[0]);
+        fields[ACL_DPORT] = ntohs(ports[1]);
+    }
+
+    const struct acl_node *node = acl->nodes;
+    while (node->field != ACL_LEAF) {
+        uint32_t part = (fields[node->field] - node->base) >> node->shift;
+        node = &acl->nodes[acl->children[node->first + part]];
+    }
+
+    // The rules of a leaf are in their order, so the first match wins.
+    for (uint32_t i = 0; i < node->cnt; i++) {
+        uint32_t rule_id = acl->leaf_rules[node->first + i];
+        const struct acl_rule *rule = &acl->rules[rule_id];
+
+        int match = 1;
+        for (int f = 0; f < ACL_FIELDS_CNT; f++) {
+            match &= fields[f] >= rule->lo[f] && fields[f] <= rule->hi[f];
+        }
+
+        if (match) {
+            acl->hits[rule_id]++;
+            return rule->action;
+        }
+    }
+
+    acl->hits[acl->rules_cnt]++;
+    return ACL_PERMIT;
+}
+
+
+void acl_print_hits(const acl_t *acl, FILE *out) {
+    fprintf(out, "ACL: %d rules, %d tree nodes, %d rules in the leaves\n", acl->rules_cnt,
+            acl->nodes_cnt, acl->leaf_rules_cnt);
+
+    for (int i = 0; i < acl->rules_cnt; i++) {
+        if (!acl->hits[i]) {
+            continue;
+        }
+
+        const struct acl_rule *rule = &acl->rules[i];
+        struct in_addr src = { htonl(rule->lo[ACL_SRC]) }, dst = { htonl(rule->lo[ACL_DST]) };
+        char src_text[INET_ADDRSTRLEN], dst_text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &src, src_text, sizeof(src_text));
+        inet_ntop(AF_INET, &dst, dst_text, sizeof(dst_text));
+
+        char proto_text[8] = "any";
+        if (rule->lo[ACL_PROTO] == rule->hi[ACL_PROTO]) {
+            snprintf(proto_text, sizeof(proto_text), "%u", rule->lo[ACL_PROTO]);
+        }
+
+        fprintf(out, "  line %d: %s %s/%d %s/%d proto %s ports %u-%u %u-%u: %" PRIu64 " hits\n",
+                rule->line, rule->action == ACL_DENY ? "deny" : "permit",
+                src_text, rule->src_len, dst_text, rule->dst_len, proto_text,
+                rule->lo[ACL_SPORT], rule->hi[ACL_SPORT],
+                rule->lo[ACL_DPORT], rule->hi[ACL_DPORT], acl->hits[i]);
+    }
+
+    fprintf(out, "  no rule (permitted): %" PRIu64 " hits\n", acl->hits[acl->rules_cnt]);
+}
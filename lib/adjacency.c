@@ -0,0 +1,199 @@
+#include "adjacency.h"
+#include "interfaces.h"
+#include "utils.h"
+#include "hugepage.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <limits.h>
+
+
+static inline uint32_t adjacency_bucket(uint32_t next_hop) {
+    // Multiplicative hashing, so that all the bits of the IP matter.
+    return (next_hop * 2654435761u) >> (32 - ADJ_BUCKETS_BITS);
+}
+
+
+adjacency_table_t *init_adjacency_table(int capacity) {
+    adjacency_table_t *adj_table = hugepage_alloc("adjacency buckets", sizeof(adjacency_table_t));
+    adj_table->entries = hugepage_alloc("adjacencies", capacity * sizeof(adjacency_t));
+
+    adj_table->size = 0;
+    adj_table->capacity = capacity;
+
+    return adj_table;
+}
+
+
+adjacency_t *adjacency_find(adjacency_table_t *adj_table, uint32_t next_hop,
+                            int interface) {
+    adjacency_t *adj = adj_table->buckets[adjacency_bucket(next_hop)];
+    for (; adj; adj = adj->bucket_next) {
+        if (adj->next_hop == next_hop && adj->interface == interface) {
+            return adj;
+        }
+    }
+
+    return NULL;
+}
+
+
+adjacency_t *adjacency_get(adjacency_table_t *adj_table, uint32_t next_hop,
+                           int interface) {
+    uint32_t bucket = adjacency_bucket(next_hop);
+
+    adjacency_t *found = adjacency_find(adj_table, next_hop, interface);
+    if (found) {
+        return found;
+    }
+
+    DIE(adj_table->size == adj_table->capacity, "Adjacency table full.\n");
+
+    adjacency_t *adj = &adj_table->entries[adj_table->size++];
+    memset(adj->rewrite, 0, ADJ_REWRITE_LEN);
+    adj->resolved = 0;
+    adj->interface = interface;
+    adj->next_hop = next_hop;
+    adj->is_static = 0;
+    adj->confirmed_ms = 0;
+    adj->next_probe_ms = 0;
+    adj->probes = 0;
+    adj->paced = 0;
+    adj->resolver = NULL;
+
+    adj->bucket_next = adj_table->buckets[bucket];
+    adj_table->buckets[bucket] = adj;
+
+    return adj;
+}
+
+
+/**
+ * Stores the MAC of the next hop in its adjacencies.
+ * @param interface Only adjacency to update, or -1 for all of them
+ * @param is_static Whether the MAC comes from the static neighbor file
+ * @param probe_delay_ms When to ask for the MAC again
+ */
+static int update_adjacencies(adjacency_table_t *adj_table, uint32_t next_hop,
+                              int interface, const uint8_t *mac, int is_static,
+                              uint64_t probe_delay_ms) {
+    int updated = 0;
+    uint64_t now = get_time_ms();
+
+    // The same next hop might be reachable through several interfaces.
+    adjacency_t *adj = adj_table->buckets[adjacency_bucket(next_hop)];
+    for (; adj; adj = adj->bucket_next) {
+        if (adj->next_hop != next_hop || adj->interface >= router_interfaces_cnt
+            || (interface >= 0 && adj->interface != interface)) {
+            continue;
+        }
+
+        if (adj->is_static && !is_static) {
+            // ARP does not override the configured MACs.
+            continue;
+        }
+
+        struct ether_header *eth_hdr = (struct ether_header*) adj->rewrite;
+        mac_copy(eth_hdr->ether_dhost, mac);
+        mac_copy(eth_hdr->ether_shost, router_interfaces[adj->interface].mac);
+        eth_hdr->ether_type = htons(ETHER_TYPE_IPV4);
+
+        __atomic_store_n(&adj->resolved, 1, __ATOMIC_RELAXED);
+        adj->is_static = is_static;
+        adj->confirmed_ms = now;
+        adj->next_probe_ms = now + probe_delay_ms;
+        adj->probes = 0;
+        updated++;
+
+        // Without preresolution, the timer of the resolver is idle until
+        // there is a MAC to expire.
+        if (adj->resolver && !is_static && !timer_pending(&adj->timer)) {
+            timer_start(&adj->timer, adj->confirmed_ms + NEIGH_LIFETIME_MS);
+        }
+    }
+
+    return updated;
+}
+
+
+int adjacency_resolve(adjacency_table_t *adj_table, uint32_t next_hop, int interface,
+                      const uint8_t *mac) {
+    return update_adjacencies(adj_table, next_hop, interface, mac, 0, NEIGH_REFRESH_MS);
+}
+
+
+int adjacency_load(adjacency_table_t *adj_table, uint32_t next_hop,
+                   const uint8_t *mac, int is_static) {
+    // A MAC saved before a restart is used right away, but confirmed
+    // as soon as possible, in case the neighbor changed meanwhile.
+    // The files do not say the interface: the MAC holds on all of them.
+    return update_adjacencies(adj_table, next_hop, -1, mac, is_static, 0);
+}
+
+
+void adjacency_set_interface_mac(adjacency_table_t *adj_table, int interface,
+                                 const uint8_t *mac) {
+    for (int i = 0; i < adj_table->size; i++) {
+        adjacency_t *adj = &adj_table->entries[i];
+        if (adj->interface == interface) {
+            mac_copy(((struct ether_header*) adj->rewrite)->ether_shost, mac);
+        }
+    }
+}
+
+
+/**
+ * @return Whether the MAC of the next hop of the adjacency is saved with an
+ * earlier adjacency, on another interface.
+ */
+static int next_hop_saved(adjacency_table_t *adj_table, adjacency_t *adj) {
+    adjacency_t *other = adj_table->buckets[adjacency_bucket(adj->next_hop)];
+    for (; other; other = other->bucket_next) {
+        if (other < adj && other->next_hop == adj->next_hop
+            && other->resolved && !other->is_static) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int save_adjacencies(adjacency_table_t *adj_table, const char *path) {
+    // Write a temporary file first, so that a crash while saving
+    // does not leave a truncated snapshot behind.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        return -1;
+    }
+
+    int saved = 0;
+    for (int i = 0; i < adj_table->size; i++) {
+        adjacency_t *adj = &adj_table->entries[i];
+        if (!adj->resolved || adj->is_static) {
+            continue;
+        }
+
+        // The file has no interface, so a next hop is written once, and
+        // loaded on all of its interfaces.
+        if (next_hop_saved(adj_table, adj)) {
+            continue;
+        }
+
+        struct in_addr ip = { .s_addr = adj->next_hop };
+        uint8_t *mac = ((struct ether_header*) adj->rewrite)->ether_dhost;
+
+        fprintf(f, "%s %02x:%02x:%02x:%02x:%02x:%02x\n", inet_ntoa(ip),
+                mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        saved++;
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return saved;
+}
@@ -0,0 +1,45 @@
+#include "alloc_debug.h"
+
+#ifdef DEBUG_ALLOC
+
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+// Per thread: the helper threads allocate while the forwarding loop is
+// inside a check, which must only see its own allocations.
+static __thread uint64_t heap_allocs;
+
+
+uint64_t heap_alloc_count() {
+    return heap_allocs;
+}
+
+
+void *malloc(size_t size) {
+    heap_allocs++;
+    return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size) {
+    heap_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size) {
+    heap_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    heap_allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+#endif /* DEBUG_ALLOC */
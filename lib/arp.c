@@ -1,94 +1,230 @@
 #include "arp.h"
+#include "interfaces.h"
+#include "stats.h"
+#include "trace.h"
+#include "egress.h"
+#include "hugepage.h"
 #include <string.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 
-arp_packet_queue *init_packet_queue() {
-    arp_packet_queue *packet_queue = malloc(sizeof(arp_packet_queue));
-    DIE(!packet_queue, "Packet queue malloc failed.\n");
+arp_packet_queue *init_packet_queue(packet_pool_t *pool, enum arp_drop_policy drop_policy) {
+    arp_packet_queue *packet_queue = hugepage_alloc("ARP queue", sizeof(arp_packet_queue));
+    packet_queue->hop_storage = hugepage_alloc("ARP pending hops",
+                                               ARP_PENDING_MAX_HOPS * sizeof(arp_pending_hop));
 
-    packet_queue->entries = queue_create();
+    packet_queue->free_hops = NULL;
+    for (int i = ARP_PENDING_MAX_HOPS - 1; i >= 0; i--) {
+        packet_queue->hop_storage[i].next = packet_queue->free_hops;
+        packet_queue->free_hops = &packet_queue->hop_storage[i];
+    }
+
+    packet_queue->pool = pool;
     packet_queue->cnt = 0;
+    packet_queue->max_per_hop = ARP_PENDING_MAX_PACKETS;
+    packet_queue->drop_policy = drop_policy;
 
     return packet_queue;
 }
 
 
-void send_arp_request(uint8_t *sender_mac, uint32_t sender_ip,
-                      uint32_t target_ip, int interface) {
-    uint8_t broadcast_mac[6];
-    int res = hwaddr_aton("ff:ff:ff:ff:ff:ff", broadcast_mac);
-    DIE(res, "MAC broadcast address parsing failed.\n");
+static inline uint32_t pending_bucket(uint32_t next_hop) {
+    // Multiplicative hashing, so that all the bits of the IP matter.
+    return (next_hop * 2654435761u) >> (32 - ARP_PENDING_BUCKETS_BITS);
+}
+
+
+arp_pending_hop *find_pending_hop(arp_packet_queue *packet_queue,
+                                  uint32_t next_hop, int interface) {
+    arp_pending_hop *hop = packet_queue->buckets[pending_bucket(next_hop)];
 
-    char *request_packet = create_arp_packet(sender_mac, broadcast_mac,
-                                             sender_ip, target_ip, ARP_OP_REQUEST);
+    while (hop != NULL) {
+        if (hop->next_hop == next_hop && hop->interface == interface) {
+            return hop;
+        }
+
+        hop = hop->bucket_next;
+    }
 
-    size_t length = sizeof(struct ether_header) + sizeof (struct arp_header);
-    send_to_link(interface, request_packet, length);
-    free(request_packet);
+    return NULL;
 }
 
 
-void send_arp_reply(uint8_t *sender_mac, uint8_t *target_mac,
-                    uint32_t sender_ip, uint32_t target_ip,
-                    int interface) {
-    char *reply_packet = create_arp_packet(sender_mac, target_mac, sender_ip,
-                                           target_ip, ARP_OP_REPLY);
+/**
+ * Removes the oldest packet of the pending next hop.
+ * @return The packet, still referenced by the caller.
+ */
+static packet_buf_t *dequeue_pending_packet(arp_packet_queue *packet_queue,
+                                            arp_pending_hop *hop) {
+    packet_buf_t *pkt = hop->head;
+
+    hop->head = pkt->next;
+    if (!hop->head) {
+        hop->tail = NULL;
+    }
+    pkt->next = NULL;
+
+    hop->cnt--;
+    packet_queue->cnt--;
 
-    size_t length = sizeof(struct ether_header) + sizeof (struct arp_header);
-    send_to_link(interface, reply_packet, length);
-    free(reply_packet);
+    return pkt;
 }
 
 
-void add_packet_in_queue(arp_packet_queue *packet_queue, char *orig_packet,
-                         struct route_table_entry *best_route, size_t packet_len) {
-    char *new_packet = malloc(packet_len);
-    DIE(!new_packet, "Malloc for packet copy failed.\n");
+/**
+ * Unlinks the pending next hop from the packet queue, drops the packets
+ * still waiting in it and gives it back to the free list.
+ */
+static void remove_pending_hop(arp_packet_queue *packet_queue, arp_pending_hop *hop) {
+    arp_pending_hop **iter = &packet_queue->buckets[pending_bucket(hop->next_hop)];
+    while (*iter != hop) {
+        iter = &(*iter)->bucket_next;
+    }
+    *iter = hop->bucket_next;
 
-    memcpy(new_packet, orig_packet, packet_len);
+    timer_stop(&hop->retry_timer);
 
-    // Create a new queue entry.
-    arp_queue_entry *new_entry = malloc(sizeof(arp_queue_entry ));
-    DIE(!new_entry, "Malloc for queue entry failed.\n");
+    while (hop->head) {
+        packet_buf_t *pkt = dequeue_pending_packet(packet_queue, hop);
+        trace_drop(pkt, STAT_DROP_ARP_TIMEOUT);
+        packet_put(pkt);
+    }
 
-    new_entry->packet = new_packet;
-    new_entry->packet_len = packet_len;
-    new_entry->best_route = best_route;
+    hop->next = packet_queue->free_hops;
+    packet_queue->free_hops = hop;
+}
 
-    queue_enq(packet_queue->entries, new_entry);
-    packet_queue->cnt += 1;
+
+/**
+ * Retransmits the ARP request of the pending next hop, whose backoff has
+ * elapsed, or gives up on its packets once the retries are exhausted.
+ */
+static void retry_pending_hop(void *arg, uint64_t now) {
+    arp_pending_hop *hop = arg;
+
+    if (hop->retries >= ARP_REQUEST_MAX_RETRIES) {
+        // The next hop does not answer, give up on its packets.
+        stats_add(STAT_DROP_ARP_TIMEOUT, hop->cnt);
+        remove_pending_hop(hop->packet_queue, hop);
+        return;
+    }
+
+    interface_info_t *send_if = &router_interfaces[hop->interface];
+    send_arp_request(send_if->mac, send_if->ip, hop->next_hop, hop->interface);
+
+    hop->retries++;
+    hop->backoff_ms *= 2;
+    if (hop->backoff_ms > ARP_REQUEST_MAX_BACKOFF_MS) {
+        hop->backoff_ms = ARP_REQUEST_MAX_BACKOFF_MS;
+    }
+    timer_start(&hop->retry_timer, now + hop->backoff_ms);
 }
 
 
-uint8_t *search_addr_in_cache(list arp_cache, uint32_t target_ip) {
-    if (!arp_cache) {
-        // Cache is empty.
+/**
+ * Takes a free pending next hop and links it in the packet queue.
+ * @return The new pending next hop, or NULL if there are too many already.
+ */
+static arp_pending_hop *create_pending_hop(arp_packet_queue *packet_queue,
+                                           adjacency_t *adj) {
+    arp_pending_hop *hop = packet_queue->free_hops;
+    if (!hop) {
         return NULL;
     }
+    packet_queue->free_hops = hop->next;
+
+    uint32_t next_hop = adj->next_hop;
+
+    hop->next_hop = next_hop;
+    hop->interface = adj->interface;
+    hop->adj = adj;
+    hop->head = NULL;
+    hop->tail = NULL;
+    hop->cnt = 0;
+    hop->retries = 0;
+    hop->backoff_ms = ARP_REQUEST_BACKOFF_MS;
+    hop->packet_queue = packet_queue;
+
+    timer_init(&hop->retry_timer, retry_pending_hop, hop);
+    timer_start(&hop->retry_timer, get_time_ms() + hop->backoff_ms);
+
+    uint32_t bucket = pending_bucket(next_hop);
+    hop->bucket_next = packet_queue->buckets[bucket];
+    packet_queue->buckets[bucket] = hop;
+
+    return hop;
+}
+
+
+void send_arp_request(uint8_t *sender_mac, uint32_t sender_ip,
+                      uint32_t target_ip, int interface) {
+    uint8_t broadcast_mac[6];
+    int res = hwaddr_aton("ff:ff:ff:ff:ff:ff", broadcast_mac);
+    DIE(res, "MAC broadcast address parsing failed.\n");
+
+    char request_packet[ARP_PACKET_LEN];
+    create_arp_packet(request_packet, sender_mac, broadcast_mac,
+                      sender_ip, target_ip, ARP_OP_REQUEST);
+
+    egress_send_frame(interface, request_packet, ARP_PACKET_LEN);
+    STAT_INC(STAT_ARP_REQUESTS_SENT);
+}
+
+
+void send_arp_reply(uint8_t *sender_mac, uint8_t *target_mac,
+                    uint32_t sender_ip, uint32_t target_ip,
+                    int interface) {
+    char reply_packet[ARP_PACKET_LEN];
+    create_arp_packet(reply_packet, sender_mac, target_mac, sender_ip,
+                      target_ip, ARP_OP_REPLY);
+
+    egress_send_frame(interface, reply_packet, ARP_PACKET_LEN);
+    STAT_INC(STAT_ARP_REPLIES_SENT);
+}
+
 
-    list cache_iter = arp_cache;
-    while (cache_iter != NULL) {
-        arp_cache_entry *entry = (arp_cache_entry*) cache_iter->element;
+void add_packet_in_queue(arp_packet_queue *packet_queue, arp_pending_hop *hop,
+                         packet_buf_t *pkt, struct route_table_entry *best_route) {
+    if (hop->cnt >= packet_queue->max_per_hop) {
+        STAT_INC(STAT_DROP_ARP_QUEUE_FULL);
 
-        if (ntohl(entry->ip) == target_ip) {
-            return entry->mac;
+        if (packet_queue->drop_policy == ARP_DROP_NEWEST) {
+            trace_drop(pkt, STAT_DROP_ARP_QUEUE_FULL);
+            return;
         }
 
-        cache_iter = cache_iter->next;
+        // Make room by dropping the oldest packet.
+        packet_buf_t *oldest = dequeue_pending_packet(packet_queue, hop);
+        trace_drop(oldest, STAT_DROP_ARP_QUEUE_FULL);
+        packet_put(oldest);
+    } else if (packet_queue->cnt >= ARP_PENDING_MAX_TOTAL) {
+        STAT_INC(STAT_DROP_ARP_QUEUE_FULL);
+        trace_drop(pkt, STAT_DROP_ARP_QUEUE_FULL);
+        return;
     }
 
-    return NULL;
+    // The queue keeps its own reference, the packet is not copied.
+    packet_get(pkt);
+    pkt->best_route = best_route;
+    pkt->next = NULL;
+
+    if (hop->tail) {
+        hop->tail->next = pkt;
+    } else {
+        hop->head = pkt;
+    }
+    hop->tail = pkt;
+
+    hop->cnt += 1;
+    packet_queue->cnt += 1;
+    STAT_INC(STAT_ARP_PACKETS_QUEUED);
 }
 
 
-char *create_arp_packet(uint8_t *sender_mac, uint8_t *target_mac,
+void create_arp_packet(char *packet, uint8_t *sender_mac, uint8_t *target_mac,
                        uint32_t sender_ip, uint32_t target_ip,
                        uint16_t arp_op) {
-    char *packet = malloc(sizeof(struct ether_header) + sizeof (struct arp_header));
-    DIE(!packet, "ARP packet malloc failed.\n");
-
     struct ether_header *eth_hdr = (struct ether_header*) packet;
 
     mac_copy(eth_hdr->ether_shost, sender_mac);
@@ -106,77 +242,92 @@ char *create_arp_packet(uint8_t *sender_mac, uint8_t *target_mac,
     arp_hdr->spa = sender_ip;
     mac_copy(arp_hdr->tha, target_mac);
     arp_hdr->tpa = target_ip;
-
-    return packet;
 }
 
 
-void handle_arp_reply(struct arp_header *arp_hdr, list *arp_cache,
-                      arp_packet_queue *packet_queue) {
-    add_cache_entry(arp_cache, arp_hdr->spa, arp_hdr->sha);
+int arp_reply_resolve(struct arp_header *arp_hdr, int interface,
+                      adjacency_table_t *adj_table) {
+    STAT_INC(STAT_ARP_REPLIES_RECEIVED);
 
-    int sent_packets_cnt = 0;
-
-    // Iterate the queue and send the packets whose next hop's MAC
-    // address has just been received (i.e. look at the IP of each entry)
-    for (int i = 0; i < packet_queue->cnt; i++) {
-        arp_queue_entry *entry = (arp_queue_entry*) queue_deq(packet_queue->entries);
+    return adjacency_resolve(adj_table, arp_hdr->spa, interface, arp_hdr->sha);
+}
 
-        if (entry->best_route->next_hop == arp_hdr->spa) {
-            // Send the packet.
-            uint8_t local_send_mac[6];
-            get_interface_mac(entry->best_route->interface, local_send_mac);
 
-            struct ether_header *eth_hdr = (struct ether_header*) entry->packet;
-            update_mac_addresses(eth_hdr, arp_hdr->sha, local_send_mac);
-            send_to_link(entry->best_route->interface, entry->packet, entry->packet_len);
+void arp_reply_drain(struct arp_header *arp_hdr, int interface,
+                     arp_packet_queue *packet_queue) {
+    arp_pending_hop *hop = find_pending_hop(packet_queue, arp_hdr->spa, interface);
+    if (!hop) {
+        // Nothing was waiting for this MAC.
+        return;
+    }
 
-            free(entry->packet);
-            free(entry);
+    // Only the packets of this next hop are sent.
+    while (hop->head) {
+        packet_buf_t *pkt = dequeue_pending_packet(packet_queue, hop);
 
-            sent_packets_cnt++;
-            continue;
-        }
+        egress_send_adjacency(pkt, hop->adj);
+        trace_egress(pkt, hop->interface, pkt->best_route);
 
-        // If the packet is not sent, re-enqueue it.
-        queue_enq(packet_queue->entries, entry);
+        packet_put(pkt);
     }
 
-    packet_queue->cnt -= sent_packets_cnt;
+    remove_pending_hop(packet_queue, hop);
+}
+
+
+void handle_arp_reply(struct arp_header *arp_hdr, int interface,
+                      adjacency_table_t *adj_table, arp_packet_queue *packet_queue) {
+    if (arp_reply_resolve(arp_hdr, interface, adj_table)) {
+        arp_reply_drain(arp_hdr, interface, packet_queue);
+    }
 }
 
 
-void add_cache_entry(list *arp_cache, uint32_t ip, uint8_t *mac) {
-    arp_cache_entry *new_entry = malloc(sizeof(arp_cache_entry));
-    DIE(!new_entry, "ARP cache entry malloc failed.\n");
+void answer_arp_request(struct arp_header *arp_hdr, int interface) {
+    interface_info_t *recv_if = &router_interfaces[interface];
+
+    if (arp_hdr->tpa == recv_if->ip) {
+        send_arp_reply(recv_if->mac, arp_hdr->sha, recv_if->ip, arp_hdr->spa, interface);
+    }
+}
 
-    new_entry->ip = ip;
-    mac_copy(new_entry->mac, mac);
 
-    *arp_cache = cons(new_entry, *arp_cache);
+void handle_arp_packet(struct arp_header *arp_hdr, int interface,
+                       adjacency_table_t *adj_table, arp_packet_queue *packet_queue) {
+    if (ntohs(arp_hdr->op) == ARP_OP_REQUEST) {
+        answer_arp_request(arp_hdr, interface);
+    } else {
+        // Received an ARP_OP_REPLY
+        handle_arp_reply(arp_hdr, interface, adj_table, packet_queue);
+    }
 }
 
 
-void send_packet_safely(char *packet, size_t packet_len, list arp_cache,
-                        arp_packet_queue *packet_queue,
-                        struct route_table_entry *best_route) {
-    int send_interface = best_route->interface;
-    uint8_t local_send_mac[6];
-    get_interface_mac(send_interface, local_send_mac);
+int send_packet_safely(packet_buf_t *pkt, arp_packet_queue *packet_queue,
+                       struct route_table_entry *best_route, adjacency_t *adj) {
+    // The slow path reads the flag while the forwarding loop changes it.
+    if (__atomic_load_n(&adj->resolved, __ATOMIC_RELAXED)) {
+        egress_send_adjacency(pkt, adj);
+        trace_egress(pkt, adj->interface, best_route);
+        return 1;
+    }
 
-    uint32_t local_send_ip = inet_addr(get_interface_ip(best_route->interface));
+    arp_pending_hop *hop = find_pending_hop(packet_queue, adj->next_hop, adj->interface);
 
-    uint8_t *next_hop_mac = search_addr_in_cache(arp_cache, ntohl(best_route->next_hop));
-    if (!next_hop_mac) {
-        add_packet_in_queue(packet_queue, packet, best_route, packet_len);
+    if (!hop) {
+        // First packet towards this next hop, so ask for its MAC.
+        hop = create_pending_hop(packet_queue, adj);
+        if (!hop) {
+            // Too many unresolved next hops, drop the packet.
+            STAT_INC(STAT_DROP_ARP_QUEUE_FULL);
+            trace_drop(pkt, STAT_DROP_ARP_QUEUE_FULL);
+            return 0;
+        }
 
-        send_arp_request(local_send_mac, local_send_ip,
-                         best_route->next_hop, send_interface);
-        return;
+        interface_info_t *send_if = &router_interfaces[adj->interface];
+        send_arp_request(send_if->mac, send_if->ip, adj->next_hop, adj->interface);
     }
 
-    // If MAC address was found in the cache, send the packet.
-    struct ether_header *eth_hdr = (struct ether_header*) packet;
-    update_mac_addresses(eth_hdr, next_hop_mac, local_send_mac);
-    send_to_link(send_interface, packet, packet_len);
+    add_packet_in_queue(packet_queue, hop, pkt, best_route);
+    return 0;
 }
@@ -0,0 +1,495 @@
+#include "dataplane.h"
+#include "interfaces.h"
+#include "alloc_debug.h"
+#include "stats.h"
+#include "trace.h"
+#include "route_stats.h"
+#include "icmp6.h"
+#include "fragment.h"
+#include <netinet/in.h>
+
+
+static inline void drop_packet(packet_buf_t *pkt, enum stats_counter reason) {
+    STAT_INC(reason);
+    trace_drop(pkt, reason);
+}
+
+
+/**
+ * Forwards an IPv6 packet that is not for the router, or answers
+ * with an ICMPv6 error.
+ */
+static void forward_ipv6_packet(dataplane_t *dp, packet_buf_t *pkt, int interface,
+                                struct ipv6hdr *ip6_hdr) {
+    ALLOC_CHECK_BEGIN();
+
+    if (ipv6_is_multicast(ip6_hdr->daddr) || ipv6_is_link_local(ip6_hdr->daddr)) {
+        // Not routed beyond the link.
+        drop_packet(pkt, STAT_DROP_NOT_FORWARDED);
+        return;
+    }
+
+    if (ip6_hdr->hop_limit <= 1) {
+        drop_packet(pkt, STAT_DROP_TTL);
+        create_icmp6_error(pkt, interface, ICMPV6_TIME_EXCEEDED_TYPE, 0, dp->icmp_limiter,
+                           dp->route6_table, dp->nd_table);
+        return;
+    }
+
+    uint64_t lookup_start_cycles = stats_cycles();
+    struct route6_table_entry *best_route = get_best_route6(dp->route6_table,
+                                                            ip6_hdr->daddr);
+    stats_record(HIST_LOOKUP, stats_cycles() - lookup_start_cycles);
+
+    if (!best_route) {
+        drop_packet(pkt, STAT_DROP_NO_ROUTE);
+        create_icmp6_error(pkt, interface, ICMPV6_DEST_UNREACHABLE_TYPE,
+                           ICMPV6_NO_ROUTE_CODE, dp->icmp_limiter,
+                           dp->route6_table, dp->nd_table);
+        return;
+    }
+
+    if (ipv6_is_link_local(ip6_hdr->saddr)) {
+        drop_packet(pkt, STAT_DROP_NOT_FORWARDED);
+        create_icmp6_error(pkt, interface, ICMPV6_DEST_UNREACHABLE_TYPE,
+                           ICMPV6_BEYOND_SCOPE_CODE, dp->icmp_limiter,
+                           dp->route6_table, dp->nd_table);
+        return;
+    }
+
+    // Only the source may fragment an IPv6 packet.
+    int mtu = router_interfaces[best_route->interface].mtu;
+    if (sizeof(struct ipv6hdr) + ntohs(ip6_hdr->payload_len) > (size_t) mtu) {
+        drop_packet(pkt, STAT_DROP_TOO_BIG);
+        create_icmp6_packet_too_big(pkt, interface, mtu, dp->icmp_limiter,
+                                    dp->route6_table, dp->nd_table);
+        return;
+    }
+
+    // No checksum to update in IPv6.
+    ip6_hdr->hop_limit--;
+
+    nd_neighbor_t *neigh = dp->route6_table->neighbors[best_route - dp->route6_table->entries];
+    if (!neigh) {
+        // On-link prefix: the destination is the neighbor.
+        neigh = nd_neighbor_get(dp->nd_table, ip6_hdr->daddr, best_route->interface);
+        if (!neigh) {
+            drop_packet(pkt, STAT_DROP_ND_QUEUE_FULL);
+            return;
+        }
+    }
+
+    if (nd_send_packet(dp->nd_table, neigh, pkt)) {
+        ALLOC_CHECK_END();
+    }
+}
+
+
+/**
+ * Handles an IPv6 packet: ND and Echo requests for the router, or forwarding.
+ */
+static void handle_ipv6_packet(dataplane_t *dp, packet_buf_t *pkt, int interface) {
+    struct ipv6hdr *ip6_hdr = (struct ipv6hdr*) (pkt->data + sizeof(struct ether_header));
+
+    if (pkt->len < sizeof(struct ether_header) + sizeof(struct ipv6hdr)
+        || (ntohl(ip6_hdr->ver_tc_flow) >> 28) != 6
+        || sizeof(struct ether_header) + sizeof(struct ipv6hdr)
+           + ntohs(ip6_hdr->payload_len) > pkt->len) {
+        drop_packet(pkt, STAT_DROP_MALFORMED);
+        return;
+    }
+
+    int is_local = is_interface_ip6(interface, ip6_hdr->daddr);
+    if (!is_local && !ipv6_is_multicast(ip6_hdr->daddr)) {
+        forward_ipv6_packet(dp, pkt, interface, ip6_hdr);
+        return;
+    }
+
+    struct icmp6hdr *icmp6_hdr = (struct icmp6hdr*) (ip6_hdr + 1);
+    if (ip6_hdr->nexthdr != IPV6_ICMPV6
+        || ntohs(ip6_hdr->payload_len) < sizeof(struct icmp6hdr)) {
+        drop_packet(pkt, STAT_DROP_NOT_FORWARDED);
+        return;
+    }
+
+    if (icmp6_hdr->type == ICMPV6_NEIGH_SOLICIT_TYPE
+        || icmp6_hdr->type == ICMPV6_NEIGH_ADVERT_TYPE) {
+        nd_receive(dp->nd_table, pkt, interface);
+    } else if (icmp6_hdr->type == ICMPV6_ECHO_REQ_TYPE && is_local) {
+        create_icmp6_reply(pkt, interface);
+    } else {
+        drop_packet(pkt, STAT_DROP_NOT_FORWARDED);
+    }
+}
+
+
+enum dataplane_node {
+    NODE_ETHERNET_INPUT,
+    NODE_IP4_INPUT,
+    NODE_ARP_INPUT,
+    NODE_IP6_INPUT,
+    NODE_ICMP_LOCAL,
+    NODE_IP4_LOOKUP,
+    NODE_IP4_FRAGMENT,
+    NODE_IP4_REWRITE,
+    NODE_INTERFACE_OUTPUT,
+    NODES_CNT
+};
+
+
+/**
+ * Counts the received packets, drops the ones for other MACs and sorts the
+ * others by ethertype.
+ */
+static void ethernet_input_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        if (i + 1 < frame->cnt) {
+            __builtin_prefetch(frame->pkts[i + 1]->data);
+        }
+
+        STAT_INC(STAT_RX_PACKETS);
+        stats_add(STAT_RX_BYTES, pkt->len);
+        trace_ingress(pkt, pkt->rx_interface);
+
+        struct ether_header *eth_hdr = (struct ether_header*) pkt->data;
+        if (!check_destination_validity(eth_hdr->ether_dhost,
+                                        router_interfaces[pkt->rx_interface].mac)) {
+            drop_packet(pkt, STAT_DROP_BAD_MAC);
+            continue;
+        }
+
+        uint16_t ether_type = ntohs(eth_hdr->ether_type);
+        if (ether_type == ETHER_TYPE_IPV4) {
+            graph_enqueue(dp->graph, NODE_IP4_INPUT, pkt);
+        } else if (ether_type == ETHER_TYPE_ARP) {
+            graph_enqueue(dp->graph, NODE_ARP_INPUT, pkt);
+        } else if (ether_type == ETHER_TYPE_IPV6 && dp->route6_table) {
+            graph_enqueue(dp->graph, NODE_IP6_INPUT, pkt);
+        } else {
+            drop_packet(pkt, STAT_DROP_OTHER_TYPE);
+        }
+    }
+}
+
+
+/**
+ * Sends the Echo requests for the router to icmp-local, and checks the
+ * checksum and the ACL of the packets to forward.
+ */
+static void ip4_input_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+
+        // Check if the router is the actual destination.
+        if (ip_hdr->daddr == router_interfaces[pkt->rx_interface].ip
+            && ip_hdr->protocol == IPV4_ICMP) {
+            struct icmphdr *icmp_hdr = (struct icmphdr*) (ip_hdr + 1);
+            if (icmp_hdr->type == ICMP_ECHO_REQ_TYPE) {
+                graph_enqueue(dp->graph, NODE_ICMP_LOCAL, pkt);
+                continue;
+            }
+        }
+
+        if (!authorize_checksum(ip_hdr)) {
+            // Wrong checksum.
+            drop_packet(pkt, STAT_DROP_BAD_CHECKSUM);
+            continue;
+        }
+
+        if (dp->acl && acl_classify(dp->acl, pkt, ip_hdr) == ACL_DENY) {
+            drop_packet(pkt, STAT_DROP_ACL);
+            continue;
+        }
+
+        graph_enqueue(dp->graph, NODE_IP4_LOOKUP, pkt);
+    }
+}
+
+
+static void arp_input_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        struct arp_header *arp_hdr = (struct arp_header*) (pkt->data
+                                      + sizeof(struct ether_header));
+
+        if (dp->slowpath) {
+            // The adjacencies are only written here, the slow path sends
+            // the packets that waited for this reply.
+            if (ntohs(arp_hdr->op) == ARP_OP_REQUEST
+                || arp_reply_resolve(arp_hdr, pkt->rx_interface, dp->adj_table)) {
+                slowpath_punt(dp->slowpath, pkt, SLOWPATH_ARP, 0);
+            }
+            continue;
+        }
+
+        handle_arp_packet(arp_hdr, pkt->rx_interface, dp->adj_table, dp->packet_queue);
+    }
+}
+
+
+static void ip6_input_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        handle_ipv6_packet(dp, frame->pkts[i], frame->pkts[i]->rx_interface);
+    }
+}
+
+
+static void icmp_local_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        int interface = pkt->rx_interface;
+
+        if (dp->slowpath) {
+            // The slow path answers the neighbor directly, as it does no
+            // lookup: a request from a multicast MAC has no way back.
+            struct ether_header *eth_hdr = (struct ether_header*) pkt->data;
+            if (eth_hdr->ether_shost[0] & 1) {
+                drop_packet(pkt, STAT_DROP_MALFORMED);
+                continue;
+            }
+            slowpath_punt(dp->slowpath, pkt, SLOWPATH_ECHO, 0);
+            continue;
+        }
+
+        create_icmp_reply(pkt, interface, dp->packet_queue, dp->vrf_tables[interface]);
+    }
+}
+
+
+/**
+ * Answers a packet with an ICMP error, unless the limiter suppresses it.
+ * The route back and its adjacency are found here even when the slow path
+ * builds the error, as only the forwarding loop may read the route tables.
+ * @param mtu MTU of the next hop for Fragmentation needed, else 0
+ */
+static void send_error(dataplane_t *dp, packet_buf_t *pkt, uint8_t type, uint8_t code,
+                       uint16_t mtu) {
+    struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+    route_table_t *route_table = dp->vrf_tables[pkt->rx_interface];
+
+    struct route_table_entry *best_route = icmp_error_route(ip_hdr, dp->icmp_limiter,
+                                                            route_table);
+    if (!best_route) {
+        return;
+    }
+    adjacency_t *adj = get_route_adjacency(route_table, best_route);
+
+    if (dp->slowpath) {
+        pkt->best_route = best_route;
+        pkt->adj = adj;
+        slowpath_punt(dp->slowpath, pkt, SLOWPATH_ICMP_ERROR, SLOWPATH_ICMP_ARG(type, code, mtu));
+        return;
+    }
+
+    send_icmp_error(ip_hdr, type, code, htonl(mtu), best_route, adj, dp->packet_queue);
+}
+
+
+/**
+ * Sends a packet on its route, or makes it wait for the ARP reply of the
+ * next hop, in the slow path if there is one.
+ */
+static void send_or_punt(dataplane_t *dp, packet_buf_t *pkt, adjacency_t *adj) {
+    if (dp->slowpath && !adj->resolved) {
+        pkt->adj = adj;
+        slowpath_punt(dp->slowpath, pkt, SLOWPATH_RESOLVE, 0);
+        return;
+    }
+
+    send_packet_safely(pkt, dp->packet_queue, pkt->best_route, adj);
+}
+
+
+/**
+ * Decrements the TTL and finds the route of the packets, in the table of
+ * the VRF of their interface, or answers with an ICMP error. The packets
+ * too big for the MTU of their route go to ip4-fragment.
+ */
+static void ip4_lookup_node(dataplane_t *dp, graph_frame_t *frame) {
+    ALLOC_CHECK_BEGIN();
+
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+        route_table_t *route_table = dp->vrf_tables[pkt->rx_interface];
+
+        if (!update_ttl(ip_hdr)) {
+            drop_packet(pkt, STAT_DROP_TTL);
+            send_error(dp, pkt, ICMP_TIME_EXCEEDED_TYPE, 0, 0);
+            continue;
+        }
+
+        uint64_t lookup_start_cycles = stats_cycles();
+        pkt->best_route = get_best_route(route_table, ntohl(ip_hdr->daddr));
+        stats_record(HIST_LOOKUP, stats_cycles() - lookup_start_cycles);
+
+        if (!pkt->best_route) {
+            drop_packet(pkt, STAT_DROP_NO_ROUTE);
+            send_error(dp, pkt, ICMP_DEST_UNREACHABLE_TYPE, 0, 0);
+            continue;
+        }
+        route_stats_prefetch(dp->route_table, pkt->best_route);
+
+        if (ntohs(ip_hdr->tot_len) > router_interfaces[pkt->best_route->interface].mtu) {
+            graph_enqueue(dp->graph, NODE_IP4_FRAGMENT, pkt);
+            continue;
+        }
+
+        graph_enqueue(dp->graph, NODE_IP4_REWRITE, pkt);
+    }
+
+    // Steady state forwarding never touches the heap.
+    ALLOC_CHECK_END();
+}
+
+
+/**
+ * Cuts the packets into fragments that fit in the MTU of their route, or
+ * answers with a Fragmentation needed error when their DF flag is set. The
+ * fragments do not fit in the frames of the next nodes, so they are sent
+ * on their own: they are the exception, not the fast path.
+ */
+static void ip4_fragment_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+        int mtu = router_interfaces[pkt->best_route->interface].mtu;
+        route_stats_count(dp->route_table, pkt->best_route, ntohs(ip_hdr->tot_len));
+
+        if (ip_hdr->frag_off & htons(IPV4_DF)) {
+            drop_packet(pkt, STAT_DROP_TOO_BIG);
+            // The error quotes the header as it was received, before
+            // ip4-lookup decremented its TTL.
+            ip_hdr->ttl += 1;
+            ip_hdr->check = 0;
+            ip_hdr->check = htons(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
+            // The MTU of the next hop, in the low half of the word, for
+            // Path MTU Discovery (RFC 1191).
+            send_error(dp, pkt, ICMP_DEST_UNREACHABLE_TYPE, ICMP_FRAG_NEEDED_CODE, mtu);
+            continue;
+        }
+
+        packet_buf_t *frags[IP4_MAX_FRAGMENTS];
+        int cnt = ip4_fragment(pkt, mtu, frags, IP4_MAX_FRAGMENTS);
+        if (!cnt) {
+            drop_packet(pkt, STAT_DROP_TOO_BIG);
+            continue;
+        }
+        stats_add(STAT_IP4_FRAGMENTS, cnt);
+
+        adjacency_t *adj = get_route_adjacency(dp->route_table, pkt->best_route);
+        for (int j = 0; j < cnt; j++) {
+            frags[j]->best_route = pkt->best_route;
+            send_or_punt(dp, frags[j], adj);
+            packet_put(frags[j]);
+        }
+    }
+}
+
+
+/**
+ * Writes the Ethernet header of the next hop over the packets, or makes
+ * them wait for its ARP reply.
+ */
+static void ip4_rewrite_node(dataplane_t *dp, graph_frame_t *frame) {
+    for (int i = 0; i < frame->cnt; i++) {
+        packet_buf_t *pkt = frame->pkts[i];
+        struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+        adjacency_t *adj = get_route_adjacency(dp->route_table, pkt->best_route);
+        route_stats_count(dp->route_table, pkt->best_route, ntohs(ip_hdr->tot_len));
+
+        if (!adj->resolved) {
+            send_or_punt(dp, pkt, adj);
+            continue;
+        }
+
+        adjacency_rewrite(adj, pkt->data);
+        pkt->tx_interface = adj->interface;
+        trace_egress(pkt, adj->interface, pkt->best_route);
+        graph_enqueue(dp->graph, NODE_INTERFACE_OUTPUT, pkt);
+    }
+}
+
+
+static void interface_output_node(dataplane_t *dp, graph_frame_t *frame) {
+    ALLOC_CHECK_BEGIN();
+
+    for (int i = 0; i < frame->cnt; i++) {
+        egress_send(frame->pkts[i], frame->pkts[i]->tx_interface);
+    }
+
+    ALLOC_CHECK_END();
+}
+
+
+static const graph_node_t dataplane_nodes[NODES_CNT] = {
+    [NODE_ETHERNET_INPUT] = { "ethernet-input", ethernet_input_node },
+    [NODE_IP4_INPUT] = { "ip4-input", ip4_input_node },
+    [NODE_ARP_INPUT] = { "arp-input", arp_input_node },
+    [NODE_IP6_INPUT] = { "ip6-input", ip6_input_node },
+    [NODE_ICMP_LOCAL] = { "icmp-local", icmp_local_node },
+    [NODE_IP4_LOOKUP] = { "ip4-lookup", ip4_lookup_node },
+    [NODE_IP4_FRAGMENT] = { "ip4-fragment", ip4_fragment_node },
+    [NODE_IP4_REWRITE] = { "ip4-rewrite", ip4_rewrite_node },
+    [NODE_INTERFACE_OUTPUT] = { "interface-output", interface_output_node },
+};
+
+
+void init_dataplane_graph(dataplane_t *dp) {
+    dp->graph = init_graph(dataplane_nodes, NODES_CNT);
+}
+
+
+void process_vector(dataplane_t *dp, packet_buf_t **pkts, int cnt) {
+    uint64_t start_cycles = stats_cycles();
+
+    graph_dispatch(dp->graph, dp, pkts, cnt);
+
+    // Every packet waited for the whole vector.
+    stats_record_n(HIST_PACKET, stats_cycles() - start_cycles, cnt);
+}
+
+
+void process_packet(dataplane_t *dp, packet_buf_t *pkt, int interface) {
+    pkt->rx_interface = interface;
+    process_vector(dp, &pkt, 1);
+}
+
+
+/**
+ * Switches to a newly compiled ACL, if there is one, and comes back later.
+ */
+static void housekeeping_timer_expired(void *arg, uint64_t now) {
+    dataplane_t *dp = arg;
+
+    // This thread is the only one using the ACL, so the old one can go
+    // right away: the packets saw either all of it or none.
+    acl_t *acl = __atomic_exchange_n(&dp->acl_next, NULL, __ATOMIC_ACQ_REL);
+    if (acl) {
+        if (dp->acl) {
+            acl_print_hits(dp->acl, stderr);
+            acl_free(dp->acl);
+        }
+        dp->acl = acl;
+        fprintf(stderr, "ACL: %d rules loaded\n", acl->rules_cnt);
+    }
+
+    timer_start(&dp->housekeeping, now + DATAPLANE_HOUSEKEEPING_MS);
+}
+
+
+void start_dataplane_housekeeping(dataplane_t *dp) {
+    timer_init(&dp->housekeeping, housekeeping_timer_expired, dp);
+    timer_start(&dp->housekeeping, get_time_ms() + DATAPLANE_HOUSEKEEPING_MS);
+}
+
+
+void dataplane_tick(dataplane_t *dp, uint64_t now) {
+    egress_run();
+
+    // ARP and ND retransmits, the background resolution of the next hops
+    // and the housekeeping.
+    timers_run(now);
+}
@@ -0,0 +1,484 @@
+#include "egress.h"
+#include "protocols.h"
+#include "stats.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+
+// Full frames a class may send per round (its quantum, in units of
+// max_frame_len, so that the largest frame always fits in one round), and
+// packets it may queue per interface. Control gets twice the quantum of
+// ICMP, and its own short queue, so that it waits for at most a quantum of
+// the other classes when a link is saturated by data.
+static const struct {
+    int quantum_frames;
+    int limit;
+    int red; // RED instead of tail drop
+} class_config[EGRESS_CLASSES_CNT] = {
+    [EGRESS_CONTROL] = { 2, 32, 0 },
+    [EGRESS_ICMP] = { 1, 64, 0 },
+    [EGRESS_DATA] = { 2, 256, 1 },
+};
+
+static const char *const class_names[EGRESS_CLASSES_CNT] = {
+    [EGRESS_CONTROL] = "control",
+    [EGRESS_ICMP] = "icmp",
+    [EGRESS_DATA] = "data",
+};
+
+static struct egress_port ports[ROUTER_NUM_INTERFACES];
+static packet_pool_t *egress_pool;
+static int total_backlog;
+static uint32_t red_seed = 2463534242u;
+
+// Packets of the other thread, sent by the owner of the queues once it is
+// woken up by the eventfd.
+static spsc_ring_t *handover_ring;
+static int handover_fd = -1;
+
+
+// Packets sent by the other thread since its last egress_handover_flush().
+struct egress_handover {
+    packet_buf_t *pkts[EGRESS_HANDOVER_BATCH];
+    int cnt;
+    packet_pool_t *pool; // Of the copies of the frames
+};
+
+// NULL in the owner of the queues.
+static __thread struct egress_handover *handover;
+
+
+/**
+ * Parses "N" (all the interfaces) or "IF=N,..." in Mbit/s.
+ */
+static void parse_rates(const char *rates) {
+    const char *p = rates;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        int all = *end != '=';
+        long mbps = first;
+        if (!all) {
+            mbps = strtol(end + 1, &end, 10);
+        }
+
+        DIE(end == p || mbps <= 0 || (!all && (first < 0 || first >= ROUTER_NUM_INTERFACES))
+            || (*end && *end != ','), "Invalid egress rate: %s", rates);
+
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            if (all || i == first) {
+                ports[i].rate_bps = (uint64_t) mbps * 1000000;
+            }
+        }
+
+        p = *end ? end + 1 : end;
+    }
+}
+
+
+void init_egress(packet_pool_t *pool, const char *rates) {
+    memset(ports, 0, sizeof(ports));
+    egress_pool = pool;
+    total_backlog = 0;
+
+    if (rates) {
+        parse_rates(rates);
+    }
+
+    uint64_t now = get_time_ns();
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        // A millisecond of traffic, at least two full frames.
+        ports[i].burst = ports[i].rate_bps / 8 / 1000;
+        if (ports[i].burst < 2 * (int64_t) max_frame_len) {
+            ports[i].burst = 2 * max_frame_len;
+        }
+        ports[i].tokens = ports[i].burst;
+        ports[i].last_ns = now;
+        ports[i].new_visit = 1;
+    }
+}
+
+
+static enum egress_class classify(const char *frame, size_t len) {
+    const struct ether_header *eth_hdr = (const struct ether_header *) frame;
+    uint16_t ether_type = ntohs(eth_hdr->ether_type);
+
+    if (ether_type == ETHER_TYPE_ARP) {
+        return EGRESS_CONTROL;
+    }
+
+    if (ether_type == ETHER_TYPE_IPV4
+        && len >= sizeof(struct ether_header) + sizeof(struct iphdr)) {
+        const struct iphdr *ip_hdr = (const struct iphdr *) (eth_hdr + 1);
+        if ((ip_hdr->tos >> 2) >= EGRESS_DSCP_CONTROL) {
+            return EGRESS_CONTROL;
+        }
+        return ip_hdr->protocol == IPV4_ICMP ? EGRESS_ICMP : EGRESS_DATA;
+    }
+
+    if (ether_type == ETHER_TYPE_IPV6
+        && len >= sizeof(struct ether_header) + sizeof(struct ipv6hdr) + 1) {
+        const struct ipv6hdr *ip6_hdr = (const struct ipv6hdr *) (eth_hdr + 1);
+        uint8_t traffic_class = ntohl(ip6_hdr->ver_tc_flow) >> 20;
+        if ((traffic_class >> 2) >= EGRESS_DSCP_CONTROL) {
+            return EGRESS_CONTROL;
+        }
+        if (ip6_hdr->nexthdr != IPV6_ICMPV6) {
+            return EGRESS_DATA;
+        }
+
+        uint8_t type = *(const uint8_t *) (ip6_hdr + 1);
+        return type >= ICMPV6_ROUTER_SOLICIT_TYPE && type <= ICMPV6_REDIRECT_TYPE
+               ? EGRESS_CONTROL : EGRESS_ICMP;
+    }
+
+    return EGRESS_DATA;
+}
+
+
+/**
+ * Refills the token bucket of a shaped interface.
+ * @return 1 if a frame of len bytes can be sent now, 0 otherwise.
+ */
+static int shaper_allows(struct egress_port *port, size_t len) {
+    if (!port->rate_bps) {
+        return 1;
+    }
+
+    // The clock only moves on with whole bytes, so that the frequent calls
+    // do not lose the fractions. Long idle times fill the bucket anyway.
+    uint64_t now = get_time_ns();
+    uint64_t elapsed = now - port->last_ns;
+    if (elapsed > 100000000) {
+        elapsed = 100000000;
+    }
+
+    int64_t added = elapsed * (port->rate_bps / 8) / 1000000000;
+    if (added > 0) {
+        port->tokens += added;
+        if (port->tokens > port->burst) {
+            port->tokens = port->burst;
+        }
+        port->last_ns = now;
+    }
+
+    return port->tokens >= (int64_t) len;
+}
+
+
+/**
+ * Writes a frame, if the shaper and the link accept it.
+ * @return 1 if it was sent, 0 if it has to wait.
+ */
+static int transmit(struct egress_port *port, int interface, char *frame, size_t len) {
+    if (!shaper_allows(port, len) || send_to_link(interface, frame, len) < 0) {
+        return 0;
+    }
+
+    if (port->rate_bps) {
+        port->tokens -= len;
+    }
+    return 1;
+}
+
+
+/**
+ * Decides whether a packet of the class fits in its queue: tail drop at the
+ * limit, or RED on the average length.
+ */
+static int queue_accepts(struct egress_queue *queue, enum egress_class class) {
+    int limit = class_config[class].limit;
+    if (queue->cnt >= limit || total_backlog >= EGRESS_MAX_TOTAL) {
+        STAT_INC(STAT_DROP_EGRESS_TAIL);
+        return 0;
+    }
+
+    if (!class_config[class].red) {
+        return 1;
+    }
+
+    // The average follows the length seen by the arriving packets.
+    int64_t diff = ((int64_t) queue->cnt << 8) - queue->red_avg;
+    queue->red_avg += diff / (1 << EGRESS_RED_WEIGHT_SHIFT);
+
+    uint32_t min_th = (limit / 4) << 8, max_th = (3 * limit / 4) << 8;
+    if (queue->red_avg < min_th) {
+        return 1;
+    }
+
+    if (queue->red_avg < max_th) {
+        red_seed ^= red_seed << 13;
+        red_seed ^= red_seed >> 17;
+        red_seed ^= red_seed << 5;
+
+        // p = (avg - min_th) / (max_th - min_th) / EGRESS_RED_MAX_P_INV
+        uint64_t threshold = (uint64_t) (queue->red_avg - min_th) * UINT32_MAX
+                             / (max_th - min_th) / EGRESS_RED_MAX_P_INV;
+        if (red_seed >= threshold) {
+            return 1;
+        }
+    }
+
+    STAT_INC(STAT_DROP_EGRESS_RED);
+    return 0;
+}
+
+
+static void enqueue(struct egress_port *port, enum egress_class class, packet_buf_t *pkt) {
+    struct egress_queue *queue = &port->queues[class];
+
+    pkt->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = pkt;
+    } else {
+        queue->head = pkt;
+    }
+    queue->tail = pkt;
+
+    queue->cnt++;
+    if (queue->cnt > queue->max_cnt) {
+        queue->max_cnt = queue->cnt;
+    }
+    port->backlog++;
+    total_backlog++;
+    STAT_INC(STAT_EGRESS_QUEUED);
+}
+
+
+/**
+ * Keeps the packet (and its reference) until the next egress_handover_flush().
+ * @param adj Adjacency whose header the owner writes first, NULL for none
+ */
+static void hand_over(packet_buf_t *pkt, int interface, adjacency_t *adj) {
+    if (handover->cnt == EGRESS_HANDOVER_BATCH) {
+        STAT_INC(STAT_DROP_EGRESS_TAIL);
+        packet_put(pkt);
+        return;
+    }
+
+    pkt->tx_interface = interface;
+    pkt->adj = adj;
+    handover->pkts[handover->cnt++] = pkt;
+}
+
+
+void egress_send(packet_buf_t *pkt, int interface) {
+    struct egress_port *port = &ports[interface];
+
+    if (__builtin_expect(handover != NULL, 0)) {
+        hand_over(packet_get(pkt), interface, NULL);
+        return;
+    }
+
+    if (!egress_pool) {
+        send_to_link(interface, pkt->data, pkt->len);
+        return;
+    }
+
+    if (!port->backlog && transmit(port, interface, pkt->data, pkt->len)) {
+        return;
+    }
+
+    enum egress_class class = classify(pkt->data, pkt->len);
+    struct egress_queue *queue = &port->queues[class];
+    if (!queue_accepts(queue, class)) {
+        queue->dropped++;
+        return;
+    }
+
+    enqueue(port, class, packet_get(pkt));
+}
+
+
+void egress_send_adjacency(packet_buf_t *pkt, adjacency_t *adj) {
+    if (__builtin_expect(handover != NULL, 0)) {
+        hand_over(packet_get(pkt), adj->interface, adj);
+        return;
+    }
+
+    adjacency_rewrite(adj, pkt->data);
+    egress_send(pkt, adj->interface);
+}
+
+
+void egress_send_frame(int interface, char *frame, size_t len) {
+    struct egress_port *port = &ports[interface];
+
+    if (__builtin_expect(handover != NULL, 0)) {
+        packet_buf_t *pkt = packet_alloc(handover->pool);
+        if (!pkt) {
+            STAT_INC(STAT_DROP_EGRESS_TAIL);
+            return;
+        }
+
+        memcpy(pkt->data, frame, len);
+        pkt->len = len;
+        hand_over(pkt, interface, NULL);
+        return;
+    }
+
+    if (!egress_pool) {
+        send_to_link(interface, frame, len);
+        return;
+    }
+
+    if (!port->backlog && transmit(port, interface, frame, len)) {
+        return;
+    }
+
+    enum egress_class class = classify(frame, len);
+    struct egress_queue *queue = &port->queues[class];
+    packet_buf_t *pkt = NULL;
+    if (queue_accepts(queue, class)) {
+        pkt = packet_alloc(egress_pool);
+    }
+    if (!pkt) {
+        queue->dropped++;
+        return;
+    }
+
+    memcpy(pkt->data, frame, len);
+    pkt->len = len;
+    pkt->traced = 0;
+    enqueue(port, class, pkt);
+}
+
+
+static void run_port(struct egress_port *port, int interface) {
+    while (port->backlog) {
+        struct egress_queue *queue = &port->queues[port->current];
+
+        if (!queue->cnt) {
+            queue->deficit = 0;
+            port->current = (port->current + 1) % EGRESS_CLASSES_CNT;
+            port->new_visit = 1;
+            continue;
+        }
+
+        if (port->new_visit) {
+            queue->deficit += class_config[port->current].quantum_frames * (int) max_frame_len;
+            port->new_visit = 0;
+        }
+
+        packet_buf_t *pkt = queue->head;
+        if ((int) pkt->len > queue->deficit) {
+            port->current = (port->current + 1) % EGRESS_CLASSES_CNT;
+            port->new_visit = 1;
+            continue;
+        }
+
+        // The link or the shaper is full: the round resumes here later.
+        if (!transmit(port, interface, pkt->data, pkt->len)) {
+            return;
+        }
+
+        queue->head = pkt->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        queue->cnt--;
+        queue->deficit -= pkt->len;
+        queue->sent++;
+        port->backlog--;
+        total_backlog--;
+
+        packet_put(pkt);
+    }
+}
+
+
+void egress_run() {
+    if (!total_backlog) {
+        return;
+    }
+
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        if (ports[i].backlog) {
+            run_port(&ports[i], i);
+        }
+    }
+}
+
+
+static void handle_handover(int fd, void *arg) {
+    uint64_t wakeups;
+    if (read(fd, &wakeups, sizeof(wakeups)) < 0) {
+        return;
+    }
+
+    packet_buf_t *pkt;
+    while ((pkt = spsc_ring_pop(handover_ring)) != NULL) {
+        packet_take_back(pkt);
+        if (pkt->adj) {
+            adjacency_rewrite(pkt->adj, pkt->data);
+        }
+        egress_send(pkt, pkt->tx_interface);
+        packet_put(pkt);
+    }
+}
+
+
+void egress_init_handover() {
+    handover_ring = init_spsc_ring(EGRESS_HANDOVER_RING);
+
+    handover_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    DIE(handover_fd < 0, "eventfd");
+
+    register_event_fd(handover_fd, handle_handover, NULL);
+}
+
+
+void egress_handover_thread(packet_pool_t *pool) {
+    handover = calloc(1, sizeof(struct egress_handover));
+    DIE(!handover, "Egress handover malloc failed.\n");
+    handover->pool = pool;
+}
+
+
+void egress_handover_flush() {
+    if (!handover->cnt) {
+        return;
+    }
+
+    for (int i = 0; i < handover->cnt; i++) {
+        packet_buf_t *pkt = handover->pkts[i];
+        packet_lend(pkt);
+        if (!spsc_ring_push(handover_ring, pkt)) {
+            packet_take_back(pkt);
+            STAT_INC(STAT_DROP_EGRESS_TAIL);
+            packet_put(pkt);
+        }
+    }
+    handover->cnt = 0;
+
+    uint64_t one = 1;
+    if (write(handover_fd, &one, sizeof(one)) < 0) {
+        perror("egress handover");
+    }
+}
+
+
+int egress_backlog() {
+    return total_backlog;
+}
+
+
+void egress_print_stats(FILE *out) {
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        for (int c = 0; c < EGRESS_CLASSES_CNT; c++) {
+            struct egress_queue *queue = &ports[i].queues[c];
+            if (!queue->sent && !queue->dropped) {
+                continue;
+            }
+
+            fprintf(out, "Egress %d %s: %" PRIu64 " sent after waiting, %" PRIu64 " dropped, "
+                         "longest queue %d\n", i, class_names[c], queue->sent,
+                    queue->dropped, queue->max_cnt);
+        }
+    }
+}
@@ -0,0 +1,343 @@
+#include "fib_sync.h"
+#include "trie.h"
+#include "interfaces.h"
+#include "stats.h"
+#include "route_stats.h"
+#include "utils.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+
+static void request_dump(fib_sync_t *sync) {
+    struct {
+        struct nlmsghdr nlh;
+        struct rtmsg rtm;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nlh.nlmsg_type = RTM_GETROUTE;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = ++sync->seq;
+    req.rtm.rtm_family = AF_INET;
+
+    if (send(sync->fd, &req, req.nlh.nlmsg_len, 0) < 0) {
+        perror("netlink route dump");
+        return;
+    }
+
+    sync->dumping = 1;
+    sync->generation++;
+}
+
+
+static int find_interface(fib_sync_t *sync, int ifindex) {
+    for (int i = 0; i < router_interfaces_cnt; i++) {
+        if (sync->ifindex[i] == ifindex) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Reads a route of the followed table.
+ * @param entry Filled with the route, in network order
+ * @return Whether it is a route of the table that the router can use:
+ * unicast, with a gateway, through one of its interfaces.
+ */
+static int parse_route(fib_sync_t *sync, struct nlmsghdr *nlh, struct route_table_entry *entry) {
+    struct rtmsg *rtm = NLMSG_DATA(nlh);
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm)) || rtm->rtm_family != AF_INET
+        || (rtm->rtm_flags & RTM_F_CLONED) || rtm->rtm_dst_len > 32) {
+        return 0;
+    }
+
+    uint32_t table = rtm->rtm_table;
+    uint32_t dst = 0, gateway = 0;
+    int ifindex = 0;
+
+    int attrs_len = RTM_PAYLOAD(nlh);
+    for (struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, attrs_len);
+         rta = RTA_NEXT(rta, attrs_len)) {
+        switch (rta->rta_type) {
+        case RTA_TABLE:
+            table = *(uint32_t *) RTA_DATA(rta);
+            break;
+        case RTA_DST:
+            dst = *(uint32_t *) RTA_DATA(rta);
+            break;
+        case RTA_GATEWAY:
+            gateway = *(uint32_t *) RTA_DATA(rta);
+            break;
+        case RTA_OIF:
+            ifindex = *(int *) RTA_DATA(rta);
+            break;
+        case RTA_MULTIPATH: {
+            // Only the first next hop is used.
+            struct rtnexthop *nh = RTA_DATA(rta);
+            if (RTA_PAYLOAD(rta) < sizeof(*nh) || nh->rtnh_len < sizeof(*nh)) {
+                break;
+            }
+
+            ifindex = nh->rtnh_ifindex;
+            int nh_attrs_len = nh->rtnh_len - sizeof(*nh);
+            for (struct rtattr *nh_rta = RTNH_DATA(nh); RTA_OK(nh_rta, nh_attrs_len);
+                 nh_rta = RTA_NEXT(nh_rta, nh_attrs_len)) {
+                if (nh_rta->rta_type == RTA_GATEWAY) {
+                    gateway = *(uint32_t *) RTA_DATA(nh_rta);
+                }
+            }
+            break;
+        }
+        }
+    }
+
+    uint32_t mask = rtm->rtm_dst_len ? 0xffffffff << (32 - rtm->rtm_dst_len) : 0;
+    entry->prefix = dst & htonl(mask);
+    entry->mask = htonl(mask);
+    entry->next_hop = gateway;
+    entry->interface = find_interface(sync, ifindex);
+
+    return table == sync->kernel_table && rtm->rtm_type == RTN_UNICAST && gateway
+           && entry->interface >= 0;
+}
+
+
+static void remove_slot(fib_sync_t *sync, int slot) {
+    route_table_t *table = sync->route_table;
+    struct route_table_entry *entry = &table->entries[slot];
+
+    if (slot < sync->file_cnt && sync->file_shadowed[slot]) {
+        // The route of the file is back, in its slot, still in the trie.
+        *entry = sync->file_routes[slot];
+        table->adjacencies[slot] = adjacency_get(sync->adj_table, entry->next_hop,
+                                                 entry->interface);
+        sync->file_shadowed[slot] = 0;
+        sync->seen[slot] = 0;
+        STAT_INC(STAT_FIB_ROUTES_REMOVED);
+        return;
+    }
+
+    trie_remove_vrf(&sync->route_table->trie_root, ntohl(entry->prefix), ntohl(entry->mask), 0);
+    sync->seen[slot] = 0;
+    sync->free_slots[sync->free_cnt++] = slot;
+    STAT_INC(STAT_FIB_ROUTES_REMOVED);
+}
+
+
+/**
+ * Adds the route, or replaces the one of its prefix, in place.
+ */
+static void add_route(fib_sync_t *sync, const struct route_table_entry *route) {
+    route_table_t *table = sync->route_table;
+    uint32_t prefix = ntohl(route->prefix);
+    uint32_t mask = ntohl(route->mask);
+
+    if (sync->adj_table->size == sync->adj_table->capacity
+        && !adjacency_find(sync->adj_table, route->next_hop, route->interface)) {
+        // adjacency_get() would not find room for a new next hop.
+        fprintf(stderr, "Adjacency table full, route ignored\n");
+        return;
+    }
+
+    network_trie_node_t *node = trie_find(table->trie_root, prefix, mask);
+    int slot;
+    if (node) {
+        slot = node->entry - table->entries;
+    } else if (sync->free_cnt) {
+        slot = sync->free_slots[--sync->free_cnt];
+        route_stats_forget(slot);
+    } else if (table->size < table->capacity) {
+        slot = table->size++;
+    } else {
+        fprintf(stderr, "Route table full, route ignored\n");
+        return;
+    }
+
+    if (slot < sync->file_cnt && !sync->seen[slot]) {
+        sync->file_routes[slot] = table->entries[slot];
+        sync->file_shadowed[slot] = 1;
+    }
+    table->entries[slot] = *route;
+    table->adjacencies[slot] = adjacency_get(sync->adj_table, route->next_hop, route->interface);
+    neighbor_resolver_add(sync->resolver, table->adjacencies[slot]);
+    sync->seen[slot] = sync->generation;
+
+    if (!node) {
+        node = trie_insert_vrf(&table->trie_root, prefix, mask, 0);
+        node->entry = &table->entries[slot];
+    }
+    STAT_INC(STAT_FIB_ROUTES_ADDED);
+}
+
+
+/**
+ * Removes the route of the prefix if it is the one that the kernel removed,
+ * not another one of the prefix, e.g. from the file.
+ */
+static void delete_route(fib_sync_t *sync, const struct route_table_entry *route) {
+    route_table_t *table = sync->route_table;
+    network_trie_node_t *node = trie_find(table->trie_root, ntohl(route->prefix),
+                                          ntohl(route->mask));
+    if (!node) {
+        return;
+    }
+
+    int slot = node->entry - table->entries;
+    if (sync->seen[slot] && node->entry->next_hop == route->next_hop
+        && node->entry->interface == route->interface) {
+        remove_slot(sync, slot);
+    }
+}
+
+
+/**
+ * Removes the learned routes that the dump did not have, and starts the
+ * next dump if notifications were lost meanwhile.
+ */
+static void finish_dump(fib_sync_t *sync) {
+    sync->dumping = 0;
+
+    for (int slot = 0; slot < sync->route_table->size; slot++) {
+        if (sync->seen[slot] && sync->seen[slot] != sync->generation) {
+            remove_slot(sync, slot);
+        }
+    }
+
+    if (sync->resync_needed) {
+        sync->resync_needed = 0;
+        request_dump(sync);
+    }
+}
+
+
+static void handle_message(fib_sync_t *sync, struct nlmsghdr *nlh) {
+    struct route_table_entry route;
+
+    switch (nlh->nlmsg_type) {
+    case RTM_NEWROUTE:
+        if (parse_route(sync, nlh, &route)) {
+            add_route(sync, &route);
+        }
+        break;
+    case RTM_DELROUTE:
+        if (parse_route(sync, nlh, &route)) {
+            delete_route(sync, &route);
+        }
+        break;
+    case NLMSG_DONE:
+        if (sync->dumping && nlh->nlmsg_seq == sync->seq) {
+            finish_dump(sync);
+        }
+        break;
+    case NLMSG_ERROR: {
+        struct nlmsgerr *err = NLMSG_DATA(nlh);
+        if (err->error && nlh->nlmsg_seq == sync->seq) {
+            // The dump was refused, the routes stay as they are.
+            fprintf(stderr, "Netlink route dump: %s\n", strerror(-err->error));
+            sync->dumping = 0;
+        }
+        break;
+    }
+    }
+}
+
+
+/**
+ * Applies the messages of one read of the socket.
+ */
+static void receive_messages(fib_sync_t *sync, int flags) {
+    static char buf[FIB_SYNC_READ_LEN] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+    ssize_t len = recv(sync->fd, buf, sizeof(buf), flags);
+    if (len < 0) {
+        if (errno == ENOBUFS) {
+            // Notifications were lost: the table is dumped again.
+            STAT_INC(STAT_FIB_RESYNCS);
+            if (sync->dumping) {
+                sync->resync_needed = 1;
+            } else {
+                request_dump(sync);
+            }
+        }
+        return;
+    }
+
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+        handle_message(sync, nlh);
+    }
+}
+
+
+/**
+ * Applies at most one read of notifications, so that a bulk change is
+ * spread over several turns of the receive loop, between the vectors.
+ */
+static void handle_fib_event(int fd, void *arg) {
+    receive_messages(arg, MSG_DONTWAIT);
+}
+
+
+fib_sync_t *init_fib_sync(uint32_t kernel_table, route_table_t *route_table,
+                          adjacency_table_t *adj_table, neighbor_resolver_t *resolver) {
+    fib_sync_t *sync = calloc(1, sizeof(fib_sync_t));
+    DIE(!sync, "FIB sync malloc failed.\n");
+
+    sync->kernel_table = kernel_table;
+    sync->route_table = route_table;
+    sync->adj_table = adj_table;
+    sync->resolver = resolver;
+    for (int i = 0; i < router_interfaces_cnt; i++) {
+        sync->ifindex[i] = get_interface_index(i);
+    }
+
+    sync->free_slots = malloc(route_table->capacity * sizeof(int));
+    sync->seen = calloc(route_table->capacity, sizeof(uint32_t));
+    sync->file_cnt = route_table->size;
+    sync->file_routes = malloc((sync->file_cnt + 1) * sizeof(struct route_table_entry));
+    sync->file_shadowed = calloc(sync->file_cnt + 1, 1);
+    DIE(!sync->free_slots || !sync->seen || !sync->file_routes || !sync->file_shadowed,
+        "FIB sync malloc failed.\n");
+
+    sync->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    DIE(sync->fd < 0, "netlink socket");
+
+    // Past the limit of the socket buffers if allowed (CAP_NET_ADMIN).
+    int rcvbuf = FIB_SYNC_RCVBUF;
+    if (setsockopt(sync->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        setsockopt(sync->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_ROUTE;
+    DIE(bind(sync->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0, "netlink bind");
+
+    // The notifications sent during the first dump are applied after it,
+    // in order.
+    uint64_t start_ms = get_time_ms();
+    request_dump(sync);
+    while (sync->dumping) {
+        receive_messages(sync, 0);
+    }
+
+    int learned = 0;
+    for (int slot = 0; slot < route_table->size; slot++) {
+        learned += sync->seen[slot] != 0;
+    }
+    fprintf(stderr, "Kernel table %u: %d routes loaded in %" PRIu64 " ms\n", kernel_table,
+            learned, get_time_ms() - start_ms);
+
+    register_event_fd(sync->fd, handle_fib_event, sync);
+
+    return sync;
+}
@@ -1,28 +1,30 @@
 #include "forwarding.h"
+#include "hugepage.h"
 #include <netinet/in.h>
 
 
-route_table_t *init_route_table(const char *path) {
+route_table_t *init_route_table(const char *path, adjacency_table_t *adj_table,
+                                int capacity) {
     route_table_t *route_table = malloc(sizeof(route_table_t ));
     DIE(!route_table, "Route table malloc.\n");
 
-    route_table->entries = malloc(MAX_RTABLE_LEN * sizeof(struct route_table_entry));
-    DIE(!route_table->entries, "Route table entries malloc failed.\n");
+    route_table->capacity = capacity;
+    route_table->entries = hugepage_alloc("routes", capacity * sizeof(struct route_table_entry));
 
     route_table->size = read_rtable(path, route_table->entries);
 
-    // Insert all the prefixes in the trie.
-    route_table->trie_root = create_trie_node();
+    route_table->adjacencies = hugepage_alloc("route adjacencies",
+                                              capacity * sizeof(adjacency_t *));
 
     for (int i = 0; i < route_table->size; i++) {
-        uint32_t ip_prefix = ntohl(route_table->entries[i].prefix);
-        uint32_t ip_mask = ntohl(route_table->entries[i].mask);
-
-        network_trie_node_t *final_node = trie_insert(route_table->trie_root,
-                                                      ip_prefix, ip_mask);
-        final_node->entry = &route_table->entries[i];
+        route_table->adjacencies[i] = adjacency_get(adj_table,
+                                                    route_table->entries[i].next_hop,
+                                                    route_table->entries[i].interface);
     }
 
+    // Build the trie of all the prefixes at once.
+    route_table->trie_root = trie_build(route_table->entries, route_table->size, NULL);
+
     return route_table;
 }
 
@@ -37,7 +39,8 @@ int check_destination_validity(const uint8_t* destination_mac, const uint8_t *lo
         }
     }
 
-    if (broadcast) {
+    // IPv6 multicast (33:33:...), e.g. Neighbor Solicitations.
+    if (broadcast || (destination_mac[0] == 0x33 && destination_mac[1] == 0x33)) {
         return 1;
     }
 
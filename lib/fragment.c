@@ -0,0 +1,124 @@
+#include "fragment.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+// Option types (RFC 791). The ones with the high bit set are repeated in
+// every fragment.
+#define IP4_OPT_END 0
+#define IP4_OPT_NOP 1
+#define IP4_OPT_COPIED 0x80
+
+
+/**
+ * Copies the options that the fragments after the first one repeat,
+ * padded with End of options to a whole number of words.
+ * @return The length of the copy.
+ */
+static size_t copy_fragment_options(const uint8_t *options, size_t len, uint8_t *copy) {
+    size_t copy_len = 0;
+    size_t i = 0;
+
+    while (i < len && options[i] != IP4_OPT_END) {
+        if (options[i] == IP4_OPT_NOP) {
+            i++;
+            continue;
+        }
+
+        // A truncated option ends the list.
+        if (i + 1 >= len || options[i + 1] < 2 || i + options[i + 1] > len) {
+            break;
+        }
+
+        uint8_t opt_len = options[i + 1];
+        if (options[i] & IP4_OPT_COPIED) {
+            memcpy(copy + copy_len, options + i, opt_len);
+            copy_len += opt_len;
+        }
+        i += opt_len;
+    }
+
+    while (copy_len % 4) {
+        copy[copy_len++] = IP4_OPT_END;
+    }
+
+    return copy_len;
+}
+
+
+/**
+ * Gives the references to the fragments back, when not all of them could
+ * be made.
+ */
+static void put_fragments(packet_buf_t **frags, int cnt) {
+    for (int i = 0; i < cnt; i++) {
+        packet_put(frags[i]);
+    }
+}
+
+
+int ip4_fragment(packet_buf_t *pkt, int mtu, packet_buf_t **frags, int max_cnt) {
+    struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+    size_t hdr_len = ip_hdr->ihl * 4;
+    size_t tot_len = ntohs(ip_hdr->tot_len);
+
+    if (hdr_len < sizeof(struct iphdr) || tot_len <= hdr_len
+        || sizeof(struct ether_header) + tot_len > pkt->len) {
+        return 0;
+    }
+
+    // Header of the fragments after the first one, with fewer options.
+    uint8_t later_hdr[60];
+    memcpy(later_hdr, ip_hdr, sizeof(struct iphdr));
+    size_t later_hdr_len = sizeof(struct iphdr)
+        + copy_fragment_options((uint8_t*) (ip_hdr + 1), hdr_len - sizeof(struct iphdr),
+                                later_hdr + sizeof(struct iphdr));
+    ((struct iphdr*) later_hdr)->ihl = later_hdr_len / 4;
+
+    // The packet may be a fragment already: its offset is added to the
+    // ones of its fragments, and the last of them keeps its More fragments.
+    uint16_t frag_off = ntohs(ip_hdr->frag_off);
+    size_t first_offset = (frag_off & IPV4_OFFSET_MASK) * 8;
+    uint16_t last_more = frag_off & IPV4_MF;
+
+    const char *data = (const char*) ip_hdr + hdr_len;
+    size_t data_len = tot_len - hdr_len;
+    size_t pos = 0;
+    int cnt = 0;
+
+    while (pos < data_len) {
+        const void *hdr = cnt ? (const void*) later_hdr : (const void*) ip_hdr;
+        size_t len = cnt ? later_hdr_len : hdr_len;
+
+        // All the fragments but the last one carry a multiple of 8 bytes,
+        // at least 8 since the MTU is at least IPV4_MIN_MTU.
+        size_t chunk = (mtu - len) & ~7;
+        if (chunk >= data_len - pos) {
+            chunk = data_len - pos;
+        }
+
+        packet_buf_t *frag = cnt < max_cnt ? packet_alloc(pkt->pool) : NULL;
+        if (!frag) {
+            put_fragments(frags, cnt);
+            return 0;
+        }
+        frags[cnt++] = frag;
+
+        memcpy(frag->data, pkt->data, sizeof(struct ether_header));
+        struct iphdr *frag_hdr = (struct iphdr*) (frag->data + sizeof(struct ether_header));
+        memcpy(frag_hdr, hdr, len);
+        memcpy((char*) frag_hdr + len, data + pos, chunk);
+
+        uint16_t more = pos + chunk < data_len ? IPV4_MF : last_more;
+        frag_hdr->tot_len = htons(len + chunk);
+        frag_hdr->frag_off = htons(((first_offset + pos) / 8) | more);
+        frag_hdr->check = 0; // Initial value
+        frag_hdr->check = htons(checksum((uint16_t *) frag_hdr, len));
+
+        frag->len = sizeof(struct ether_header) + len + chunk;
+        frag->rx_interface = pkt->rx_interface;
+        frag->best_route = pkt->best_route;
+        pos += chunk;
+    }
+
+    return cnt;
+}
@@ -0,0 +1,42 @@
+#include "graph.h"
+#include "hugepage.h"
+#include <string.h>
+
+
+graph_t *init_graph(const graph_node_t *nodes, int cnt) {
+    DIE(cnt > GRAPH_MAX_NODES, "Too many graph nodes.\n");
+
+    graph_t *graph = hugepage_alloc("graph frames", sizeof(graph_t));
+    DIE(!graph, "Graph malloc failed.\n");
+
+    graph->nodes = nodes;
+    graph->nodes_cnt = cnt;
+
+    const char *names[GRAPH_MAX_NODES];
+    for (int i = 0; i < cnt; i++) {
+        names[i] = nodes[i].name;
+    }
+    stats_set_node_names(names, cnt);
+
+    return graph;
+}
+
+
+void graph_dispatch(graph_t *graph, struct dataplane *dp, packet_buf_t **pkts, int cnt) {
+    graph_frame_t *first = &graph->frames[0];
+    memcpy(first->pkts, pkts, cnt * sizeof(packet_buf_t *));
+    first->cnt = cnt;
+
+    for (int n = 0; n < graph->nodes_cnt; n++) {
+        graph_frame_t *frame = &graph->frames[n];
+        if (!frame->cnt) {
+            continue;
+        }
+
+        uint64_t start_cycles = stats_cycles();
+        graph->nodes[n].function(dp, frame);
+        stats_node_add(n, frame->cnt, stats_cycles() - start_cycles);
+
+        frame->cnt = 0;
+    }
+}
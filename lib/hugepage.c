@@ -0,0 +1,160 @@
+#include "hugepage.h"
+#include "lib.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define CACHE_LINE_SIZE 64
+
+
+struct hugepage_region {
+    const char *name;
+    void *addr;
+    size_t size;
+    enum hugepage_backing backing;
+};
+
+static struct hugepage_region regions[HUGEPAGE_MAX_REGIONS];
+static int regions_cnt;
+
+// Huge page the small allocations are currently carved from.
+static char *shared_chunk;
+static size_t shared_used;
+static enum hugepage_backing shared_backing;
+
+
+static const char *backing_names[] = {
+    [HUGEPAGE_HUGETLB] = "hugetlb",
+    [HUGEPAGE_THP] = "thp",
+    [HUGEPAGE_NONE] = "4k",
+};
+
+
+/**
+ * Maps size bytes (a multiple of HUGEPAGE_SIZE), aligned to a huge page.
+ */
+static void *map_huge(size_t size, enum hugepage_backing *backing) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+        *backing = HUGEPAGE_HUGETLB;
+        return addr;
+    }
+
+    // No reserved huge pages. Map more, to keep an aligned part only,
+    // since the kernel can only use huge pages for aligned ranges.
+    char *raw = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    DIE(raw == MAP_FAILED, "mmap");
+
+    char *aligned = (char *) (((uintptr_t) raw + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + size < raw + size + HUGEPAGE_SIZE) {
+        munmap(aligned + size, raw + size + HUGEPAGE_SIZE - (aligned + size));
+    }
+
+    *backing = madvise(aligned, size, MADV_HUGEPAGE) == 0 ? HUGEPAGE_THP : HUGEPAGE_NONE;
+    return aligned;
+}
+
+
+void *hugepage_alloc(const char *region, size_t size) {
+    size = (size + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+
+    void *addr;
+    enum hugepage_backing backing;
+
+    if (size >= HUGEPAGE_SHARED_MAX) {
+        addr = map_huge((size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1), &backing);
+    } else {
+        if (!shared_chunk || shared_used + size > HUGEPAGE_SIZE) {
+            shared_chunk = map_huge(HUGEPAGE_SIZE, &shared_backing);
+            shared_used = 0;
+        }
+
+        addr = shared_chunk + shared_used;
+        backing = shared_backing;
+        shared_used += size;
+    }
+
+    if (regions_cnt < HUGEPAGE_MAX_REGIONS) {
+        regions[regions_cnt++] = (struct hugepage_region) {region, addr, size, backing};
+    }
+
+    // Anonymous mappings are already zeroed.
+    return addr;
+}
+
+
+size_t hugepage_prefault() {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t bytes = 0;
+
+    for (int i = 0; i < regions_cnt; i++) {
+        volatile char *start = regions[i].addr;
+
+        // A write fault, so that a private page really gets allocated.
+        for (size_t offset = 0; offset < regions[i].size; offset += page_size) {
+            start[offset] = start[offset];
+        }
+
+        bytes += regions[i].size;
+    }
+
+    return bytes;
+}
+
+
+/**
+ * Reads, from /proc/self/smaps, the kB of transparent huge pages of the
+ * mapping that contains addr.
+ */
+static long thp_kb(void *addr) {
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (!smaps) {
+        return -1;
+    }
+
+    char line[256];
+    int inside = 0;
+    long kb = -1;
+
+    while (fgets(line, sizeof(line), smaps)) {
+        uintptr_t start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (inside) {
+                break;
+            }
+            inside = (uintptr_t) addr >= start && (uintptr_t) addr < end;
+        } else if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+
+    fclose(smaps);
+    return kb;
+}
+
+
+void hugepage_report() {
+    char report[1024];
+    int len = snprintf(report, sizeof(report), "Huge pages:");
+
+    for (int i = 0; i < regions_cnt && len < (int) sizeof(report); i++) {
+        struct hugepage_region *region = &regions[i];
+
+        len += snprintf(report + len, sizeof(report) - len, "%s %s %.1f MB %s",
+                        i ? "," : "", region->name, region->size / 1048576.0,
+                        backing_names[region->backing]);
+
+        if (region->backing == HUGEPAGE_THP && len < (int) sizeof(report)) {
+            // The whole mapping, which may hold several regions.
+            len += snprintf(report + len, sizeof(report) - len, " (%ld kB in use)",
+                            thp_kb(region->addr));
+        }
+    }
+
+    fprintf(stderr, "%s\n", report);
+}
@@ -1,74 +1,87 @@
 #include "icmp.h"
+#include "interfaces.h"
+#include "stats.h"
+#include "trace.h"
+#include "egress.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 
-void create_icmp_reply(struct iphdr *ip_hdr, size_t packet_len, list arp_cache,
+void create_icmp_reply(packet_buf_t *pkt, int interface,
                        arp_packet_queue *packet_queue, route_table_t *route_table) {
-    struct icmphdr *icmp_hdr = (struct icmphdr*) (((char*) ip_hdr) + sizeof(struct iphdr));
+    struct ether_header *eth_hdr = (struct ether_header*) pkt->data;
+    struct iphdr *ip_hdr = (struct iphdr*) (pkt->data + sizeof(struct ether_header));
+    struct icmphdr *icmp_hdr = (struct icmphdr*) (((char*) ip_hdr) + ip_hdr->ihl * 4);
+
+    // The request becomes the reply: swapping the IPs does not change the
+    // checksum, while the new TTL and type are accounted for incrementally.
+    uint32_t requester_ip = ip_hdr->saddr;
+    ip_hdr->saddr = ip_hdr->daddr;
+    ip_hdr->daddr = requester_ip;
+
+    uint16_t old_ttl_word = (ip_hdr->ttl << 8) | ip_hdr->protocol;
+    ip_hdr->ttl = 64; // Default value
+    uint16_t new_ttl_word = (ip_hdr->ttl << 8) | ip_hdr->protocol;
+    ip_hdr->check = checksum_adjust(ip_hdr->check, old_ttl_word, new_ttl_word);
+
+    uint16_t old_type_word = (icmp_hdr->type << 8) | icmp_hdr->code;
+    icmp_hdr->type = ICMP_ECHO_REPLY_TYPE;
+    icmp_hdr->code = 0;
+    uint16_t new_type_word = (icmp_hdr->type << 8) | icmp_hdr->code;
+    icmp_hdr->checksum = checksum_adjust(icmp_hdr->checksum, old_type_word, new_type_word);
+
+    STAT_INC(STAT_ICMP_ECHO_REPLIES);
+
+    if (!(eth_hdr->ether_shost[0] & 1)) {
+        // The request came from a (unicast) neighbor, which knows the way
+        // back to the requester, so answer it directly, without LPM or ARP.
+        mac_copy(eth_hdr->ether_dhost, eth_hdr->ether_shost);
+        mac_copy(eth_hdr->ether_shost, router_interfaces[interface].mac);
+        egress_send(pkt, interface);
+        trace_egress(pkt, interface, NULL);
+        return;
+    }
 
-    // Create the answer packet.
-    char *ans_packet = malloc(packet_len);
-    DIE(!ans_packet, "ICMP reply malloc failed.\n");
-
-    struct ether_header *ans_eth_hdr = (struct ether_header*) ans_packet;
-    ans_eth_hdr->ether_type = htons(ETHER_TYPE_IPV4);
-
-    // Complete IPv4 header.
-    struct iphdr *ans_ip_hdr = (struct iphdr*) (ans_packet + sizeof(struct ether_header));
-    ans_ip_hdr->ihl = 5;
-    ans_ip_hdr->version = 4;
-    ans_ip_hdr->tos = 0;
-    ans_ip_hdr->tot_len = ip_hdr->tot_len;
-    ans_ip_hdr->id = ip_hdr->id;
-    ans_ip_hdr->frag_off = ip_hdr->frag_off;
-    ans_ip_hdr->ttl = 64; // Default value
-    ans_ip_hdr->protocol = IPV4_ICMP;
-    ans_ip_hdr->check = 0; // Initial value
-    ans_ip_hdr->saddr = ip_hdr->daddr;
-    ans_ip_hdr->daddr = ip_hdr->saddr;
-
-    // Complete ICMP header.
-    struct icmphdr *ans_icmp_hdr = (struct icmphdr*) (ans_packet + sizeof(struct ether_header)
-                                                      + sizeof(struct iphdr));
-    ans_icmp_hdr->type = ICMP_ECHO_REPLY_TYPE;
-    ans_icmp_hdr->code = 0;
-    ans_icmp_hdr->checksum = 0; // Initial value
-    ans_icmp_hdr->un.echo.id = icmp_hdr->un.echo.id;
-    ans_icmp_hdr->un.echo.sequence = icmp_hdr->un.echo.sequence;
-
-    // Copy the data from the original packet.
-    char *data = (char*) (((char*) icmp_hdr) + sizeof(struct icmphdr));
-    size_t data_len = packet_len - (sizeof(struct ether_header) + sizeof(struct iphdr)
-                                    + sizeof(struct icmphdr));
+    struct route_table_entry *best_route = get_best_route(route_table,
+                                            ntohl(ip_hdr->daddr));
+    if (!best_route) {
+        return;
+    }
 
-    char *ans_data = (char*) (((char*) ans_icmp_hdr) + sizeof(struct icmphdr));
-    memcpy(ans_data, data, data_len);
+    send_packet_safely(pkt, packet_queue, best_route,
+                       get_route_adjacency(route_table, best_route));
+}
 
-    // Compute the checksums.
-    ans_ip_hdr->check = htons(checksum((uint16_t *) ans_ip_hdr, sizeof(struct iphdr)));
-    ans_icmp_hdr->checksum = htons(checksum((uint16_t *) ans_icmp_hdr,
-                                            sizeof(struct icmphdr) + data_len));
 
-    struct route_table_entry *best_route = get_best_route(route_table,
-                                            ntohl(ans_ip_hdr->daddr));
-    DIE(!best_route, "There should be a valid route.\n");
+struct route_table_entry *icmp_error_route(struct iphdr *ip_hdr,
+                                           icmp_rate_limiter_t *limiter,
+                                           route_table_t *route_table) {
+    if (!icmp_error_allowed(limiter, ip_hdr->saddr)) {
+        STAT_INC(STAT_ICMP_ERRORS_SUPPRESSED);
+        return NULL;
+    }
 
-    send_packet_safely(ans_packet, packet_len, arp_cache, packet_queue, best_route);
-    free(ans_packet);
+    // Best route is needed to deduce the source IP. The VRF of the
+    // packet may have none back to its source.
+    return get_best_route(route_table, ntohl(ip_hdr->saddr));
 }
 
 
-void create_icmp_error(struct iphdr *ip_hdr, uint8_t error_type, list arp_cache,
-                       arp_packet_queue *packet_queue, route_table_t *route_table) {
+void send_icmp_error(struct iphdr *ip_hdr, uint8_t error_type, uint8_t code, uint32_t rest,
+                     struct route_table_entry *best_route, adjacency_t *adj,
+                     arp_packet_queue *packet_queue) {
     // Total size of the packet, consisting of the headers and first
     // 64 bits (i.e. 8 bytes) of data from the original packet.
     size_t err_packet_len = sizeof(struct ether_header) + sizeof(struct iphdr)
                             + sizeof(struct icmphdr) + sizeof(struct iphdr) + 8;
 
     // Create the error packet.
-    char *err_packet = malloc(err_packet_len);
-    DIE(!err_packet, "ICMP error malloc failed.\n");
+    packet_buf_t *err_pkt = packet_alloc(packet_queue->pool);
+    if (!err_pkt) {
+        return;
+    }
+    err_pkt->len = err_packet_len;
+    char *err_packet = err_pkt->data;
 
     struct ether_header *err_eth_hdr = (struct ether_header*) err_packet;
     err_eth_hdr->ether_type = htons(ETHER_TYPE_IPV4);
@@ -85,21 +98,15 @@ void create_icmp_error(struct iphdr *ip_hdr, uint8_t error_type, list arp_cache,
     err_ip_hdr->protocol = IPV4_ICMP;
     err_ip_hdr->check = 0; // Initial value
     err_ip_hdr->daddr = ip_hdr->saddr;
-
-    // Best route is needed to deduce the source IP.
-    struct route_table_entry *best_route = get_best_route(route_table,
-                                    ntohl(err_ip_hdr->daddr));
-    DIE(!best_route, "There should be a valid route.\n");
-
-    uint32_t source_ip = inet_addr((get_interface_ip(best_route->interface)));
-    err_ip_hdr->saddr = source_ip;
+    err_ip_hdr->saddr = router_interfaces[adj->interface].ip;
 
     // Complete ICMP header.
     struct icmphdr *err_icmp_hdr = (struct icmphdr*) (err_packet + sizeof(struct ether_header)
                                                       + sizeof(struct iphdr));
     err_icmp_hdr->type = error_type;
-    err_icmp_hdr->code = 0;
+    err_icmp_hdr->code = code;
     err_icmp_hdr->checksum = 0; // Initial value
+    err_icmp_hdr->un.gateway = rest;
 
     // Copy the IPv4 header and 8 bytes of data after it from the original packet.
     char *ip_hdr_copy = (char*)(((char*) err_icmp_hdr) + sizeof(struct icmphdr));
@@ -110,6 +117,8 @@ void create_icmp_error(struct iphdr *ip_hdr, uint8_t error_type, list arp_cache,
     err_icmp_hdr->checksum = htons(checksum((uint16_t *) err_icmp_hdr,
                                    sizeof(struct icmphdr) + sizeof(struct iphdr) + 8));
 
-    send_packet_safely(err_packet, err_packet_len, arp_cache, packet_queue, best_route);
-    free(err_packet);
+    STAT_INC(STAT_ICMP_ERRORS_SENT);
+    send_packet_safely(err_pkt, packet_queue, best_route, adj);
+    packet_put(err_pkt);
 }
+
@@ -0,0 +1,157 @@
+#include "icmp6.h"
+#include "interfaces.h"
+#include "stats.h"
+#include "trace.h"
+#include "egress.h"
+#include "utils.h"
+#include <string.h>
+#include <netinet/in.h>
+
+
+void create_icmp6_reply(packet_buf_t *pkt, int interface) {
+    struct ether_header *eth_hdr = (struct ether_header*) pkt->data;
+    struct ipv6hdr *ip6_hdr = (struct ipv6hdr*) (pkt->data + sizeof(struct ether_header));
+    struct icmp6hdr *icmp6_hdr = (struct icmp6hdr*) (ip6_hdr + 1);
+
+    // Swapping the addresses does not change the pseudo-header sum,
+    // only the type is accounted for incrementally.
+    uint8_t requester_ip[16];
+    memcpy(requester_ip, ip6_hdr->saddr, 16);
+    memcpy(ip6_hdr->saddr, ip6_hdr->daddr, 16);
+    memcpy(ip6_hdr->daddr, requester_ip, 16);
+    ip6_hdr->hop_limit = 64; // Default value
+
+    uint16_t old_type_word = (icmp6_hdr->type << 8) | icmp6_hdr->code;
+    icmp6_hdr->type = ICMPV6_ECHO_REPLY_TYPE;
+    icmp6_hdr->code = 0;
+    uint16_t new_type_word = (icmp6_hdr->type << 8) | icmp6_hdr->code;
+    icmp6_hdr->checksum = checksum_adjust(icmp6_hdr->checksum, old_type_word, new_type_word);
+
+    STAT_INC(STAT_ICMP_ECHO_REPLIES);
+
+    mac_copy(eth_hdr->ether_dhost, eth_hdr->ether_shost);
+    mac_copy(eth_hdr->ether_shost, router_interfaces[interface].mac);
+    egress_send(pkt, interface);
+    trace_egress(pkt, interface, NULL);
+}
+
+
+/**
+ * @return 1 if an error may be sent about the packet (RFC 4443, 2.4 e).
+ */
+static int error_permitted(struct ipv6hdr *ip6_hdr, const uint8_t *dst_mac) {
+    if (ipv6_is_multicast(ip6_hdr->daddr) || (dst_mac[0] & 1)
+        || ipv6_is_multicast(ip6_hdr->saddr) || ipv6_is_unspecified(ip6_hdr->saddr)) {
+        return 0;
+    }
+
+    if (ip6_hdr->nexthdr == IPV6_ICMPV6) {
+        struct icmp6hdr *icmp6_hdr = (struct icmp6hdr*) (ip6_hdr + 1);
+
+        // No errors about errors, nor about ND messages.
+        if (icmp6_hdr->type < ICMPV6_ECHO_REQ_TYPE
+            || icmp6_hdr->type >= ICMPV6_NEIGH_SOLICIT_TYPE) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ * Builds and sends the ICMPv6 error.
+ * @param param The first word of the body (e.g. the MTU), in network order
+ */
+static void send_icmp6_error(packet_buf_t *pkt, int interface, uint8_t type, uint8_t code,
+                             uint32_t param, icmp_rate_limiter_t *limiter,
+                             route6_table_t *route6_table, nd_table_t *nd) {
+    struct ether_header *eth_hdr = (struct ether_header*) pkt->data;
+    struct ipv6hdr *ip6_hdr = (struct ipv6hdr*) (pkt->data + sizeof(struct ether_header));
+
+    if (!error_permitted(ip6_hdr, eth_hdr->ether_dhost)) {
+        return;
+    }
+
+    if (!icmp6_error_allowed(limiter, ip6_hdr->saddr)) {
+        STAT_INC(STAT_ICMP_ERRORS_SUPPRESSED);
+        return;
+    }
+
+    // Link-local sources are only reachable on the link the packet came
+    // from, the others through their route.
+    int send_interface = interface;
+    nd_neighbor_t *neigh = NULL;
+    if (!ipv6_is_link_local(ip6_hdr->saddr)) {
+        struct route6_table_entry *route = get_best_route6(route6_table, ip6_hdr->saddr);
+        if (!route) {
+            return;
+        }
+        send_interface = route->interface;
+        neigh = route6_table->neighbors[route - route6_table->entries];
+    }
+    if (!neigh) {
+        neigh = nd_neighbor_get(nd, ip6_hdr->saddr, send_interface);
+        if (!neigh) {
+            return;
+        }
+    }
+
+    // As much of the packet as fits in the minimum MTU.
+    size_t copy_len = sizeof(struct ipv6hdr) + ntohs(ip6_hdr->payload_len);
+    size_t max_copy_len = IPV6_MIN_MTU - sizeof(struct ipv6hdr) - sizeof(struct icmp6hdr);
+    if (copy_len > max_copy_len) {
+        copy_len = max_copy_len;
+    }
+
+    packet_buf_t *err_pkt = packet_alloc(nd->pool);
+    if (!err_pkt) {
+        return;
+    }
+    err_pkt->len = sizeof(struct ether_header) + sizeof(struct ipv6hdr)
+                   + sizeof(struct icmp6hdr) + copy_len;
+
+    struct ether_header *err_eth_hdr = (struct ether_header*) err_pkt->data;
+    err_eth_hdr->ether_type = htons(ETHER_TYPE_IPV6);
+
+    // Global source address, unless answering a link-local one.
+    interface_info_t *send_if = &router_interfaces[send_interface];
+    int src_idx = send_if->ip6_cnt > 1 && !ipv6_is_link_local(ip6_hdr->saddr);
+
+    struct ipv6hdr *err_ip6_hdr = (struct ipv6hdr*) (err_eth_hdr + 1);
+    err_ip6_hdr->ver_tc_flow = htonl(6 << 28);
+    err_ip6_hdr->payload_len = htons(sizeof(struct icmp6hdr) + copy_len);
+    err_ip6_hdr->nexthdr = IPV6_ICMPV6;
+    err_ip6_hdr->hop_limit = 64; // Default value
+    memcpy(err_ip6_hdr->saddr, send_if->ip6[src_idx], 16);
+    memcpy(err_ip6_hdr->daddr, ip6_hdr->saddr, 16);
+
+    struct icmp6hdr *err_icmp6_hdr = (struct icmp6hdr*) (err_ip6_hdr + 1);
+    err_icmp6_hdr->type = type;
+    err_icmp6_hdr->code = code;
+    err_icmp6_hdr->checksum = 0; // Initial value
+    err_icmp6_hdr->un.reserved = param;
+
+    memcpy(err_icmp6_hdr + 1, ip6_hdr, copy_len);
+    err_icmp6_hdr->checksum = ipv6_checksum(err_ip6_hdr, err_icmp6_hdr,
+                                            sizeof(struct icmp6hdr) + copy_len);
+
+    STAT_INC(STAT_ICMP_ERRORS_SENT);
+    nd_send_packet(nd, neigh, err_pkt);
+    packet_put(err_pkt);
+}
+
+
+void create_icmp6_error(packet_buf_t *pkt, int interface, uint8_t type, uint8_t code,
+                        icmp_rate_limiter_t *limiter, route6_table_t *route6_table,
+                        nd_table_t *nd) {
+    send_icmp6_error(pkt, interface, type, code, 0, limiter, route6_table, nd);
+}
+
+
+void create_icmp6_packet_too_big(packet_buf_t *pkt, int interface, int mtu,
+                                 icmp_rate_limiter_t *limiter, route6_table_t *route6_table,
+                                 nd_table_t *nd) {
+    send_icmp6_error(pkt, interface, ICMPV6_PACKET_TOO_BIG_TYPE, 0, htonl(mtu), limiter,
+                     route6_table, nd);
+}
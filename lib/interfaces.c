@@ -0,0 +1,94 @@
+#include "interfaces.h"
+#include "protocols.h"
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+interface_info_t router_interfaces[ROUTER_NUM_INTERFACES];
+int router_interfaces_cnt;
+
+
+/**
+ * Reads the IPv6 addresses of the interface, with the link-local one first.
+ * Without any (IPv6 disabled in the kernel), the router still needs one for
+ * Neighbor Discovery, so the EUI-64 link-local address is made up.
+ */
+static void init_interface_ip6(int interface, interface_info_t *info) {
+    uint8_t addrs[INTERFACE_MAX_IP6][16];
+    int cnt = get_interface_ip6(interface, addrs, INTERFACE_MAX_IP6);
+
+    info->ip6_cnt = 1;
+    memset(info->ip6[0], 0, 16);
+
+    for (int i = 0; i < cnt; i++) {
+        if (addrs[i][0] == 0xfe && (addrs[i][1] & 0xc0) == 0x80) {
+            memcpy(info->ip6[0], addrs[i], 16);
+        } else if (info->ip6_cnt < INTERFACE_MAX_IP6) {
+            memcpy(info->ip6[info->ip6_cnt++], addrs[i], 16);
+        }
+    }
+
+    if (info->ip6[0][0] == 0) {
+        uint8_t *ll = info->ip6[0];
+        ll[0] = 0xfe;
+        ll[1] = 0x80;
+        ll[8] = info->mac[0] ^ 0x02;
+        ll[9] = info->mac[1];
+        ll[10] = info->mac[2];
+        ll[11] = 0xff;
+        ll[12] = 0xfe;
+        ll[13] = info->mac[3];
+        ll[14] = info->mac[4];
+        ll[15] = info->mac[5];
+    }
+}
+
+
+void init_interfaces_info(int cnt) {
+    DIE(cnt > ROUTER_NUM_INTERFACES, "Too many interfaces.\n");
+
+    for (int i = 0; i < cnt; i++) {
+        get_interface_mac(i, router_interfaces[i].mac);
+        router_interfaces[i].ip = inet_addr(get_interface_ip(i));
+        init_interface_ip6(i, &router_interfaces[i]);
+
+        int mtu = get_interface_mtu(i);
+        if (mtu > INTERFACE_MAX_MTU) {
+            fprintf(stderr, "Interface %d: MTU %d, using %d\n", i, mtu, INTERFACE_MAX_MTU);
+            mtu = INTERFACE_MAX_MTU;
+        }
+        DIE(mtu < IPV4_MIN_MTU, "Interface MTU too small.\n");
+        router_interfaces[i].mtu = mtu;
+    }
+
+    router_interfaces_cnt = cnt;
+    update_max_frame_len();
+}
+
+
+int is_interface_ip6(int interface, const uint8_t *addr) {
+    interface_info_t *info = &router_interfaces[interface];
+
+    for (int i = 0; i < info->ip6_cnt; i++) {
+        if (memcmp(info->ip6[i], addr, 16) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void update_max_frame_len() {
+    size_t len = MAX_PACKET_LEN;
+
+    for (int i = 0; i < router_interfaces_cnt; i++) {
+        size_t frame_len = sizeof(struct ether_header) + router_interfaces[i].mtu;
+        if (frame_len > len) {
+            len = frame_len;
+        }
+    }
+
+    max_frame_len = len;
+}
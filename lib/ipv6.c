@@ -0,0 +1,137 @@
+#include "ipv6.h"
+#include "hugepage.h"
+#include "interfaces.h"
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/**
+ * Parses a mask, either as an address ("ffff:ffff::") or as a length.
+ * @return The prefix length, or -1 if the mask is not valid.
+ */
+static int parse_mask6(const char *text) {
+    if (!strchr(text, ':')) {
+        char *end;
+        long len = strtol(text, &end, 10);
+        return *end || len < 0 || len > 128 ? -1 : len;
+    }
+
+    uint8_t mask[16];
+    if (inet_pton(AF_INET6, text, mask) != 1) {
+        return -1;
+    }
+
+    int len = 0;
+    while (len < 128 && (mask[len / 8] & (0x80 >> (len % 8)))) {
+        len++;
+    }
+
+    // The ones must be contiguous.
+    for (int bit = len; bit < 128; bit++) {
+        if (mask[bit / 8] & (0x80 >> (bit % 8))) {
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+
+route6_table_t *init_route6_table(const char *path, nd_table_t *nd) {
+    FILE *f = fopen(path, "r");
+    DIE(f == NULL, "Failed to open %s", path);
+
+    struct route6_table_entry *entries = NULL;
+    int size = 0, capacity = 0;
+
+    char line[256], prefix[64], next_hop[64], mask[64];
+    int interface, line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        if (sscanf(line, "%63s %63s %63s %d", prefix, next_hop, mask, &interface) != 4) {
+            continue;
+        }
+        if (interface < 0 || interface >= router_interfaces_cnt) {
+            // Like the IPv4 neighbors, routes through interfaces that are
+            // not set up are left out.
+            fprintf(stderr, "%s:%d: interface %d is not set up, route ignored\n",
+                    path, line_no, interface);
+            continue;
+        }
+
+        if (size == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            entries = realloc(entries, capacity * sizeof(struct route6_table_entry));
+            DIE(!entries, "IPv6 route table malloc failed.\n");
+        }
+
+        struct route6_table_entry *entry = &entries[size++];
+        entry->len = parse_mask6(mask);
+        entry->interface = interface;
+        DIE(inet_pton(AF_INET6, prefix, entry->prefix) != 1
+            || inet_pton(AF_INET6, next_hop, entry->next_hop) != 1
+            || entry->len < 0,
+            "%s:%d: invalid IPv6 route", path, line_no);
+    }
+    fclose(f);
+
+    route6_table_t *route6_table = malloc(sizeof(route6_table_t));
+    DIE(!route6_table, "IPv6 route table malloc failed.\n");
+
+    route6_table->size = size;
+    route6_table->entries = hugepage_alloc("routes6", size * sizeof(struct route6_table_entry));
+    route6_table->neighbors = hugepage_alloc("route6 neighbors", size * sizeof(nd_neighbor_t *));
+
+    struct lpm6_prefix *prefixes = malloc((size + 1) * sizeof(struct lpm6_prefix));
+    DIE(!prefixes, "IPv6 prefixes malloc failed.\n");
+
+    for (int i = 0; i < size; i++) {
+        route6_table->entries[i] = entries[i];
+
+        if (!ipv6_is_unspecified(entries[i].next_hop)) {
+            route6_table->neighbors[i] = nd_neighbor_get(nd, entries[i].next_hop,
+                                                         entries[i].interface);
+            DIE(!route6_table->neighbors[i], "Too many IPv6 next hops.\n");
+        }
+
+        memcpy(prefixes[i].addr, entries[i].prefix, 16);
+        prefixes[i].len = entries[i].len;
+        prefixes[i].value = i;
+    }
+
+    route6_table->lpm = lpm6_build(prefixes, size);
+
+    free(prefixes);
+    free(entries);
+
+    return route6_table;
+}
+
+
+uint16_t ipv6_checksum(const struct ipv6hdr *ip6_hdr, const void *data, size_t len) {
+    uint64_t sum = 0;
+
+    // Pseudo-header: addresses, length and next header.
+    const uint16_t *words = (const uint16_t *) ip6_hdr->saddr;
+    for (int i = 0; i < 16; i++) {
+        sum += ntohs(words[i]);
+    }
+    sum += len >> 16;
+    sum += len & 0xffff;
+    sum += ip6_hdr->nexthdr;
+
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (bytes[i] << 8) | bytes[i + 1];
+    }
+    if (len & 1) {
+        sum += bytes[len - 1] << 8;
+    }
+
+    while (sum >> 16) {
+        sum = (sum >> 16) + (sum & 0xffff);
+    }
+
+    return htons((uint16_t) ~sum);
+}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "lib.h"
+#include "stats.h"
 
 #include <sys/ioctl.h>
 #include <net/if.h>
@@ -16,9 +18,27 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
 
 
 int interfaces[ROUTER_NUM_INTERFACES];
+size_t max_frame_len = MAX_PACKET_LEN;
+
+#define MAX_EVENT_FDS 8
+
+/* Non-packet file descriptors, watched along with the interfaces */
+struct event_fd {
+	int fd;
+	void (*handler)(int fd, void *arg);
+	void *arg;
+};
+
+static struct event_fd event_fds[MAX_EVENT_FDS];
+static int event_fds_cnt;
+
+int hex2byte(const char *hex);
 
 int get_sock(const char *if_name)
 {
@@ -38,6 +58,10 @@ int get_sock(const char *if_name)
 
 	res = bind(s, (struct sockaddr *)&addr , sizeof(addr));
 	DIE(res == -1, "bind");
+
+	/* A full link must not block the loop, the egress queues wait instead */
+	res = fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	DIE(res == -1, "fcntl O_NONBLOCK");
 	return s;
 }
 
@@ -49,14 +73,19 @@ int send_to_link(int intidx, char *frame_data, size_t length)
 	 */
 	int ret;
 	ret = write(interfaces[intidx], frame_data, length);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+		return -1;
 	DIE(ret == -1, "write");
+
+	STAT_INC(STAT_TX_PACKETS);
+	stats_add(STAT_TX_BYTES, length);
 	return ret;
 }
 
 ssize_t receive_from_link(int intidx, char *frame_data)
 {
 	ssize_t ret;
-	ret = read(interfaces[intidx], frame_data, MAX_PACKET_LEN);
+	ret = read(interfaces[intidx], frame_data, max_frame_len);
 	return ret;
 }
 
@@ -66,7 +95,7 @@ int socket_receive_message(int sockfd, char *frame_data, size_t *len)
 	 * Note that "buffer" should be at least the MTU size of the
 	 * interface, eg 1500 bytes
 	 * */
-	int ret = read(sockfd, frame_data, MAX_PACKET_LEN);
+	int ret = read(sockfd, frame_data, max_frame_len);
 	DIE(ret < 0, "read");
 	*len = ret;
 	return 0;
@@ -99,6 +128,136 @@ int recv_from_any_link(char *frame_data, size_t *length) {
 	return -1;
 }
 
+int recv_from_any_link_timeout(char *frame_data, size_t *length, int timeout_ms) {
+	int res;
+	fd_set set;
+	struct timeval tv;
+	int max_fd = interfaces[ROUTER_NUM_INTERFACES - 1];
+
+	FD_ZERO(&set);
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		FD_SET(interfaces[i], &set);
+	}
+	for (int i = 0; i < event_fds_cnt; i++) {
+		FD_SET(event_fds[i].fd, &set);
+		if (event_fds[i].fd > max_fd)
+			max_fd = event_fds[i].fd;
+	}
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	res = select(max_fd + 1, &set, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+	if (res == -1 && errno == EINTR)
+		return -1;
+	DIE(res == -1, "select");
+
+	for (int i = 0; i < event_fds_cnt; i++) {
+		if (FD_ISSET(event_fds[i].fd, &set)) {
+			event_fds[i].handler(event_fds[i].fd, event_fds[i].arg);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		if (FD_ISSET(interfaces[i], &set)) {
+			ssize_t ret = receive_from_link(i, frame_data);
+			DIE(ret < 0, "receive_from_link");
+			*length = ret;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Reads up to cnt waiting frames of an interface, without blocking */
+static int recv_waiting_frames(int intidx, char **frames, size_t *lengths,
+			       int *ifs, int cnt)
+{
+	struct mmsghdr msgs[cnt];
+	struct iovec iovs[cnt];
+
+	for (int i = 0; i < cnt; i++) {
+		iovs[i].iov_base = frames[i];
+		iovs[i].iov_len = max_frame_len;
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int ret = recvmmsg(interfaces[intidx], msgs, cnt, MSG_DONTWAIT, NULL);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	DIE(ret == -1, "recvmmsg");
+
+	for (int i = 0; i < ret; i++) {
+		lengths[i] = msgs[i].msg_len;
+		ifs[i] = intidx;
+	}
+	return ret;
+}
+
+int recv_burst_timeout(char **frames, size_t *lengths, int *ifs, int max_cnt,
+		       int timeout_ms)
+{
+	int interface = recv_from_any_link_timeout(frames[0], &lengths[0], timeout_ms);
+	if (interface < 0)
+		return 0;
+	ifs[0] = interface;
+
+	/*
+	 * First a fair share of the vector for each interface, so that a busy
+	 * one cannot starve the others, then whatever is left.
+	 */
+	int cnt = 1;
+	int quota = (max_cnt - 1) / ROUTER_NUM_INTERFACES;
+	for (int pass = 0; pass < 2 && cnt < max_cnt; pass++) {
+		for (int i = 0; i < ROUTER_NUM_INTERFACES && cnt < max_cnt; i++) {
+			int intidx = (interface + i) % ROUTER_NUM_INTERFACES;
+			int want = max_cnt - cnt;
+			if (pass == 0 && want > quota)
+				want = quota;
+			if (!want)
+				continue;
+			cnt += recv_waiting_frames(intidx, frames + cnt, lengths + cnt,
+						   ifs + cnt, want);
+		}
+	}
+
+	return cnt;
+}
+
+void register_event_fd(int fd, void (*handler)(int fd, void *arg), void *arg)
+{
+	DIE(event_fds_cnt == MAX_EVENT_FDS, "Too many event file descriptors.\n");
+
+	event_fds[event_fds_cnt].fd = fd;
+	event_fds[event_fds_cnt].handler = handler;
+	event_fds[event_fds_cnt].arg = arg;
+	event_fds_cnt++;
+}
+
+int get_interface_index(int interface)
+{
+	struct sockaddr_ll addr;
+	socklen_t len = sizeof(addr);
+	int ret = getsockname(interfaces[interface], (struct sockaddr *)&addr, &len);
+	DIE(ret == -1, "getsockname");
+	return addr.sll_ifindex;
+}
+
+int set_interface_filter(int interface, struct sock_filter *insns, int cnt)
+{
+	struct sock_fprog prog = {
+		.len = cnt,
+		.filter = insns,
+	};
+
+	return setsockopt(interfaces[interface], SOL_SOCKET, SO_ATTACH_FILTER,
+			  &prog, sizeof(prog));
+}
+
 char *get_interface_ip(int interface)
 {
 	struct ifreq ifr;
@@ -113,6 +272,35 @@ char *get_interface_ip(int interface)
 	return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
 }
 
+int get_interface_ip6(int interface, uint8_t addrs[][16], int max_cnt)
+{
+	char if_name[IFNAMSIZ], name[IFNAMSIZ + 1], hex[33];
+	unsigned int ifindex, plen, scope, flags;
+	int cnt = 0;
+
+	if (interface == 0)
+		sprintf(if_name, "rr-0-1");
+	else
+		sprintf(if_name, "r-%u", interface - 1);
+
+	/* The kernel has no ioctl for these, so they are read from procfs */
+	FILE *f = fopen("/proc/net/if_inet6", "r");
+	if (f == NULL)
+		return 0;
+
+	while (cnt < max_cnt && fscanf(f, "%32s %x %x %x %x %16s", hex, &ifindex,
+				       &plen, &scope, &flags, name) == 6) {
+		if (strcmp(name, if_name) != 0)
+			continue;
+		for (int i = 0; i < 16; i++)
+			addrs[cnt][i] = hex2byte(hex + 2 * i);
+		cnt++;
+	}
+
+	fclose(f);
+	return cnt;
+}
+
 void get_interface_mac(int interface, uint8_t *mac)
 {
 	struct ifreq ifr;
@@ -127,6 +315,19 @@ void get_interface_mac(int interface, uint8_t *mac)
 	memcpy(mac, ifr.ifr_addr.sa_data, 6);
 }
 
+int get_interface_mtu(int interface)
+{
+	struct ifreq ifr;
+	int ret;
+	if (interface == 0)
+		sprintf(ifr.ifr_name, "rr-0-1");
+	else
+		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	ret = ioctl(interfaces[interface], SIOCGIFMTU, &ifr);
+	DIE(ret == -1, "ioctl SIOCGIFMTU");
+	return ifr.ifr_mtu;
+}
+
 static int hex2num(char c)
 {
 	if (c >= '0' && c <= '9')
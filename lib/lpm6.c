@@ -0,0 +1,209 @@
+#include "lpm6.h"
+#include "hugepage.h"
+#include "lib.h"
+#include <string.h>
+
+
+// For a value of the next 4 bits, the internal bits of the prefixes of
+// 0..3 bits that match it.
+static uint16_t internal_match[1 << LPM6_STRIDE];
+
+
+struct lpm6_builder {
+    lpm6_node_t *nodes;
+    uint32_t *results;
+    int nodes_cnt, nodes_cap;
+    int results_cnt, results_cap;
+};
+
+
+static inline unsigned int get_nibble(const uint8_t *addr, int depth) {
+    uint8_t byte = addr[depth / 8];
+    return depth % 8 ? byte & 0xf : byte >> 4;
+}
+
+
+static inline int internal_pos(int len, unsigned int nibble) {
+    return (1 << len) - 1 + (nibble >> (LPM6_STRIDE - len));
+}
+
+
+static void init_internal_match() {
+    for (unsigned int nibble = 0; nibble < (1 << LPM6_STRIDE); nibble++) {
+        internal_match[nibble] = 0;
+        for (int len = 0; len < LPM6_STRIDE; len++) {
+            internal_match[nibble] |= 1 << internal_pos(len, nibble);
+        }
+    }
+}
+
+
+static int compare_prefixes(const void *a, const void *b) {
+    const struct lpm6_prefix *prefix_a = a;
+    const struct lpm6_prefix *prefix_b = b;
+
+    // A prefix comes before the longer ones that start with it, and the
+    // equal ones keep the order of their values, so the last one wins.
+    int res = memcmp(prefix_a->addr, prefix_b->addr, 16);
+    if (res) {
+        return res;
+    }
+    if (prefix_a->len != prefix_b->len) {
+        return prefix_a->len - prefix_b->len;
+    }
+    return (prefix_a->value > prefix_b->value) - (prefix_a->value < prefix_b->value);
+}
+
+
+static void clear_host_bits(uint8_t *addr, int len) {
+    for (int i = 0; i < 16; i++) {
+        int bits = len - i * 8;
+        if (bits <= 0) {
+            addr[i] = 0;
+        } else if (bits < 8) {
+            addr[i] &= 0xff << (8 - bits);
+        }
+    }
+}
+
+
+static int reserve_nodes(struct lpm6_builder *builder, int cnt) {
+    if (builder->nodes_cnt + cnt > builder->nodes_cap) {
+        builder->nodes_cap = 2 * builder->nodes_cap + cnt;
+        builder->nodes = realloc(builder->nodes, builder->nodes_cap * sizeof(lpm6_node_t));
+        DIE(!builder->nodes, "LPM6 nodes malloc failed.\n");
+    }
+
+    int first = builder->nodes_cnt;
+    memset(&builder->nodes[first], 0, cnt * sizeof(lpm6_node_t));
+    builder->nodes_cnt += cnt;
+
+    return first;
+}
+
+
+static int reserve_results(struct lpm6_builder *builder, int cnt) {
+    if (builder->results_cnt + cnt > builder->results_cap) {
+        builder->results_cap = 2 * builder->results_cap + cnt;
+        builder->results = realloc(builder->results, builder->results_cap * sizeof(uint32_t));
+        DIE(!builder->results, "LPM6 results malloc failed.\n");
+    }
+
+    int first = builder->results_cnt;
+    builder->results_cnt += cnt;
+
+    return first;
+}
+
+
+/**
+ * Fills a node from the sorted prefixes that go through it (they all share
+ * its first depth bits), then its children. The prefixes of a child are
+ * contiguous, as the ones ending in this node sort before them.
+ */
+static void build_node(struct lpm6_builder *builder, int node_idx,
+                       const struct lpm6_prefix *prefixes, int cnt, int depth) {
+    uint32_t values[1 << LPM6_STRIDE];
+    int child_start[1 << LPM6_STRIDE], child_cnt[1 << LPM6_STRIDE] = {0};
+    uint16_t internal = 0, external = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        int len = prefixes[i].len - depth;
+
+        if (len < LPM6_STRIDE) {
+            unsigned int nibble = len ? get_nibble(prefixes[i].addr, depth) : 0;
+            int pos = internal_pos(len, nibble);
+            internal |= 1 << pos;
+            values[pos] = prefixes[i].value;
+            continue;
+        }
+
+        unsigned int nibble = get_nibble(prefixes[i].addr, depth);
+        if (!child_cnt[nibble]) {
+            child_start[nibble] = i;
+            external |= 1 << nibble;
+        }
+        DIE(child_start[nibble] + child_cnt[nibble] != i, "LPM6 prefixes not sorted.\n");
+        child_cnt[nibble]++;
+    }
+
+    int results = reserve_results(builder, __builtin_popcount(internal));
+    for (int pos = 0, k = results; pos < (1 << LPM6_STRIDE); pos++) {
+        if (internal & (1 << pos)) {
+            builder->results[k++] = values[pos];
+        }
+    }
+
+    // The nodes may move when reserving, so the indexes are kept.
+    int children = reserve_nodes(builder, __builtin_popcount(external));
+    lpm6_node_t *node = &builder->nodes[node_idx];
+    node->internal = internal;
+    node->external = external;
+    node->children = children;
+    node->results = results;
+
+    for (unsigned int nibble = 0, k = children; nibble < (1 << LPM6_STRIDE); nibble++) {
+        if (child_cnt[nibble]) {
+            build_node(builder, k++, prefixes + child_start[nibble], child_cnt[nibble],
+                       depth + LPM6_STRIDE);
+        }
+    }
+}
+
+
+lpm6_t *lpm6_build(struct lpm6_prefix *prefixes, int cnt) {
+    if (!internal_match[0]) {
+        init_internal_match();
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        DIE(prefixes[i].len < 0 || prefixes[i].len > 128, "Invalid IPv6 prefix length.\n");
+        clear_host_bits(prefixes[i].addr, prefixes[i].len);
+    }
+    qsort(prefixes, cnt, sizeof(struct lpm6_prefix), compare_prefixes);
+
+    struct lpm6_builder builder = {0};
+    reserve_nodes(&builder, 1);
+    build_node(&builder, 0, prefixes, cnt, 0);
+
+    // Copy the arrays, now that their size is known, to huge pages.
+    lpm6_t *lpm = malloc(sizeof(lpm6_t));
+    DIE(!lpm, "LPM6 malloc failed.\n");
+
+    lpm->nodes_cnt = builder.nodes_cnt;
+    lpm->results_cnt = builder.results_cnt;
+    lpm->nodes = hugepage_alloc("trie6", builder.nodes_cnt * sizeof(lpm6_node_t));
+    lpm->results = hugepage_alloc("trie6 results", (builder.results_cnt + 1) * sizeof(uint32_t));
+    memcpy(lpm->nodes, builder.nodes, builder.nodes_cnt * sizeof(lpm6_node_t));
+    memcpy(lpm->results, builder.results, builder.results_cnt * sizeof(uint32_t));
+
+    free(builder.nodes);
+    free(builder.results);
+
+    return lpm;
+}
+
+
+int64_t lpm6_lookup(const lpm6_t *lpm, const uint8_t *addr) {
+    const lpm6_node_t *node = lpm->nodes;
+    int64_t best = -1;
+
+    for (int depth = 0; ; depth += LPM6_STRIDE) {
+        unsigned int nibble = depth < 128 ? get_nibble(addr, depth) : 0;
+
+        // The longest of the matching prefixes has the highest position.
+        uint16_t match = node->internal & internal_match[nibble];
+        if (match) {
+            int pos = 31 - __builtin_clz(match);
+            best = lpm->results[node->results
+                                + __builtin_popcount(node->internal & ((1u << pos) - 1))];
+        }
+
+        if (depth == 128 || !(node->external & (1 << nibble))) {
+            return best;
+        }
+
+        node = &lpm->nodes[node->children
+                           + __builtin_popcount(node->external & ((1u << nibble) - 1))];
+    }
+}
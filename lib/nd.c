@@ -0,0 +1,401 @@
+#include "nd.h"
+#include "ipv6.h"
+#include "interfaces.h"
+#include "hugepage.h"
+#include "stats.h"
+#include "trace.h"
+#include "egress.h"
+#include "utils.h"
+#include <string.h>
+#include <netinet/in.h>
+
+
+nd_table_t *init_nd_table(packet_pool_t *pool) {
+    nd_table_t *nd = hugepage_alloc("ND table", sizeof(nd_table_t));
+    nd->entries = hugepage_alloc("ND neighbors", ND_MAX_NEIGHBORS * sizeof(nd_neighbor_t));
+    nd->pool = pool;
+
+    return nd;
+}
+
+
+static inline uint32_t nd_bucket(const uint8_t *addr, int interface) {
+    // The interface identifier is the part that differs between neighbors.
+    uint32_t low;
+    memcpy(&low, addr + 12, sizeof(low));
+
+    return ((low ^ interface) * 2654435761u) >> (32 - ND_BUCKETS_BITS);
+}
+
+
+static nd_neighbor_t *nd_neighbor_find(nd_table_t *nd, const uint8_t *addr, int interface) {
+    nd_neighbor_t *neigh = nd->buckets[nd_bucket(addr, interface)];
+
+    while (neigh != NULL) {
+        if (neigh->interface == interface && memcmp(neigh->addr, addr, 16) == 0) {
+            return neigh;
+        }
+
+        neigh = neigh->bucket_next;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Sends a Neighbor Solicitation or Advertisement from the link-local
+ * address of the interface, with a link-layer address option.
+ * @param dst_mac Destination MAC
+ * @param dst_ip Destination IP
+ * @param type ICMPV6_NEIGH_SOLICIT_TYPE or ICMPV6_NEIGH_ADVERT_TYPE
+ * @param flags Flags of an advertisement, 0 for a solicitation
+ * @param target Address the message is about
+ */
+static void send_nd_message(int interface, const uint8_t *dst_mac, const uint8_t *dst_ip,
+                            uint8_t type, uint8_t flags, const uint8_t *target) {
+    interface_info_t *send_if = &router_interfaces[interface];
+    char packet[ND_PACKET_LEN];
+
+    struct ether_header *eth_hdr = (struct ether_header*) packet;
+    mac_copy(eth_hdr->ether_dhost, dst_mac);
+    mac_copy(eth_hdr->ether_shost, send_if->mac);
+    eth_hdr->ether_type = htons(ETHER_TYPE_IPV6);
+
+    struct ipv6hdr *ip6_hdr = (struct ipv6hdr*) (packet + sizeof(struct ether_header));
+    ip6_hdr->ver_tc_flow = htonl(6 << 28);
+    ip6_hdr->payload_len = htons(sizeof(struct nd_msg));
+    ip6_hdr->nexthdr = IPV6_ICMPV6;
+    ip6_hdr->hop_limit = 255; // Proves to the receiver that it is on-link
+    memcpy(ip6_hdr->saddr, send_if->ip6[0], 16);
+    memcpy(ip6_hdr->daddr, dst_ip, 16);
+
+    struct nd_msg *msg = (struct nd_msg*) (ip6_hdr + 1);
+    memset(msg, 0, sizeof(struct nd_msg));
+    msg->icmp.type = type;
+    msg->icmp.un.flags = flags;
+    memcpy(msg->target, target, 16);
+    msg->opt_type = type == ICMPV6_NEIGH_SOLICIT_TYPE ? ND_OPT_SOURCE_MAC : ND_OPT_TARGET_MAC;
+    msg->opt_len = 1;
+    mac_copy(msg->opt_mac, send_if->mac);
+    msg->icmp.checksum = ipv6_checksum(ip6_hdr, msg, sizeof(struct nd_msg));
+
+    egress_send_frame(interface, packet, ND_PACKET_LEN);
+}
+
+
+/**
+ * Asks for the MAC of the neighbor: on its solicited-node multicast
+ * address while unresolved, straight to it to check that it is still
+ * there otherwise.
+ */
+static void send_solicitation(nd_neighbor_t *neigh) {
+    uint8_t dst_ip[16] = {0xff, 0x02, [11] = 0x01, [12] = 0xff};
+    uint8_t dst_mac[6] = {0x33, 0x33, 0xff};
+
+    if (neigh->resolved) {
+        memcpy(dst_ip, neigh->addr, 16);
+        mac_copy(dst_mac, neigh->rewrite);
+    } else {
+        memcpy(dst_ip + 13, neigh->addr + 13, 3);
+        memcpy(dst_mac + 3, neigh->addr + 13, 3);
+    }
+
+    send_nd_message(neigh->interface, dst_mac, dst_ip, ICMPV6_NEIGH_SOLICIT_TYPE, 0,
+                    neigh->addr);
+    STAT_INC(STAT_ND_SOLICITS_SENT);
+}
+
+
+static packet_buf_t *dequeue_neighbor_packet(nd_table_t *nd, nd_neighbor_t *neigh) {
+    packet_buf_t *pkt = neigh->head;
+
+    neigh->head = pkt->next;
+    if (!neigh->head) {
+        neigh->tail = NULL;
+    }
+    pkt->next = NULL;
+
+    neigh->cnt--;
+    nd->pending--;
+
+    return pkt;
+}
+
+
+/**
+ * Gives up on a neighbor that does not answer: its packets are dropped.
+ */
+static void fail_neighbor(nd_table_t *nd, nd_neighbor_t *neigh) {
+    stats_add(STAT_DROP_ND_TIMEOUT, neigh->cnt);
+
+    while (neigh->head) {
+        packet_buf_t *pkt = dequeue_neighbor_packet(nd, neigh);
+        trace_drop(pkt, STAT_DROP_ND_TIMEOUT);
+        packet_put(pkt);
+    }
+
+    neigh->probes = 0;
+}
+
+
+/**
+ * Sets the timer of the neighbor to its next retransmission, refresh or
+ * expiry. An idle unresolved neighbor needs none.
+ */
+static void schedule_neighbor(nd_neighbor_t *neigh) {
+    if (!neigh->resolved) {
+        if (neigh->probes) {
+            timer_start(&neigh->timer, neigh->next_probe_ms);
+        } else {
+            timer_stop(&neigh->timer);
+        }
+        return;
+    }
+
+    uint64_t refresh_ms = neigh->confirmed_ms + NEIGH_REFRESH_MS;
+    if (refresh_ms < neigh->next_probe_ms) {
+        refresh_ms = neigh->next_probe_ms;
+    }
+
+    uint64_t expiry_ms = neigh->confirmed_ms + NEIGH_LIFETIME_MS;
+    timer_start(&neigh->timer, refresh_ms < expiry_ms ? refresh_ms : expiry_ms);
+}
+
+
+/**
+ * Retransmits the solicitation of an unresolved neighbor, or gives up on it
+ * after ND_MAX_SOLICIT of them, and probes (unicast) or forgets a resolved
+ * one that is about to expire or did. The advertisements only move the
+ * times, so the timer may find nothing to do yet.
+ */
+static void neighbor_timer_expired(void *arg, uint64_t now) {
+    nd_neighbor_t *neigh = arg;
+
+    if (!neigh->resolved) {
+        if (neigh->probes && now >= neigh->next_probe_ms) {
+            if (neigh->probes >= ND_MAX_SOLICIT) {
+                fail_neighbor(neigh->table, neigh);
+            } else {
+                send_solicitation(neigh);
+                neigh->probes++;
+                neigh->next_probe_ms = now + ND_RETRANS_MS;
+            }
+        }
+    } else if (now - neigh->confirmed_ms >= NEIGH_LIFETIME_MS) {
+        // Not heard of for too long, resolved again by the next packet.
+        neigh->resolved = 0;
+        neigh->probes = 0;
+    } else if (now - neigh->confirmed_ms >= NEIGH_REFRESH_MS
+               && now >= neigh->next_probe_ms) {
+        send_solicitation(neigh);
+        neigh->next_probe_ms = now + ND_RETRANS_MS;
+    }
+
+    schedule_neighbor(neigh);
+}
+
+
+nd_neighbor_t *nd_neighbor_get(nd_table_t *nd, const uint8_t *addr, int interface) {
+    nd_neighbor_t *neigh = nd_neighbor_find(nd, addr, interface);
+    if (neigh) {
+        return neigh;
+    }
+
+    if (nd->size == ND_MAX_NEIGHBORS) {
+        return NULL;
+    }
+
+    neigh = &nd->entries[nd->size++];
+    memcpy(neigh->addr, addr, 16);
+    neigh->interface = interface;
+    neigh->table = nd;
+    timer_init(&neigh->timer, neighbor_timer_expired, neigh);
+
+    uint32_t bucket = nd_bucket(addr, interface);
+    neigh->bucket_next = nd->buckets[bucket];
+    nd->buckets[bucket] = neigh;
+
+    return neigh;
+}
+
+
+/**
+ * Stores the MAC of the neighbor and sends the packets waiting for it.
+ */
+static void resolve_neighbor(nd_table_t *nd, nd_neighbor_t *neigh, const uint8_t *mac) {
+    struct ether_header *eth_hdr = (struct ether_header*) neigh->rewrite;
+    mac_copy(eth_hdr->ether_dhost, mac);
+    mac_copy(eth_hdr->ether_shost, router_interfaces[neigh->interface].mac);
+    eth_hdr->ether_type = htons(ETHER_TYPE_IPV6);
+
+    neigh->resolved = 1;
+    neigh->confirmed_ms = get_time_ms();
+    neigh->probes = 0;
+    schedule_neighbor(neigh);
+
+    while (neigh->head) {
+        packet_buf_t *pkt = dequeue_neighbor_packet(nd, neigh);
+
+        memcpy(pkt->data, neigh->rewrite, ADJ_REWRITE_LEN);
+        egress_send(pkt, neigh->interface);
+        trace_egress(pkt, neigh->interface, NULL);
+
+        packet_put(pkt);
+    }
+}
+
+
+int nd_send_packet(nd_table_t *nd, nd_neighbor_t *neigh, packet_buf_t *pkt) {
+    if (neigh->resolved) {
+        memcpy(pkt->data, neigh->rewrite, ADJ_REWRITE_LEN);
+        egress_send(pkt, neigh->interface);
+        trace_egress(pkt, neigh->interface, NULL);
+        return 1;
+    }
+
+    if (neigh->cnt >= ND_MAX_PENDING_PACKETS || nd->pending >= ND_MAX_PENDING_TOTAL) {
+        STAT_INC(STAT_DROP_ND_QUEUE_FULL);
+        trace_drop(pkt, STAT_DROP_ND_QUEUE_FULL);
+        return 0;
+    }
+
+    // The queue keeps its own reference, the packet is not copied.
+    packet_get(pkt);
+    pkt->next = NULL;
+    if (neigh->tail) {
+        neigh->tail->next = pkt;
+    } else {
+        neigh->head = pkt;
+    }
+    neigh->tail = pkt;
+
+    neigh->cnt++;
+    nd->pending++;
+    STAT_INC(STAT_ND_PACKETS_QUEUED);
+
+    if (!neigh->probes) {
+        // First packet towards this neighbor, so ask for its MAC.
+        send_solicitation(neigh);
+        neigh->probes = 1;
+        neigh->next_probe_ms = get_time_ms() + ND_RETRANS_MS;
+        schedule_neighbor(neigh);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Searches the options of a ND message for a link-layer address.
+ * @return The MAC, NULL if there is none, or the address of
+ * malformed_mac if an option is malformed.
+ */
+static const uint8_t *find_mac_option(const uint8_t *options, size_t len, uint8_t type,
+                                      const uint8_t *malformed_mac) {
+    const uint8_t *mac = NULL;
+
+    while (len >= 2) {
+        size_t opt_len = options[1] * 8;
+        if (opt_len == 0 || opt_len > len) {
+            return malformed_mac;
+        }
+
+        if (options[0] == type && opt_len >= 8) {
+            mac = options + 2;
+        }
+
+        options += opt_len;
+        len -= opt_len;
+    }
+
+    return mac;
+}
+
+
+void nd_set_interface_mac(nd_table_t *nd, int interface, const uint8_t *mac) {
+    for (int i = 0; i < nd->size; i++) {
+        nd_neighbor_t *neigh = &nd->entries[i];
+        if (neigh->interface == interface) {
+            mac_copy(((struct ether_header*) neigh->rewrite)->ether_shost, mac);
+        }
+    }
+}
+
+
+void nd_receive(nd_table_t *nd, packet_buf_t *pkt, int interface) {
+    static const uint8_t malformed;
+
+    struct ether_header *eth_hdr = (struct ether_header*) pkt->data;
+    struct ipv6hdr *ip6_hdr = (struct ipv6hdr*) (pkt->data + sizeof(struct ether_header));
+    struct nd_msg *msg = (struct nd_msg*) (ip6_hdr + 1);
+    size_t len = ntohs(ip6_hdr->payload_len);
+
+    // The caller checked that the payload is all there.
+    size_t min_len = sizeof(struct icmp6hdr) + sizeof(msg->target);
+    if (len < min_len || ip6_hdr->hop_limit != 255 || msg->icmp.code != 0
+        || ip6_hdr->nexthdr != IPV6_ICMPV6 || ipv6_is_multicast(msg->target)) {
+        STAT_INC(STAT_DROP_MALFORMED);
+        trace_drop(pkt, STAT_DROP_MALFORMED);
+        return;
+    }
+
+    if (ipv6_checksum(ip6_hdr, msg, len) != 0) {
+        STAT_INC(STAT_DROP_BAD_CHECKSUM);
+        trace_drop(pkt, STAT_DROP_BAD_CHECKSUM);
+        return;
+    }
+
+    uint8_t opt_type = msg->icmp.type == ICMPV6_NEIGH_SOLICIT_TYPE
+                       ? ND_OPT_SOURCE_MAC : ND_OPT_TARGET_MAC;
+    const uint8_t *mac = find_mac_option((uint8_t *) msg + min_len, len - min_len,
+                                         opt_type, &malformed);
+    if (mac == &malformed) {
+        STAT_INC(STAT_DROP_MALFORMED);
+        trace_drop(pkt, STAT_DROP_MALFORMED);
+        return;
+    }
+
+    if (msg->icmp.type == ICMPV6_NEIGH_SOLICIT_TYPE) {
+        if (ipv6_is_unspecified(ip6_hdr->saddr)) {
+            // Duplicate Address Detection of another node, not answered.
+            return;
+        }
+
+        // The solicitation proves that its sender is there.
+        nd_neighbor_t *sender = nd_neighbor_find(nd, ip6_hdr->saddr, interface);
+        if (sender && mac) {
+            resolve_neighbor(nd, sender, mac);
+        }
+
+        if (is_interface_ip6(interface, msg->target)) {
+            send_nd_message(interface, mac ? mac : eth_hdr->ether_shost, ip6_hdr->saddr,
+                            ICMPV6_NEIGH_ADVERT_TYPE,
+                            ND_ADVERT_ROUTER | ND_ADVERT_SOLICITED | ND_ADVERT_OVERRIDE,
+                            msg->target);
+            STAT_INC(STAT_ND_ADVERTS_SENT);
+        }
+        return;
+    }
+
+    STAT_INC(STAT_ND_ADVERTS_RECEIVED);
+
+    nd_neighbor_t *neigh = nd_neighbor_find(nd, msg->target, interface);
+    if (!neigh) {
+        // Not a neighbor the router needs.
+        return;
+    }
+
+    // Without the override flag, a known MAC is not replaced (RFC 4861, 7.2.5).
+    if (neigh->resolved && (!mac || !(msg->icmp.un.flags & ND_ADVERT_OVERRIDE))) {
+        if (msg->icmp.un.flags & ND_ADVERT_SOLICITED) {
+            neigh->confirmed_ms = get_time_ms();
+            neigh->probes = 0;
+        }
+        return;
+    }
+
+    if (mac) {
+        resolve_neighbor(nd, neigh, mac);
+    }
+}
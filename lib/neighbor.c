@@ -0,0 +1,198 @@
+#include "neighbor.h"
+#include "interfaces.h"
+#include "arp.h"
+#include "stats.h"
+#include "egress.h"
+#include <string.h>
+
+
+/**
+ * Sends an ARP request for the next hop of the adjacency. If its MAC is
+ * known, the first request goes only to it, to confirm it is still there.
+ * If that is not answered, the MAC might have changed, so the next
+ * ones are broadcast.
+ */
+static void probe_adjacency(adjacency_t *adj) {
+    interface_info_t *send_if = &router_interfaces[adj->interface];
+
+    if (!adj->resolved || adj->probes > 0) {
+        send_arp_request(send_if->mac, send_if->ip, adj->next_hop, adj->interface);
+        return;
+    }
+
+    struct ether_header *eth_hdr = (struct ether_header*) adj->rewrite;
+
+    char request_packet[ARP_PACKET_LEN];
+    create_arp_packet(request_packet, send_if->mac, eth_hdr->ether_dhost,
+                      send_if->ip, adj->next_hop, ARP_OP_REQUEST);
+    egress_send_frame(adj->interface, request_packet, ARP_PACKET_LEN);
+    STAT_INC(STAT_ARP_REQUESTS_SENT);
+}
+
+
+/**
+ * Gives a turn to a request of the pacer's kind: in the current tick if it
+ * has room left, else in the first later one that has.
+ * @return Start of the tick of the turn, not after now if it is this one.
+ */
+static uint64_t take_turn(struct neighbor_pacer *pacer, int per_tick, uint64_t now) {
+    if (pacer->window_ms + NEIGH_TICK_MS <= now) {
+        pacer->window_ms = now;
+        pacer->used = 0;
+    }
+
+    if (pacer->used == per_tick) {
+        pacer->window_ms += NEIGH_TICK_MS;
+        pacer->used = 0;
+    }
+
+    pacer->used++;
+    return pacer->window_ms;
+}
+
+
+/**
+ * Sets the timer of the adjacency to its next probe, or to its expiry if
+ * it comes first.
+ */
+static void schedule_adjacency(adjacency_t *adj) {
+    uint64_t expires_ms = adj->next_probe_ms;
+    if (adj->resolved && adj->confirmed_ms + NEIGH_LIFETIME_MS < expires_ms) {
+        expires_ms = adj->confirmed_ms + NEIGH_LIFETIME_MS;
+    }
+
+    timer_start(&adj->timer, expires_ms);
+}
+
+
+/**
+ * Sets the timer of the adjacency to its expiry, when the next hops are
+ * only asked for on demand. An unresolved adjacency needs none.
+ */
+static void schedule_expiry(adjacency_t *adj) {
+    if (adj->resolved) {
+        timer_start(&adj->timer, adj->confirmed_ms + NEIGH_LIFETIME_MS);
+    }
+}
+
+
+/**
+ * Forgets the adjacency if it expired, and asks for its MAC once its
+ * turn has come. The ARP replies only move the times, so the timer may
+ * find nothing to do yet.
+ */
+static void adjacency_timer_expired(void *arg, uint64_t now) {
+    adjacency_t *adj = arg;
+    neighbor_resolver_t *resolver = adj->resolver;
+
+    if (adj->is_static) {
+        // Configured since, never asked for nor expired.
+        return;
+    }
+
+    if (adj->resolved && now - adj->confirmed_ms >= NEIGH_LIFETIME_MS) {
+        // Not confirmed in time, the next packets will wait for ARP.
+        __atomic_store_n(&adj->resolved, 0, __ATOMIC_RELAXED);
+    }
+
+    if (!resolver->preresolve) {
+        schedule_expiry(adj);
+        return;
+    }
+
+    if (now < adj->next_probe_ms) {
+        adj->paced = 0;
+        schedule_adjacency(adj);
+        return;
+    }
+
+    if (!adj->paced) {
+        // The resolved next hops carry traffic, so they are never starved
+        // by the (possibly many) dead ones.
+        uint64_t turn_ms = adj->resolved
+                           ? take_turn(&resolver->refreshes, NEIGH_REFRESHES_PER_TICK, now)
+                           : take_turn(&resolver->discoveries, NEIGH_REQUESTS_PER_TICK, now);
+        if (turn_ms > now) {
+            adj->next_probe_ms = turn_ms;
+            adj->paced = 1;
+            schedule_adjacency(adj);
+            return;
+        }
+    }
+    adj->paced = 0;
+
+    probe_adjacency(adj);
+
+    adj->probes++;
+    if (adj->probes >= NEIGH_MAX_PROBES) {
+        adj->probes = 0;
+        adj->next_probe_ms = now + NEIGH_FAILED_RETRY_MS;
+    } else {
+        adj->next_probe_ms = now + NEIGH_PROBE_INTERVAL_MS;
+    }
+
+    schedule_adjacency(adj);
+}
+
+
+neighbor_resolver_t *init_neighbor_resolver(adjacency_table_t *adj_table, int preresolve) {
+    neighbor_resolver_t *resolver = malloc(sizeof(neighbor_resolver_t));
+    DIE(!resolver, "Neighbor resolver malloc failed.\n");
+
+    resolver->adj_table = adj_table;
+    resolver->preresolve = preresolve;
+    memset(&resolver->discoveries, 0, sizeof(resolver->discoveries));
+    memset(&resolver->refreshes, 0, sizeof(resolver->refreshes));
+
+    for (int i = 0; i < adj_table->size; i++) {
+        neighbor_resolver_add(resolver, &adj_table->entries[i]);
+    }
+
+    return resolver;
+}
+
+
+void neighbor_resolver_add(neighbor_resolver_t *resolver, adjacency_t *adj) {
+    if (adj->interface >= router_interfaces_cnt || adj->is_static || adj->resolver) {
+        // The route table might mention interfaces that are not set up,
+        // and the static MACs need no resolving.
+        return;
+    }
+
+    adj->resolver = resolver;
+    timer_init(&adj->timer, adjacency_timer_expired, adj);
+    if (resolver->preresolve) {
+        schedule_adjacency(adj);
+    } else {
+        schedule_expiry(adj);
+    }
+}
+
+
+int load_neighbor_file(adjacency_table_t *adj_table, char *path, int is_static) {
+    // parse_arp_table() needs the table allocated beforehand.
+    FILE *f = fopen(path, "r");
+    DIE(f == NULL, "Failed to open %s", path);
+
+    int lines_cnt = 0;
+    for (int c = fgetc(f); c != EOF; c = fgetc(f)) {
+        if (c == '\n') {
+            lines_cnt++;
+        }
+    }
+    fclose(f);
+
+    struct arp_table_entry *arp_table = malloc((lines_cnt + 1) * sizeof(struct arp_table_entry));
+    DIE(!arp_table, "Neighbor file malloc failed.\n");
+
+    int entries_cnt = parse_arp_table(path, arp_table);
+
+    int resolved = 0;
+    for (int i = 0; i < entries_cnt; i++) {
+        resolved += adjacency_load(adj_table, arp_table[i].ip, arp_table[i].mac,
+                                   is_static);
+    }
+
+    free(arp_table);
+    return resolved;
+}
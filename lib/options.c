@@ -0,0 +1,189 @@
+#include "options.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+enum {
+    OPT_NO_ARP_PRERESOLVE = 256,
+    OPT_NO_PREFILTER,
+    OPT_ARP_TABLE,
+    OPT_ARP_SNAPSHOT,
+    OPT_TRACE_SAMPLE,
+    OPT_RTABLE6,
+    OPT_ACL,
+    OPT_EGRESS_RATE,
+    OPT_VRF,
+    OPT_NETLINK_TABLE,
+    OPT_SLOW_PATH,
+    OPT_ARP_DROP_POLICY,
+    OPT_CPU,
+    OPT_HELPER_CPUS,
+    OPT_SCHED_FIFO,
+    OPT_MLOCK,
+    OPT_PREFAULT,
+    OPT_NUMA_NODE,
+};
+
+
+static const struct option long_options[] = {
+    {"no-arp-preresolve", no_argument, NULL, OPT_NO_ARP_PRERESOLVE},
+    {"no-prefilter", no_argument, NULL, OPT_NO_PREFILTER},
+    {"arp-table", required_argument, NULL, OPT_ARP_TABLE},
+    {"arp-snapshot", required_argument, NULL, OPT_ARP_SNAPSHOT},
+    {"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+    {"rtable6", required_argument, NULL, OPT_RTABLE6},
+    {"acl", required_argument, NULL, OPT_ACL},
+    {"egress-rate", required_argument, NULL, OPT_EGRESS_RATE},
+    {"vrf", required_argument, NULL, OPT_VRF},
+    {"netlink-table", required_argument, NULL, OPT_NETLINK_TABLE},
+    {"slow-path", no_argument, NULL, OPT_SLOW_PATH},
+    {"arp-drop-policy", required_argument, NULL, OPT_ARP_DROP_POLICY},
+    {"cpu", required_argument, NULL, OPT_CPU},
+    {"helper-cpus", required_argument, NULL, OPT_HELPER_CPUS},
+    {"sched-fifo", required_argument, NULL, OPT_SCHED_FIFO},
+    {"mlock", no_argument, NULL, OPT_MLOCK},
+    {"prefault", no_argument, NULL, OPT_PREFAULT},
+    {"numa-node", required_argument, NULL, OPT_NUMA_NODE},
+    {NULL, 0, NULL, 0}
+};
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] rtable iface...\n"
+                    "Options:\n"
+                    "  --no-arp-preresolve  do not resolve the next hops at startup\n"
+                    "  --no-prefilter       receive all the frames of the interfaces,\n"
+                    "                       without the kernel (BPF) filter\n"
+                    "  --arp-table FILE     static neighbors (\"IP MAC\" lines)\n"
+                    "  --arp-snapshot FILE  learned neighbors, reloaded at startup\n"
+                    "                       and saved when the router stops\n"
+                    "  --trace-sample N     trace 1 packet in N from the start\n"
+                    "                       (0, the default, traces none)\n"
+                    "  --rtable6 FILE       IPv6 route table, in the rtable format\n"
+                    "                       (IPv6 is dropped without one)\n"
+                    "  --acl FILE           permit / deny rules of the forwarded\n"
+                    "                       IPv4 packets, reloaded on SIGHUP\n"
+                    "  --egress-rate RATES  shape the interfaces to N Mbit/s: \"N\"\n"
+                    "                       for all of them, or \"IF=N,...\"\n"
+                    "  --vrf FILE:IF,...    route the packets of the interfaces with\n"
+                    "                       the table in FILE (repeatable, at most 7)\n"
+                    "  --netlink-table ID   follow the kernel routing table ID (e.g.\n"
+                    "                       254 for main), on top of rtable\n"
+                    "  --slow-path          answer ARP and ICMP from a thread of\n"
+                    "                       their own, off the forwarding loop\n"
+                    "  --arp-drop-policy P  when the packets waiting for a next hop\n"
+                    "                       fill its queue, drop the \"newest\" one\n"
+                    "                       (the default) or the \"oldest\" one\n"
+                    "  --cpu N              pin the forwarding loop to CPU N\n"
+                    "  --helper-cpus LIST   CPUs of the helper threads (e.g. 1,4-7)\n"
+                    "  --sched-fifo PRIO    run the forwarding loop as SCHED_FIFO\n"
+                    "  --mlock              lock all the memory in RAM\n"
+                    "  --prefault           touch all the dataplane memory at startup\n"
+                    "  --numa-node N        allocate the memory on NUMA node N\n",
+            prog);
+    exit(1);
+}
+
+
+void parse_router_options(int *argc, char *argv[], router_options_t *opts) {
+    opts->arp_preresolve = 1;
+    opts->prefilter = 1;
+    opts->arp_table = NULL;
+    opts->arp_snapshot = NULL;
+    opts->trace_sample = 0;
+    opts->rtable6 = NULL;
+    opts->acl = NULL;
+    opts->egress_rates = NULL;
+    opts->vrfs_cnt = 0;
+    opts->netlink_table = 0;
+    opts->slow_path = 0;
+    opts->arp_drop_oldest = 0;
+    opts->cpu = -1;
+    opts->helper_cpus = NULL;
+    opts->fifo_priority = 0;
+    opts->mlock = 0;
+    opts->prefault = 0;
+    opts->numa_node = -1;
+
+    int opt;
+    while ((opt = getopt_long(*argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_NO_ARP_PRERESOLVE:
+            opts->arp_preresolve = 0;
+            break;
+        case OPT_NO_PREFILTER:
+            opts->prefilter = 0;
+            break;
+        case OPT_ARP_TABLE:
+            opts->arp_table = optarg;
+            break;
+        case OPT_ARP_SNAPSHOT:
+            opts->arp_snapshot = optarg;
+            break;
+        case OPT_TRACE_SAMPLE:
+            opts->trace_sample = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_RTABLE6:
+            opts->rtable6 = optarg;
+            break;
+        case OPT_ACL:
+            opts->acl = optarg;
+            break;
+        case OPT_EGRESS_RATE:
+            opts->egress_rates = optarg;
+            break;
+        case OPT_VRF:
+            if (opts->vrfs_cnt == OPTIONS_MAX_VRFS) {
+                usage(argv[0]);
+            }
+            opts->vrfs[opts->vrfs_cnt++] = optarg;
+            break;
+        case OPT_NETLINK_TABLE:
+            opts->netlink_table = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_SLOW_PATH:
+            opts->slow_path = 1;
+            break;
+        case OPT_ARP_DROP_POLICY:
+            if (strcmp(optarg, "newest") != 0 && strcmp(optarg, "oldest") != 0) {
+                usage(argv[0]);
+            }
+            opts->arp_drop_oldest = strcmp(optarg, "oldest") == 0;
+            break;
+        case OPT_CPU:
+            opts->cpu = atoi(optarg);
+            break;
+        case OPT_HELPER_CPUS:
+            opts->helper_cpus = optarg;
+            break;
+        case OPT_SCHED_FIFO:
+            opts->fifo_priority = atoi(optarg);
+            break;
+        case OPT_MLOCK:
+            opts->mlock = 1;
+            break;
+        case OPT_PREFAULT:
+            opts->prefault = 1;
+            break;
+        case OPT_NUMA_NODE:
+            opts->numa_node = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // getopt_long() moved the positional arguments at the end.
+    int new_argc = 1;
+    for (int i = optind; i < *argc; i++) {
+        argv[new_argc++] = argv[i];
+    }
+    argv[new_argc] = NULL;
+    *argc = new_argc;
+
+    if (*argc < 3) {
+        usage(argv[0]);
+    }
+}
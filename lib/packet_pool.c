@@ -0,0 +1,84 @@
+#include "packet_pool.h"
+#include "hugepage.h"
+#include <stdlib.h>
+
+
+__thread int packet_pool_thread;
+
+
+packet_pool_t *init_packet_pool(int size) {
+    packet_pool_t *pool = malloc(sizeof(packet_pool_t));
+    DIE(!pool, "Packet pool malloc failed.\n");
+
+    pool->buf_size = PACKET_BUF_SIZE(max_frame_len);
+    pool->descriptors = hugepage_alloc("packet descriptors", size * sizeof(packet_buf_t));
+    pool->buffers = hugepage_alloc("packet buffers", (size_t) size * pool->buf_size);
+
+    pool->free_list = NULL;
+    pool->size = size;
+    pool->free_cnt = size;
+    pool->owner = &packet_pool_thread;
+    pool->lent = 0;
+
+    uint32_t returns_size = 1;
+    while (returns_size < (uint32_t) size) {
+        returns_size <<= 1;
+    }
+    pool->returns = init_spsc_ring(returns_size);
+
+    // Build the free list backwards, so that the buffers are
+    // handed out in memory order.
+    for (int i = size - 1; i >= 0; i--) {
+        packet_buf_t *pkt = &pool->descriptors[i];
+
+        pkt->data = pool->buffers + (size_t) i * pool->buf_size;
+        pkt->len = 0;
+        pkt->refcnt = 0;
+        pkt->best_route = NULL;
+        pkt->pool = pool;
+        pkt->next = pool->free_list;
+        pool->free_list = pkt;
+    }
+
+    return pool;
+}
+
+
+void packet_pool_set_owner(packet_pool_t *pool) {
+    pool->owner = &packet_pool_thread;
+}
+
+
+void packet_pool_reclaim(packet_pool_t *pool) {
+    packet_buf_t *pkt;
+    while ((pkt = spsc_ring_pop(pool->returns)) != NULL) {
+        pool->lent--;
+        pkt->next = pool->free_list;
+        pool->free_list = pkt;
+        pool->free_cnt++;
+    }
+}
+
+
+packet_buf_t *packet_alloc(packet_pool_t *pool) {
+    packet_buf_t *pkt = pool->free_list;
+    if (!pkt) {
+        // The buffers given back by the other thread.
+        packet_pool_reclaim(pool);
+
+        pkt = pool->free_list;
+        if (!pkt) {
+            return NULL;
+        }
+    }
+
+    pool->free_list = pkt->next;
+    pool->free_cnt--;
+
+    pkt->next = NULL;
+    pkt->refcnt = 1;
+    pkt->traced = 0;
+    pkt->best_route = NULL;
+
+    return pkt;
+}
@@ -0,0 +1,211 @@
+#include "prefilter.h"
+#include "interfaces.h"
+#include "protocols.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <stddef.h>
+
+
+// Targets of the jumps of the program, resolved once it is complete.
+enum prefilter_label {
+    LABEL_NEXT = -1,
+    LABEL_CHECK_MAC,
+    LABEL_UNICAST,
+    LABEL_BROADCAST,
+    LABEL_ACCEPT,
+    LABEL_DROP,
+    LABELS_CNT
+};
+
+
+struct prefilter_program {
+    struct sock_filter insns[PREFILTER_MAX_INSNS];
+    int8_t jt_label[PREFILTER_MAX_INSNS];
+    int8_t jf_label[PREFILTER_MAX_INSNS];
+    int labels[LABELS_CNT];
+    int cnt;
+};
+
+
+static int prefilter_ipv6;
+static int prefilter_cnt;
+
+// Prebuilt headers to update when a MAC changes, set once they exist.
+static adjacency_table_t *watched_adj_table;
+static nd_table_t *watched_nd_table;
+
+
+static void emit(struct prefilter_program *prog, uint16_t code, uint32_t k) {
+    DIE(prog->cnt == PREFILTER_MAX_INSNS, "BPF program too long.\n");
+
+    prog->insns[prog->cnt] = (struct sock_filter) BPF_STMT(code, k);
+    prog->jt_label[prog->cnt] = LABEL_NEXT;
+    prog->jf_label[prog->cnt] = LABEL_NEXT;
+    prog->cnt++;
+}
+
+
+static void emit_jump(struct prefilter_program *prog, uint32_t k, int jt_label, int jf_label) {
+    emit(prog, BPF_JMP | BPF_JEQ | BPF_K, k);
+    prog->jt_label[prog->cnt - 1] = jt_label;
+    prog->jf_label[prog->cnt - 1] = jf_label;
+}
+
+
+static void place_label(struct prefilter_program *prog, int label) {
+    prog->labels[label] = prog->cnt;
+}
+
+
+/**
+ * Turns the labels of the jumps into offsets, which only go forward.
+ */
+static void resolve_labels(struct prefilter_program *prog) {
+    for (int i = 0; i < prog->cnt; i++) {
+        if (prog->jt_label[i] != LABEL_NEXT) {
+            prog->insns[i].jt = prog->labels[(int) prog->jt_label[i]] - (i + 1);
+        }
+        if (prog->jf_label[i] != LABEL_NEXT) {
+            prog->insns[i].jf = prog->labels[(int) prog->jf_label[i]] - (i + 1);
+        }
+    }
+}
+
+
+/**
+ * Generates the program of an interface: the ethertype first (the cheap
+ * test that rejects most of the foreign traffic), then the destination MAC,
+ * compared as a 32-bit and a 16-bit word.
+ */
+static void generate_program(struct prefilter_program *prog, const uint8_t *mac) {
+    memset(prog, 0, sizeof(*prog));
+
+    uint32_t mac_low = (uint32_t) mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5];
+    uint32_t mac_high = mac[0] << 8 | mac[1];
+
+    emit(prog, BPF_LD | BPF_H | BPF_ABS, offsetof(struct ether_header, ether_type));
+    emit_jump(prog, ETHER_TYPE_IPV4, LABEL_CHECK_MAC, LABEL_NEXT);
+    if (prefilter_ipv6) {
+        emit_jump(prog, ETHER_TYPE_IPV6, LABEL_CHECK_MAC, LABEL_NEXT);
+    }
+    emit_jump(prog, ETHER_TYPE_ARP, LABEL_CHECK_MAC, LABEL_DROP);
+
+    place_label(prog, LABEL_CHECK_MAC);
+    emit(prog, BPF_LD | BPF_W | BPF_ABS, 2);
+    emit_jump(prog, mac_low, LABEL_UNICAST, LABEL_NEXT);
+    emit_jump(prog, 0xffffffff, LABEL_BROADCAST, LABEL_NEXT);
+    if (prefilter_ipv6) {
+        // Multicast MACs of IPv6 (33:33:xx:xx:xx:xx), e.g. the
+        // solicited-node addresses of Neighbor Discovery.
+        emit(prog, BPF_LD | BPF_H | BPF_ABS, 0);
+        emit_jump(prog, 0x3333, LABEL_ACCEPT, LABEL_DROP);
+    } else {
+        emit(prog, BPF_RET | BPF_K, 0);
+    }
+
+    place_label(prog, LABEL_UNICAST);
+    emit(prog, BPF_LD | BPF_H | BPF_ABS, 0);
+    emit_jump(prog, mac_high, LABEL_ACCEPT, LABEL_DROP);
+
+    place_label(prog, LABEL_BROADCAST);
+    emit(prog, BPF_LD | BPF_H | BPF_ABS, 0);
+    emit_jump(prog, 0xffff, LABEL_ACCEPT, LABEL_DROP);
+
+    place_label(prog, LABEL_ACCEPT);
+    emit(prog, BPF_RET | BPF_K, max_frame_len);
+
+    place_label(prog, LABEL_DROP);
+    emit(prog, BPF_RET | BPF_K, 0);
+
+    resolve_labels(prog);
+}
+
+
+static void attach_program(int interface) {
+    struct prefilter_program prog;
+    generate_program(&prog, router_interfaces[interface].mac);
+
+    // Without a filter the router still works, only with more copies.
+    if (set_interface_filter(interface, prog.insns, prog.cnt) < 0) {
+        perror("SO_ATTACH_FILTER");
+    }
+}
+
+
+/**
+ * Reads the link notifications, and generates the program of an interface
+ * again if its MAC changed.
+ */
+static void handle_link_event(int fd, void *arg) {
+    char buf[8192];
+    ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len <= 0) {
+        return;
+    }
+
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+        if (nlh->nlmsg_type != RTM_NEWLINK) {
+            continue;
+        }
+
+        struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+        int attrs_len = IFLA_PAYLOAD(nlh);
+        for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attrs_len);
+             rta = RTA_NEXT(rta, attrs_len)) {
+            if (rta->rta_type != IFLA_ADDRESS || RTA_PAYLOAD(rta) != 6) {
+                continue;
+            }
+
+            for (int i = 0; i < prefilter_cnt; i++) {
+                uint8_t *mac = router_interfaces[i].mac;
+                if (get_interface_index(i) != ifi->ifi_index
+                    || memcmp(mac, RTA_DATA(rta), 6) == 0) {
+                    continue;
+                }
+
+                // The frames that were already built keep the old MAC,
+                // the next ones are rewritten with the new one.
+                memcpy(mac, RTA_DATA(rta), 6);
+                if (watched_adj_table) {
+                    adjacency_set_interface_mac(watched_adj_table, i, mac);
+                }
+                if (watched_nd_table) {
+                    nd_set_interface_mac(watched_nd_table, i, mac);
+                }
+                attach_program(i);
+                fprintf(stderr, "Interface %d: new MAC, filter and neighbors updated\n", i);
+            }
+        }
+    }
+}
+
+
+void init_prefilter(int cnt, int ipv6) {
+    prefilter_ipv6 = ipv6;
+    prefilter_cnt = cnt;
+
+    for (int i = 0; i < cnt; i++) {
+        attach_program(i);
+    }
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    DIE(fd < 0, "netlink socket");
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK;
+    DIE(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0, "netlink bind");
+
+    register_event_fd(fd, handle_link_event, NULL);
+}
+
+
+void prefilter_watch_neighbors(adjacency_table_t *adj_table, nd_table_t *nd_table) {
+    watched_adj_table = adj_table;
+    watched_nd_table = nd_table;
+}
@@ -0,0 +1,85 @@
+#include "ratelimit.h"
+#include "lib.h"
+#include "utils.h"
+#include <string.h>
+#include <netinet/in.h>
+
+
+int token_bucket_take(token_bucket_t *bucket, uint32_t rate, uint32_t burst,
+                      uint64_t now) {
+    // A rate of R tokens / second is R milli-tokens / millisecond.
+    uint64_t refill = (now - bucket->last_refill_ms) * rate;
+    bucket->last_refill_ms = now;
+
+    bucket->milli_tokens += refill;
+    if (bucket->milli_tokens > (uint64_t) burst * 1000) {
+        bucket->milli_tokens = (uint64_t) burst * 1000;
+    }
+
+    if (bucket->milli_tokens < 1000) {
+        return 0;
+    }
+
+    bucket->milli_tokens -= 1000;
+    return 1;
+}
+
+
+icmp_rate_limiter_t *init_icmp_rate_limiter() {
+    icmp_rate_limiter_t *limiter = calloc(1, sizeof(icmp_rate_limiter_t));
+    DIE(!limiter, "ICMP rate limiter malloc failed.\n");
+
+    uint64_t now = get_time_ms();
+
+    limiter->global.milli_tokens = (uint64_t) ICMP_ERR_GLOBAL_BURST * 1000;
+    limiter->global.last_refill_ms = now;
+
+    for (int i = 0; i < ICMP_ERR_PREFIX_BUCKETS; i++) {
+        limiter->per_prefix[i].milli_tokens = (uint64_t) ICMP_ERR_PREFIX_BURST * 1000;
+        limiter->per_prefix[i].last_refill_ms = now;
+    }
+
+    return limiter;
+}
+
+
+/**
+ * Checks the bucket of the prefix, then the global one.
+ * @param prefix_hash Hash of the source prefix, spread over 32 bits
+ */
+static int error_allowed(icmp_rate_limiter_t *limiter, uint32_t prefix_hash) {
+    uint64_t now = get_time_ms();
+    uint32_t bucket = prefix_hash >> (32 - ICMP_ERR_PREFIX_BUCKETS_BITS);
+
+    // The prefix is checked first, so that a single source
+    // cannot use up the global budget.
+    if (!token_bucket_take(&limiter->per_prefix[bucket], ICMP_ERR_PREFIX_RATE,
+                           ICMP_ERR_PREFIX_BURST, now)) {
+        limiter->suppressed_prefix++;
+        return 0;
+    }
+
+    if (!token_bucket_take(&limiter->global, ICMP_ERR_GLOBAL_RATE,
+                           ICMP_ERR_GLOBAL_BURST, now)) {
+        limiter->suppressed_global++;
+        return 0;
+    }
+
+    limiter->allowed++;
+    return 1;
+}
+
+
+int icmp_error_allowed(icmp_rate_limiter_t *limiter, uint32_t source_ip) {
+    uint32_t prefix = ntohl(source_ip) >> (32 - ICMP_ERR_PREFIX_LEN);
+
+    return error_allowed(limiter, prefix * 2654435761u);
+}
+
+
+int icmp6_error_allowed(icmp_rate_limiter_t *limiter, const uint8_t *source) {
+    uint64_t prefix;
+    memcpy(&prefix, source, ICMP6_ERR_PREFIX_LEN / 8);
+
+    return error_allowed(limiter, (prefix * 0x9e3779b97f4a7c15ull) >> 32);
+}
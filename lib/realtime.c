@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "realtime.h"
+#include "hugepage.h"
+#include "lib.h"
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+
+// Affinity of the router before the setup, for the forwarding loop
+// when it is not pinned.
+static cpu_set_t initial_cpus;
+
+// CPUs of the helper threads, empty before the setup.
+static cpu_set_t helper_cpus;
+
+
+/**
+ * Parses a CPU list such as "0,2-3".
+ * @return 0 on success, -1 on a malformed list.
+ */
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return -1;
+        }
+
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return -1;
+            }
+        }
+
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        p = end;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+
+void realtime_setup_begin(const router_options_t *opts) {
+    sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus);
+
+    if (opts->numa_node >= 0) {
+        // Preferred rather than bound: better remote memory than none.
+        unsigned long nodemask[16] = {0};
+        DIE(opts->numa_node >= (int) (sizeof(nodemask) * 8), "Invalid NUMA node.\n");
+        nodemask[opts->numa_node / 64] = 1UL << (opts->numa_node % 64);
+
+        long res = syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+                           sizeof(nodemask) * 8);
+        DIE(res < 0, "set_mempolicy");
+    }
+
+    helper_cpus = initial_cpus;
+    if (opts->helper_cpus) {
+        DIE(parse_cpu_list(opts->helper_cpus, &helper_cpus) < 0, "Invalid CPU list.\n");
+
+        int res = sched_setaffinity(0, sizeof(helper_cpus), &helper_cpus);
+        DIE(res < 0, "sched_setaffinity");
+    }
+}
+
+
+void realtime_setup_end(const router_options_t *opts) {
+    char report[256];
+    int len = snprintf(report, sizeof(report), "Realtime:");
+
+    if (opts->prefault) {
+        size_t bytes = hugepage_prefault();
+        len += snprintf(report + len, sizeof(report) - len, " %.1f MB prefaulted,",
+                        bytes / 1048576.0);
+    }
+
+    if (opts->mlock) {
+        // Also locks (and faults in) whatever is mapped later.
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+            len += snprintf(report + len, sizeof(report) - len, " memory locked,");
+        } else {
+            len += snprintf(report + len, sizeof(report) - len, " mlockall failed (%s),",
+                            strerror(errno));
+        }
+    }
+
+    if (opts->numa_node >= 0) {
+        len += snprintf(report + len, sizeof(report) - len, " NUMA node %d,",
+                        opts->numa_node);
+    }
+
+    // The helper CPUs were only for the setup, unless the loop is pinned.
+    cpu_set_t loop_cpus = initial_cpus;
+    if (opts->cpu >= 0) {
+        DIE(opts->cpu >= CPU_SETSIZE, "Invalid CPU.\n");
+        CPU_ZERO(&loop_cpus);
+        CPU_SET(opts->cpu, &loop_cpus);
+    }
+
+    int res = sched_setaffinity(0, sizeof(loop_cpus), &loop_cpus);
+    DIE(res < 0, "sched_setaffinity");
+    if (opts->cpu >= 0) {
+        len += snprintf(report + len, sizeof(report) - len, " forwarding loop on CPU %d,",
+                        opts->cpu);
+    }
+
+    if (opts->fifo_priority > 0) {
+        struct sched_param param = { .sched_priority = opts->fifo_priority };
+        res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (res == 0) {
+            len += snprintf(report + len, sizeof(report) - len, " SCHED_FIFO %d,",
+                            opts->fifo_priority);
+        } else {
+            len += snprintf(report + len, sizeof(report) - len, " SCHED_FIFO failed (%s),",
+                            strerror(res));
+        }
+    }
+
+    if (report[len - 1] == ',') {
+        report[len - 1] = '\0';
+        fprintf(stderr, "%s\n", report);
+    }
+}
+
+
+void realtime_helper_thread() {
+    // Started by the forwarding loop, whose CPU and policy it inherited.
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+    if (CPU_COUNT(&helper_cpus) > 0) {
+        sched_setaffinity(0, sizeof(helper_cpus), &helper_cpus);
+    }
+}
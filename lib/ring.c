@@ -0,0 +1,13 @@
+#include "ring.h"
+#include "hugepage.h"
+
+
+spsc_ring_t *init_spsc_ring(uint32_t size) {
+    DIE(!size || (size & (size - 1)), "The size of a ring must be a power of 2.\n");
+
+    spsc_ring_t *ring = hugepage_alloc("rings", sizeof(spsc_ring_t));
+    ring->slots = hugepage_alloc("ring slots", size * sizeof(void *));
+    ring->mask = size - 1;
+
+    return ring;
+}
@@ -0,0 +1,218 @@
+#include "route_stats.h"
+#include "trie.h"
+#include "hugepage.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+
+__thread route_counter_t *route_counters_local;
+
+static route_counter_t *thread_counters[ROUTE_STATS_MAX_THREADS];
+static int threads_cnt;
+
+// The distinct tables of the VRFs, the first one storing the routes.
+static route_table_t *tables[ROUTER_NUM_INTERFACES];
+static int tables_cnt;
+
+// Sums of the threads when each slot was given to its current route, owned
+// by the thread that changes the route table.
+static route_counter_t *forgotten;
+
+
+// A route in use, with its traffic summed over the threads.
+struct route_total {
+    int slot; // Index in the snapshot, which keeps the order of the table
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+
+static void sum_slot(int slot, route_counter_t *sum) {
+    sum->packets = 0;
+    sum->bytes = 0;
+
+    int cnt = __atomic_load_n(&threads_cnt, __ATOMIC_ACQUIRE);
+    for (int t = 0; t < cnt; t++) {
+        route_counter_t *c = &thread_counters[t][slot];
+        sum->packets += __atomic_load_n(&c->packets, __ATOMIC_RELAXED);
+        sum->bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * Marks the slots of the routes reachable from a node, the ones in use.
+ */
+static void mark_in_use(network_trie_node_t *node, uint8_t *in_use) {
+    for (; node; node = node->right) {
+        if (node->final_state == TRUE && node->entry) {
+            in_use[node->entry - tables[0]->entries] = 1;
+        }
+        mark_in_use(node->left, in_use);
+    }
+}
+
+
+static int compare_packets(const void *a, const void *b) {
+    const struct route_total *x = a, *y = b;
+    if (x->packets != y->packets) {
+        return x->packets < y->packets ? 1 : -1;
+    }
+
+    return x->slot - y->slot;
+}
+
+
+static void print_route(FILE *file, struct route_table_entry *entry) {
+    char prefix[INET_ADDRSTRLEN], next_hop[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &entry->prefix, prefix, sizeof(prefix));
+    inet_ntop(AF_INET, &entry->next_hop, next_hop, sizeof(next_hop));
+
+    fprintf(file, "%15s/%-2d via %-15s if %d", prefix, __builtin_popcount(entry->mask),
+            next_hop, entry->interface);
+}
+
+
+void route_stats_register_thread() {
+    int id = __atomic_load_n(&threads_cnt, __ATOMIC_ACQUIRE);
+    DIE(id >= ROUTE_STATS_MAX_THREADS, "Too many threads for the route statistics.\n");
+
+    thread_counters[id] = hugepage_alloc("route counters",
+                                         tables[0]->capacity * sizeof(route_counter_t));
+    __atomic_store_n(&threads_cnt, id + 1, __ATOMIC_RELEASE);
+
+    route_counters_local = thread_counters[id];
+}
+
+
+void init_route_stats(route_table_t **vrf_tables, int vrf_tables_cnt) {
+    tables_cnt = 0;
+    threads_cnt = 0;
+    for (int i = 0; i < vrf_tables_cnt; i++) {
+        int seen = 0;
+        for (int j = 0; j < tables_cnt; j++) {
+            seen |= tables[j] == vrf_tables[i];
+        }
+        if (!seen) {
+            DIE(tables_cnt == ROUTER_NUM_INTERFACES, "Too many route tables.\n");
+            tables[tables_cnt++] = vrf_tables[i];
+        }
+    }
+
+    forgotten = calloc(tables[0]->capacity, sizeof(route_counter_t));
+    DIE(!forgotten, "Route statistics malloc failed.\n");
+
+    route_stats_register_thread();
+}
+
+
+void route_stats_forget(int slot) {
+    if (forgotten) {
+        sum_slot(slot, &forgotten[slot]);
+    }
+}
+
+
+route_stats_snapshot_t *route_stats_snapshot() {
+    if (!tables_cnt) {
+        return NULL;
+    }
+
+    // The removed and shadowed routes are the ones no trie leads to.
+    route_table_t *store = tables[0];
+    uint8_t *in_use = calloc(store->size + 1, 1);
+    if (!in_use) {
+        return NULL;
+    }
+    for (int i = 0; i < tables_cnt; i++) {
+        mark_in_use(tables[i]->trie_root, in_use);
+    }
+
+    int used = 0;
+    for (int slot = 0; slot < store->size; slot++) {
+        used += in_use[slot];
+    }
+
+    route_stats_snapshot_t *snapshot = malloc(sizeof(route_stats_snapshot_t));
+    if (snapshot) {
+        snapshot->routes = malloc((used + 1) * sizeof(struct route_snapshot));
+    }
+    if (!snapshot || !snapshot->routes) {
+        free(snapshot);
+        free(in_use);
+        return NULL;
+    }
+
+    snapshot->routes_cnt = 0;
+    for (int slot = 0; slot < store->size; slot++) {
+        if (in_use[slot]) {
+            struct route_snapshot *route = &snapshot->routes[snapshot->routes_cnt++];
+            route->slot = slot;
+            route->entry = store->entries[slot];
+            route->forgotten = forgotten[slot];
+        }
+    }
+
+    free(in_use);
+    return snapshot;
+}
+
+
+void route_stats_report(FILE *file, route_stats_snapshot_t *snapshot, int top_n) {
+    int used = snapshot->routes_cnt;
+    struct route_total *totals = malloc((used + 1) * sizeof(struct route_total));
+    if (!totals) {
+        fprintf(file, "error: out of memory\n");
+        return;
+    }
+
+    int untouched = 0;
+    uint64_t packets = 0, bytes = 0;
+    for (int i = 0; i < used; i++) {
+        struct route_snapshot *route = &snapshot->routes[i];
+        route_counter_t sum;
+        sum_slot(route->slot, &sum);
+
+        struct route_total *total = &totals[i];
+        total->slot = i;
+        total->packets = sum.packets - route->forgotten.packets;
+        total->bytes = sum.bytes - route->forgotten.bytes;
+        packets += total->packets;
+        bytes += total->bytes;
+        untouched += total->packets == 0;
+    }
+
+    qsort(totals, used, sizeof(struct route_total), compare_packets);
+
+    fprintf(file, "%d routes, %d untouched, %" PRIu64 " packets, %" PRIu64 " bytes\n",
+            used, untouched, packets, bytes);
+
+    fprintf(file, "hottest:\n");
+    for (int i = 0; i < used && i < top_n && totals[i].packets; i++) {
+        fprintf(file, "%4d ", i + 1);
+        print_route(file, &snapshot->routes[totals[i].slot].entry);
+        fprintf(file, " %12" PRIu64 " packets %14" PRIu64 " bytes %6.2f%%\n",
+                totals[i].packets, totals[i].bytes,
+                100.0 * totals[i].packets / packets);
+    }
+
+    // The untouched routes are at the end, in the order of the table.
+    fprintf(file, "untouched:\n");
+    for (int i = used - untouched; i < used && i < used - untouched + top_n; i++) {
+        fprintf(file, "     ");
+        print_route(file, &snapshot->routes[totals[i].slot].entry);
+        fprintf(file, "\n");
+    }
+    if (untouched > top_n) {
+        fprintf(file, "     ... %d more\n", untouched - top_n);
+    }
+
+    free(totals);
+}
+
+
+void route_stats_free_snapshot(route_stats_snapshot_t *snapshot) {
+    free(snapshot->routes);
+    free(snapshot);
+}
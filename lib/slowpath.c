@@ -0,0 +1,160 @@
+#include "slowpath.h"
+#include "icmp.h"
+#include "egress.h"
+#include "timer.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+
+static void handle_punt(slowpath_t *slowpath, packet_buf_t *pkt) {
+    char *l3 = pkt->data + sizeof(struct ether_header);
+    uint32_t arg = pkt->punt_arg;
+
+    // The forwarding loop chose the adjacency: the route slot of
+    // best_route may have been given to another route since, so it only
+    // annotates the trace.
+    switch (pkt->punt_reason) {
+    case SLOWPATH_ARP:
+        if (ntohs(((struct arp_header*) l3)->op) == ARP_OP_REQUEST) {
+            answer_arp_request((struct arp_header*) l3, pkt->rx_interface);
+        } else {
+            // Resolved by the forwarding loop already.
+            arp_reply_drain((struct arp_header*) l3, pkt->rx_interface,
+                            slowpath->packet_queue);
+        }
+        break;
+    case SLOWPATH_ECHO:
+        // The reply goes straight back to the neighbor, without a lookup.
+        create_icmp_reply(pkt, pkt->rx_interface, slowpath->packet_queue, NULL);
+        break;
+    case SLOWPATH_ICMP_ERROR:
+        send_icmp_error((struct iphdr*) l3, arg >> 24, (arg >> 16) & 0xff,
+                        htonl(arg & 0xffff), pkt->best_route, pkt->adj,
+                        slowpath->packet_queue);
+        break;
+    case SLOWPATH_RESOLVE:
+        send_packet_safely(pkt, slowpath->packet_queue, pkt->best_route, pkt->adj);
+        break;
+    }
+}
+
+
+static void *slowpath_thread(void *arg) {
+    slowpath_t *slowpath = arg;
+
+    stats_register_thread();
+    trace_register_thread();
+    packet_pool_set_owner(slowpath->pool);
+    egress_handover_thread(slowpath->pool);
+
+    // The retransmits of the ARP requests.
+    int timer_fd = init_thread_timers();
+
+    struct pollfd fds[2] = {
+        { .fd = slowpath->wake_fd, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            DIE(errno != EINTR, "slow path poll");
+            continue;
+        }
+
+        if (fds[0].revents) {
+            uint64_t wakeups;
+            if (read(slowpath->wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+                continue;
+            }
+
+            packet_buf_t *pkt;
+            while ((pkt = spsc_ring_pop(slowpath->ring)) != NULL) {
+                packet_take_back(pkt);
+                handle_punt(slowpath, pkt);
+                packet_put(pkt);
+            }
+        }
+
+        if (fds[1].revents) {
+            timers_handle_fd(timer_fd, NULL);
+        }
+
+        egress_handover_flush();
+    }
+
+    return NULL;
+}
+
+
+slowpath_t *init_slowpath(enum arp_drop_policy drop_policy) {
+    slowpath_t *slowpath = calloc(1, sizeof(slowpath_t));
+    DIE(!slowpath, "Slow path malloc failed.\n");
+
+    slowpath->ring = init_spsc_ring(SLOWPATH_RING_SIZE);
+    slowpath->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    DIE(slowpath->wake_fd < 0, "eventfd");
+
+    slowpath->pool = init_packet_pool(SLOWPATH_POOL_SIZE);
+    slowpath->packet_queue = init_packet_queue(slowpath->pool, drop_policy);
+
+    egress_init_handover();
+
+    int ret = pthread_create(&slowpath->thread, NULL, slowpath_thread, slowpath);
+    DIE(ret != 0, "Could not start the slow path.\n");
+
+    return slowpath;
+}
+
+
+void slowpath_punt(slowpath_t *slowpath, packet_buf_t *pkt, enum slowpath_reason reason,
+                   uint32_t arg) {
+    // The buffers of the pool that the slow path holds, or will once the
+    // batch is flushed, some of them maybe given back already.
+    packet_pool_t *pool = pkt->pool;
+    if (pool->lent + slowpath->batch_cnt >= SLOWPATH_MAX_LENT) {
+        packet_pool_reclaim(pool);
+    }
+
+    if (slowpath->batch_cnt == SLOWPATH_BATCH
+        || pool->lent + slowpath->batch_cnt >= SLOWPATH_MAX_LENT) {
+        STAT_INC(STAT_DROP_PUNT_FULL);
+        trace_drop(pkt, STAT_DROP_PUNT_FULL);
+        return;
+    }
+
+    pkt->punt_reason = reason;
+    pkt->punt_arg = arg;
+    slowpath->batch[slowpath->batch_cnt++] = packet_get(pkt);
+}
+
+
+void slowpath_flush(slowpath_t *slowpath) {
+    if (!slowpath->batch_cnt) {
+        return;
+    }
+
+    for (int i = 0; i < slowpath->batch_cnt; i++) {
+        packet_buf_t *pkt = slowpath->batch[i];
+        packet_lend(pkt);
+        if (!spsc_ring_push(slowpath->ring, pkt)) {
+            // The slow path is behind: the exceptions are dropped, the
+            // forwarding goes on.
+            packet_take_back(pkt);
+            STAT_INC(STAT_DROP_PUNT_FULL);
+            trace_drop(pkt, STAT_DROP_PUNT_FULL);
+            packet_put(pkt);
+        }
+    }
+    stats_add(STAT_PUNTS, slowpath->batch_cnt);
+    slowpath->batch_cnt = 0;
+
+    uint64_t one = 1;
+    if (write(slowpath->wake_fd, &one, sizeof(one)) < 0) {
+        perror("slow path wake up");
+    }
+}
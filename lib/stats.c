@@ -0,0 +1,91 @@
+#include "stats.h"
+#include "lib.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+
+static stats_thread_t private_slot;
+__thread stats_thread_t *stats_local = &private_slot;
+
+static stats_shm_t private_shm;
+static stats_shm_t *stats_shm = &private_shm;
+static char stats_shm_name[64];
+
+
+/**
+ * Measures how many cycles of stats_cycles() make a microsecond.
+ */
+static uint64_t calibrate_cycles() {
+    struct timespec start, end, delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t start_cycles = stats_cycles();
+    nanosleep(&delay, NULL);
+    uint64_t end_cycles = stats_cycles();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t elapsed_us = (end.tv_sec - start.tv_sec) * 1000000
+                          + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    return elapsed_us ? (end_cycles - start_cycles) / elapsed_us : 1;
+}
+
+
+void init_stats() {
+    snprintf(stats_shm_name, sizeof(stats_shm_name), "%s%d", STATS_SHM_PREFIX, getpid());
+
+    int fd = shm_open(stats_shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, sizeof(stats_shm_t)) == 0) {
+            void *mem = mmap(NULL, sizeof(stats_shm_t), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+            if (mem != MAP_FAILED) {
+                stats_shm = mem;
+            }
+        }
+        close(fd);
+    }
+
+    if (stats_shm == &private_shm) {
+        fprintf(stderr, "Statistics are not published in shared memory.\n");
+        stats_shm_name[0] = '\0';
+    }
+
+    memset(stats_shm, 0, sizeof(stats_shm_t));
+    stats_shm->version = STATS_VERSION;
+    stats_shm->pid = getpid();
+    stats_shm->cycles_per_us = calibrate_cycles();
+
+    // Readers check the magic last, once the rest is valid.
+    __atomic_store_n(&stats_shm->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    stats_register_thread();
+}
+
+
+void stats_register_thread() {
+    uint32_t slot = __atomic_fetch_add(&stats_shm->threads_cnt, 1, __ATOMIC_ACQ_REL);
+    DIE(slot >= STATS_MAX_THREADS, "Too many threads for the statistics.\n");
+
+    stats_local = &stats_shm->threads[slot];
+}
+
+
+void destroy_stats() {
+    if (stats_shm_name[0]) {
+        shm_unlink(stats_shm_name);
+    }
+}
+
+
+void stats_set_node_names(const char *const *names, int cnt) {
+    DIE(cnt > STATS_MAX_NODES, "Too many nodes for the statistics.\n");
+
+    for (int i = 0; i < cnt; i++) {
+        snprintf(stats_shm->node_names[i], STATS_NODE_NAME_LEN, "%s", names[i]);
+    }
+    __atomic_store_n(&stats_shm->nodes_cnt, cnt, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,243 @@
+#include "timer.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/timerfd.h>
+
+#define TIMER_SLOTS_MASK (TIMER_SLOTS - 1)
+
+
+// Every thread has its own wheel.
+static __thread wheel_timer_t *slots[TIMER_LEVELS][TIMER_SLOTS];
+static __thread uint64_t wheel_now; // Last millisecond processed
+static __thread uint64_t pending_cnt;
+
+static __thread int timer_fd = -1;
+static __thread uint64_t armed_ms; // 0 when disarmed
+static __thread int running;      // The timerfd is armed once the callbacks are done
+
+
+static void link_timer(wheel_timer_t **head, wheel_timer_t *timer) {
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+
+static void unlink_timer(wheel_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+
+/**
+ * Links the timer in the slot of the lowest level that spans its expiry,
+ * counted from the current millisecond.
+ * @param earliest First millisecond whose slot has not been expired yet
+ */
+static void place_timer(wheel_timer_t *timer, uint64_t earliest) {
+    uint64_t expires = timer->expires_ms;
+    if (expires < earliest) {
+        expires = earliest;
+    }
+
+    uint64_t delta = expires - wheel_now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << ((level + 1) * TIMER_SLOTS_BITS)) {
+        level++;
+    }
+
+    if (delta >= 1ULL << (TIMER_LEVELS * TIMER_SLOTS_BITS)) {
+        // Beyond the wheel: placed again when its slot comes.
+        expires = wheel_now + (1ULL << (TIMER_LEVELS * TIMER_SLOTS_BITS)) - 1;
+    }
+
+    int slot = (expires >> (level * TIMER_SLOTS_BITS)) & TIMER_SLOTS_MASK;
+    link_timer(&slots[level][slot], timer);
+}
+
+
+/**
+ * Arms the timerfd for the first timer of level 0, or for the next time the
+ * higher levels move down, whichever comes first, or disarms it.
+ */
+static void arm_timerfd() {
+    if (timer_fd < 0) {
+        return;
+    }
+
+    uint64_t deadline = 0;
+    if (pending_cnt) {
+        deadline = (wheel_now | TIMER_SLOTS_MASK) + 1;
+        for (int k = 1; k < TIMER_SLOTS; k++) {
+            if (slots[0][(wheel_now + k) & TIMER_SLOTS_MASK]) {
+                if (wheel_now + k < deadline) {
+                    deadline = wheel_now + k;
+                }
+                break;
+            }
+        }
+    }
+
+    if (deadline == armed_ms) {
+        return;
+    }
+    armed_ms = deadline;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000;
+    spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+    int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    DIE(ret < 0, "timerfd_settime");
+}
+
+
+void timers_handle_fd(int fd, void *arg) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+
+    // Armed again below, for the next timer.
+    armed_ms = 0;
+    timers_run(get_time_ms());
+}
+
+
+int init_thread_timers() {
+    memset(slots, 0, sizeof(slots));
+    wheel_now = get_time_ms();
+    pending_cnt = 0;
+    armed_ms = 0;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    DIE(timer_fd < 0, "timerfd_create");
+
+    return timer_fd;
+}
+
+
+void init_timers() {
+    register_event_fd(init_thread_timers(), timers_handle_fd, NULL);
+}
+
+
+void timer_init(wheel_timer_t *timer, void (*callback)(void *arg, uint64_t now), void *arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires_ms = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+
+void timer_start(wheel_timer_t *timer, uint64_t expires_ms) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+        pending_cnt--;
+    }
+
+    timer->expires_ms = expires_ms;
+    place_timer(timer, wheel_now + 1);
+    pending_cnt++;
+
+    if (!running && (!armed_ms || expires_ms < armed_ms)) {
+        arm_timerfd();
+    }
+}
+
+
+void timer_stop(wheel_timer_t *timer) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+        pending_cnt--;
+    }
+}
+
+
+/**
+ * Moves the timers of a slot of a higher level down, now that it starts,
+ * before the current millisecond is expired.
+ */
+static void cascade(int level, int slot) {
+    wheel_timer_t *timer = slots[level][slot];
+    slots[level][slot] = NULL;
+
+    while (timer) {
+        wheel_timer_t *next = timer->next;
+        place_timer(timer, wheel_now);
+        timer = next;
+    }
+}
+
+
+static void expire_slot(int slot, uint64_t now) {
+    // The callbacks may stop the other timers of the slot, or start new
+    // ones, which go to the slots of the next milliseconds.
+    wheel_timer_t *expired = slots[0][slot];
+    slots[0][slot] = NULL;
+    if (expired) {
+        expired->pprev = &expired;
+    }
+
+    while (expired) {
+        wheel_timer_t *timer = expired;
+        unlink_timer(timer);
+        pending_cnt--;
+        timer->callback(timer->arg, now);
+    }
+}
+
+
+void timers_run(uint64_t now) {
+    if (!pending_cnt) {
+        if (now > wheel_now) {
+            wheel_now = now;
+        }
+        arm_timerfd();
+        return;
+    }
+
+    int expired = 0;
+    running = 1;
+
+    while (wheel_now < now) {
+        wheel_now++;
+
+        int slot = wheel_now & TIMER_SLOTS_MASK;
+        if (!slot) {
+            for (int level = 1; level < TIMER_LEVELS; level++) {
+                int level_slot = (wheel_now >> (level * TIMER_SLOTS_BITS)) & TIMER_SLOTS_MASK;
+                cascade(level, level_slot);
+                if (level_slot) {
+                    break;
+                }
+            }
+            expired = 1;
+        }
+
+        if (slots[0][slot]) {
+            expire_slot(slot, now);
+            expired = 1;
+        }
+    }
+
+    running = 0;
+
+    if (expired || !armed_ms || armed_ms <= now) {
+        arm_timerfd();
+    }
+}
+
+
+uint64_t timers_pending_cnt() {
+    return pending_cnt;
+}
@@ -0,0 +1,534 @@
+#include "trace.h"
+#include "interfaces.h"
+#include "route_stats.h"
+#include "realtime.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+// pcapng block types and options.
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_LINKTYPE_ETHERNET 1
+
+// Time allowed to a client to send its command.
+#define TRACE_CONTROL_TIMEOUT_MS 100
+
+#define TRACE_COMMAND_LEN 512
+
+
+volatile uint32_t trace_sample_every;
+__thread trace_ring_t *trace_local;
+
+static trace_ring_t *trace_rings[TRACE_MAX_THREADS];
+static int trace_rings_cnt;
+
+// The part of a command that runs on a helper thread, with what it needs
+// from the forwarding thread, and the client it replies to.
+struct control_job {
+    int client;
+    void (*run)(struct control_job *job, FILE *reply);
+    route_stats_snapshot_t *routes; // Freed with the job, like dump_fd
+    int top_n;
+    int dump_fd;                    // File of the dump, or -1
+};
+
+static int control_fd = -1;
+static char control_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void trace_sample(packet_buf_t *pkt, int interface) {
+    trace_ring_t *ring = trace_local;
+    if (!ring) {
+        return;
+    }
+
+    if (ring->countdown > 1) {
+        ring->countdown--;
+        return;
+    }
+    ring->countdown = trace_sample_every;
+
+    // Remembers the ingress interface, for the drop record.
+    pkt->traced = interface + 1;
+    trace_record(pkt, TRACE_INGRESS, interface, 0, NULL);
+}
+
+
+void trace_record(packet_buf_t *pkt, enum trace_point point, int interface,
+                  int reason, struct route_table_entry *route) {
+    trace_ring_t *ring = trace_local;
+    if (!ring) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    trace_record_t *record = &ring->records[head % TRACE_RING_SIZE];
+
+    record->timestamp_ns = realtime_ns();
+    record->point = point;
+    record->interface = interface >= 0 ? interface : pkt->traced - 1;
+    record->reason = reason;
+    record->has_route = route != NULL;
+    if (route) {
+        record->route = *route;
+    }
+
+    record->len = pkt->len;
+    record->caplen = pkt->len < TRACE_SNAPLEN ? pkt->len : TRACE_SNAPLEN;
+    memcpy(record->data, pkt->data, record->caplen);
+
+    // The dump only reads the records before the head.
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Writes a pcapng block: header, body, padding to 4 bytes, options
+ * (already padded) and trailing length.
+ */
+static int write_block(FILE *file, uint32_t type, const void *body, uint32_t body_len,
+                       const void *options, uint32_t options_len) {
+    static const uint8_t padding[4];
+    uint32_t pad = (4 - body_len % 4) % 4;
+    uint32_t total_len = 12 + body_len + pad + options_len;
+
+    if (fwrite(&type, 4, 1, file) != 1 || fwrite(&total_len, 4, 1, file) != 1
+        || (body_len && fwrite(body, body_len, 1, file) != 1)
+        || (pad && fwrite(padding, pad, 1, file) != 1)
+        || (options_len && fwrite(options, options_len, 1, file) != 1)
+        || fwrite(&total_len, 4, 1, file) != 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Appends an option to a buffer, padded to 4 bytes.
+ * @return The new length of the buffer.
+ */
+static uint32_t add_option(uint8_t *options, uint32_t len, uint16_t code,
+                           const void *value, uint16_t value_len) {
+    memcpy(options + len, &code, 2);
+    memcpy(options + len + 2, &value_len, 2);
+    memcpy(options + len + 4, value, value_len);
+    len += 4 + value_len;
+
+    while (len % 4) {
+        options[len++] = 0;
+    }
+
+    return len;
+}
+
+
+static uint32_t end_options(uint8_t *options, uint32_t len) {
+    memset(options + len, 0, 4);
+    return len + 4;
+}
+
+
+static int write_interfaces(FILE *file) {
+    for (int i = 0; i < router_interfaces_cnt; i++) {
+        uint8_t body[8];
+        uint16_t linktype = PCAPNG_LINKTYPE_ETHERNET, reserved = 0;
+        uint32_t snaplen = TRACE_SNAPLEN;
+        memcpy(body, &linktype, 2);
+        memcpy(body + 2, &reserved, 2);
+        memcpy(body + 4, &snaplen, 4);
+
+        char name[16];
+        snprintf(name, sizeof(name), "if%d", i);
+        uint8_t tsresol = 9; // Nanoseconds
+
+        uint8_t options[64];
+        uint32_t options_len = add_option(options, 0, PCAPNG_OPT_IF_NAME, name, strlen(name));
+        options_len = add_option(options, options_len, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+        options_len = end_options(options, options_len);
+
+        if (write_block(file, PCAPNG_IDB, body, sizeof(body), options, options_len) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void describe_record(const trace_record_t *record, int thread_id,
+                            char *comment, size_t size) {
+    if (record->point == TRACE_INGRESS) {
+        snprintf(comment, size, "thread %d ingress", thread_id);
+    } else if (record->point == TRACE_DROP) {
+        snprintf(comment, size, "thread %d drop %s", thread_id,
+                 stats_counter_names[record->reason]);
+    } else if (!record->has_route) {
+        snprintf(comment, size, "thread %d egress reply", thread_id);
+    } else {
+        char prefix[INET_ADDRSTRLEN], next_hop[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &record->route.prefix, prefix, sizeof(prefix));
+        inet_ntop(AF_INET, &record->route.next_hop, next_hop, sizeof(next_hop));
+
+        snprintf(comment, size, "thread %d egress route %s/%d via %s interface %d",
+                 thread_id, prefix, __builtin_popcount(record->route.mask),
+                 next_hop, record->route.interface);
+    }
+}
+
+
+static int write_record(FILE *file, const trace_record_t *record, int thread_id) {
+    uint8_t body[20 + TRACE_SNAPLEN];
+    uint32_t interface_id = record->interface;
+    uint32_t ts_high = record->timestamp_ns >> 32;
+    uint32_t ts_low = record->timestamp_ns;
+
+    memcpy(body, &interface_id, 4);
+    memcpy(body + 4, &ts_high, 4);
+    memcpy(body + 8, &ts_low, 4);
+    memcpy(body + 12, &record->caplen, 4);
+    memcpy(body + 16, &record->len, 4);
+    memcpy(body + 20, record->data, record->caplen);
+
+    char comment[128];
+    describe_record(record, thread_id, comment, sizeof(comment));
+
+    uint8_t options[sizeof(comment) + 8];
+    uint32_t options_len = add_option(options, 0, PCAPNG_OPT_COMMENT, comment, strlen(comment));
+    options_len = end_options(options, options_len);
+
+    return write_block(file, PCAPNG_EPB, body, 20 + record->caplen, options, options_len);
+}
+
+
+int trace_dump_pcapng(int fd) {
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t shb[16];
+    uint32_t magic = PCAPNG_BYTE_ORDER_MAGIC;
+    uint16_t major = 1, minor = 0;
+    int64_t section_len = -1;
+    memcpy(shb, &magic, 4);
+    memcpy(shb + 4, &major, 2);
+    memcpy(shb + 6, &minor, 2);
+    memcpy(shb + 8, &section_len, 8);
+
+    int written = 0;
+    int res = write_block(file, PCAPNG_SHB, shb, sizeof(shb), NULL, 0);
+    if (res == 0) {
+        res = write_interfaces(file);
+    }
+
+    int rings_cnt = __atomic_load_n(&trace_rings_cnt, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < rings_cnt && res == 0; i++) {
+        trace_ring_t *ring = trace_rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        // The owner keeps writing: a record is only kept if the owner had
+        // not started to overwrite it once it is copied.
+        for (uint64_t j = first; j < head && res == 0; j++) {
+            trace_record_t record = ring->records[j % TRACE_RING_SIZE];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (j + TRACE_RING_SIZE <= __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            res = write_record(file, &record, ring->thread_id);
+            written++;
+        }
+    }
+
+    if (fclose(file) != 0 || res < 0) {
+        return -1;
+    }
+
+    return written;
+}
+
+
+static void report_routes(struct control_job *job, FILE *reply) {
+    route_stats_report(reply, job->routes, job->top_n);
+}
+
+
+static void dump_trace(struct control_job *job, FILE *reply) {
+    int written = trace_dump_pcapng(job->dump_fd);
+    job->dump_fd = -1;
+    if (written < 0) {
+        fprintf(reply, "error writing the dump\n");
+    } else {
+        fprintf(reply, "ok %d packets written\n", written);
+    }
+}
+
+
+/**
+ * Writes the reply of a job and closes its client.
+ */
+static void run_job(struct control_job *job) {
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *file = open_memstream(&reply, &reply_len);
+    if (file) {
+        job->run(job, file);
+        fclose(file);
+        send(job->client, reply, reply_len, MSG_NOSIGNAL);
+        free(reply);
+    }
+
+    if (job->routes) {
+        route_stats_free_snapshot(job->routes);
+    }
+    if (job->dump_fd >= 0) {
+        close(job->dump_fd);
+    }
+    close(job->client);
+    free(job);
+}
+
+
+static void *control_job_thread(void *arg) {
+    realtime_helper_thread();
+    run_job(arg);
+    return NULL;
+}
+
+
+/**
+ * Runs a job on a helper thread, or right away if none can be started.
+ */
+static void start_job(struct control_job *job) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, control_job_thread, job) != 0) {
+        run_job(job);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+
+/**
+ * Runs one command of the control socket, on the forwarding thread.
+ * @param dump_fd File passed with the command, or -1; set to -1 if the job
+ * takes it
+ * @return The job that completes the reply on a helper thread, or NULL if
+ * the reply is complete.
+ */
+static struct control_job *run_command(char *command, int *dump_fd, FILE *reply) {
+    command[strcspn(command, "\r\n")] = '\0';
+
+    unsigned int sample_every, top_n;
+
+    if (sscanf(command, "sample %u", &sample_every) == 1) {
+        trace_sample_every = sample_every;
+        fprintf(reply, "ok sampling 1 in %u\n", sample_every);
+    } else if (strcmp(command, "dump") == 0) {
+        // The router never opens a path given by a client: the client
+        // opens the file, with its own rights, and passes it.
+        if (*dump_fd < 0) {
+            fprintf(reply, "error: \"dump\" needs the file, passed with SCM_RIGHTS\n");
+            return NULL;
+        }
+
+        // The rings are copied and written by the helper thread, which
+        // leaves out the records overwritten meanwhile.
+        struct control_job *job = malloc(sizeof(struct control_job));
+        if (!job) {
+            fprintf(reply, "error: out of memory\n");
+            return NULL;
+        }
+        job->run = dump_trace;
+        job->routes = NULL;
+        job->dump_fd = *dump_fd;
+        *dump_fd = -1;
+        return job;
+    } else if (strcmp(command, "status") == 0) {
+        uint64_t records = 0;
+        for (int i = 0; i < trace_rings_cnt; i++) {
+            records += trace_rings[i]->head;
+        }
+        fprintf(reply, "sampling 1 in %u, %d threads, %" PRIu64 " records\n",
+                trace_sample_every, trace_rings_cnt, records);
+    } else if (sscanf(command, "routes %u", &top_n) == 1) {
+        // The sums, the sort and the formatting of a large table would
+        // hold the forwarding loop.
+        struct control_job *job = malloc(sizeof(struct control_job));
+        route_stats_snapshot_t *routes = job ? route_stats_snapshot() : NULL;
+        if (!routes) {
+            free(job);
+            fprintf(reply, "error: no route statistics\n");
+            return NULL;
+        }
+        job->run = report_routes;
+        job->routes = routes;
+        job->dump_fd = -1;
+        job->top_n = top_n;
+        return job;
+    } else {
+        fprintf(reply, "error: expected \"sample N\", \"dump\", "
+                       "\"status\" or \"routes N\"\n");
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Receives a command, and the file descriptor that may come with it.
+ * @param dump_fd Set to the descriptor, or to -1 if there is none
+ * @return The length of the command, as recv().
+ */
+static ssize_t recv_command(int client, char *command, size_t size, int *dump_fd) {
+    struct iovec iov = { .iov_base = command, .iov_len = size };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    *dump_fd = -1;
+    ssize_t len = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+
+    // The descriptors that do not fit are closed by the kernel.
+    struct cmsghdr *cmsg = len >= 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(dump_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return len;
+}
+
+
+static void handle_control(int fd, void *arg) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+        return;
+    }
+
+    // A slow client must not hold the dataplane for long.
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = TRACE_CONTROL_TIMEOUT_MS * 1000 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char command[TRACE_COMMAND_LEN];
+    int dump_fd;
+    ssize_t len = recv_command(client, command, sizeof(command) - 1, &dump_fd);
+    if (len > 0) {
+        command[len] = '\0';
+
+        char *reply = NULL;
+        size_t reply_len = 0;
+        FILE *file = open_memstream(&reply, &reply_len);
+        if (file) {
+            struct control_job *job = run_command(command, &dump_fd, file);
+            fclose(file);
+            if (job) {
+                free(reply);
+                job->client = client;
+                start_job(job);
+                return;
+            }
+            send(client, reply, reply_len, MSG_NOSIGNAL);
+            free(reply);
+        }
+    }
+
+    if (dump_fd >= 0) {
+        close(dump_fd);
+    }
+    close(client);
+}
+
+
+void trace_register_thread() {
+    int id = __atomic_load_n(&trace_rings_cnt, __ATOMIC_ACQUIRE);
+    DIE(id >= TRACE_MAX_THREADS, "Too many threads for the trace.\n");
+
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    DIE(!ring, "calloc failed.\n");
+    ring->thread_id = id;
+
+    trace_rings[id] = ring;
+    __atomic_store_n(&trace_rings_cnt, id + 1, __ATOMIC_RELEASE);
+
+    trace_local = ring;
+}
+
+
+void init_trace(uint32_t sample_every) {
+    trace_sample_every = sample_every;
+    trace_register_thread();
+
+    snprintf(control_path, sizeof(control_path), "%s%d.sock",
+             TRACE_SOCKET_PREFIX, getpid());
+    unlink(control_path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(control_fd < 0, "socket");
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path);
+
+    // Only the user of the router may connect, from the moment the socket
+    // appears in /tmp.
+    mode_t old_umask = umask(0177);
+    int res = bind(control_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_umask);
+
+    if (res < 0 || listen(control_fd, 4) < 0) {
+        fprintf(stderr, "No trace control socket.\n");
+        close(control_fd);
+        control_fd = -1;
+        return;
+    }
+
+    register_event_fd(control_fd, handle_control, NULL);
+}
+
+
+void destroy_trace() {
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(control_path);
+        control_fd = -1;
+    }
+}
@@ -1,5 +1,11 @@
+#define _GNU_SOURCE
 #include "trie.h"
 #include "utils.h"
+#include "hugepage.h"
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
 
 
 network_trie_node_t *create_trie_node() {
@@ -10,6 +16,8 @@ network_trie_node_t *create_trie_node() {
     node->left = NULL;
     node->right = NULL;
     node->final_state = FALSE;
+    node->vrf = 0;
+    node->heap = 1;
 
     return node;
 }
@@ -93,3 +101,441 @@ network_trie_node_t *trie_retrieve(network_trie_node_t *root, uint32_t target_ip
 
     return NULL;
 }
+
+
+network_trie_node_t *trie_find(network_trie_node_t *root, uint32_t ip_prefix,
+                               uint32_t ip_mask) {
+    int bits = get_mask_ones_cnt(ip_mask);
+    network_trie_node_t *curr_node = root;
+
+    for (int i = 0; i < bits && curr_node; i++) {
+        int curr_bit = (ip_prefix >> (31 - i)) & 1;
+        curr_node = curr_bit ? curr_node->right : curr_node->left;
+    }
+
+    if (curr_node && curr_node->final_state == TRUE) {
+        return curr_node;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Makes the node linked at *link one of the VRF: a new one if there is
+ * none, or a copy if it belongs to another VRF, which keeps the original.
+ */
+static network_trie_node_t *own_trie_node(network_trie_node_t **link, uint8_t vrf) {
+    network_trie_node_t *node = *link;
+
+    if (node && node->vrf == vrf) {
+        return node;
+    }
+
+    network_trie_node_t *copy = create_trie_node();
+    if (node) {
+        *copy = *node;
+    }
+    copy->vrf = vrf;
+    copy->heap = 1;
+    *link = copy;
+
+    return copy;
+}
+
+
+network_trie_node_t *trie_insert_vrf(network_trie_node_t **root, uint32_t ip_prefix,
+                                     uint32_t ip_mask, uint8_t vrf) {
+    int bits_to_insert = get_mask_ones_cnt(ip_mask);
+    network_trie_node_t *curr_node = own_trie_node(root, vrf);
+
+    for (int i = 0; i < bits_to_insert; i++) {
+        int curr_bit = (ip_prefix >> (31 - i)) & 1;
+        curr_node = own_trie_node(curr_bit ? &curr_node->right : &curr_node->left, vrf);
+    }
+
+    curr_node->final_state = TRUE;
+
+    return curr_node;
+}
+
+
+/**
+ * Removes the prefix below the node linked at *link, of the given depth,
+ * and unlinks the node if nothing is left below it. The root stays.
+ */
+static void remove_vrf_prefix(network_trie_node_t **link, uint32_t ip_prefix, int bits,
+                              int depth, uint8_t vrf) {
+    network_trie_node_t *node = own_trie_node(link, vrf);
+
+    if (depth == bits) {
+        node->final_state = FALSE;
+        node->entry = NULL;
+    } else {
+        int curr_bit = (ip_prefix >> (31 - depth)) & 1;
+        network_trie_node_t **child = curr_bit ? &node->right : &node->left;
+        if (*child) {
+            remove_vrf_prefix(child, ip_prefix, bits, depth + 1, vrf);
+        }
+    }
+
+    // The nodes of the arena of trie_build() are only unlinked.
+    if (depth && node->final_state == FALSE && !node->left && !node->right) {
+        *link = NULL;
+        if (node->heap) {
+            free(node);
+        }
+    }
+}
+
+
+void trie_remove_vrf(network_trie_node_t **root, uint32_t ip_prefix, uint32_t ip_mask,
+                     uint8_t vrf) {
+    remove_vrf_prefix(root, ip_prefix, get_mask_ones_cnt(ip_mask), 0, vrf);
+}
+
+
+// A prefix to build, with its length and its position in the route table.
+struct trie_build_key {
+    uint32_t prefix; // Host order, bits after the length cleared
+    int len;
+    int index;
+};
+
+struct trie_builder {
+    struct route_table_entry *entries;
+    int split_depth;     // Depth of the roots of the subtrees
+
+    struct trie_build_key *keys; // Grouped by subtree
+    struct trie_build_key *tmp;  // Room for sorting them
+    int bucket_start[TRIE_BUCKETS + 1];
+    int bucket_nodes[TRIE_BUCKETS];
+    int arena_start[TRIE_BUCKETS];
+    network_trie_node_t *arena;
+
+    int next_bucket;     // Next subtree to be taken by a thread
+    void (*work)(struct trie_builder *builder, int bucket);
+};
+
+
+/**
+ * Sorts keys in the lexicographic order of their bit strings (a prefix
+ * comes before the longer ones that start with it), i.e. by prefix, then
+ * length. The radix sort is stable, so equal keys stay in table order.
+ * Only the bytes that are not the same for all the keys are sorted on.
+ */
+static void sort_keys(struct trie_build_key *keys, struct trie_build_key *tmp, int cnt) {
+    uint64_t and_all = UINT64_MAX, or_all = 0;
+    for (int i = 0; i < cnt; i++) {
+        uint64_t sort_key = ((uint64_t) keys[i].prefix << 8) | keys[i].len;
+        and_all &= sort_key;
+        or_all |= sort_key;
+    }
+
+    for (int shift = 0; shift < 40; shift += 8) {
+        if ((((and_all ^ or_all) >> shift) & 0xff) == 0) {
+            continue;
+        }
+
+        int counts[257] = {0};
+        for (int i = 0; i < cnt; i++) {
+            uint64_t sort_key = ((uint64_t) keys[i].prefix << 8) | keys[i].len;
+            counts[((sort_key >> shift) & 0xff) + 1]++;
+        }
+        for (int d = 0; d < 256; d++) {
+            counts[d + 1] += counts[d];
+        }
+        for (int i = 0; i < cnt; i++) {
+            uint64_t sort_key = ((uint64_t) keys[i].prefix << 8) | keys[i].len;
+            tmp[counts[(sort_key >> shift) & 0xff]++] = keys[i];
+        }
+
+        memcpy(keys, tmp, cnt * sizeof(struct trie_build_key));
+    }
+}
+
+
+/**
+ * Length of a prefix, i.e. the leading ones of its mask, like
+ * get_mask_ones_cnt() but without a loop.
+ */
+static inline int prefix_len(uint32_t mask) {
+    return ~mask ? __builtin_clz(~mask) : 32;
+}
+
+
+/**
+ * Number of leading bits two keys share, at most the length of both.
+ */
+static int common_bits(const struct trie_build_key *a, const struct trie_build_key *b) {
+    uint32_t diff = a->prefix ^ b->prefix;
+    int common = diff ? __builtin_clz(diff) : 32;
+
+    if (common > a->len) {
+        common = a->len;
+    }
+    if (common > b->len) {
+        common = b->len;
+    }
+
+    return common;
+}
+
+
+/**
+ * Sorts the keys of a subtree (already in table order) and counts its nodes: every key adds the
+ * nodes below the part of its path it shares with the previous one.
+ */
+static void sort_bucket(struct trie_builder *builder, int bucket) {
+    struct trie_build_key *keys = builder->keys + builder->bucket_start[bucket];
+    int cnt = builder->bucket_start[bucket + 1] - builder->bucket_start[bucket];
+
+    sort_keys(keys, builder->tmp + builder->bucket_start[bucket], cnt);
+
+    int nodes = 1;
+    for (int i = 0; i < cnt; i++) {
+        int shared = i ? common_bits(&keys[i], &keys[i - 1]) : 0;
+        if (shared < builder->split_depth) {
+            shared = builder->split_depth;
+        }
+        nodes += keys[i].len - shared;
+    }
+
+    builder->bucket_nodes[bucket] = nodes;
+}
+
+
+/**
+ * Builds a subtree from its sorted keys, in its slice of the arena,
+ * keeping the current path from its root.
+ */
+static void build_bucket(struct trie_builder *builder, int bucket) {
+    struct trie_build_key *keys = builder->keys + builder->bucket_start[bucket];
+    int cnt = builder->bucket_start[bucket + 1] - builder->bucket_start[bucket];
+    int depth_min = builder->split_depth;
+
+    network_trie_node_t *next_node = builder->arena + builder->arena_start[bucket];
+    network_trie_node_t *end = next_node + builder->bucket_nodes[bucket];
+    network_trie_node_t *path[33];
+
+    for (network_trie_node_t *node = next_node; node < end; node++) {
+        node->entry = NULL;
+        node->left = NULL;
+        node->right = NULL;
+        node->final_state = FALSE;
+        node->vrf = 0;
+        node->heap = 0;
+    }
+    path[depth_min] = next_node++;
+
+    for (int i = 0; i < cnt; i++) {
+        int depth = i ? common_bits(&keys[i], &keys[i - 1]) : 0;
+        if (depth < depth_min) {
+            depth = depth_min;
+        }
+
+        network_trie_node_t *node = path[depth];
+        for (; depth < keys[i].len; depth++) {
+            int curr_bit = (keys[i].prefix >> (31 - depth)) & 1;
+            network_trie_node_t **child = curr_bit ? &node->right : &node->left;
+
+            if (*child == NULL) {
+                DIE(next_node == end, "Trie node count mismatch.\n");
+                *child = next_node++;
+            }
+
+            node = *child;
+            path[depth + 1] = node;
+        }
+
+        // Equal keys stayed in table order, so the last one wins.
+        node->final_state = TRUE;
+        node->entry = &builder->entries[keys[i].index];
+    }
+}
+
+
+static void *trie_build_worker(void *arg) {
+    struct trie_builder *builder = arg;
+
+    while (1) {
+        int bucket = __atomic_fetch_add(&builder->next_bucket, 1, __ATOMIC_RELAXED);
+        if (bucket >= TRIE_BUCKETS) {
+            return NULL;
+        }
+
+        if (builder->bucket_start[bucket] < builder->bucket_start[bucket + 1]) {
+            builder->work(builder, bucket);
+        }
+    }
+}
+
+
+/**
+ * Runs the work on every subtree, spread over the CPUs the router may
+ * use (see --helper-cpus).
+ */
+static void run_on_buckets(struct trie_builder *builder,
+                           void (*work)(struct trie_builder *builder, int bucket)) {
+    cpu_set_t cpus;
+    long threads_cnt = 1;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        threads_cnt = CPU_COUNT(&cpus);
+    }
+    if (threads_cnt > TRIE_BUILD_MAX_THREADS) {
+        threads_cnt = TRIE_BUILD_MAX_THREADS;
+    }
+
+    builder->next_bucket = 0;
+    builder->work = work;
+
+    // The calling thread works too.
+    pthread_t threads[TRIE_BUILD_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads_cnt; i++) {
+        if (pthread_create(&threads[started], NULL, trie_build_worker, builder) == 0) {
+            started++;
+        }
+    }
+
+    trie_build_worker(builder);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
+/**
+ * Depth of the roots of the subtrees: TRIE_SPLIT_BITS after the bits shared
+ * by all the prefixes of at least TRIE_SPLIT_BITS bits (a default route
+ * would otherwise share nothing with the others).
+ */
+static int find_split_depth(struct route_table_entry *entries, int size) {
+    uint32_t min_prefix = UINT32_MAX, max_prefix = 0;
+
+    for (int i = 0; i < size; i++) {
+        uint32_t mask = ntohl(entries[i].mask);
+        if (prefix_len(mask) < TRIE_SPLIT_BITS) {
+            continue;
+        }
+
+        uint32_t prefix = ntohl(entries[i].prefix) & mask;
+        if (prefix < min_prefix) {
+            min_prefix = prefix;
+        }
+        if (prefix > max_prefix) {
+            max_prefix = prefix;
+        }
+    }
+
+    if (min_prefix > max_prefix) {
+        return TRIE_SPLIT_BITS;
+    }
+
+    uint32_t diff = min_prefix ^ max_prefix;
+    int depth = (diff ? __builtin_clz(diff) : 32) + TRIE_SPLIT_BITS;
+
+    return depth < 32 ? depth : 32;
+}
+
+
+network_trie_node_t *trie_build(struct route_table_entry *entries, int size,
+                                int *nodes_cnt) {
+    struct trie_builder *builder = calloc(1, sizeof(struct trie_builder));
+    DIE(!builder, "Trie builder malloc failed.\n");
+
+    builder->entries = entries;
+    builder->split_depth = find_split_depth(entries, size);
+    builder->keys = malloc(size * sizeof(struct trie_build_key));
+    builder->tmp = malloc(size * sizeof(struct trie_build_key));
+    DIE(!builder->keys || !builder->tmp, "Trie keys malloc failed.\n");
+
+    int shift = 32 - builder->split_depth;
+    network_trie_node_t *root = create_trie_node();
+
+    // Count the keys of every subtree, then place them. The shorter ones
+    // are inserted right away, in table order, above the subtrees.
+    int counts[TRIE_BUCKETS] = {0};
+    for (int i = 0; i < size; i++) {
+        uint32_t mask = ntohl(entries[i].mask);
+        int len = prefix_len(mask);
+
+        if (len < builder->split_depth) {
+            network_trie_node_t *final_node = trie_insert(root, ntohl(entries[i].prefix), mask);
+            final_node->entry = &entries[i];
+        } else {
+            counts[(ntohl(entries[i].prefix) >> shift) & (TRIE_BUCKETS - 1)]++;
+        }
+    }
+
+    for (int b = 0; b < TRIE_BUCKETS; b++) {
+        builder->bucket_start[b + 1] = builder->bucket_start[b] + counts[b];
+        counts[b] = builder->bucket_start[b];
+    }
+
+    uint32_t top_bits = 0;
+    for (int i = 0; i < size; i++) {
+        uint32_t mask = ntohl(entries[i].mask);
+        int len = prefix_len(mask);
+        if (len < builder->split_depth) {
+            continue;
+        }
+
+        uint32_t prefix = ntohl(entries[i].prefix) & mask;
+        int bucket = (prefix >> shift) & (TRIE_BUCKETS - 1);
+        builder->keys[counts[bucket]++] = (struct trie_build_key) {prefix, len, i};
+        top_bits = prefix;
+    }
+
+    run_on_buckets(builder, sort_bucket);
+
+    // All the subtrees go in one array, in address order.
+    int total_nodes = 0;
+    for (int b = 0; b < TRIE_BUCKETS; b++) {
+        builder->arena_start[b] = total_nodes;
+        if (builder->bucket_start[b] < builder->bucket_start[b + 1]) {
+            total_nodes += builder->bucket_nodes[b];
+        }
+    }
+
+    if (total_nodes) {
+        builder->arena = hugepage_alloc("trie", total_nodes * sizeof(network_trie_node_t));
+    }
+
+    run_on_buckets(builder, build_bucket);
+
+    // Stitch every subtree under the root, below the shared bits.
+    for (int b = 0; b < TRIE_BUCKETS; b++) {
+        if (builder->bucket_start[b] == builder->bucket_start[b + 1]) {
+            continue;
+        }
+
+        uint32_t path = (top_bits >> shift << shift) & ~((uint32_t) (TRIE_BUCKETS - 1) << shift);
+        path |= (uint32_t) b << shift;
+
+        network_trie_node_t *node = root;
+        for (int depth = 0; depth < builder->split_depth; depth++) {
+            int curr_bit = (path >> (31 - depth)) & 1;
+            network_trie_node_t **child = curr_bit ? &node->right : &node->left;
+
+            if (depth == builder->split_depth - 1) {
+                *child = builder->arena + builder->arena_start[b];
+            } else if (*child == NULL) {
+                *child = create_trie_node();
+            }
+
+            node = *child;
+        }
+    }
+
+    if (nodes_cnt) {
+        *nodes_cnt = total_nodes;
+    }
+
+    free(builder->keys);
+    free(builder->tmp);
+    free(builder);
+
+    return root;
+}
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <time.h>
+#include <netinet/in.h>
 
 void mac_copy(uint8_t *dest_mac, const uint8_t *src_mac) {
     memcpy(dest_mac, src_mac, 6 * sizeof(uint8_t));
@@ -34,3 +36,30 @@ int get_mask_ones_cnt(uint32_t ip_mask) {
         shift_order--;
     }
 }
+
+
+uint16_t checksum_adjust(uint16_t check, uint16_t old_word, uint16_t new_word) {
+    // HC' = ~(~HC + ~m + m')
+    uint32_t sum = (uint16_t) ~ntohs(check) + (uint16_t) ~old_word + new_word;
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+
+    return htons((uint16_t) ~sum);
+}
+
+
+uint64_t get_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+uint64_t get_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
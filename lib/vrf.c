@@ -0,0 +1,271 @@
+#include "vrf.h"
+#include "trie.h"
+#include "utils.h"
+#include <string.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+
+
+// Open addressing hash tables, used only while the VRFs are loaded: the
+// stored routes by their contents, and the prefixes of a VRF.
+struct route_index {
+    int *slots; // 1 + index of the stored route, 0 if free
+    int bits;
+};
+
+struct prefix_set {
+    uint64_t *slots; // Key of the prefix, 0 if free
+    int bits;
+};
+
+
+/**
+ * Bits of the slot numbers of a hash table with at most keys_cnt keys,
+ * so that it stays at most half full.
+ */
+static int hash_bits(int keys_cnt) {
+    int bits = 4;
+    while ((1 << bits) < 2 * keys_cnt) {
+        bits++;
+    }
+
+    return bits;
+}
+
+
+static inline uint32_t hash_slot(uint64_t key, int bits) {
+    // Multiplicative hashing, so that all the bits of the key matter.
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+
+static uint32_t route_slot_hash(const struct route_table_entry *entry, int bits) {
+    uint64_t key = ((uint64_t) entry->prefix << 32 | entry->mask)
+                   * 0xc2b2ae3d27d4eb4fULL + ((uint64_t) entry->next_hop << 32 | entry->interface);
+    return hash_slot(key, bits);
+}
+
+
+/**
+ * @return The slot of the stored route with the same contents as entry,
+ * or the free slot where it goes.
+ */
+static int *route_slot(route_table_t *store, struct route_index *index,
+                       const struct route_table_entry *entry) {
+    uint32_t mask = (1U << index->bits) - 1;
+    uint32_t slot = route_slot_hash(entry, index->bits);
+
+    while (index->slots[slot]
+           && memcmp(&store->entries[index->slots[slot] - 1], entry, sizeof(*entry)) != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    return &index->slots[slot];
+}
+
+
+/**
+ * Key of the prefix of a route: its bits, then its length plus 1, so that
+ * no key is 0.
+ */
+static uint64_t prefix_key(const struct route_table_entry *entry) {
+    uint32_t mask = ntohl(entry->mask);
+    return (uint64_t) (ntohl(entry->prefix) & mask) << 8 | (get_mask_ones_cnt(mask) + 1);
+}
+
+
+static uint64_t *prefix_slot(struct prefix_set *set, uint64_t key) {
+    uint32_t mask = (1U << set->bits) - 1;
+    uint32_t slot = hash_slot(key, set->bits);
+
+    while (set->slots[slot] && set->slots[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+
+    return &set->slots[slot];
+}
+
+
+/**
+ * Parses "FILE:IF,IF..." and gives the interfaces to the VRF.
+ */
+static void parse_vrf_spec(vrf_set_t *vrfs, int vrf, char *spec) {
+    char *colon = strrchr(spec, ':');
+    DIE(!colon || colon == spec || !colon[1], "Invalid VRF: %s\n", spec);
+
+    *colon = '\0';
+    vrfs->vrfs[vrf].path = spec;
+
+    const char *p = colon + 1;
+    while (*p) {
+        char *end;
+        long interface = strtol(p, &end, 10);
+        DIE(end == p || interface < 0 || interface >= ROUTER_NUM_INTERFACES
+            || vrfs->interface_vrf[interface] || (*end && *end != ','),
+            "Invalid interfaces of the VRF %s: %s\n", spec, colon + 1);
+
+        vrfs->interface_vrf[interface] = vrf;
+        p = *end ? end + 1 : end;
+    }
+}
+
+
+static void count_trie_nodes(network_trie_node_t *node, uint8_t vrf, vrf_t *stats) {
+    if (!node) {
+        return;
+    }
+
+    stats->nodes_cnt++;
+    if (node->vrf == vrf) {
+        stats->own_nodes_cnt++;
+    }
+
+    count_trie_nodes(node->left, vrf, stats);
+    count_trie_nodes(node->right, vrf, stats);
+}
+
+
+/**
+ * Builds the table of a VRF from the default one: its trie starts as the
+ * trie of the default VRF, from which the prefixes it does not have are
+ * removed, and in which its routes are inserted, where they differ. Only
+ * the nodes on the way are copied. Its routes are stored, unless a previous
+ * VRF already has the same ones.
+ * @param routes Room for reading MAX_RTABLE_LEN routes
+ */
+static void load_vrf(vrf_set_t *vrfs, int vrf, struct route_index *index,
+                     struct route_table_entry *routes, adjacency_table_t *adj_table) {
+    vrf_t *info = &vrfs->vrfs[vrf];
+    route_table_t *store = vrfs->vrfs[0].route_table;
+
+    info->routes_cnt = read_rtable(info->path, routes);
+
+    route_table_t *table = malloc(sizeof(route_table_t));
+    DIE(!table, "Route table malloc.\n");
+    *table = *store;
+    info->route_table = table;
+
+    struct prefix_set prefixes;
+    prefixes.bits = hash_bits(info->routes_cnt);
+    prefixes.slots = calloc(1 << prefixes.bits, sizeof(uint64_t));
+    DIE(!prefixes.slots, "VRF prefixes malloc failed.\n");
+
+    for (int i = 0; i < info->routes_cnt; i++) {
+        uint64_t key = prefix_key(&routes[i]);
+        *prefix_slot(&prefixes, key) = key;
+    }
+
+    for (int i = 0; i < vrfs->vrfs[0].routes_cnt; i++) {
+        struct route_table_entry *entry = &store->entries[i];
+        uint32_t prefix = ntohl(entry->prefix);
+        uint32_t mask = ntohl(entry->mask);
+
+        // A prefix found twice in the default VRF is removed only once.
+        if (!*prefix_slot(&prefixes, prefix_key(entry))
+            && trie_find(table->trie_root, prefix, mask)) {
+            trie_remove_vrf(&table->trie_root, prefix, mask, vrf);
+        }
+    }
+
+    for (int i = 0; i < info->routes_cnt; i++) {
+        int *slot = route_slot(store, index, &routes[i]);
+        if (!*slot) {
+            DIE(store->size == store->capacity, "Too many routes in the VRFs.\n");
+
+            store->entries[store->size] = routes[i];
+            store->adjacencies[store->size] = adjacency_get(adj_table, routes[i].next_hop,
+                                                            routes[i].interface);
+            *slot = ++store->size;
+            info->own_routes_cnt++;
+        }
+
+        struct route_table_entry *entry = &store->entries[*slot - 1];
+        uint32_t prefix = ntohl(entry->prefix);
+        uint32_t mask = ntohl(entry->mask);
+
+        // As in the default VRF, the last entry of a prefix wins.
+        network_trie_node_t *node = trie_find(table->trie_root, prefix, mask);
+        if (!node || node->entry != entry) {
+            node = trie_insert_vrf(&table->trie_root, prefix, mask, vrf);
+            node->entry = entry;
+        }
+    }
+
+    free(prefixes.slots);
+}
+
+
+vrf_set_t *init_vrfs(const char *default_path, char **specs, int specs_cnt,
+                     adjacency_table_t *adj_table, int extra_routes) {
+    DIE(specs_cnt >= VRF_MAX, "Too many VRFs.\n");
+
+    vrf_set_t *vrfs = calloc(1, sizeof(vrf_set_t));
+    DIE(!vrfs, "VRF malloc failed.\n");
+    vrfs->cnt = 1 + specs_cnt;
+
+    for (int v = 1; v < vrfs->cnt; v++) {
+        parse_vrf_spec(vrfs, v, specs[v - 1]);
+    }
+
+    // The routes of all the VRFs are stored in the table of the default one.
+    route_table_t *store = init_route_table(default_path, adj_table,
+                                            vrfs->cnt * MAX_RTABLE_LEN + extra_routes);
+    vrf_t *default_vrf = &vrfs->vrfs[0];
+    default_vrf->path = default_path;
+    default_vrf->route_table = store;
+    default_vrf->routes_cnt = store->size;
+    default_vrf->own_routes_cnt = store->size;
+
+    if (vrfs->cnt > 1) {
+        struct route_index index;
+        index.bits = hash_bits(store->capacity);
+        index.slots = calloc(1 << index.bits, sizeof(int));
+        struct route_table_entry *routes = malloc(MAX_RTABLE_LEN * sizeof(struct route_table_entry));
+        DIE(!index.slots || !routes, "VRF routes malloc failed.\n");
+
+        // The same routes of the default VRF share the last one, which is
+        // the one in its trie.
+        for (int i = 0; i < store->size; i++) {
+            *route_slot(store, &index, &store->entries[i]) = i + 1;
+        }
+
+        for (int v = 1; v < vrfs->cnt; v++) {
+            load_vrf(vrfs, v, &index, routes, adj_table);
+        }
+
+        free(routes);
+        free(index.slots);
+    }
+
+    for (int v = 0; v < vrfs->cnt; v++) {
+        vrf_t *vrf = &vrfs->vrfs[v];
+        vrf->route_table->size = store->size;
+        count_trie_nodes(vrf->route_table->trie_root, v, vrf);
+    }
+
+    return vrfs;
+}
+
+
+void vrf_print_memory(vrf_set_t *vrfs, FILE *file) {
+    size_t route_size = sizeof(struct route_table_entry) + sizeof(adjacency_t *);
+    size_t node_size = sizeof(network_trie_node_t);
+    size_t total = 0, unshared_total = 0;
+
+    for (int v = 0; v < vrfs->cnt; v++) {
+        vrf_t *vrf = &vrfs->vrfs[v];
+        size_t own = vrf->own_routes_cnt * route_size + vrf->own_nodes_cnt * node_size;
+        size_t unshared = vrf->routes_cnt * route_size + vrf->nodes_cnt * node_size;
+
+        fprintf(file, "VRF %d (%s): %d routes, %d stored for it, %d trie nodes, "
+                      "%d of its own: %.2f MB (%.2f MB unshared)\n", v, vrf->path,
+                vrf->routes_cnt, vrf->own_routes_cnt, vrf->nodes_cnt, vrf->own_nodes_cnt,
+                own / 1048576.0, unshared / 1048576.0);
+
+        total += own;
+        unshared_total += unshared;
+    }
+
+    fprintf(file, "VRFs: %.2f MB in total (%.2f MB unshared)\n", total / 1048576.0,
+            unshared_total / 1048576.0);
+}
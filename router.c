@@ -1,94 +1,302 @@
 #include "lib.h"
-#include "forwarding.h"
-#include "arp.h"
-#include "icmp.h"
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include "dataplane.h"
+#include "interfaces.h"
+#include "options.h"
+#include "stats.h"
+#include "trace.h"
+#include "hugepage.h"
+#include "realtime.h"
+#include "egress.h"
+#include "prefilter.h"
+#include "timer.h"
+#include "vrf.h"
+#include "fib_sync.h"
+#include "route_stats.h"
+#include <signal.h>
+#include <inttypes.h>
+
+
+static volatile sig_atomic_t stop_requested;
+static volatile sig_atomic_t reload_requested;
+
+static void handle_stop_signal(int signum) {
+    stop_requested = 1;
+}
+
+
+static void handle_reload_signal(int signum) {
+    reload_requested = 1;
+}
+
+
+/**
+ * Makes SIGINT and SIGTERM interrupt the main loop instead of killing the
+ * router, so that it can save its state before exiting, and SIGHUP reload
+ * the ACL.
+ */
+static void install_signal_handlers() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    sa.sa_handler = handle_reload_signal;
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+
+/**
+ * Takes buffers from the pool for the rest of the vector, as many as it has.
+ * @param ready Buffers already at the start of the vector
+ * @return Buffers in the vector now
+ */
+static int refill_vector(packet_pool_t *pool, packet_buf_t **pkts, char **frames, int ready) {
+    while (ready < GRAPH_VECTOR_SIZE) {
+        packet_buf_t *pkt = packet_alloc(pool);
+        if (!pkt) {
+            break;
+        }
+
+        pkts[ready] = pkt;
+        frames[ready] = pkt->data;
+        ready++;
+    }
+
+    return ready;
+}
 
 
 int main(int argc, char *argv[])
 {
-    char buf[MAX_PACKET_LEN];
+    router_options_t options;
+    parse_router_options(&argc, argv, &options);
+
+    // NUMA node and helper CPUs, before anything is allocated.
+    realtime_setup_begin(&options);
+
+    // Counters and latency histograms, published in shared memory.
+    init_stats();
 
     // Do not modify this line
     init(argc - 2, argv + 2);
 
-    // Route table is in network order.
-    route_table_t *route_table = init_route_table(argv[1]);
+    // The addresses of the interfaces do not change while running.
+    init_interfaces_info(argc - 2);
 
-    // Initialize the ARP cache and the packet queue.
-    list arp_cache = NULL;
-    arp_packet_queue *packet_queue = init_packet_queue();
+    // The kernel drops the frames that are not for the router, instead of
+    // copying them to it.
+    if (options.prefilter) {
+        init_prefilter(argc - 2, options.rtable6 != NULL);
+    }
 
-    while (1) {
-        int interface;
-        size_t len;
+    // Retransmits, neighbor aging and the periodic work run from a timer
+    // wheel, whose timerfd wakes the receive loop up.
+    init_timers();
 
-        interface = recv_from_any_link(buf, &len);
-        DIE(interface < 0, "recv_from_any_links");
+    // Sampled packet trace, controlled through a unix socket.
+    init_trace(options.trace_sample);
 
-        struct ether_header *eth_hdr = (struct ether_header*) buf;
+    dataplane_t dp;
 
-        // IP of the current interface.
-        char *dot_local_ip = get_interface_ip(interface); // IP in dot form
-        uint32_t local_recv_ip = inet_addr(dot_local_ip); // IP in network order
+    // Route table is in network order. The routes towards the same
+    // next hop share an adjacency, which acts as the ARP cache.
+    dp.adj_table = init_adjacency_table(MAX_RTABLE_LEN);
 
-        // MAC of the current interface.
-        uint8_t local_recv_mac[6];
-        get_interface_mac(interface, local_recv_mac);
+    // Each VRF has its own route table, sharing the identical routes and
+    // subtrees with the default one.
+    // The routes of a kernel table are added to the default VRF, in place,
+    // so its trie cannot be shared with other VRFs.
+    DIE(options.netlink_table && options.vrfs_cnt, "--netlink-table excludes --vrf.\n");
+    vrf_set_t *vrfs = init_vrfs(argv[1], options.vrfs, options.vrfs_cnt, dp.adj_table,
+                                options.netlink_table ? FIB_SYNC_MAX_ROUTES : 0);
+    dp.route_table = vrfs->vrfs[0].route_table;
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        dp.vrf_tables[i] = vrfs->vrfs[vrfs->interface_vrf[i]].route_table;
+    }
+    vrf_print_memory(vrfs, stderr);
 
-        if (!check_destination_validity(eth_hdr->ether_dhost, local_recv_mac)) {
-            continue;
+    // Traffic of every route, reported through the trace control socket.
+    init_route_stats(dp.vrf_tables, ROUTER_NUM_INTERFACES);
+
+    // All the packets live in preallocated buffers.
+    dp.packet_pool = init_packet_pool(PACKET_POOL_SIZE);
+
+    // Neighbors known without ARP: the configured ones and the ones
+    // learned before a restart.
+    if (options.arp_table) {
+        load_neighbor_file(dp.adj_table, options.arp_table, 1);
+    }
+    if (options.arp_snapshot && access(options.arp_snapshot, R_OK) == 0) {
+        int restored = load_neighbor_file(dp.adj_table, options.arp_snapshot, 0);
+        fprintf(stderr, "Restored %d adjacencies from %s\n", restored,
+                options.arp_snapshot);
+    }
+
+    // Packets that the links cannot take yet wait in per class queues.
+    init_egress(dp.packet_pool, options.egress_rates);
+
+    // Initialize the packet queue.
+    enum arp_drop_policy drop_policy = options.arp_drop_oldest ? ARP_DROP_OLDEST
+                                                               : ARP_DROP_NEWEST;
+    dp.packet_queue = init_packet_queue(dp.packet_pool, drop_policy);
+
+    // ICMP errors are rate limited, so that a scan cannot overload the router.
+    dp.icmp_limiter = init_icmp_rate_limiter();
+
+    // Expire the learned MACs, and resolve the next hops of the routes
+    // before the traffic needs them, unless --no-arp-preresolve.
+    dp.resolver = init_neighbor_resolver(dp.adj_table, options.arp_preresolve);
+
+    // A routing daemon or "ip route" changes the routes while running.
+    if (options.netlink_table) {
+        init_fib_sync(options.netlink_table, dp.route_table, dp.adj_table, dp.resolver);
+    }
+
+    // Filter of the forwarded packets, compiled again on SIGHUP.
+    dp.acl = NULL;
+    dp.acl_next = NULL;
+    if (options.acl) {
+        dp.acl = acl_compile(options.acl);
+        DIE(!dp.acl, "Invalid ACL.\n");
+    }
+
+    // IPv6 is forwarded only with its own route table, whose next hops
+    // are resolved by Neighbor Discovery.
+    dp.route6_table = NULL;
+    dp.nd_table = NULL;
+    if (options.rtable6) {
+        dp.nd_table = init_nd_table(dp.packet_pool);
+        dp.route6_table = init_route6_table(options.rtable6, dp.nd_table);
+    }
+
+    // A new MAC of an interface is also the source of its neighbors.
+    if (options.prefilter) {
+        prefilter_watch_neighbors(dp.adj_table, dp.nd_table);
+    }
+
+    // ARP and ICMP are handled by a thread of their own, started before
+    // realtime_setup_end() so that it runs on the helper CPUs.
+    dp.slowpath = NULL;
+    if (options.slow_path) {
+        dp.slowpath = init_slowpath(drop_policy);
+    }
+
+    // Prefault, lock, pin and schedule the forwarding loop.
+    realtime_setup_end(&options);
+
+    // The tables have been filled, so the kernel has backed them by now.
+    hugepage_report();
+
+    // Nodes the received vectors go through.
+    init_dataplane_graph(&dp);
+    start_dataplane_housekeeping(&dp);
+
+    // Buffers of the next vector, taken from the pool in advance: the first
+    // ready ones. The queues are bounded so that the pool always has a
+    // vector left, but if it runs short anyway, the vector shrinks.
+    packet_buf_t *pkts[GRAPH_VECTOR_SIZE];
+    char *frames[GRAPH_VECTOR_SIZE];
+    size_t lengths[GRAPH_VECTOR_SIZE];
+    int rx_interfaces[GRAPH_VECTOR_SIZE];
+    int ready = refill_vector(dp.packet_pool, pkts, frames, 0);
+
+    // Where a frame is received, and dropped, while the pool is empty.
+    char *scratch = malloc(max_frame_len);
+    DIE(!scratch, "Scratch frame malloc failed.\n");
+
+    install_signal_handlers();
+
+    while (!stop_requested) {
+        if (ready < GRAPH_VECTOR_SIZE) {
+            ready = refill_vector(dp.packet_pool, pkts, frames, ready);
+        }
+        if (!ready) {
+            frames[0] = scratch;
         }
 
-        if (ntohs(eth_hdr->ether_type) == ETHER_TYPE_IPV4) {
-            struct iphdr *ip_hdr = (struct iphdr*) (buf + sizeof(struct ether_header));
-
-            // Check if the router is the actual destination.
-            if (ip_hdr->daddr == local_recv_ip && ip_hdr->protocol == IPV4_ICMP) {
-                struct icmphdr *icmp_hdr = (struct icmphdr*) (buf + sizeof(struct ether_header)
-                                            + sizeof(struct iphdr));
-                if (icmp_hdr->type == ICMP_ECHO_REQ_TYPE) {
-                    create_icmp_reply(ip_hdr, len, arp_cache, packet_queue, route_table);
-                    continue;
-                }
-            }
+        // The timers wake the loop up when they expire, so it only needs a
+        // timeout while packets wait for a link.
+        int cnt = recv_burst_timeout(frames, lengths, rx_interfaces, ready ? ready : 1,
+                                     egress_backlog() ? 1 : -1);
 
-            if (!authorize_checksum(ip_hdr)) {
-                // Wrong checksum.
-                continue;
+        // The new rules are compiled by another thread, and replace the
+        // current ones in dataplane_tick() once ready.
+        if (reload_requested) {
+            reload_requested = 0;
+            if (options.acl) {
+                acl_compile_async(options.acl, &dp.acl_next);
             }
+        }
 
-            if (!update_ttl(ip_hdr)) {
-                create_icmp_error(ip_hdr, ICMP_TIME_EXCEEDED_TYPE,
-                                  arp_cache, packet_queue, route_table);
-                continue;
-            }
+        dataplane_tick(&dp, get_time_ms());
 
-            struct route_table_entry *best_route = get_best_route(route_table,
-                                            ntohl(ip_hdr->daddr));
-            if (!best_route) {
-                create_icmp_error(ip_hdr, ICMP_DEST_UNREACHABLE_TYPE,
-                                  arp_cache, packet_queue, route_table);
-                continue;
-            }
+        if (!cnt) {
+            continue;
+        }
 
-            send_packet_safely(buf, len, arp_cache, packet_queue, best_route);
+        if (!ready) {
+            // The loop goes on, so the timers and the egress queues give
+            // the buffers back.
+            stats_add(STAT_DROP_NO_BUFFER, cnt);
+            continue;
+        }
+
+        for (int i = 0; i < cnt; i++) {
+            pkts[i]->len = lengths[i];
+            pkts[i]->rx_interface = rx_interfaces[i];
+        }
 
-        } else if (ntohs(eth_hdr->ether_type) == ETHER_TYPE_ARP) {
-            struct arp_header *arp_hdr = (struct arp_header*) (buf + sizeof(struct ether_header));
+        process_vector(&dp, pkts, cnt);
+
+        // Drop the references to the used buffers. Unless a queue still
+        // holds them, the same (cache hot) buffers are handed out again.
+        // When the pool has none left, the last buffer of the vector takes
+        // the place of the missing one.
+        for (int i = cnt - 1; i >= 0; i--) {
+            packet_put(pkts[i]);
+            packet_buf_t *pkt = packet_alloc(dp.packet_pool);
+            if (!pkt) {
+                pkt = pkts[--ready];
+            }
 
-            if (ntohs(arp_hdr->op) == ARP_OP_REQUEST) {
-                if (arp_hdr->tpa == local_recv_ip) {
-                    send_arp_reply(local_recv_mac, arp_hdr->sha, local_recv_ip,
-                                   arp_hdr->spa, interface);
-                    continue;
-                }
-            } else {
-                // Received an ARP_OP_REPLY
-                handle_arp_reply(arp_hdr, &arp_cache, packet_queue);
+            if (i < ready) {
+                pkts[i] = pkt;
+                frames[i] = pkt->data;
             }
         }
+
+        // The punted packets are only referenced by the slow path now.
+        if (dp.slowpath) {
+            slowpath_flush(dp.slowpath);
+        }
+    }
+
+    for (int i = 0; i < ready; i++) {
+        packet_put(pkts[i]);
+    }
+    free(scratch);
+
+    if (options.arp_snapshot) {
+        int saved = save_adjacencies(dp.adj_table, options.arp_snapshot);
+        DIE(saved < 0, "Saving the ARP snapshot failed");
+        fprintf(stderr, "Saved %d adjacencies to %s\n", saved, options.arp_snapshot);
     }
-}
 
+    fprintf(stderr, "ICMP errors: %" PRIu64 " sent, %" PRIu64 " suppressed (prefix limit), "
+                    "%" PRIu64 " suppressed (global limit)\n", dp.icmp_limiter->allowed,
+            dp.icmp_limiter->suppressed_prefix, dp.icmp_limiter->suppressed_global);
+
+    if (dp.acl) {
+        acl_print_hits(dp.acl, stderr);
+    }
+
+    egress_print_stats(stderr);
+
+    destroy_trace();
+    destroy_stats();
+
+    return 0;
+}
@@ -0,0 +1,507 @@
+/*
+ * Offline benchmark of the packet processing, without any interface: the
+ * frames are fed straight to process_vector(), in vectors like the ones the
+ * router receives, and send_to_link() is replaced (at link time) by a stub
+ * that only counts them.
+ *
+ * Usage: bench_dataplane [rtable] [--packets N] [--mix forward|arp-miss|icmp]
+ *                        [--pcap FILE] [--trace-sample N] [--acl FILE]
+ *                        [--vector N] [--mtu N]
+ */
+#include "dataplane.h"
+#include "interfaces.h"
+#include "stats.h"
+#include "trace.h"
+#include "route_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define BENCH_FRAMES 4096
+#define BENCH_DEFAULT_PACKETS 5000000
+#define BENCH_PAYLOAD_LEN 64
+#define BENCH_TICK_PACKETS 1024
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+
+// A frame as it comes from the wire, copied in a pool buffer for every
+// packet, like recv_burst_timeout() would do.
+struct bench_frame {
+    char *data;
+    size_t len;
+    int interface;
+    adjacency_t *miss_adj; // Unresolved again after every pass, if not NULL
+};
+
+typedef struct bench_frame bench_frame_t;
+
+
+struct bench {
+    dataplane_t dp;
+    bench_frame_t *frames;
+    int frames_cnt;
+    uint32_t no_route_ip; // Host order
+};
+
+typedef struct bench bench_t;
+
+
+static uint64_t tx_packets;
+static uint64_t tx_bytes;
+
+// Replaces the real send_to_link() (-Wl,--wrap=send_to_link).
+int __wrap_send_to_link(int interface, char *frame_data, size_t length) {
+    tx_packets++;
+    tx_bytes += length;
+    return length;
+}
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * Gives the interfaces made-up addresses: 02:00:00:00:00:0i and 10.0.i.1,
+ * and the same MTU, which sizes the packet buffers.
+ */
+static void init_bench_interfaces(int mtu) {
+    router_interfaces_cnt = ROUTER_NUM_INTERFACES;
+
+    for (int i = 0; i < router_interfaces_cnt; i++) {
+        uint8_t mac[6] = {0x02, 0, 0, 0, 0, i};
+        memcpy(router_interfaces[i].mac, mac, 6);
+        router_interfaces[i].ip = htonl(0x0a000001 | (i << 8));
+        router_interfaces[i].mtu = mtu;
+    }
+
+    update_max_frame_len();
+}
+
+
+static bench_frame_t *new_frame(bench_t *bench, size_t len, int interface) {
+    DIE(bench->frames_cnt == BENCH_FRAMES, "Too many frames.\n");
+
+    bench_frame_t *frame = &bench->frames[bench->frames_cnt++];
+    frame->data = calloc(1, len);
+    DIE(!frame->data, "calloc failed.\n");
+    frame->len = len;
+    frame->interface = interface;
+    frame->miss_adj = NULL;
+
+    return frame;
+}
+
+
+/**
+ * Builds an ICMP Echo request received on the interface, with the addresses
+ * in network order.
+ */
+static void build_ipv4_frame(bench_t *bench, int interface, uint32_t saddr,
+                             uint32_t daddr, uint8_t ttl, adjacency_t *miss_adj) {
+    size_t len = sizeof(struct ether_header) + sizeof(struct iphdr)
+                 + sizeof(struct icmphdr) + BENCH_PAYLOAD_LEN;
+    bench_frame_t *frame = new_frame(bench, len, interface);
+    frame->miss_adj = miss_adj;
+
+    struct ether_header *eth_hdr = (struct ether_header*) frame->data;
+    uint8_t src_mac[6] = {0x02, 0xbe, 0, 0, 0, interface};
+    memcpy(eth_hdr->ether_dhost, router_interfaces[interface].mac, 6);
+    memcpy(eth_hdr->ether_shost, src_mac, 6);
+    eth_hdr->ether_type = htons(ETHER_TYPE_IPV4);
+
+    struct iphdr *ip_hdr = (struct iphdr*) (frame->data + sizeof(struct ether_header));
+    ip_hdr->version = 4;
+    ip_hdr->ihl = 5;
+    ip_hdr->tot_len = htons(len - sizeof(struct ether_header));
+    ip_hdr->id = htons(bench->frames_cnt);
+    ip_hdr->ttl = ttl;
+    ip_hdr->protocol = IPV4_ICMP;
+    ip_hdr->saddr = saddr;
+    ip_hdr->daddr = daddr;
+    ip_hdr->check = htons(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
+
+    struct icmphdr *icmp_hdr = (struct icmphdr*) (ip_hdr + 1);
+    icmp_hdr->type = ICMP_ECHO_REQ_TYPE;
+    icmp_hdr->un.echo.id = htons(1);
+    icmp_hdr->un.echo.sequence = htons(bench->frames_cnt);
+    icmp_hdr->checksum = htons(checksum((uint16_t *) icmp_hdr,
+                                        sizeof(struct icmphdr) + BENCH_PAYLOAD_LEN));
+}
+
+
+/**
+ * Builds the ARP reply of a next hop, which resolves its adjacency.
+ */
+static void build_arp_reply_frame(bench_t *bench, adjacency_t *adj) {
+    bench_frame_t *frame = new_frame(bench, ARP_PACKET_LEN, adj->interface);
+    interface_info_t *iface = &router_interfaces[adj->interface];
+    uint8_t hop_mac[6] = {0x02, 0xaa, 0, 0, 0, 0};
+    memcpy(hop_mac + 2, &adj->next_hop, 4);
+
+    create_arp_packet(frame->data, hop_mac, iface->mac, adj->next_hop,
+                      iface->ip, ARP_OP_REPLY);
+}
+
+
+/**
+ * Picks a random destination (host order) covered by a route that can be
+ * used, i.e. whose interface exists.
+ * @return The adjacency of the route.
+ */
+static adjacency_t *random_destination(bench_t *bench, uint32_t *dest_ip) {
+    route_table_t *rt = bench->dp.route_table;
+
+    while (1) {
+        struct route_table_entry *entry = &rt->entries[rand() % rt->size];
+        uint32_t ip = ntohl(entry->prefix) | (rand() & ~ntohl(entry->mask));
+
+        // A longer prefix may cover the address.
+        struct route_table_entry *best_route = get_best_route(rt, ip);
+        if (best_route && best_route->interface < router_interfaces_cnt) {
+            *dest_ip = ip;
+            return get_route_adjacency(rt, best_route);
+        }
+    }
+}
+
+
+/**
+ * Finds an address (host order) without any route, for Destination
+ * Unreachable errors.
+ */
+static uint32_t find_no_route_ip(bench_t *bench) {
+    for (uint32_t ip = 0x0a000000; ip < 0xe0000000; ip += 0x00010000) {
+        if (!get_best_route(bench->dp.route_table, ip | 0x0909)) {
+            return ip | 0x0909;
+        }
+    }
+
+    DIE(1, "Every address has a route.\n");
+    return 0;
+}
+
+
+/**
+ * Resolves every adjacency with a made-up MAC, as after warm-up.
+ */
+static void resolve_all_adjacencies(bench_t *bench) {
+    adjacency_table_t *adj_table = bench->dp.adj_table;
+
+    for (int i = 0; i < adj_table->size; i++) {
+        adjacency_t *adj = &adj_table->entries[i];
+        uint8_t hop_mac[6] = {0x02, 0xaa, 0, 0, 0, 0};
+        memcpy(hop_mac + 2, &adj->next_hop, 4);
+        adjacency_load(adj_table, adj->next_hop, hop_mac, 1);
+    }
+}
+
+
+/**
+ * Resolved traffic towards random destinations of the route table.
+ */
+static void build_forward_mix(bench_t *bench) {
+    while (bench->frames_cnt < BENCH_FRAMES) {
+        uint32_t dest_ip;
+        random_destination(bench, &dest_ip);
+        uint32_t saddr = bench->dp.route_table->entries[0].prefix | htonl(7);
+        build_ipv4_frame(bench, 0, saddr, htonl(dest_ip), 64, NULL);
+    }
+}
+
+
+/**
+ * Half of the packets go to next hops that are not resolved yet: they are
+ * queued, ARP is asked for, and the reply drains the queue. The next hops
+ * are forgotten again after every pass, so the misses do not disappear.
+ */
+static void build_arp_miss_mix(bench_t *bench) {
+    uint32_t saddr = bench->dp.route_table->entries[0].prefix | htonl(7);
+    int miss_hops = BENCH_FRAMES / 64;
+    int pending_cnt = 0;
+    adjacency_t *pending[BENCH_FRAMES / 64];
+
+    while (bench->frames_cnt + pending_cnt < BENCH_FRAMES) {
+        uint32_t dest_ip;
+        adjacency_t *adj = random_destination(bench, &dest_ip);
+
+        if (bench->frames_cnt % 2 == 0) {
+            build_ipv4_frame(bench, 0, saddr, htonl(dest_ip), 64, NULL);
+            continue;
+        }
+
+        // A few packets towards every missing next hop, then its reply.
+        if (pending_cnt < miss_hops) {
+            adj->is_static = 0;
+            pending[pending_cnt++] = adj;
+        }
+        adj = pending[rand() % pending_cnt];
+        build_ipv4_frame(bench, 0, saddr, adj->next_hop, 64, adj);
+    }
+
+    for (int i = 0; i < pending_cnt; i++) {
+        build_arp_reply_frame(bench, pending[i]);
+    }
+}
+
+
+/**
+ * Traffic the router answers itself: Echo requests, expired TTLs and
+ * destinations without a route. Most errors are stopped by the limiter.
+ */
+static void build_icmp_mix(bench_t *bench) {
+    bench->no_route_ip = find_no_route_ip(bench);
+
+    while (bench->frames_cnt < BENCH_FRAMES) {
+        uint32_t source_ip;
+        random_destination(bench, &source_ip);
+        int interface = bench->frames_cnt % router_interfaces_cnt;
+
+        switch (bench->frames_cnt % 3) {
+        case 0:
+            build_ipv4_frame(bench, interface, htonl(source_ip),
+                             router_interfaces[interface].ip, 64, NULL);
+            break;
+        case 1:
+            build_ipv4_frame(bench, interface, htonl(source_ip),
+                             htonl(source_ip ^ 1), 1, NULL);
+            break;
+        default:
+            build_ipv4_frame(bench, interface, htonl(source_ip),
+                             htonl(bench->no_route_ip), 64, NULL);
+        }
+    }
+}
+
+
+/**
+ * Loads the frames of a (classic) pcap file. They are all received on
+ * interface 0, so their destination MAC is rewritten to its address.
+ */
+static void load_pcap(bench_t *bench, const char *path) {
+    FILE *file = fopen(path, "rb");
+    DIE(!file, "Cannot open the pcap file.\n");
+
+    uint32_t global_hdr[6];
+    DIE(fread(global_hdr, sizeof(global_hdr), 1, file) != 1, "Truncated pcap file.\n");
+    DIE(global_hdr[0] != PCAP_MAGIC && global_hdr[0] != PCAP_MAGIC_NS,
+        "Not a little endian pcap file.\n");
+
+    uint32_t record_hdr[4];
+    while (bench->frames_cnt < BENCH_FRAMES
+           && fread(record_hdr, sizeof(record_hdr), 1, file) == 1) {
+        uint32_t caplen = record_hdr[2];
+        DIE(caplen > max_frame_len, "Frame too long (see --mtu).\n");
+
+        bench_frame_t *frame = new_frame(bench, caplen, 0);
+        DIE(fread(frame->data, caplen, 1, file) != 1, "Truncated pcap file.\n");
+
+        if (caplen >= sizeof(struct ether_header)) {
+            memcpy(frame->data, router_interfaces[0].mac, 6);
+        }
+    }
+
+    fclose(file);
+    DIE(bench->frames_cnt == 0, "No frames in the pcap file.\n");
+}
+
+
+static void run(bench_t *bench, long packets, int vector, const char *name) {
+    dataplane_t *dp = &bench->dp;
+    packet_buf_t *pkts[GRAPH_VECTOR_SIZE];
+    int pkts_cnt = 0;
+
+    uint64_t start_ns = now_ns();
+
+    for (long i = 0; i < packets; i += pkts_cnt) {
+        int frame_idx = i % bench->frames_cnt;
+
+        if (frame_idx == 0) {
+            // New pass, forget the next hops resolved by the previous one.
+            for (int j = 0; j < bench->frames_cnt; j++) {
+                if (bench->frames[j].miss_adj) {
+                    bench->frames[j].miss_adj->resolved = 0;
+                }
+            }
+        }
+
+        for (int j = 0; j < pkts_cnt; j++) {
+            packet_put(pkts[j]);
+        }
+
+        // A vector never spans two passes.
+        pkts_cnt = vector;
+        if (pkts_cnt > bench->frames_cnt - frame_idx) {
+            pkts_cnt = bench->frames_cnt - frame_idx;
+        }
+        if (pkts_cnt > packets - i) {
+            pkts_cnt = packets - i;
+        }
+
+        for (int j = 0; j < pkts_cnt; j++) {
+            bench_frame_t *frame = &bench->frames[frame_idx + j];
+
+            pkts[j] = packet_alloc(dp->packet_pool);
+            DIE(!pkts[j], "Packet pool exhausted.\n");
+
+            memcpy(pkts[j]->data, frame->data, frame->len);
+            pkts[j]->len = frame->len;
+            pkts[j]->rx_interface = frame->interface;
+        }
+
+        process_vector(dp, pkts, pkts_cnt);
+
+        if (i / BENCH_TICK_PACKETS != (i + pkts_cnt) / BENCH_TICK_PACKETS) {
+            dataplane_tick(dp, get_time_ms());
+        }
+    }
+
+    uint64_t elapsed_ns = now_ns() - start_ns;
+
+    for (int j = 0; j < pkts_cnt; j++) {
+        packet_put(pkts[j]);
+    }
+
+    printf("%-10s %10ld packets %8.3f s %8.3f Mpps %8.1f ns/packet %10lu tx\n",
+           name, packets, elapsed_ns / 1e9, packets * 1e3 / elapsed_ns,
+           (double) elapsed_ns / packets, tx_packets);
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [rtable] [--packets N] "
+                    "[--mix forward|arp-miss|icmp] [--pcap FILE] "
+                    "[--trace-sample N] [--acl FILE] [--vector N] [--mtu N]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"packets", required_argument, NULL, 'n'},
+        {"mix",     required_argument, NULL, 'm'},
+        {"pcap",    required_argument, NULL, 'p'},
+        {"trace-sample", required_argument, NULL, 't'},
+        {"acl",     required_argument, NULL, 'a'},
+        {"vector",  required_argument, NULL, 'v'},
+        {"mtu",     required_argument, NULL, 'u'},
+        {NULL,      0,                 NULL, 0}
+    };
+
+    long packets = BENCH_DEFAULT_PACKETS;
+    const char *mix = NULL;
+    const char *pcap_path = NULL;
+    const char *rtable_path = "rtable0.txt";
+    const char *acl_path = NULL;
+    int vector = GRAPH_VECTOR_SIZE;
+    int mtu = 1500;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:m:p:t:a:v:u:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            packets = atol(optarg);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'p':
+            pcap_path = optarg;
+            break;
+        case 't':
+            // Trace ring without the control socket.
+            trace_register_thread();
+            trace_sample_every = atoi(optarg);
+            break;
+        case 'a':
+            acl_path = optarg;
+            break;
+        case 'v':
+            // 1 processes the packets one by one, like before the graph.
+            vector = atoi(optarg);
+            break;
+        case 'u':
+            mtu = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        rtable_path = argv[optind];
+    }
+    if (packets <= 0 || vector <= 0 || vector > GRAPH_VECTOR_SIZE
+        || mtu < IPV4_MIN_MTU || mtu > INTERFACE_MAX_MTU) {
+        usage(argv[0]);
+    }
+
+    const char *mixes[] = {"forward", "arp-miss", "icmp"};
+    int mixes_cnt = sizeof(mixes) / sizeof(mixes[0]);
+
+    init_bench_interfaces(mtu);
+    init_timers();
+    srand(1);
+
+    for (int m = 0; m < mixes_cnt; m++) {
+        if ((mix && strcmp(mix, mixes[m]) != 0) || (pcap_path && m > 0)) {
+            continue;
+        }
+
+        // Every mix starts from a fresh dataplane.
+        bench_t bench;
+        bench.dp.adj_table = init_adjacency_table(MAX_RTABLE_LEN);
+        bench.dp.route_table = init_route_table(rtable_path, bench.dp.adj_table, MAX_RTABLE_LEN);
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            bench.dp.vrf_tables[i] = bench.dp.route_table;
+        }
+        init_route_stats(bench.dp.vrf_tables, ROUTER_NUM_INTERFACES);
+        bench.dp.packet_pool = init_packet_pool(PACKET_POOL_SIZE);
+        bench.dp.packet_queue = init_packet_queue(bench.dp.packet_pool, ARP_DROP_NEWEST);
+        init_egress(bench.dp.packet_pool, NULL);
+        bench.dp.icmp_limiter = init_icmp_rate_limiter();
+        bench.dp.resolver = NULL;
+        bench.dp.slowpath = NULL;
+        bench.dp.route6_table = NULL;
+        bench.dp.nd_table = NULL;
+        bench.dp.acl = NULL;
+        bench.dp.acl_next = NULL;
+        if (acl_path) {
+            bench.dp.acl = acl_compile(acl_path);
+            DIE(!bench.dp.acl, "Invalid ACL.\n");
+        }
+        init_dataplane_graph(&bench.dp);
+        bench.frames = calloc(BENCH_FRAMES, sizeof(bench_frame_t));
+        DIE(!bench.frames, "calloc failed.\n");
+        bench.frames_cnt = 0;
+
+        resolve_all_adjacencies(&bench);
+
+        if (pcap_path) {
+            load_pcap(&bench, pcap_path);
+        } else if (m == 0) {
+            build_forward_mix(&bench);
+        } else if (m == 1) {
+            build_arp_miss_mix(&bench);
+        } else {
+            build_icmp_mix(&bench);
+        }
+
+        tx_packets = 0;
+        tx_bytes = 0;
+        run(&bench, packets, vector, pcap_path ? "pcap" : mixes[m]);
+
+        if (bench.dp.acl) {
+            acl_print_hits(bench.dp.acl, stdout);
+        }
+    }
+
+    return 0;
+}
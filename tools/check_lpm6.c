@@ -0,0 +1,143 @@
+/*
+ * Checks of the IPv6 longest prefix match against a linear search, with
+ * prefixes nested in each other and the same prefix repeated.
+ *
+ * Usage: check_lpm6
+ */
+#include "lpm6.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define CHECK_PREFIXES 4096
+#define CHECK_LOOKUPS 100000
+
+
+/**
+ * @return Whether the first len bits of addr and prefix are the same.
+ */
+static int prefix_matches(const uint8_t *prefix, int len, const uint8_t *addr) {
+    for (int i = 0; len > 0; i++, len -= 8) {
+        uint8_t mask = len >= 8 ? 0xff : 0xff << (8 - len);
+        if ((prefix[i] ^ addr[i]) & mask) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * The expected result: the longest prefix that matches, and among the
+ * equal ones, the last one.
+ */
+static int64_t linear_lookup(const struct lpm6_prefix *prefixes, int cnt,
+                             const uint8_t *addr) {
+    int64_t best = -1;
+    int best_len = -1;
+    for (int i = 0; i < cnt; i++) {
+        if (prefixes[i].len >= best_len
+            && prefix_matches(prefixes[i].addr, prefixes[i].len, addr)) {
+            best = prefixes[i].value;
+            best_len = prefixes[i].len;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Makes a prefix out of a few random bytes, so that they overlap often.
+ */
+static void random_prefix(struct lpm6_prefix *prefix) {
+    memset(prefix->addr, 0, 16);
+    prefix->addr[0] = 0x20;
+    prefix->addr[1] = rand() % 4;
+    prefix->addr[2] = rand() % 4;
+    prefix->addr[7] = rand() % 4;
+    prefix->len = 16 + rand() % 49;
+
+    // Host bits are cleared, like the route table does.
+    for (int i = 0; i < 16; i++) {
+        int bits = prefix->len - i * 8;
+        if (bits <= 0) {
+            prefix->addr[i] = 0;
+        } else if (bits < 8) {
+            prefix->addr[i] &= 0xff << (8 - bits);
+        }
+    }
+}
+
+
+/**
+ * Builds the tree out of a copy, since lpm6_build sorts the prefixes.
+ * @return The number of lookups that do not agree with the linear search.
+ */
+static int check(const char *name, const struct lpm6_prefix *prefixes, int cnt,
+                 uint8_t (*addrs)[16], int addrs_cnt) {
+    struct lpm6_prefix *sorted = malloc(cnt * sizeof(struct lpm6_prefix));
+    if (!sorted) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(sorted, prefixes, cnt * sizeof(struct lpm6_prefix));
+    lpm6_t *lpm = lpm6_build(sorted, cnt);
+    free(sorted);
+
+    int errors = 0;
+    for (int i = 0; i < addrs_cnt; i++) {
+        int64_t expected = linear_lookup(prefixes, cnt, addrs[i]);
+        int64_t found = lpm6_lookup(lpm, addrs[i]);
+        if (found != expected) {
+            char text[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, addrs[i], text, sizeof(text));
+            fprintf(stderr, "%s: %s: expected %ld, found %ld\n",
+                    name, text, (long) expected, (long) found);
+            errors++;
+        }
+    }
+    printf("%s: %d prefixes, %d lookups, %d errors\n", name, cnt, addrs_cnt, errors);
+    return errors;
+}
+
+
+int main(void) {
+    struct lpm6_prefix *prefixes = malloc(CHECK_PREFIXES * sizeof(struct lpm6_prefix));
+    uint8_t (*addrs)[16] = malloc(CHECK_LOOKUPS * sizeof(*addrs));
+    if (!prefixes || !addrs) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    int errors = 0;
+
+    // The same prefix on every line, with and without a shorter one: the
+    // last line wins, whatever the order of the sort.
+    for (int i = 0; i < CHECK_PREFIXES; i++) {
+        inet_pton(AF_INET6, "2001:db8::", prefixes[i].addr);
+        prefixes[i].len = 32;
+        prefixes[i].value = i;
+    }
+    inet_pton(AF_INET6, "2001:db8::1", addrs[0]);
+    errors += check("duplicated", prefixes, CHECK_PREFIXES, addrs, 1);
+    inet_pton(AF_INET6, "2001::", prefixes[CHECK_PREFIXES / 2].addr);
+    prefixes[CHECK_PREFIXES / 2].len = 16;
+    inet_pton(AF_INET6, "2001:db9::1", addrs[1]);
+    errors += check("duplicated nested", prefixes, CHECK_PREFIXES, addrs, 2);
+
+    // Random prefixes, many of them repeated, and addresses around them.
+    for (int i = 0; i < CHECK_PREFIXES; i++) {
+        random_prefix(&prefixes[i]);
+        prefixes[i].value = i;
+    }
+    for (int i = 0; i < CHECK_LOOKUPS; i++) {
+        memcpy(addrs[i], prefixes[rand() % CHECK_PREFIXES].addr, 16);
+        addrs[i][rand() % 16] ^= 1 << (rand() % 8);
+    }
+    errors += check("random", prefixes, CHECK_PREFIXES, addrs, CHECK_LOOKUPS);
+
+    free(prefixes);
+    free(addrs);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+#!/bin/bash
+#
+# End to end benchmark of the router, without Mininet: the topology of
+# router 0 is made of network namespaces and veth pairs, the real router
+# binary forwards between them, and traffic_gen sends UDP from h0 to h1 at
+# each rate, reporting throughput, loss and latency percentiles.
+#
+# Usage (as root, after make): tools/netns_bench.sh [rate...]
+#   Rates are in datagrams per second, 0 for as fast as possible.
+#   Environment: DURATION (s, default 5), SIZE (UDP payload, default 64),
+#   RTABLE (default rtable0.txt), ROUTER_ARGS (extra router options).
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+RATES=${*:-"10000 50000 100000 0"}
+DURATION=${DURATION:-5}
+SIZE=${SIZE:-64}
+RTABLE=${RTABLE:-rtable0.txt}
+PORT=9000
+PREFIX=rbench
+NAMESPACES="$PREFIX-rtr $PREFIX-h0 $PREFIX-h1 $PREFIX-p0"
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "The namespaces need root." >&2
+    exit 1
+fi
+
+for binary in router traffic_gen; do
+    if [ ! -x "$binary" ]; then
+        echo "Missing ./$binary, run make first." >&2
+        exit 1
+    fi
+done
+
+cleanup() {
+    [ -n "$ROUTER_PID" ] && kill "$ROUTER_PID" 2>/dev/null && wait "$ROUTER_PID" 2>/dev/null
+    for ns in $NAMESPACES; do
+        ip netns del "$ns" 2>/dev/null || true
+    done
+    return 0
+}
+
+trap cleanup EXIT
+cleanup
+
+for ns in $NAMESPACES; do
+    ip netns add "$ns"
+    ip -n "$ns" link set lo up
+done
+
+# Links to the router: router interface, host interface, host namespace,
+# router IP and host IP, as in checker/topo.py.
+add_link() {
+    ip link add "$1" netns $PREFIX-rtr type veth peer name "$2" netns "$3"
+    ip -n $PREFIX-rtr addr add "$4/24" dev "$1"
+    ip -n $PREFIX-rtr link set "$1" up
+    ip -n "$3" addr add "$5/24" dev "$2"
+    ip -n "$3" link set "$2" up
+    ip -n "$3" route add default via "$4"
+    ip netns exec "$3" sysctl -qw net.ipv6.conf.all.disable_ipv6=1
+    if command -v ethtool > /dev/null; then
+        ip netns exec "$3" ethtool -K "$2" tx off > /dev/null 2>&1 || true
+    fi
+}
+
+add_link rr-0-1 p-0 $PREFIX-p0 192.0.1.1 192.0.1.2
+add_link r-0 h-0 $PREFIX-h0 192.168.0.1 192.168.0.2
+add_link r-1 h-1 $PREFIX-h1 192.168.1.1 192.168.1.2
+
+# The router owns the interfaces: the kernel of its namespace neither
+# forwards nor answers.
+ip netns exec $PREFIX-rtr sysctl -qw net.ipv4.ip_forward=0 net.ipv4.icmp_echo_ignore_all=1 \
+    net.ipv6.conf.all.disable_ipv6=1
+
+ip netns exec $PREFIX-rtr ./router $ROUTER_ARGS "$RTABLE" rr-0-1 r-0 r-1 \
+    > /tmp/$PREFIX-router.log 2>&1 &
+ROUTER_PID=$!
+sleep 1
+
+if ! kill -0 $ROUTER_PID 2>/dev/null; then
+    echo "The router exited:" >&2
+    cat /tmp/$PREFIX-router.log >&2
+    exit 1
+fi
+
+# Sends one datagram: h0, h1 and the router resolve their neighbors before
+# the first measurement, and the gateway is known to work.
+check_path() {
+    ip netns exec $PREFIX-h1 ./traffic_gen recv --port $PORT --duration 2 \
+        --idle-ms 200 --run 0 > /tmp/$PREFIX-recv.0 &
+    local recv_pid=$!
+    sleep 0.2
+    ip netns exec $PREFIX-h0 ./traffic_gen send 192.168.1.2 --port $PORT --run 0 \
+        --rate 20 --duration 0.5 > /dev/null
+    wait $recv_pid
+    local received
+    received=$(awk '/^received/ {print $2}' /tmp/$PREFIX-recv.0)
+    rm -f /tmp/$PREFIX-recv.0
+    [ "${received:-0}" -gt 0 ]
+}
+
+check_path || {
+    echo "No connectivity from h0 to h1 through the router." >&2
+    exit 1
+}
+
+printf "%-10s %12s %12s %8s %10s %10s %10s %10s\n" \
+    "rate" "sent pps" "recv pps" "loss %" "p50 us" "p99 us" "p999 us" "max us"
+
+run=0
+for rate in $RATES; do
+    run=$((run + 1))
+    out=/tmp/$PREFIX-recv.$run
+
+    ip netns exec $PREFIX-h1 ./traffic_gen recv --port $PORT --run $run \
+        --duration $((DURATION + 5)) --idle-ms 1000 > "$out" &
+    recv_pid=$!
+    sleep 0.2
+
+    sent=$(ip netns exec $PREFIX-h0 ./traffic_gen send 192.168.1.2 --port $PORT \
+           --run $run --rate "$rate" --duration "$DURATION" --size "$SIZE")
+    wait $recv_pid
+
+    sent_cnt=$(echo "$sent" | awk '{print $2}')
+    sent_pps=$(echo "$sent" | awk '{print $7}')
+    recv_cnt=$(awk '/^received/ {print $2}' "$out")
+    recv_pps=$(awk '/^received/ {print $7}' "$out")
+    read -r p50 p99 p999 max <<< "$(awk '/^latency/ {print $4, $6, $8, $10}' "$out")"
+    loss=$(awk -v s="$sent_cnt" -v r="$recv_cnt" \
+           'BEGIN {printf "%.3f", (s > 0) ? 100 * (s - r) / s : 0}')
+
+    label=$rate
+    [ "$rate" = 0 ] && label=max
+    printf "%-10s %12s %12s %8s %10s %10s %10s %10s\n" \
+        "$label" "$sent_pps" "$recv_pps" "$loss" "$p50" "$p99" "$p999" "$max"
+    rm -f "$out"
+done
+
+if ! kill -0 $ROUTER_PID 2>/dev/null; then
+    echo "The router died during the benchmark:" >&2
+    tail /tmp/$PREFIX-router.log >&2
+    exit 1
+fi
@@ -0,0 +1,123 @@
+#!/bin/bash
+#
+# End to end test of --netlink-table, on the namespaces of netns_bench.sh:
+# a route of the kernel for a prefix of the route file takes its place, and
+# the route of the file is back once the kernel removes it.
+#
+# Usage (as root, after make): tools/netns_fib_test.sh
+#   Environment: RTABLE (default rtable0.txt, which must route
+#   192.168.1.0/24 to r-1), ROUTER_ARGS (extra router options).
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+RTABLE=${RTABLE:-rtable0.txt}
+KERNEL_TABLE=100
+PORT=9001
+PREFIX=rfib
+NAMESPACES="$PREFIX-rtr $PREFIX-h0 $PREFIX-h1 $PREFIX-p0"
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "The namespaces need root." >&2
+    exit 1
+fi
+
+for binary in router traffic_gen; do
+    if [ ! -x "$binary" ]; then
+        echo "Missing ./$binary, run make first." >&2
+        exit 1
+    fi
+done
+
+cleanup() {
+    [ -n "$ROUTER_PID" ] && kill "$ROUTER_PID" 2>/dev/null && wait "$ROUTER_PID" 2>/dev/null
+    for ns in $NAMESPACES; do
+        ip netns del "$ns" 2>/dev/null || true
+    done
+    return 0
+}
+
+trap cleanup EXIT
+cleanup
+
+for ns in $NAMESPACES; do
+    ip netns add "$ns"
+    ip -n "$ns" link set lo up
+done
+
+# Links to the router, as in netns_bench.sh.
+add_link() {
+    ip link add "$1" netns $PREFIX-rtr type veth peer name "$2" netns "$3"
+    ip -n $PREFIX-rtr addr add "$4/24" dev "$1"
+    ip -n $PREFIX-rtr link set "$1" up
+    ip -n "$3" addr add "$5/24" dev "$2"
+    ip -n "$3" link set "$2" up
+    ip -n "$3" route add default via "$4"
+    ip netns exec "$3" sysctl -qw net.ipv6.conf.all.disable_ipv6=1
+}
+
+add_link rr-0-1 p-0 $PREFIX-p0 192.0.1.1 192.0.1.2
+add_link r-0 h-0 $PREFIX-h0 192.168.0.1 192.168.0.2
+add_link r-1 h-1 $PREFIX-h1 192.168.1.1 192.168.1.2
+
+ip netns exec $PREFIX-rtr sysctl -qw net.ipv4.ip_forward=0 net.ipv4.icmp_echo_ignore_all=1 \
+    net.ipv6.conf.all.disable_ipv6=1
+
+ip netns exec $PREFIX-rtr ./router --netlink-table $KERNEL_TABLE $ROUTER_ARGS "$RTABLE" \
+    rr-0-1 r-0 r-1 > /tmp/$PREFIX-router.log 2>&1 &
+ROUTER_PID=$!
+sleep 1
+
+if ! kill -0 $ROUTER_PID 2>/dev/null; then
+    echo "The router exited:" >&2
+    cat /tmp/$PREFIX-router.log >&2
+    exit 1
+fi
+
+# Sends a few datagrams from h0 to h1.
+# Prints the number that h1 received.
+received_by_h1() {
+    local out=/tmp/$PREFIX-recv.$1
+    ip netns exec $PREFIX-h1 ./traffic_gen recv --port $PORT --duration 2 \
+        --idle-ms 300 --run "$1" > "$out" &
+    local recv_pid=$!
+    sleep 0.2
+    ip netns exec $PREFIX-h0 ./traffic_gen send 192.168.1.2 --port $PORT --run "$1" \
+        --rate 20 --duration 0.5 > /dev/null
+    wait $recv_pid
+    awk '/^received/ {print $2}' "$out"
+    rm -f "$out"
+}
+
+failed=0
+check() {
+    if [ "$2" = pass ]; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+[ "$(received_by_h1 1)" -gt 0 ] && res=pass || res=fail
+check "the route of the file forwards" $res
+
+# The kernel sends the prefix of h1 to p0 instead.
+ip -n $PREFIX-rtr route add 192.168.1.0/24 via 192.0.1.2 table $KERNEL_TABLE
+sleep 0.3
+[ "$(received_by_h1 2)" -eq 0 ] && res=pass || res=fail
+check "the route of the kernel replaces it" $res
+
+ip -n $PREFIX-rtr route del 192.168.1.0/24 via 192.0.1.2 table $KERNEL_TABLE
+sleep 0.3
+[ "$(received_by_h1 3)" -gt 0 ] && res=pass || res=fail
+check "the route of the file is back after the delete" $res
+
+if ! kill -0 $ROUTER_PID 2>/dev/null; then
+    echo "The router died during the test:" >&2
+    tail /tmp/$PREFIX-router.log >&2
+    exit 1
+fi
+
+exit $failed
@@ -0,0 +1,192 @@
+/*
+ * Live view of the router statistics, read from the shared memory segment
+ * published by the router, without any cost for the forwarding loop.
+ *
+ * Usage: router_stats [pid] [interval_ms]
+ */
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/**
+ * Finds the pid of a running router, from the name of its segment.
+ * @return The pid, or -1 if there is none.
+ */
+static int find_router_pid() {
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) {
+        return -1;
+    }
+
+    // Segment names start with a '/', which is not part of the file name.
+    const char *prefix = STATS_SHM_PREFIX + 1;
+    int pid = -1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            pid = atoi(entry->d_name + strlen(prefix));
+            break;
+        }
+    }
+
+    closedir(dir);
+    return pid;
+}
+
+
+/**
+ * Sums the counters and histograms of all the threads.
+ */
+static void sum_threads(const stats_shm_t *shm, stats_thread_t *total) {
+    memset(total, 0, sizeof(*total));
+
+    uint32_t threads_cnt = __atomic_load_n(&shm->threads_cnt, __ATOMIC_ACQUIRE);
+    if (threads_cnt > STATS_MAX_THREADS) {
+        threads_cnt = STATS_MAX_THREADS;
+    }
+
+    for (uint32_t t = 0; t < threads_cnt; t++) {
+        for (int i = 0; i < STAT_COUNTERS_CNT; i++) {
+            total->counters[i] += __atomic_load_n(&shm->threads[t].counters[i],
+                                                  __ATOMIC_RELAXED);
+        }
+
+        for (int h = 0; h < HIST_CNT; h++) {
+            for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+                total->histograms[h][b] += __atomic_load_n(&shm->threads[t].histograms[h][b],
+                                                           __ATOMIC_RELAXED);
+            }
+        }
+
+        for (int n = 0; n < STATS_MAX_NODES; n++) {
+            const struct stats_node *node = &shm->threads[t].nodes[n];
+            total->nodes[n].calls += __atomic_load_n(&node->calls, __ATOMIC_RELAXED);
+            total->nodes[n].packets += __atomic_load_n(&node->packets, __ATOMIC_RELAXED);
+            total->nodes[n].cycles += __atomic_load_n(&node->cycles, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/**
+ * @return Upper bound, in nanoseconds, of the bucket holding the
+ * given percentile of the samples in the (delta) histogram.
+ */
+static double histogram_percentile(const uint64_t *hist, double percentile,
+                                   uint64_t cycles_per_us) {
+    uint64_t samples = 0;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        samples += hist[b];
+    }
+    if (samples == 0) {
+        return 0;
+    }
+
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= samples * percentile) {
+            return (double) (2ULL << b) * 1000 / cycles_per_us;
+        }
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    int pid = argc > 1 ? atoi(argv[1]) : find_router_pid();
+    int interval_ms = argc > 2 ? atoi(argv[2]) : 1000;
+
+    if (pid <= 0) {
+        fprintf(stderr, "No running router found.\n");
+        return 1;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s%d", STATS_SHM_PREFIX, pid);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return 1;
+    }
+
+    const stats_shm_t *shm = mmap(NULL, sizeof(stats_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+        || shm->version != STATS_VERSION) {
+        fprintf(stderr, "%s is not a router statistics segment.\n", name);
+        return 1;
+    }
+
+    stats_thread_t prev, curr;
+    sum_threads(shm, &prev);
+
+    while (1) {
+        usleep(interval_ms * 1000);
+        sum_threads(shm, &curr);
+
+        printf("\033[H\033[Jrouter %u, %u thread(s)\n\n", shm->pid, shm->threads_cnt);
+        printf("%-24s %16s %14s\n", "counter", "total", "rate/s");
+
+        for (int i = 0; i < STAT_COUNTERS_CNT; i++) {
+            double rate = (double) (curr.counters[i] - prev.counters[i]) * 1000 / interval_ms;
+            printf("%-24s %16lu %14.0f\n", stats_counter_names[i],
+                   (unsigned long) curr.counters[i], rate);
+        }
+
+        printf("\n%-24s %12s %12s %12s\n", "latency (last interval)", "p50 (ns)",
+               "p99 (ns)", "p99.9 (ns)");
+
+        for (int h = 0; h < HIST_CNT; h++) {
+            uint64_t delta[STATS_HIST_BUCKETS];
+            for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+                delta[b] = curr.histograms[h][b] - prev.histograms[h][b];
+            }
+
+            printf("%-24s %12.0f %12.0f %12.0f\n", stats_histogram_names[h],
+                   histogram_percentile(delta, 0.5, shm->cycles_per_us),
+                   histogram_percentile(delta, 0.99, shm->cycles_per_us),
+                   histogram_percentile(delta, 0.999, shm->cycles_per_us));
+        }
+
+        uint32_t nodes_cnt = __atomic_load_n(&shm->nodes_cnt, __ATOMIC_ACQUIRE);
+        if (nodes_cnt > STATS_MAX_NODES) {
+            nodes_cnt = STATS_MAX_NODES;
+        }
+        if (nodes_cnt) {
+            printf("\n%-24s %12s %12s %12s %12s\n", "node (last interval)", "vectors/s",
+                   "packets/s", "pkts/vector", "cycles/pkt");
+        }
+
+        for (uint32_t n = 0; n < nodes_cnt; n++) {
+            uint64_t calls = curr.nodes[n].calls - prev.nodes[n].calls;
+            uint64_t packets = curr.nodes[n].packets - prev.nodes[n].packets;
+            uint64_t cycles = curr.nodes[n].cycles - prev.nodes[n].cycles;
+
+            printf("%-24.*s %12.0f %12.0f %12.1f %12.1f\n", STATS_NODE_NAME_LEN,
+                   shm->node_names[n], (double) calls * 1000 / interval_ms,
+                   (double) packets * 1000 / interval_ms,
+                   calls ? (double) packets / calls : 0,
+                   packets ? (double) cycles / packets : 0);
+        }
+
+        fflush(stdout);
+        prev = curr;
+    }
+
+    return 0;
+}
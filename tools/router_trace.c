@@ -0,0 +1,137 @@
+/*
+ * Client of the trace control socket of the router.
+ *
+ * Usage: router_trace [-p pid] sample N | dump FILE | status | routes N
+ */
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/**
+ * Finds the control socket of a running router in /tmp.
+ * @return 0 on success, -1 if there is none.
+ */
+static int find_socket(char *path, size_t size) {
+    const char *prefix = strrchr(TRACE_SOCKET_PREFIX, '/') + 1;
+
+    DIR *dir = opendir("/tmp");
+    if (!dir) {
+        return -1;
+    }
+
+    int res = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            snprintf(path, size, "/tmp/%s", entry->d_name);
+            res = 0;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return res;
+}
+
+
+/**
+ * Sends the command, with the file descriptor if there is one.
+ * @return As sendmsg().
+ */
+static ssize_t send_command(int fd, const char *command, int dump_fd) {
+    struct iovec iov = { .iov_base = (char *) command, .iov_len = strlen(command) };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (dump_fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &dump_fd, sizeof(int));
+    }
+
+    return sendmsg(fd, &msg, 0);
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p pid] sample N | dump FILE | status | routes N\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s.sock",
+                 TRACE_SOCKET_PREFIX, argv[2]);
+        first = 3;
+    } else if (find_socket(addr.sun_path, sizeof(addr.sun_path)) < 0) {
+        fprintf(stderr, "No running router found.\n");
+        return 1;
+    }
+
+    if (first >= argc) {
+        usage(argv[0]);
+    }
+
+    // The router does not open the dump: the file is opened here, with the
+    // rights of the user, and passed along with the command.
+    char command[1024] = "";
+    int dump_fd = -1;
+    if (strcmp(argv[first], "dump") == 0) {
+        if (first + 2 != argc) {
+            usage(argv[0]);
+        }
+        dump_fd = open(argv[first + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (dump_fd < 0) {
+            perror(argv[first + 1]);
+            return 1;
+        }
+        strcpy(command, "dump\n");
+    } else {
+        for (int i = first; i < argc; i++) {
+            strncat(command, argv[i], sizeof(command) - strlen(command) - 1);
+            strncat(command, i + 1 < argc ? " " : "\n", sizeof(command) - strlen(command) - 1);
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(addr.sun_path);
+        return 1;
+    }
+
+    if (send_command(fd, command, dump_fd) < 0) {
+        perror("send");
+        return 1;
+    }
+
+    char reply[1024];
+    ssize_t len;
+    while ((len = recv(fd, reply, sizeof(reply), 0)) > 0) {
+        fwrite(reply, 1, len, stdout);
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * UDP traffic generator for the end to end benchmark (tools/netns_bench.sh):
+ * the sender paces numbered, timestamped datagrams at a given rate, and the
+ * receiver reports the throughput and the latency percentiles from the
+ * timestamps. Both ends read CLOCK_MONOTONIC, so they must run on the same
+ * host (network namespaces share the clock).
+ *
+ * Usage: traffic_gen send IP [--port N] [--rate PPS] [--duration S]
+ *                            [--size N] [--run ID]
+ *        traffic_gen recv [--port N] [--duration S] [--idle-ms N] [--run ID]
+ */
+#define _GNU_SOURCE // sendmmsg(), recvmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define TRAFFIC_MAGIC 0x7247656e
+#define TRAFFIC_DEFAULT_PORT 9000
+#define TRAFFIC_BATCH 32
+#define TRAFFIC_MAX_SIZE 1472
+#define TRAFFIC_MAX_SAMPLES (64 << 20)
+
+
+// Start of the payload of every datagram, in host order: sender and
+// receiver are on the same host.
+struct traffic_hdr {
+    uint32_t magic;
+    uint32_t run;     // Datagrams of another run are ignored
+    uint64_t seq;
+    uint64_t sent_ns; // CLOCK_MONOTONIC when the datagram was handed to the kernel
+};
+
+struct traffic_args {
+    const char *ip;
+    int port;
+    double rate;      // Datagrams per second, 0 for as fast as possible
+    double duration;  // Seconds
+    int size;         // UDP payload
+    int idle_ms;      // The receiver stops after this long without a datagram
+    uint32_t run;
+};
+
+
+static volatile sig_atomic_t stop_requested;
+
+static void handle_stop_signal(int signum) {
+    stop_requested = 1;
+}
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void sleep_until_ns(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+/**
+ * Sends the datagrams in batches (sendmmsg()), each one as soon as its time
+ * in the schedule has come: when the sender falls behind, the next batch
+ * catches up, so the average rate holds.
+ */
+static int run_sender(const struct traffic_args *args) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    int sndbuf = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    // Without a UDP checksum (allowed over IPv4), a veth that offloads it
+    // cannot leave it for the router to forward unfinished.
+    int no_check = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NO_CHECK, &no_check, sizeof(no_check));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(args->port);
+    if (inet_pton(AF_INET, args->ip, &addr.sin_addr) != 1
+        || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(args->ip);
+        return 1;
+    }
+
+    static char payloads[TRAFFIC_BATCH][TRAFFIC_MAX_SIZE];
+    struct mmsghdr msgs[TRAFFIC_BATCH];
+    struct iovec iovs[TRAFFIC_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < TRAFFIC_BATCH; i++) {
+        iovs[i].iov_base = payloads[i];
+        iovs[i].iov_len = args->size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) (args->duration * 1e9);
+    double interval_ns = args->rate > 0 ? 1e9 / args->rate : 0;
+    uint64_t seq = 0;
+    uint64_t send_errors = 0;
+
+    while (!stop_requested) {
+        uint64_t now = now_ns();
+        if (now >= end) {
+            break;
+        }
+
+        // Datagrams due by now, at most a batch.
+        int cnt = TRAFFIC_BATCH;
+        if (interval_ns > 0) {
+            uint64_t due = (uint64_t) ((now - start) / interval_ns) + 1;
+            if (due <= seq) {
+                sleep_until_ns(start + (uint64_t) (seq * interval_ns));
+                continue;
+            }
+            if (due - seq < TRAFFIC_BATCH) {
+                cnt = due - seq;
+            }
+        }
+
+        for (int i = 0; i < cnt; i++) {
+            struct traffic_hdr *hdr = (struct traffic_hdr *) payloads[i];
+            hdr->magic = TRAFFIC_MAGIC;
+            hdr->run = args->run;
+            hdr->seq = seq + i;
+            hdr->sent_ns = now;
+        }
+
+        int sent = sendmmsg(fd, msgs, cnt, 0);
+        if (sent < 0) {
+            // The socket buffer is full: the datagrams count as sent, and
+            // lost, so that the schedule goes on.
+            send_errors++;
+            sent = cnt;
+        }
+        seq += sent;
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("sent %" PRIu64 " datagrams in %.2f s: %.0f pps, %.1f Mbit/s, %" PRIu64
+           " send errors\n",
+           seq, elapsed, seq / elapsed, seq * args->size * 8 / elapsed / 1e6, send_errors);
+
+    close(fd);
+    return 0;
+}
+
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile_us(const uint32_t *sorted, uint64_t cnt, double p) {
+    if (!cnt) {
+        return 0;
+    }
+
+    uint64_t index = (uint64_t) (p * (cnt - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+
+/**
+ * Receives the datagrams of the run until the duration is over or the
+ * sender stops (no datagram for idle_ms), then reports them. A datagram
+ * whose sequence number is lower than the highest one seen counts as
+ * reordered; duplicates are not expected on the path.
+ */
+static int run_receiver(const struct traffic_args *args) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    int rcvbuf = 8 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // Wakes up regularly, to check the idle time and the duration.
+    struct timeval timeout = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(args->port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    uint32_t *latencies = malloc(TRAFFIC_MAX_SAMPLES * sizeof(uint32_t));
+    if (!latencies) {
+        perror("malloc");
+        return 1;
+    }
+
+    static char payloads[TRAFFIC_BATCH][TRAFFIC_MAX_SIZE];
+    struct mmsghdr msgs[TRAFFIC_BATCH];
+    struct iovec iovs[TRAFFIC_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < TRAFFIC_BATCH; i++) {
+        iovs[i].iov_base = payloads[i];
+        iovs[i].iov_len = TRAFFIC_MAX_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) (args->duration * 1e9);
+    uint64_t first_ns = 0, last_ns = 0;
+    uint64_t received = 0, bytes = 0, reordered = 0, samples = 0;
+    uint64_t next_seq = 0;
+
+    while (!stop_requested) {
+        uint64_t now = now_ns();
+        if (now >= end || (received && now - last_ns >= (uint64_t) args->idle_ms * 1000000)) {
+            break;
+        }
+
+        int cnt = recvmmsg(fd, msgs, TRAFFIC_BATCH, 0, NULL);
+        if (cnt <= 0) {
+            continue;
+        }
+
+        now = now_ns();
+        for (int i = 0; i < cnt; i++) {
+            struct traffic_hdr *hdr = (struct traffic_hdr *) payloads[i];
+            if (msgs[i].msg_len < sizeof(*hdr) || hdr->magic != TRAFFIC_MAGIC
+                || hdr->run != args->run) {
+                continue;
+            }
+
+            if (!received) {
+                first_ns = now;
+            }
+            received++;
+            bytes += msgs[i].msg_len;
+            last_ns = now;
+
+            if (hdr->seq < next_seq) {
+                reordered++;
+            } else {
+                next_seq = hdr->seq + 1;
+            }
+
+            if (samples < TRAFFIC_MAX_SAMPLES) {
+                uint64_t latency = now - hdr->sent_ns;
+                latencies[samples++] = latency > UINT32_MAX ? UINT32_MAX : latency;
+            }
+        }
+    }
+
+    qsort(latencies, samples, sizeof(uint32_t), compare_u32);
+
+    // next_seq is one past the highest sequence number received.
+    char highest[24] = "none";
+    if (next_seq) {
+        snprintf(highest, sizeof(highest), "%" PRIu64, next_seq - 1);
+    }
+
+    double elapsed = received > 1 ? (last_ns - first_ns) / 1e9 : 0;
+    printf("received %" PRIu64 " datagrams in %.2f s: %.0f pps, %.1f Mbit/s, %" PRIu64
+           " reordered, highest seq %s\n", received, elapsed,
+           elapsed > 0 ? received / elapsed : 0, elapsed > 0 ? bytes * 8 / elapsed / 1e6 : 0,
+           reordered, highest);
+    printf("latency us: p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+           percentile_us(latencies, samples, 0.50), percentile_us(latencies, samples, 0.99),
+           percentile_us(latencies, samples, 0.999), percentile_us(latencies, samples, 1));
+
+    free(latencies);
+    close(fd);
+    return 0;
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s send IP [--port N] [--rate PPS] [--duration S]\n"
+                    "                  [--size N] [--run ID]\n"
+                    "       %s recv [--port N] [--duration S] [--idle-ms N] [--run ID]\n"
+                    "  --rate 0 sends as fast as possible; --size is the UDP payload,\n"
+                    "  from %zu to %d bytes\n",
+            prog, prog, sizeof(struct traffic_hdr), TRAFFIC_MAX_SIZE);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"size", required_argument, NULL, 's'},
+        {"idle-ms", required_argument, NULL, 'i'},
+        {"run", required_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0}
+    };
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+
+    int sender = strcmp(argv[1], "send") == 0;
+    if (!sender && strcmp(argv[1], "recv") != 0) {
+        usage(argv[0]);
+    }
+
+    struct traffic_args args = {NULL, TRAFFIC_DEFAULT_PORT, 0, 5, 64, 1000, 0};
+    int first = 2;
+    if (sender) {
+        if (argc < 3) {
+            usage(argv[0]);
+        }
+        args.ip = argv[2];
+        first = 3;
+    }
+
+    optind = first;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            args.port = atoi(optarg);
+            break;
+        case 'r':
+            args.rate = atof(optarg);
+            break;
+        case 'd':
+            args.duration = atof(optarg);
+            break;
+        case 's':
+            args.size = atoi(optarg);
+            break;
+        case 'i':
+            args.idle_ms = atoi(optarg);
+            break;
+        case 'u':
+            args.run = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || args.size < (int) sizeof(struct traffic_hdr)
+        || args.size > TRAFFIC_MAX_SIZE || args.duration <= 0 || args.rate < 0) {
+        usage(argv[0]);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    return sender ? run_sender(&args) : run_receiver(&args);
+}